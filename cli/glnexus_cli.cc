@@ -15,6 +15,8 @@
 #include "ctpl_stl.h"
 #include "spdlog/spdlog.h"
 #include "cli_utils.h"
+#include "server.h"
+#include <signal.h>
 
 using namespace std;
 
@@ -42,7 +44,12 @@ static int all_steps(const vector<string> &vcf_files,
                      size_t mem_budget, size_t nr_threads,
                      bool debug,
                      bool iter_compare,
-                     size_t bucket_size) {
+                     size_t bucket_size,
+                     size_t bucket_records,
+                     const string &bucket_bedfilename,
+                     bool numa,
+                     const string &checkpoint_dir,
+                     bool resume_load) {
     GLnexus::Status s;
     GLnexus::unifier_config unifier_cfg;
     GLnexus::genotyper_config genotyper_cfg;
@@ -56,11 +63,18 @@ static int all_steps(const vector<string> &vcf_files,
     H("load unifier/genotyper configuration",
         GLnexus::cli::utils::load_config(console, config_name, unifier_cfg, genotyper_cfg, cfg_crc32c, squeeze));
 
-    // initilize empty database
+    // initilize empty database, or reuse the one left by an interrupted run
     string dbpath("GLnexus.DB");
     vector<pair<string,size_t> > contigs;
-    H("initializing database", GLnexus::cli::utils::db_init(console, dbpath, vcf_files[0], contigs,
-                                                            bucket_size));
+    if (resume_load && GLnexus::cli::utils::check_dir_exists(dbpath)) {
+        console->info("resuming bulk load into existing {}", dbpath);
+        H("reading contigs from existing database",
+          GLnexus::cli::utils::db_get_contigs(console, dbpath, contigs));
+    } else {
+        H("initializing database", GLnexus::cli::utils::db_init(console, dbpath, vcf_files[0], contigs,
+                                                                bucket_size, bucket_records,
+                                                                bucket_bedfilename));
+    }
 
     {
         // sanity check, see that we can get the contigs back
@@ -71,28 +85,38 @@ static int all_steps(const vector<string> &vcf_files,
             return GLnexus::Status::Invalid("error, contigs read from DB do not match originals");
     }
 
+    // Keep the database open through all the following stages, so that each
+    // doesn't start over with a cold cache
+    unique_ptr<GLnexus::cli::utils::DBSession> session;
+    H("open database",
+      GLnexus::cli::utils::DBSession::Open(console, dbpath, GLnexus::RocksKeyValue::OpenMode::BULK_LOAD,
+                                           mem_budget, nr_threads, session));
+
     // Load the GVCFs into the database
     {
         // use an empty range filter
         vector<GLnexus::range> ranges;
         H("bulk load into DB",
-          GLnexus::cli::utils::db_bulk_load(console, mem_budget, nr_threads, vcf_files, dbpath, ranges, contigs, false));
+          GLnexus::cli::utils::db_bulk_load(console, *session, vcf_files, ranges, contigs, false,
+                                            resume_load));
     }
+    // switch to reads in place; allele discovery proceeds while the final
+    // compactions run in the background
+    H("switch database to read mode", session->read_optimize());
 
     if (iter_compare) {
         H("compare database iteration methods",
-          GLnexus::cli::utils::compare_db_itertion_algorithms(console, dbpath, 50));
+          GLnexus::cli::utils::compare_db_itertion_algorithms(console, *session, 50));
     }
 
     // discover alleles
     // TODO: if bedfilename is empty, fill ranges with all contigs
-    // TODO: overlap allele discovery with final compactions. have db_bulk_load output a RocksKeyValue pointer which we can reuse
     vector<GLnexus::range> ranges;
     H("parsing the bed file", GLnexus::cli::utils::parse_bed_file(console, bedfilename, contigs, ranges));
     GLnexus::discovered_alleles dsals;
     unsigned sample_count = 0;
     H("discover alleles",
-      GLnexus::cli::utils::discover_alleles(console, mem_budget, nr_threads, dbpath, ranges, contigs, dsals, sample_count));
+      GLnexus::cli::utils::discover_alleles(console, *session, ranges, contigs, dsals, sample_count, numa));
     if (debug) {
         string filename("/tmp/dsals.yml");
         console->info("Writing discovered alleles as YAML to {}", filename);
@@ -100,24 +124,13 @@ static int all_steps(const vector<string> &vcf_files,
           GLnexus::cli::utils::yaml_write_discovered_alleles_to_file(dsals, contigs, sample_count, filename));
     }
 
-    // partition dsals by contig to reduce peak memory usage in the unifier
-    std::vector<GLnexus::discovered_alleles> dsals_by_contig(contigs.size());
-    for (auto p = dsals.begin(); p != dsals.end(); dsals.erase(p++)) {
-        UNPAIR(*p, al, dai);
-        assert(al.pos.rid >= 0 && al.pos.rid < contigs.size());
-        dsals_by_contig[al.pos.rid][al] = dai;
-    }
-
-    // unify sites
-    // we could parallelize over dsals_by_contig although this might increase memory usage.
+    // unify sites, in parallel across active regions. Given a memory budget,
+    // stream the active regions through the unifier in bounded chunks.
     vector<GLnexus::unified_site> sites;
     GLnexus::unifier_stats stats;
-    for (auto& dsals_i : dsals_by_contig) {
-        GLnexus::unifier_stats stats1;
-        H("unify sites",
-          GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals_i, sample_count, sites, stats1));
-        stats += stats1;
-    }
+    H("unify sites",
+      GLnexus::cli::utils::unify_sites(console, unifier_cfg, contigs, dsals, sample_count, sites, stats,
+                                       nr_threads, mem_budget > 0));
     console->info("unified to {} sites cleanly with {} ALT alleles. {} ALT alleles were {} and {} were filtered out on quality thresholds.",
                   sites.size(), stats.unified_alleles, stats.lost_alleles,
                   (unifier_cfg.monoallelic_sites_for_lost_alleles ? "additionally included in monoallelic sites" : "lost due to failure to unify"),
@@ -129,6 +142,10 @@ static int all_steps(const vector<string> &vcf_files,
           GLnexus::cli::utils::write_unified_sites_to_file(sites, contigs, filename));
     }
 
+    // hold the sites in a compact table for the duration of genotyping
+    GLnexus::unified_site_table site_table;
+    GLnexus::unified_site_table_of_vector(sites, site_table);
+
     // genotype
     genotyper_cfg.output_residuals = debug;
     vector<string> hdr_lines = { ("##GLnexusConfig="+config_name), ("##GLnexusConfigCRC32C="+cfg_crc32c) };
@@ -139,11 +156,51 @@ static int all_steps(const vector<string> &vcf_files,
     }
     string outfile("-");
     H("Genotyping",
-      GLnexus::cli::utils::genotype(console, mem_budget, nr_threads, dbpath, genotyper_cfg, sites, hdr_lines, outfile));
+      GLnexus::cli::utils::genotype(console, *session, genotyper_cfg, site_table, hdr_lines, outfile, numa,
+                                    checkpoint_dir));
 
     return 0;
 }
 
+// Serve region queries against an existing database until interrupted (see
+// GLnexus::Server). return 0 on clean shutdown, 1 on failure.
+static int serve(const string &socket_path,
+                 const string &config_name, bool squeeze,
+                 size_t mem_budget, size_t nr_threads,
+                 size_t max_requests, bool numa) {
+    GLnexus::Status s;
+    GLnexus::server_config cfg;
+    string cfg_crc32c;
+    H("load unifier/genotyper configuration",
+        GLnexus::cli::utils::load_config(console, config_name, cfg.unifier, cfg.genotyper, cfg_crc32c, squeeze));
+
+    // Block the termination signals before any threads start (they inherit
+    // the mask), so that we can wait for them below.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+
+    unique_ptr<GLnexus::cli::utils::DBSession> session;
+    H("open database",
+      GLnexus::cli::utils::DBSession::Open(console, "GLnexus.DB", GLnexus::RocksKeyValue::OpenMode::READ_ONLY,
+                                           mem_budget, nr_threads, session));
+
+    cfg.socket_path = socket_path;
+    cfg.max_concurrent_requests = max_requests;
+    cfg.service.threads = session->threads();
+    cfg.service.numa = numa;
+    cfg.service.extra_header_lines = { ("##GLnexusConfig="+config_name), ("##GLnexusConfigCRC32C="+cfg_crc32c) };
+    unique_ptr<GLnexus::Server> server;
+    H("start server", GLnexus::Server::Start(console, cfg, session->data(), session->data(), server));
+
+    int sig = 0;
+    sigwait(&sigs, &sig);
+    console->info("received signal {}, shutting down", sig);
+    server->Stop();
+    return 0;
+}
 
 void help(const char* prog) {
     cout << "Usage: " << prog << " [options] /vcf/file/1 .. /vcf/file/N" << endl
@@ -155,6 +212,16 @@ void help(const char* prog) {
          << "  --list, -l            given files contain lists of gVCF filenames, one per line" << endl
          << "  --mem-gbytes X, -m X  memory budget, in gbytes (default: most of system memory)" << endl
          << "  --threads X, -t X     thread budget (default: all hardware threads)" << endl
+         << "  --numa                place worker threads on NUMA nodes and route work by genomic range" << endl
+         << "  --bucket_records N    size storage buckets to hold ~N records of the first gVCF, instead of fixed size" << endl
+         << "  --bucket_bed FILE     BED file of storage bucket ranges, instead of fixed size" << endl
+         << "  --checkpoint DIR      checkpoint genotyping progress in DIR; rerunning an interrupted job with the" << endl
+         << "                        same inputs (after removing GLnexus.DB) skips the genotyping already done" << endl
+         << "  --resume-load         reuse the GLnexus.DB left by an interrupted run, loading only the gVCFs not" << endl
+         << "                        already in it" << endl
+         << "  --serve SOCKET        serve region queries against the existing GLnexus.DB on a Unix socket," << endl
+         << "                        until interrupted (no gVCF files)" << endl
+         << "  --max-requests N      with --serve, the maximum number of requests processed at once (default: 4)" << endl
          << "  --help, -h            print this help message" << endl
          << endl << "Configuration presets:" << endl;
     cout << GLnexus::cli::utils::describe_config_presets() << endl;
@@ -184,8 +251,15 @@ int main(int argc, char *argv[]) {
         {"mem-gbytes", required_argument, 0, 'm'},
         {"threads", required_argument, 0, 't'},
         {"bucket_size", required_argument, 0, 'x'},
+        {"bucket_records", required_argument, 0, 'R'},
+        {"bucket_bed", required_argument, 0, 'B'},
         {"debug", no_argument, 0, 'd'},
         {"iter_compare", no_argument, 0, 'i'},
+        {"numa", no_argument, 0, 'N'},
+        {"checkpoint", required_argument, 0, 'K'},
+        {"serve", required_argument, 0, 'V'},
+        {"max-requests", required_argument, 0, 'Q'},
+        {"resume-load", no_argument, 0, 'L'},
         {0, 0, 0, 0}
     };
 
@@ -195,9 +269,13 @@ int main(int argc, char *argv[]) {
     bool list_of_files = false;
     bool debug = false;
     bool iter_compare = false;
-    string bedfilename;
+    bool numa = false;
+    bool resume_load = false;
+    string bedfilename, bucket_bedfilename, serve_socket, checkpoint_dir;
+    size_t max_requests = 4;
     size_t mem_budget = 0, nr_threads = 0;
     size_t bucket_size = GLnexus::BCFKeyValueData::default_bucket_size;
+    size_t bucket_records = 0;
 
     while (-1 != (c = getopt_long(argc, argv, "hb:dIx:m:t:",
                                   long_options, nullptr))) {
@@ -236,6 +314,38 @@ int main(int argc, char *argv[]) {
                 iter_compare = true;
                 break;
 
+            case 'N':
+                numa = true;
+                break;
+
+            case 'L':
+                resume_load = true;
+                break;
+
+            case 'K':
+                checkpoint_dir = string(optarg);
+                if (checkpoint_dir.size() == 0) {
+                    cerr << "invalid checkpoint directory" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'V':
+                serve_socket = string(optarg);
+                if (serve_socket.size() == 0) {
+                    cerr << "invalid socket path" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'Q':
+                max_requests = strtoul(optarg, nullptr, 10);
+                if (max_requests == 0 || max_requests > 1024) {
+                    cerr << "invalid --max-requests" << endl;
+                    return 1;
+                }
+                break;
+
             case 'x':
                 bucket_size = strtoul(optarg, nullptr, 10);
                 if (bucket_size == 0 || bucket_size > 1000000000) {
@@ -244,6 +354,22 @@ int main(int argc, char *argv[]) {
                 }
                 break;
 
+            case 'R':
+                bucket_records = strtoul(optarg, nullptr, 10);
+                if (bucket_records == 0 || bucket_records > 1000000000) {
+                    cerr << "bucket records should be in [1,1e9]" << endl;
+                    return 1;
+                }
+                break;
+
+            case 'B':
+                bucket_bedfilename = string(optarg);
+                if (bucket_bedfilename.size() == 0) {
+                    cerr <<  "invalid bucket BED filename" << endl;
+                    return 1;
+                }
+                break;
+
             case 'm':
                 mem_budget = strtoull(optarg, nullptr, 10);
                 if (mem_budget == 0 || mem_budget > 16*1024) {
@@ -266,6 +392,16 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (debug && !checkpoint_dir.empty()) {
+        // (residuals output isn't checkpointed)
+        cerr << "--checkpoint can't be used with --debug" << endl;
+        return 1;
+    }
+
+    if (!serve_socket.empty()) {
+        return serve(serve_socket, config_name, squeeze, mem_budget, nr_threads, max_requests, numa);
+    }
+
     if (optind > argc-1) {
         help(argv[0]);
         return 1;
@@ -291,5 +427,6 @@ int main(int argc, char *argv[]) {
         vcf_files = vcf_files_precursor;
     }
 
-    return all_steps(vcf_files, bedfilename, config_name, squeeze, mem_budget, nr_threads, debug, iter_compare, bucket_size);
+    return all_steps(vcf_files, bedfilename, config_name, squeeze, mem_budget, nr_threads, debug, iter_compare, bucket_size,
+                     bucket_records, bucket_bedfilename, numa, checkpoint_dir, resume_load);
 }
@@ -25,13 +25,28 @@ public:
 
     /// Initialize a brand-new database, which SHOULD be empty to begin with.
     /// Contigs are stored and an empty sample set "*" is created.
+    ///
+    /// Records are stored in buckets of interval_len bp, unless
+    /// bucket_boundaries is nonempty: then the begin and end positions of
+    /// these ranges become bucket boundaries on their contigs, so that bucket
+    /// size can follow the density of records (e.g. small buckets in exome
+    /// targets, large ones in gaps). Beyond the last boundary on a contig,
+    /// and on contigs without any, buckets are interval_len bp.
     static Status InitializeDB(KeyValue::DB* db,
                                const std::vector<std::pair<std::string,size_t> >& contigs,
-                               int interval_len = default_bucket_size);
+                               int interval_len = default_bucket_size,
+                               const std::vector<range>& bucket_boundaries = {});
 
-    /// Open an existing database
+    /// Open an existing database. Imports that were interrupted (e.g. by a
+    /// crash during bulk load) are finished if all their data had been
+    /// written, or rolled back otherwise, unless the database is read-only.
     static Status Open(KeyValue::DB* db, std::unique_ptr<BCFKeyValueData>& ans);
 
+    /// The data sets whose interrupted imports were recovered by Open: true
+    /// if the import was finished, false if it was rolled back (so that the
+    /// data set can be imported again).
+    const std::map<std::string,bool>& recovered_imports() const;
+
     virtual ~BCFKeyValueData();
 
     // Metadata
@@ -41,10 +56,21 @@ public:
     Status sample_dataset(const std::string& sample, std::string& ans) const override;
     Status all_samples_sampleset(std::string& ans) override;
     Status sample_count(size_t& ans) const override;
+    uint64_t metadata_version() const override;
 
     Status new_sampleset(MetadataCache& metadata, const std::string& sampleset,
                          const std::set<std::string>& samples);
 
+    /// Number of bucket values which each iterator produced by
+    /// sampleset_range reads ahead in the background, overlapping storage
+    /// I/O with the processing of preceding datasets. 0 (the default)
+    /// disables read-ahead. The reads of all iterators go through one pool of
+    /// [threads] I/O threads, created when read-ahead is first enabled, so
+    /// it's worthwhile mainly for cold reads by a few callers; with a warm
+    /// cache, the handoff to the pool costs more than the read.
+    static const size_t default_prefetch_depth = 0;
+    void set_prefetch_depth(size_t depth, size_t threads = 4);
+
     // statistics
     std::shared_ptr<StatsRangeQuery> getRangeStats();
 
@@ -107,7 +133,8 @@ public:
     };
 
     /// Import a new data set (a gVCF file, possibly containing multiple samples).
-    /// The data set name must be unique.
+    /// The data set name must be unique. If the import fails, any data already
+    /// written for it are removed.
     /// The sample names in the data set (gVCF column names) must be unique.
     /// All samples are immediately added to the sample set "*"
     /// If range_filter is nonempty, then import only records overlapping one
@@ -125,6 +152,24 @@ public:
         samples_imported = move(rslt.samples);
         return s;
     }
+
+    /// Remove a data set and its samples. The all-samples sample set moves
+    /// to a new version without them; existing sample sets, which are
+    /// immutable, keep referring to them. The data set's records are deleted in the same atomic batch
+    /// as its metadata. Increments metadata_version(), so MetadataCache
+    /// instances started beforehand discard what they've cached.
+    Status remove_dataset(const std::string& dataset);
+
+    /// Replace a data set with a new gVCF file. The file is imported under a
+    /// staged name, then swapped in for the existing data set in one atomic
+    /// batch (which holds the whole new data set in memory), so if the import
+    /// fails the existing data set stays in place. The new file's samples
+    /// mustn't belong to any other data set; those of the existing data set
+    /// that it lacks are removed as by remove_dataset. The all-samples sample
+    /// set moves to one new version, and metadata_version() is incremented.
+    Status replace_dataset(const std::string& dataset, const std::string& filename,
+                           const std::set<range>& range_filter,
+                           import_result& rslt);
 };
 
 /// Get the bucket key prefix length for the bcf collection. This is used with
@@ -53,6 +53,23 @@ public:
     // have undefined results.
     virtual Status next() = 0;
 
+    // Advance the iterator to the first key/value pair whose key is >= [key],
+    // which must not precede the current key. The default implementation
+    // steps through the intervening pairs; implementations with an efficient
+    // seek should override it.
+    virtual Status seek(const std::string& target) {
+        Status s;
+        while (valid()) {
+            Data k = key();
+            int c = memcmp(k.data, target.data(), std::min(k.size, target.size()));
+            if (c > 0 || (c == 0 && k.size >= target.size())) {
+                break;
+            }
+            S(next());
+        }
+        return Status::OK();
+    }
+
 };
 
 /// A DB snapshot providing consistent multiple reads if possible. Thread-safe.
@@ -95,7 +112,10 @@ public:
     virtual ~WriteBatch() = default;
 
     virtual Status put(CollectionHandle coll, const std::string& key, const Data& value) = 0;
-    //virtual Status delete(Collection* coll, const std::string& key) = 0;
+
+    /// Delete the record with the given key, if any (it's not an error if
+    /// there's none). Writes in a batch apply in the order given.
+    virtual Status delete_key(CollectionHandle coll, const std::string& key) = 0;
 
     /// Apply a batch of writes.
     virtual Status commit() = 0;
@@ -131,6 +151,7 @@ public:
     Status get0(CollectionHandle coll, const std::string& key, std::shared_ptr<Data>& value) const override;
     Status iterator(CollectionHandle coll, const std::string& key, std::unique_ptr<Iterator>& it) const override;
     virtual Status put(CollectionHandle coll, const std::string& key, const Data& value);
+    virtual Status delete_key(CollectionHandle coll, const std::string& key);
 
     /// Ensure all writes are flushed to storage
     virtual Status flush() = 0;
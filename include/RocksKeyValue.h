@@ -27,9 +27,11 @@ enum class OpenMode {
     READ_ONLY,
 
     /// Offline bulk loading. Write operations will be faster but read
-    /// performance may be reduced drastically. Transaction durability
-    /// features are disabled; the database is liable to be corrupted if the
-    /// DB object's destructor is not executed (e.g. crash or power failure)
+    /// performance may be reduced drastically. Writes aren't synced to disk,
+    /// so those shortly preceding a crash or power failure may be lost, but
+    /// the database recovers to a consistent point (each write batch is
+    /// kept or lost as a whole, and no later write is kept without the
+    /// earlier ones).
     BULK_LOAD
 };
 
@@ -47,6 +49,14 @@ Status Initialize(const std::string& dbpath, const config& cfg, std::unique_ptr<
 /// Open an existing database.
 Status Open(const std::string& dbPath, const config& cfg, std::unique_ptr<KeyValue::DB>& db);
 
+/// Switch an open database to another mode in place, keeping its block cache
+/// and open files rather than closing and reopening it. Only BULK_LOAD to
+/// NORMAL is supported: this flushes the loaded data, then restores the
+/// online write and compaction settings and enlarges the block cache.
+/// Compactions still underway continue in the background. There must be no
+/// concurrent writes.
+Status Reconfigure(KeyValue::DB* db, OpenMode mode);
+
 // Delete an existing database.
 Status destroy(const std::string dbPath);
 }}
@@ -9,6 +9,7 @@
 #include "RocksKeyValue.h"
 #include "BCFKeyValueData.h"
 #include "unifier.h"
+#include "unified_site_table.h"
 
 namespace GLnexus {
 namespace cli {
@@ -97,26 +98,85 @@ std::string describe_config_presets();
 
 RocksKeyValue::prefix_spec* GLnexus_prefix_spec();
 
+// Compute density-adaptive bucket boundaries from a sample gVCF: a new
+// bucket begins after every bucket_records records.
+Status bucket_boundaries_of_gvcf(std::shared_ptr<spdlog::logger> logger,
+                                 const std::string &gvcf,
+                                 const std::vector<std::pair<std::string,size_t>> &contigs,
+                                 size_t bucket_records,
+                                 std::vector<range> &ans);
+
 // Initialize a database. Fills in the contigs.
+// The bucket boundaries are taken from bucket_bedfilename if given, otherwise
+// computed from the exemplar gVCF if bucket_records > 0. Failing both, the
+// buckets are a fixed bucket_size bp.
 Status db_init(std::shared_ptr<spdlog::logger> logger,
                const std::string &dbpath,
                const std::string &exemplar_gvcf,
                std::vector<std::pair<std::string,size_t>> &contigs, // output parameter
-               size_t bucket_size = BCFKeyValueData::default_bucket_size);
+               size_t bucket_size = BCFKeyValueData::default_bucket_size,
+               size_t bucket_records = 0,
+               const std::string &bucket_bedfilename = "");
 
 // Read the contigs from a database
 Status db_get_contigs(std::shared_ptr<spdlog::logger> logger,
                       const std::string &dbpath,
                       std::vector<std::pair<std::string,size_t> > &contigs);
 
-// Load gvcf files into a database in parallel
+// A database kept open across the stages of a single-process run (bulk load,
+// allele discovery, genotyping), so that each stage needn't reopen it and
+// start over with a cold block cache. A session opened in BULK_LOAD mode can
+// then be switched to reads in place with read_optimize().
+class DBSession {
+    std::shared_ptr<spdlog::logger> logger_;
+    std::string dbpath_;
+    size_t mem_budget_, nr_threads_;
+    std::unique_ptr<KeyValue::DB> db_;
+    std::unique_ptr<BCFKeyValueData> data_;
+
+    DBSession(std::shared_ptr<spdlog::logger> logger, const std::string& dbpath,
+              size_t mem_budget, size_t nr_threads)
+        : logger_(logger), dbpath_(dbpath), mem_budget_(mem_budget), nr_threads_(nr_threads) {}
+
+public:
+    // nr_threads == 0: all cores
+    static Status Open(std::shared_ptr<spdlog::logger> logger,
+                       const std::string& dbpath, RocksKeyValue::OpenMode mode,
+                       size_t mem_budget, size_t nr_threads,
+                       std::unique_ptr<DBSession>& ans);
+
+    // switch from BULK_LOAD to NORMAL mode (see RocksKeyValue::Reconfigure);
+    // compactions following the bulk load continue in the background.
+    Status read_optimize();
+
+    const std::string& path() const { return dbpath_; }
+    size_t mem_budget() const { return mem_budget_; }
+    size_t threads() const { return nr_threads_; }
+    KeyValue::DB& db() { return *db_; }
+    BCFKeyValueData& data() { return *data_; }
+};
+
+// Load gvcf files into a database in parallel. With resume, gVCFs whose data
+// sets are already in the database (loaded by an interrupted run) are
+// skipped; otherwise they fail to load.
 Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     size_t mem_budget, size_t nr_threads,
                     const std::vector<std::string> &gvcfs,
                     const std::string &dbpath,
                     const std::vector<range> &ranges,   // limit the bulk load to these ranges
                     std::vector<std::pair<std::string,size_t>> &contigs, // output param
-                    bool delete_gvcf_after_load = false);
+                    bool delete_gvcf_after_load = false,
+                    bool resume = false);
+
+// As above, within a session (which must be in BULK_LOAD mode). The loaded
+// data are flushed, but compactions may still be running upon return.
+Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
+                    DBSession& session,
+                    const std::vector<std::string> &gvcfs,
+                    const std::vector<range> &ranges,
+                    std::vector<std::pair<std::string,size_t>> &contigs, // output param
+                    bool delete_gvcf_after_load = false,
+                    bool resume = false);
 
 // Discover alleles in the database. Return discovered alleles, and the sample count.
 Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
@@ -125,18 +185,32 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         const std::vector<range> &ranges,
                         const std::vector<std::pair<std::string,size_t> > &contigs,
                         discovered_alleles &dsals,
-                        unsigned &sample_count);
+                        unsigned &sample_count,
+                        bool numa = false);
+
+// As above, within a session
+Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
+                        DBSession& session,
+                        const std::vector<range> &ranges,
+                        const std::vector<std::pair<std::string,size_t> > &contigs,
+                        discovered_alleles &dsals,
+                        unsigned &sample_count,
+                        bool numa = false);
 
 // Run unifier on given discovered alleles.
 // input dsals is cleared by side-effect to save memory
 // output sites is appended to (not cleared!)
+// With nr_threads != 1 (0 = all cores), active regions are unified in
+// parallel; stream bounds the work in flight at once (see unified_sites).
 Status unify_sites(std::shared_ptr<spdlog::logger> logger,
                    const unifier_config &unifier_cfg,
                    const std::vector<std::pair<std::string,size_t> > &contigs,
                    discovered_alleles &dsals,
                    unsigned sample_count,
                    std::vector<unified_site> &sites,
-                   GLnexus::unifier_stats& stats);
+                   GLnexus::unifier_stats& stats,
+                   size_t nr_threads = 1,
+                   bool stream = false);
 
 // if the file name is "-", then output is written to stdout.
 Status genotype(std::shared_ptr<spdlog::logger> logger,
@@ -145,7 +219,38 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
                 const GLnexus::genotyper_config &genotyper_cfg,
                 const std::vector<unified_site> &sites,
                 const std::vector<std::string> &extra_header_lines,
-                const std::string &output_filename);
+                const std::string &output_filename,
+                bool numa = false);
+
+// As above, with the sites in a compact table
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                size_t mem_budget, size_t nr_threads,
+                const std::string &dbpath,
+                const GLnexus::genotyper_config &genotyper_cfg,
+                const unified_site_table &sites,
+                const std::vector<std::string> &extra_header_lines,
+                const std::string &output_filename,
+                bool numa = false);
+
+// As above, within a session. If checkpoint_dir is given, genotyping
+// progress is checkpointed there, and an interrupted run resumes from it (see
+// service_config::checkpoint_dir).
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                DBSession& session,
+                const GLnexus::genotyper_config &genotyper_cfg,
+                const std::vector<unified_site> &sites,
+                const std::vector<std::string> &extra_header_lines,
+                const std::string &output_filename,
+                bool numa = false,
+                const std::string &checkpoint_dir = "");
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                DBSession& session,
+                const GLnexus::genotyper_config &genotyper_cfg,
+                const unified_site_table &sites,
+                const std::vector<std::string> &extra_header_lines,
+                const std::string &output_filename,
+                bool numa = false,
+                const std::string &checkpoint_dir = "");
 
 // compare different implementations of database iteration methods.
 //
@@ -153,6 +258,9 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
 Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
                                       const std::string &dbpath,
                                       int n_iter);
+Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
+                                      DBSession& session,
+                                      int n_iter);
 }}}
 
 #endif
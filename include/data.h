@@ -19,7 +19,9 @@ namespace GLnexus {
 /// A data set contains all the allele/genotype/likelihood data for one or more
 /// samples -- just like a [V/B]CF file.
 /// All the GL data for each sample resides in exactly one data set.
-/// Sample sets and data sets are immutable.
+/// Sample sets are immutable. Data sets are immutable too, except that an
+/// implementation may support removing or replacing them, in which case it
+/// increments metadata_version() so that caches know to start over.
 class Metadata {
 
 public:
@@ -53,11 +55,126 @@ public:
 
     /// Return the count of all samples in the database.
     virtual Status sample_count(size_t& ans) const = 0;
+
+    /// Counter incremented whenever data sets are removed or replaced. A
+    /// persistent implementation should persist it too, as it also tells
+    /// whether progress saved by an earlier session (e.g. genotyping
+    /// checkpoints) still applies.
+    virtual uint64_t metadata_version() const { return 0; }
 };
 
 
+/// Dense mapping of the samples in a dataset's BCF header onto the columns of
+/// a sample set, i.e. the positions of its samples in sorted order. Iterating
+/// yields (bcf sample index, column) pairs in ascending bcf sample order, for
+/// the samples present in the sample set only.
+class SampleMapping {
+    std::vector<int> columns_;
+    std::vector<std::pair<int,int>> pairs_;
+    std::vector<unsigned> bcf_samples_;
+
+public:
+    SampleMapping() = default;
+
+    /// columns: for each bcf sample index, its column or -1 if the sample
+    /// isn't in the sample set
+    explicit SampleMapping(std::vector<int> columns) : columns_(std::move(columns)) {
+        for (int i = 0; i < (int) columns_.size(); i++) {
+            if (columns_[i] >= 0) {
+                pairs_.push_back(std::make_pair(i, columns_[i]));
+                bcf_samples_.push_back(i);
+            }
+        }
+    }
+
+    /// Column of the given bcf sample; throws std::out_of_range if the
+    /// sample isn't in the sample set
+    int at(int bcf_sample) const {
+        if (bcf_sample < 0 || bcf_sample >= (int) columns_.size() || columns_[bcf_sample] < 0) {
+            throw std::out_of_range("SampleMapping::at");
+        }
+        return columns_[bcf_sample];
+    }
+
+    /// bcf sample indices present in the sample set, ascending
+    const std::vector<unsigned>& bcf_samples() const { return bcf_samples_; }
+
+    bool empty() const { return pairs_.empty(); }
+    size_t size() const { return pairs_.size(); }
+    std::vector<std::pair<int,int>>::const_iterator begin() const { return pairs_.begin(); }
+    std::vector<std::pair<int,int>>::const_iterator end() const { return pairs_.end(); }
+};
+
+/// A set of dense integer sample IDs (see MetadataCache::sample_id) held as a
+/// bitmap, so that sample set union, subset and membership tests are cheap
+/// enough to use at query time.
+class SampleBitmap {
+    std::vector<uint64_t> words_;
+
+public:
+    SampleBitmap() = default;
+
+    void insert(uint32_t id) {
+        if (id/64 >= words_.size()) {
+            words_.resize(id/64+1, 0);
+        }
+        words_[id/64] |= uint64_t(1) << (id%64);
+    }
+
+    bool contains(uint32_t id) const {
+        return id/64 < words_.size() && (words_[id/64] & (uint64_t(1) << (id%64)));
+    }
+
+    size_t count() const {
+        size_t ans = 0;
+        for (auto w : words_) {
+            ans += __builtin_popcountll(w);
+        }
+        return ans;
+    }
+
+    bool empty() const {
+        for (auto w : words_) {
+            if (w) return false;
+        }
+        return true;
+    }
+
+    SampleBitmap& operator|=(const SampleBitmap& rhs) {
+        if (rhs.words_.size() > words_.size()) {
+            words_.resize(rhs.words_.size(), 0);
+        }
+        for (size_t i = 0; i < rhs.words_.size(); i++) {
+            words_[i] |= rhs.words_[i];
+        }
+        return *this;
+    }
+
+    bool subset_of(const SampleBitmap& rhs) const {
+        for (size_t i = 0; i < words_.size(); i++) {
+            uint64_t r = i < rhs.words_.size() ? rhs.words_[i] : 0;
+            if (words_[i] & ~r) return false;
+        }
+        return true;
+    }
+
+    bool operator==(const SampleBitmap& rhs) const {
+        return subset_of(rhs) && rhs.subset_of(*this);
+    }
+
+    /// Call f(id) for each member, in ascending order
+    template<class F> void for_each(F f) const {
+        for (size_t i = 0; i < words_.size(); i++) {
+            for (uint64_t w = words_[i]; w; w &= w-1) {
+                f(uint32_t(i*64 + __builtin_ctzll(w)));
+            }
+        }
+    }
+};
+
 /// Wraps any Metadata implementation to provide in-memory caching/indexing of
-/// the immutable relationships
+/// the immutable relationships. If the inner metadata_version() changes, the
+/// cache starts over.
 class MetadataCache : public Metadata {
     struct body;
     std::unique_ptr<body> body_;
@@ -75,11 +192,36 @@ public:
     Status sample_dataset(const std::string& sample, std::string& ans) const override;
     Status all_samples_sampleset(std::string& ans) override;
     Status sample_count(size_t& ans) const override;
+    uint64_t metadata_version() const override;
 
     const std::vector<std::pair<std::string,size_t> >& contigs() const;
     Status sampleset_datasets(const std::string& sampleset,
                               std::shared_ptr<const std::set<std::string> >& samples,
                               std::shared_ptr<const std::set<std::string>>& datasets) const;
+
+    /// Map the samples in the dataset's BCF header onto the sample set's
+    /// columns. hdr must be the dataset's header. The result is cached for
+    /// each sample set & dataset.
+    Status sampleset_dataset_mapping(const std::string& sampleset, const std::string& dataset,
+                                     const bcf_hdr_t* hdr,
+                                     std::shared_ptr<const SampleMapping>& ans) const;
+
+    /// Dense integer IDs for samples and datasets. These are assigned by the
+    /// cache as samples are first encountered (or imported through
+    /// register_dataset), so they're stable only for the lifetime of this
+    /// MetadataCache and while the inner metadata_version() is unchanged; the
+    /// string-based methods above remain the durable interface.
+    Status sample_id(const std::string& sample, uint32_t& ans) const;
+    Status sample_name(uint32_t sample_id, std::string& ans) const;
+    Status sample_dataset_id(uint32_t sample_id, uint32_t& ans) const;
+    Status dataset_name(uint32_t dataset_id, std::string& ans) const;
+
+    /// The sample set as a bitmap of sample IDs (cached)
+    Status sampleset_bitmap(const std::string& sampleset,
+                            std::shared_ptr<const SampleBitmap>& ans) const;
+
+    /// Assign IDs to a newly imported dataset and its samples
+    Status register_dataset(const std::string& dataset, const std::set<std::string>& samples);
 };
 
 /// Iterate over BCF records within some range.
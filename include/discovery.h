@@ -6,8 +6,9 @@
 
 namespace GLnexus {
 
-// Discover alleles from a RangeBCFIterator. Records not contained within pos will be ignored.
-Status discover_alleles_from_iterator(const std::set<std::string>& samples,
+// Discover alleles from a RangeBCFIterator over the datasets of the sample set.
+// Records not contained within pos will be ignored.
+Status discover_alleles_from_iterator(const MetadataCache& cache, const std::string& sampleset,
                                       const range& pos,
                                       RangeBCFIterator& iterator,
                                       discovered_alleles& dsals);
@@ -3,23 +3,102 @@
 
 #include "data.h"
 #include "types.h"
+#include "unified_site_table.h"
 #include <fstream>
 #include <memory>
 #include "residuals.h"
 
 namespace GLnexus {
 
+// Scratch buffers and helpers reused by genotype_site from one site to
+// the next, so that genotyping doesn't reallocate per-sample state for each
+// site. A workspace must only be used by one thread at a time; each worker
+// should have its own.
+class GenotypingWorkspace {
+public:
+    GenotypingWorkspace();
+    ~GenotypingWorkspace();
+
+    // Number of times a dataset's reference band was reused from a previous
+    // site instead of reprocessed (for diagnostics)
+    size_t ref_band_hits() const;
+
+    struct body;
+    std::unique_ptr<body> body_;
+};
+
 // Genotype a site.
 //
 // residual_rec: in case there are call losses, generate a YAML formatted record giving
 // the context. This is used offline to improve the algorithms.
+//
+// workspace: optional; if omitted, a temporary one is used for this site only.
 Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
                      const unified_site& site,
                      const std::string& sampleset, const std::vector<std::string>& samples,
                      const bcf_hdr_t* hdr, std::shared_ptr<bcf1_t>& ans,
                      bool residualsFlag,
                      std::shared_ptr<std::string> &residual_rec,
-                     std::atomic<bool>* abort = nullptr);
+                     std::atomic<bool>* abort = nullptr,
+                     GenotypingWorkspace* workspace = nullptr);
+
+// Genotype a site held in a unified_site_table
+Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data,
+                     const unified_site_view& site,
+                     const std::string& sampleset, const std::vector<std::string>& samples,
+                     const bcf_hdr_t* hdr, std::shared_ptr<bcf1_t>& ans,
+                     bool residualsFlag,
+                     std::shared_ptr<std::string> &residual_rec,
+                     std::atomic<bool>* abort = nullptr,
+                     GenotypingWorkspace* workspace = nullptr);
+
+// Dataset-major genotyping of a window of sites on one contig, producing the
+// same records as genotype_site would for each site. Instead of querying all
+// the datasets at each site in turn, each dataset's records spanning the
+// whole window are read at once and merge-joined against the sites, so that
+// storage is streamed through in one pass per dataset.
+//
+// After Open, call genotype_datasets on disjoint subranges of
+// [0, dataset_count()), possibly concurrently from different threads; once
+// all have completed, call finish_site for each site in the window (again
+// possibly concurrently).
+class GenotypingWindow {
+    struct body;
+    std::unique_ptr<body> body_;
+
+    GenotypingWindow();
+    GenotypingWindow(const GenotypingWindow&) = delete;
+
+public:
+    // Set up the window of sites[lo,hi), which must lie on one contig. sites
+    // and samples must outlive the window.
+    static Status Open(const genotyper_config& cfg, MetadataCache& cache,
+                       const std::vector<unified_site>& sites, size_t lo, size_t hi,
+                       const std::string& sampleset, const std::vector<std::string>& samples,
+                       bool residualsFlag, std::unique_ptr<GenotypingWindow>& ans);
+    // Likewise for sites held in a unified_site_table, which are read
+    // through unified_site_view without materializing them
+    static Status Open(const genotyper_config& cfg, MetadataCache& cache,
+                       const unified_site_table& sites, size_t lo, size_t hi,
+                       const std::string& sampleset, const std::vector<std::string>& samples,
+                       bool residualsFlag, std::unique_ptr<GenotypingWindow>& ans);
+    ~GenotypingWindow();
+
+    size_t dataset_count() const;
+
+    // Approximate bytes held by the window's per-site genotyping state
+    size_t memory_size() const;
+
+    // Genotype the samples in datasets [dataset_lo, dataset_hi) at all the
+    // sites in the window
+    Status genotype_datasets(BCFData& data, size_t dataset_lo, size_t dataset_hi,
+                             GenotypingWorkspace& workspace,
+                             std::atomic<bool>* abort = nullptr);
+
+    // Produce the output record for sites[i], lo <= i < hi
+    Status finish_site(size_t i, const bcf_hdr_t* hdr, GenotypingWorkspace& workspace,
+                       std::shared_ptr<bcf1_t>& ans, std::shared_ptr<std::string>& residual_rec);
+};
 
 // Reasons for emitting a non-call (.), encoded in the RNC FORMAT field in the
 // output VCF
@@ -81,7 +160,7 @@ struct bcf1_t_plus {
     std::vector<bool> deletion_allele;
 };
 Status preprocess_record(const unified_site& site, const bcf_hdr_t* hdr, const std::shared_ptr<bcf1_t>& record, bcf1_t_plus& ans);
-Status revise_genotypes(const genotyper_config& cfg, const unified_site& us, const std::map<int, int>& sample_mapping,
+Status revise_genotypes(const genotyper_config& cfg, const unified_site& us, const SampleMapping& sample_mapping,
                         const bcf_hdr_t* hdr, bcf1_t_plus& vr);
 
 } // namespace GLnexus
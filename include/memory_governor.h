@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <string>
+
+namespace GLnexus {
+
+// Central accounting of the memory used by the major consumers: the RocksDB
+// block cache and write buffers, bulk-insert buffers, and discovery and
+// genotyping results in flight. Each component charges the bytes it holds
+// and releases them when it lets go. Components that can wait (producers of
+// in-flight results) check has_room() before taking on more, so that
+// together they stay within the budget.
+//
+// The RocksDB block cache and write buffers are provisioned up front from
+// the same budget and bounded by RocksDB itself, so they're accounted (for
+// the reports) but don't count against has_room(). Otherwise, charged at
+// full capacity, they'd leave little or no headroom for in-flight results
+// under a small budget.
+//
+// A budget of zero means unlimited: usage is still accounted (for the
+// high-water marks) but has_room() is always true.
+class MemoryGovernor {
+public:
+    enum class Component {
+        BLOCK_CACHE = 0,
+        WRITE_BUFFERS,
+        BULK_INSERT,
+        DISCOVERY,
+        GENOTYPING
+    };
+    static const int N_COMPONENTS = 5;
+
+    // the process-wide governor
+    static MemoryGovernor& global();
+
+    explicit MemoryGovernor(size_t budget = 0);
+
+    size_t budget() const { return budget_; }
+    void set_budget(size_t budget) { budget_ = budget; }
+
+    void charge(Component c, size_t bytes);
+    void release(Component c, size_t bytes);
+
+    // whether bytes more of in-flight data (bulk insert, discovery or
+    // genotyping) could be charged without exceeding the budget
+    bool has_room(size_t bytes = 0) const;
+
+    size_t in_use() const { return total_; }
+    size_t in_use(Component c) const { return used_[int(c)]; }
+    size_t high_water(Component c) const { return high_water_[int(c)]; }
+
+    // human-readable summary of the components' high-water marks
+    std::string report() const;
+
+private:
+    std::atomic<size_t> budget_;
+    std::atomic<size_t> total_;
+    std::atomic<size_t> used_[N_COMPONENTS];
+    std::atomic<size_t> high_water_[N_COMPONENTS];
+
+    MemoryGovernor(const MemoryGovernor&) = delete;
+    MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+};
+
+} // namespace GLnexus
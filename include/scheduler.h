@@ -0,0 +1,139 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace GLnexus {
+
+// Task lanes, in order of priority: idle workers take discovery tasks before
+// unification tasks before genotyping tasks.
+enum class TaskLane {
+    DISCOVERY = 0,
+    UNIFICATION = 1,
+    GENOTYPING = 2
+};
+
+// Parse a sysfs CPU list such as "0-3,8-11"; returns false if malformed.
+bool parse_cpu_list(const std::string& cpulist, std::vector<int>& ans);
+
+// Detect the NUMA topology: the CPUs of each node with any, in node order,
+// from sys_node_dir/node*/cpulist. Empty if that can't be read.
+std::vector<std::vector<int>> detect_numa_nodes(const std::string& sys_node_dir = "/sys/devices/system/node");
+
+// Work-stealing task scheduler. Each worker thread has its own deque of
+// tasks for each lane: tasks pushed from a worker go onto its own deque,
+// which it pops LIFO, while idle workers steal FIFO from the others. Tasks
+// pushed from outside go onto a shared FIFO queue, so that they're started
+// in the order submitted (callers such as Service::genotype_sites rely on
+// this to throttle themselves without deadlock).
+//
+// Like ctpl::thread_pool, tasks are callables taking the worker's index
+// (tid, in [0, size())), which may be used to index per-worker state.
+//
+// Tasks may fork further tasks and join them with get(): on a worker thread,
+// get() runs pending tasks while it waits, instead of blocking the thread.
+// A task must not hold per-worker state across such a get(), since other
+// tasks may then run on the same worker. (get() only runs tasks forked by
+// workers, never new tasks from outside, which might wait on the very task
+// that's waiting in get().)
+//
+// Given the CPUs of more than one NUMA node (see detect_numa_nodes), the
+// workers are divided among the nodes and pinned to their CPUs. Tasks may
+// then be pushed to a particular node (each has its own shared queue), and
+// idle workers steal from the other workers on their own node before looking
+// further afield.
+class Scheduler {
+public:
+    explicit Scheduler(size_t threads, const std::vector<std::vector<int>>& numa_nodes = {});
+    ~Scheduler();
+
+    size_t size() const { return workers_.size(); }
+
+    // number of NUMA nodes the workers are divided among (1 if NUMA-unaware)
+    size_t nodes() const { return node_workers_.size(); }
+
+    // NUMA node of worker tid
+    int worker_node(int tid) const { return worker_node_[tid]; }
+
+    template<class F>
+    auto push(TaskLane lane, F&& f) -> std::future<decltype(f(0))> {
+        return push(lane, -1, std::forward<F>(f));
+    }
+
+    // Push a task to be run preferably on one of the given node's workers
+    // (no preference if node < 0)
+    template<class F>
+    auto push(TaskLane lane, int node, F&& f) -> std::future<decltype(f(0))> {
+        using R = decltype(f(0));
+        auto task = std::make_shared<std::packaged_task<R(int)>>(std::forward<F>(f));
+        auto fut = task->get_future();
+        enqueue(lane, node, [task](int tid) { (*task)(tid); });
+        return fut;
+    }
+
+    // Wait for a task's result. If called from one of this scheduler's
+    // workers, runs other pending tasks in the meantime.
+    template<class T>
+    T get(std::future<T>& fut) {
+        int tid = current_worker();
+        if (tid >= 0) {
+            join(tid, [&fut]() {
+                return fut.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            });
+        }
+        return fut.get();
+    }
+
+    // index of the calling thread among this scheduler's workers, or -1
+    int current_worker() const;
+
+private:
+    using task_t = std::function<void(int)>;
+    static const int N_LANES = 3;
+
+    struct worker {
+        std::mutex mutex;
+        std::deque<task_t> lanes[N_LANES];
+    };
+    std::vector<std::unique_ptr<worker>> workers_;
+    // tasks pushed from outside the workers, per NUMA node
+    std::vector<std::unique_ptr<worker>> injected_;
+    std::vector<std::thread> threads_;
+
+    // NUMA placement: the node of each worker, the workers of each node, the
+    // CPUs of each node (empty if NUMA-unaware), and the order in which each
+    // worker tries to steal from the others
+    std::vector<int> worker_node_;
+    std::vector<std::vector<int>> node_workers_;
+    std::vector<std::vector<int>> node_cpus_;
+    std::vector<std::vector<int>> steal_order_;
+
+    // number of tasks enqueued but not yet started, and how many of those
+    // are on the workers' own deques (i.e. runnable within get())
+    std::atomic<size_t> pending_;
+    std::atomic<size_t> pending_forked_;
+    // number of workers sleeping in join()
+    std::atomic<size_t> joiners_;
+    std::atomic<size_t> next_worker_;
+    bool stop_ = false;
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+
+    void enqueue(TaskLane lane, int node, task_t task);
+    bool run_one(int tid, bool take_injected = true);
+    void join(int tid, const std::function<bool()>& ready);
+    void work(int tid);
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+};
+
+} // namespace GLnexus
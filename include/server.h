@@ -0,0 +1,95 @@
+#ifndef GLNEXUS_SERVER_H
+#define GLNEXUS_SERVER_H
+
+#include <string>
+#include <memory>
+#include "types.h"
+#include "data.h"
+#include "service.h"
+#include "spdlog/spdlog.h"
+
+namespace GLnexus {
+
+struct server_config {
+    // path of the Unix domain socket to listen on (replaced if it exists)
+    std::string socket_path;
+
+    // maximum number of requests processed at once; further connections are
+    // turned away with a "busy" error rather than queued
+    size_t max_concurrent_requests = 4;
+
+    // sample set to analyze (all samples if empty)
+    std::string sampleset;
+
+    service_config service;
+    unifier_config unifier;
+    genotyper_config genotyper;
+};
+
+// Cumulative metrics over the requests a server has received
+struct server_metrics {
+    uint64_t requests = 0;   // answered, successfully or not
+    uint64_t failed = 0;     // answered with an error
+    uint64_t rejected = 0;   // turned away due to the concurrency limit
+    uint64_t bytes_out = 0;  // response payload bytes
+    uint64_t total_ms = 0;   // time spent processing the answered requests
+    uint64_t max_ms = 0;
+
+    std::string yaml() const;
+};
+
+// Long-running server keeping a Service (and thus the database handles,
+// header caches, and sample set resolution) resident between requests, so
+// that small region queries don't each pay the startup costs.
+//
+// Protocol: a client connects to the Unix domain socket, sends one request
+// line, and reads the response, after which the server closes the
+// connection. Requests are
+//
+//     DISCOVER <ranges>    discovered alleles (YAML)
+//     UNIFY <ranges>       unified sites (YAML)
+//     GENOTYPE <ranges>    pVCF records in the genotyper's output format
+//     METRICS              cumulative server_metrics (YAML)
+//
+// where <ranges> is a comma-separated list of chrom:beg-end (1-based,
+// inclusive). The response is either "OK <n>\n" followed by an n-byte
+// payload, or "ERROR <message>\n".
+class Server {
+    // pImpl idiom
+    struct body;
+    std::unique_ptr<body> body_;
+
+    Server();
+    Server(const Server&) = delete;
+
+    void accept_loop();
+    void serve_connection(int conn);
+    void reap(bool all);
+    Status process(const std::string& verb, const std::string& args,
+                   std::string& payload, std::string& detail);
+
+public:
+    // Bind the socket and start serving requests on a background thread
+    static Status Start(std::shared_ptr<spdlog::logger> logger, const server_config& cfg,
+                        Metadata& metadata, BCFData& data, std::unique_ptr<Server>& ans);
+
+    // Stop accepting connections, abort the requests in progress, and wait
+    // for them to finish. Also done by the destructor.
+    void Stop();
+    ~Server();
+
+    // Process one request line directly, as if received on the socket;
+    // returns the payload on success.
+    Status handle(const std::string& request, std::string& payload);
+
+    server_metrics metrics() const;
+};
+
+// Client side: send a request to the server listening at socket_path and
+// return the response payload (or the error it sent back).
+Status server_request(const std::string& socket_path, const std::string& request,
+                      std::string& payload);
+
+}
+
+#endif
@@ -8,14 +8,35 @@
 #include <memory>
 #include "types.h"
 #include "data.h"
+#include "unified_site_table.h"
 
 namespace GLnexus {
 
+class BCFFileSink;
+class ResidualsFile;
+
 struct service_config {
     size_t threads = 0;
 
     // additional (informational) lines to insert into output pVCF headers
     std::vector<std::string> extra_header_lines;
+
+    // if nonzero, genotype_sites uses the dataset-major genotyper (see
+    // GenotypingWindow), in windows of up to this many sites
+    size_t dataset_major_window = 0;
+
+    // NUMA mode: divide the worker threads among the NUMA nodes (detected
+    // from /sys) and route tasks to them by genomic range. No effect on
+    // single-node hosts.
+    bool numa = false;
+
+    // Checkpointing: if checkpoint_dir is set, genotype_sites produces its
+    // output in segments of up to checkpoint_chunk sites in this directory,
+    // recording each as it's completed, and finally concatenates them into
+    // the output file. If a run is interrupted, rerunning it (with the same
+    // sites, sample set, and configuration) skips the completed segments.
+    std::string checkpoint_dir;
+    size_t checkpoint_chunk = 100000;
 };
 
 class Service {
@@ -26,6 +47,32 @@ class Service {
     Service(const service_config& cfg, BCFData& data);
     Service(const Service&) = delete;
 
+    // sites_t: std::vector<unified_site> or unified_site_table
+    template<class sites_t>
+    Status genotype_sites_impl(const genotyper_config& cfg, const std::string& sampleset,
+                               const sites_t& sites, const std::string& filename,
+                               std::atomic<bool>* abort);
+    template<class sites_t>
+    Status genotype_sites_site_major(const genotyper_config& cfg, const std::string& sampleset,
+                                     const std::vector<std::string>& sample_names,
+                                     const sites_t& sites, size_t lo, size_t hi,
+                                     const bcf_hdr_t* hdr, BCFFileSink& bcf_out,
+                                     ResidualsFile* residualsFile,
+                                     std::atomic<bool>* ext_abort);
+    template<class sites_t>
+    Status genotype_sites_dataset_major(const genotyper_config& cfg, const std::string& sampleset,
+                                        const std::vector<std::string>& sample_names,
+                                        const sites_t& sites, size_t begin, size_t end,
+                                        const bcf_hdr_t* hdr, BCFFileSink& bcf_out,
+                                        ResidualsFile* residualsFile,
+                                        std::atomic<bool>* ext_abort);
+    template<class sites_t>
+    Status genotype_sites_checkpointed(const genotyper_config& cfg, const std::string& sampleset,
+                                       const std::vector<std::string>& sample_names,
+                                       const sites_t& sites, const bcf_hdr_t* hdr,
+                                       const std::string& filename,
+                                       std::atomic<bool>* ext_abort);
+
 public:
     static Status Start(const service_config& cfg, Metadata& metadata, BCFData& data,
                         std::unique_ptr<Service>& svc);
@@ -67,6 +114,24 @@ public:
                           const std::string& filename,
                           std::atomic<bool>* abort = nullptr);
 
+    /// Genotype a set of samples at the sites in a compact table (as above)
+    Status genotype_sites(const genotyper_config& cfg, const std::string& sampleset,
+                          const unified_site_table& sites,
+                          const std::string& filename,
+                          std::atomic<bool>* abort = nullptr);
+
+    /// Genotype a set of samples at a single known variant, without
+    /// discovery or unification: the site consists of the REF allele at pos
+    /// followed by the given ALT alleles. Meant for low-latency point
+    /// queries; the datasets are read in parallel and the resulting record
+    /// is returned in memory, along with the pVCF header describing it
+    /// (which is cached for each sample set).
+    Status genotype_variant(const genotyper_config& cfg, const std::string& sampleset,
+                            const range& pos, const std::string& ref,
+                            const std::vector<std::string>& alts,
+                            std::shared_ptr<const bcf_hdr_t>& hdr, std::shared_ptr<bcf1_t>& ans,
+                            std::atomic<bool>* abort = nullptr);
+
     // Report cumulative time (milliseconds) worker threads in the above
     // operations have spent 'stalled' waiting on single-threaded processing
     // steps (e.g. output serialization)
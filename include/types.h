@@ -500,23 +500,27 @@ struct unified_site {
 struct StatsRangeQuery {
     int64_t nBCFRecordsRead;    // how many BCF records were read from the DB
     int64_t nBCFRecordsInRange; // how many were in the requested range
+    int64_t nBucketsSkipped;    // how many buckets were passed over based on their summaries
 
     // constructor
     StatsRangeQuery() {
         nBCFRecordsRead = 0;
         nBCFRecordsInRange = 0;
+        nBucketsSkipped = 0;
     }
 
     // copy constructor
     StatsRangeQuery(const StatsRangeQuery &srq) {
         nBCFRecordsRead = srq.nBCFRecordsRead;
         nBCFRecordsInRange = srq.nBCFRecordsInRange;
+        nBucketsSkipped = srq.nBucketsSkipped;
     }
 
     // Addition
     StatsRangeQuery& operator+=(const StatsRangeQuery& srq) {
         nBCFRecordsRead += srq.nBCFRecordsRead;
         nBCFRecordsInRange += srq.nBCFRecordsInRange;
+        nBucketsSkipped += srq.nBucketsSkipped;
         return *this;
     }
 
@@ -524,7 +528,8 @@ struct StatsRangeQuery {
     std::string str() {
         std::ostringstream os;
         os << "Num BCF records read " << std::to_string(nBCFRecordsRead)
-           << "  query hits " << std::to_string(nBCFRecordsInRange);
+           << "  query hits " << std::to_string(nBCFRecordsInRange)
+           << "  buckets skipped " << std::to_string(nBucketsSkipped);
         return os.str();
     }
 };
@@ -771,4 +776,9 @@ bool is_gvcf_ref_record(const bcf1_t* record);
 // corruption).
 typedef Status (*bcf_predicate)(const bcf_hdr_t*, bcf1_t*, bool &retval);
 
+// Predicate passing only variant records (excluding gVCF reference confidence
+// records). Storage implementations may recognize this predicate and pass
+// over stored data known to contain no variant records.
+Status bcf_predicate_variant_records(const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval);
+
 } //namespace GLnexus
@@ -0,0 +1,116 @@
+#ifndef GLNEXUS_UNIFIED_SITE_TABLE_H
+#define GLNEXUS_UNIFIED_SITE_TABLE_H
+
+#include "types.h"
+
+namespace GLnexus {
+
+class unified_site_table;
+
+/// Lightweight read-only view of one site in a unified_site_table, valid
+/// while the table is alive and unmodified. Mirrors the fields of
+/// unified_site; allele k = 0 is the reference.
+class unified_site_view {
+    const unified_site_table* table_;
+    size_t i_;
+
+public:
+    unified_site_view(const unified_site_table& table, size_t i) : table_(&table), i_(i) {}
+
+    const range& pos() const;
+    const range& in_target() const;
+    float lost_allele_frequency() const;
+    int qual() const;
+    bool monoallelic() const;
+
+    size_t allele_count() const;
+    std::string allele_dna(size_t k) const;
+    allele allele_normalized(size_t k) const;
+    int allele_quality(size_t k) const;
+    float allele_frequency(size_t k) const;
+
+    /// Index of the unified allele onto which the given representation maps
+    /// (as in unified_site::unification, including the implicit entries), or
+    /// -1 if none.
+    int unify(const allele& al) const;
+
+    /// The range encompassing the site and all the allele representations
+    /// unified into it (explicit or implicit)
+    range unification_range() const;
+
+    /// Convert to a unified_site (with the implicit unification entries)
+    unified_site get() const;
+};
+
+/// Compact storage for a (possibly genome-scale) list of unified sites. All
+/// the sites' DNA strings are kept in one contiguous arena, with flat arrays
+/// of fixed-size records for the sites, their alleles, and their unification
+/// entries. Unification entries implied by the alleles themselves (see
+/// unified_site::fill_implicit_unification) aren't stored but derived on
+/// demand; the rest are kept sorted for binary search.
+class unified_site_table {
+    friend class unified_site_view;
+
+    // a string in the arena
+    struct dna_ref {
+        uint64_t offset = 0;
+        uint32_t length = 0;
+    };
+    struct site_rec {
+        range pos = range(-1,-1,-1), in_target = range(-1,-1,-1);
+        float lost_allele_frequency = 0.0f;
+        int qual = 0;
+        bool monoallelic = false;
+        uint64_t alleles_begin = 0, unification_begin = 0;
+        uint32_t allele_count = 0, unification_count = 0;
+    };
+    struct allele_rec {
+        dna_ref dna;
+        range normalized_pos = range(-1,-1,-1);
+        dna_ref normalized_dna;
+        int quality = 0;
+        float frequency = 0.0f;
+    };
+    // explicit unification entry (original allele -> unified allele index)
+    struct unification_rec {
+        range pos = range(-1,-1,-1);
+        dna_ref dna;
+        int index = -1;
+    };
+
+    std::vector<site_rec> sites_;
+    std::vector<allele_rec> alleles_;
+    std::vector<unification_rec> unification_;
+    std::string arena_;
+
+    dna_ref store(const std::string& dna);
+    std::string str(const dna_ref& dna) const { return arena_.substr(dna.offset, dna.length); }
+    bool eq(const dna_ref& dna, const std::string& s) const {
+        return dna.length == s.size() && arena_.compare(dna.offset, dna.length, s) == 0;
+    }
+
+public:
+    size_t size() const { return sites_.size(); }
+    bool empty() const { return sites_.empty(); }
+    void clear();
+    void shrink_to_fit();
+
+    /// Append a site. Its unification is stored as it would be after
+    /// fill_implicit_unification().
+    void push_back(const unified_site& site);
+
+    unified_site_view operator[](size_t i) const {
+        assert(i < sites_.size());
+        return unified_site_view(*this, i);
+    }
+
+    /// Approximate memory footprint, in bytes
+    size_t memory_usage() const;
+};
+
+/// Move a vector of unified sites into a table (clearing the vector)
+void unified_site_table_of_vector(std::vector<unified_site>& sites, unified_site_table& ans);
+
+}
+
+#endif
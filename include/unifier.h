@@ -5,6 +5,8 @@
 
 namespace GLnexus {
 
+class Scheduler;
+
 // unification_config...
 struct unifier_stats {
     // # ALT alleles represented in idiomatic sites.
@@ -41,6 +43,22 @@ Status unified_sites(const unifier_config& cfg,
                      std::vector<unified_site>& ans,
                      unifier_stats& stats);
 
+/// Parallel version of the above: splits the alleles into chunks of whole
+/// active regions (which are independent of each other), unifies them on the
+/// scheduler's workers, and concatenates the results in order, giving the
+/// same sites as the serial version.
+/// stream: instead of dividing all the alleles into balanced chunks at once,
+///         take them in chunks of bounded size with a bounded number in
+///         flight, so that the intermediate state stays bounded however many
+///         alleles there are.
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N,
+                     /* const */ discovered_alleles& alleles,
+                     std::vector<unified_site>& ans,
+                     unifier_stats& stats,
+                     Scheduler& scheduler,
+                     bool stream = false);
+
 // Find which range overlaps [pos]. The ranges are assumed to be non-overlapping.
 // (exposed for unit testing)
 Status find_target_range(const std::set<range> &ranges, const range &pos, range &ans);
@@ -11,14 +11,18 @@
 #include <math.h>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <sys/time.h>
 #include "fcmm.hpp"
 #include "khash.h"
+#include "ctpl_stl.h"
 #include <regex>
 #include <endian.h>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
 #include <defs.capnp.h>
+#include "memory_governor.h"
 using namespace std;
 
 const uint64_t MAX_NUM_CONTIGS_PER_GVCF = 16777216; // 3 bytes wide
@@ -61,30 +65,48 @@ public:
 using BCFHeaderCache = fcmm::Fcmm<string,shared_ptr<const bcf_hdr_t>,hash<string>,KStringHash>;
 // this is not a hard limit but the FCMM performance degrades if it's too low
 const size_t BCF_HEADER_CACHE_SIZE = 65536;
+// background I/O threads for BCFBucketIterator read-ahead
 
 // pImpl idiom
 struct BCFKeyValueData_body {
     KeyValue::DB* db;
-    unique_ptr<BCFHeaderCache> header_cache;
+    shared_ptr<BCFHeaderCache> header_cache; // replaced (atomically) upon the
+                                             // removal of any data set
     std::unique_ptr<BCFBucketRange> rangeHelper;
     std::mutex mutex;
     ActiveMetadata amd;
     std::mutex statsMutex;
     StatsRangeQuery statsRq; // statistics for range queries
-    atomic<size_t> sample_count; // number of samples in the database. could be
-                                 // obtained from the size of the current
-                                 // all-samples sampleset, but maintained here
-                                 // for convenience.
+    atomic<size_t> sample_count{0}; // number of samples in the database. could be
+                                    // obtained from the size of the current
+                                    // all-samples sampleset, but maintained here
+                                    // for convenience.
+    atomic<size_t> prefetch_depth; // bucket values read ahead by each
+                                   // BCFBucketIterator (0 = no read-ahead)
+    atomic<uint64_t> metadata_version{0}; // incremented upon the removal of
+                                          // any data set (and persisted in
+                                          // the config collection)
+    KeyValue::CollectionHandle import_journal = nullptr; // null if the database
+                                                         // is read-only
+    map<string,bool> recovered_imports;
+    unique_ptr<ctpl::thread_pool> prefetch_pool; // created upon enabling
+                                                 // read-ahead; destroyed first
 };
 
 auto collections = { "config", "sampleset", "sample_dataset", "header", "bcf" };
 
+// Journal of the gVCF imports in progress (see import_gvcf_inner). Databases
+// created before its introduction lack it, so it's created upon Open if need
+// be, rather than required.
+const char* import_journal_collection = "import_journal";
+
 BCFKeyValueData::BCFKeyValueData() = default;
 BCFKeyValueData::~BCFKeyValueData() = default;
 
 Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
                                      const vector<pair<string,size_t>>& contigs,
-                                     int interval_len) {
+                                     int interval_len,
+                                     const vector<range>& bucket_boundaries) {
     Status s;
 
     // some basic sanity checks
@@ -95,11 +117,27 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
         if (contig_len > MAX_CONTIG_LEN)
             return Status::Invalid("contig is too long ", string(p.first) + " " + std::to_string(contig_len));
     }
+    if (interval_len <= 0)
+        return Status::Invalid("bad interval length ", std::to_string(interval_len));
+
+    // collect the bucket boundaries for each contig
+    vector<set<int>> boundaries(contigs.size());
+    for (const auto& r : bucket_boundaries) {
+        if (r.rid < 0 || r.rid >= (int)contigs.size() || r.beg < 0 || r.end <= r.beg ||
+            (size_t)r.end > contigs[r.rid].second) {
+            return Status::Invalid("invalid bucket boundary range ", r.str(contigs));
+        }
+        boundaries[r.rid].insert(r.beg);
+        if ((size_t)r.end < contigs[r.rid].second) {
+            boundaries[r.rid].insert(r.end);
+        }
+    }
 
     // create collections
     for (const auto& coll : collections) {
         S(db->create_collection(coll));
     }
+    S(db->create_collection(import_journal_collection));
 
     KeyValue::CollectionHandle config;
     S(db->collection("config", config));
@@ -134,6 +172,27 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
         S(db->put(config, "param", yaml.c_str()));
     }
 
+    // store bucket boundaries, if any, as a map from contig name to the
+    // sorted list of bucket begin positions
+    if (!bucket_boundaries.empty()) {
+        YAML::Emitter yaml;
+        yaml << YAML::BeginMap;
+        for (size_t rid = 0; rid < contigs.size(); rid++) {
+            if (boundaries[rid].empty()) {
+                continue;
+            }
+            boundaries[rid].insert(0);
+            yaml << YAML::Key << contigs[rid].first;
+            yaml << YAML::Value << YAML::Flow << YAML::BeginSeq;
+            for (int pos : boundaries[rid]) {
+                yaml << pos;
+            }
+            yaml << YAML::EndSeq;
+        }
+        yaml << YAML::EndMap;
+        S(db->put(config, "bucket_boundaries", yaml.c_str()));
+    }
+
     // create * sample set, with version number 0
     KeyValue::CollectionHandle sampleset;
     S(db->collection("sampleset", sampleset));
@@ -146,6 +205,49 @@ Status BCFKeyValueData::InitializeDB(KeyValue::DB* db,
     return BCFKeyValueData::Open(db, nop);
 }
 
+// Parse the bucket_boundaries YAML stored by InitializeDB into a vector of
+// BucketBoundaries indexed by rid.
+static Status parse_bucket_boundaries(const BCFKeyValueData& data, const string& boundaries_yaml,
+                                      vector<BucketBoundaries>& ans) {
+    const char *unexpected = "BCFKeyValueData::Open unexpected bucket_boundaries YAML";
+    Status s;
+    vector<pair<string,size_t> > contigs;
+    S(data.contigs(contigs));
+    map<string,int> rids;
+    for (size_t rid = 0; rid < contigs.size(); rid++) {
+        rids[contigs[rid].first] = rid;
+    }
+
+    ans.clear();
+    ans.resize(contigs.size());
+    try {
+        YAML::Node n = YAML::Load(boundaries_yaml);
+        if (!n.IsMap()) {
+            return Status::Invalid(unexpected, boundaries_yaml);
+        }
+        for (YAML::const_iterator it = n.begin(); it != n.end(); ++it) {
+            auto rid = rids.find(it->first.as<string>());
+            if (rid == rids.end() || !it->second.IsSequence()) {
+                return Status::Invalid(unexpected, it->first.as<string>());
+            }
+            BucketBoundaries& b = ans[rid->second];
+            for (const auto& pos : it->second) {
+                b.push_back(pos.as<int>());
+            }
+            if (b.empty() || b[0] != 0 || !is_sorted(b.begin(), b.end()) ||
+                adjacent_find(b.begin(), b.end()) != b.end() ||
+                (size_t)b.back() >= contigs[rid->second].second) {
+                return Status::Invalid(unexpected, it->first.as<string>());
+            }
+        }
+    } catch(YAML::Exception& exn) {
+        return Status::Invalid("BCFKeyValueData::Open YAML parse error in bucket_boundaries", exn.msg);
+    }
+    return Status::OK();
+}
+
+static Status recover_imports(BCFKeyValueData_body *body_);
+
 Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans) {
     assert(db != nullptr);
 
@@ -199,8 +301,50 @@ Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans)
         return Status::Invalid("Corrupt database; bad interval length ", std::to_string(interval_len));
     }
 
-    ans->body_->rangeHelper = make_unique<BCFBucketRange>(interval_len);
-    ans->body_->header_cache = make_unique<BCFHeaderCache>(BCF_HEADER_CACHE_SIZE);
+    // Read the bucket boundaries, if any (older databases lack them, and
+    // use the fixed interval_len grid throughout)
+    vector<BucketBoundaries> boundaries;
+    string boundaries_yaml;
+    s = ans->body_->db->get(coll, "bucket_boundaries", boundaries_yaml);
+    if (s.ok()) {
+        S(parse_bucket_boundaries(*ans, boundaries_yaml, boundaries));
+    } else if (s != StatusCode::NOT_FOUND) {
+        return s;
+    }
+
+    // Read the metadata version (which older databases lack, having never
+    // removed any data set)
+    string version_str;
+    s = ans->body_->db->get(coll, "metadata_version", version_str);
+    if (s.ok()) {
+        ans->body_->metadata_version = strtoull(version_str.c_str(), nullptr, 10);
+    } else if (s != StatusCode::NOT_FOUND) {
+        return s;
+    }
+
+    ans->body_->rangeHelper = make_unique<BCFBucketRange>(interval_len, move(boundaries));
+    ans->body_->header_cache = make_shared<BCFHeaderCache>(BCF_HEADER_CACHE_SIZE);
+    ans->body_->prefetch_depth = default_prefetch_depth;
+
+    // find (or create) the import journal, and recover any imports that were
+    // interrupted. If the database is read-only, leave them be; the orphaned
+    // buckets are invisible to queries in the meantime.
+    s = db->collection(import_journal_collection, coll);
+    if (s == StatusCode::NOT_FOUND) {
+        s = db->create_collection(import_journal_collection);
+        if (s.ok()) {
+            s = db->collection(import_journal_collection, coll);
+        }
+    }
+    if (s.ok()) {
+        ans->body_->import_journal = coll;
+        s = recover_imports(ans->body_.get());
+    }
+    if (s == StatusCode::NOT_IMPLEMENTED) {
+        ans->body_->import_journal = nullptr;
+    } else if (s.bad()) {
+        return s;
+    }
 
     // initialize sample_count
     string sampleset;
@@ -212,6 +356,10 @@ Status BCFKeyValueData::Open(KeyValue::DB* db, unique_ptr<BCFKeyValueData>& ans)
     return Status::OK();
 }
 
+const map<string,bool>& BCFKeyValueData::recovered_imports() const {
+    return body_->recovered_imports;
+}
+
 Status BCFKeyValueData::contigs(vector<pair<string,size_t> >& ans) const {
     Status s;
     KeyValue::CollectionHandle coll;
@@ -404,6 +552,22 @@ Status BCFKeyValueData::sample_count(size_t& ans) const {
     return Status::OK();
 }
 
+uint64_t BCFKeyValueData::metadata_version() const {
+    return body_->metadata_version;
+}
+
+void BCFKeyValueData::set_prefetch_depth(size_t depth, size_t threads) {
+    if (depth > 0) {
+        // the pool is never replaced once created, since iterators in flight
+        // may be using it; it must exist before any iterator sees depth > 0
+        std::lock_guard<std::mutex> lock(body_->mutex);
+        if (!body_->prefetch_pool) {
+            body_->prefetch_pool = make_unique<ctpl::thread_pool>(max(threads, size_t(1)));
+        }
+    }
+    body_->prefetch_depth = depth;
+}
+
 shared_ptr<StatsRangeQuery> BCFKeyValueData::getRangeStats() {
     // return a copy of the current statistics
     std::lock_guard<std::mutex> lock(body_->statsMutex);
@@ -413,8 +577,9 @@ shared_ptr<StatsRangeQuery> BCFKeyValueData::getRangeStats() {
 
 Status BCFKeyValueData::dataset_header(const string& dataset,
                                        shared_ptr<const bcf_hdr_t>& hdr) const {
-    auto cached = body_->header_cache->end();
-    if ((cached = body_->header_cache->find(dataset)) != body_->header_cache->end()) {
+    auto header_cache = atomic_load(&body_->header_cache);
+    auto cached = header_cache->end();
+    if ((cached = header_cache->find(dataset)) != header_cache->end()) {
         // Return memoized header
         hdr = cached->second;
         assert(hdr);
@@ -435,7 +600,7 @@ Status BCFKeyValueData::dataset_header(const string& dataset,
     hdr = ans;
 
     // Memoize it
-    body_->header_cache->insert(make_pair(dataset, hdr));;
+    header_cache->insert(make_pair(dataset, hdr));;
     return Status::OK();
 }
 
@@ -476,11 +641,21 @@ static Status ScanBCFBucket(const range& bucket, const string& dataset,
         ::capnp::FlatArrayMessageReader message(kj::ArrayPtr<const ::capnp::word>((::capnp::word*)data.data, data.size / sizeof(::capnp::word)));
         capnp::BCFBucket::Reader bucket_reader = message.getRoot<capnp::BCFBucket>();
 
-        // Scan: begin at a position informed by the 'skip index'
-        //       end on encounting a record whose beg position is >= query.end
+        // Pass over the bucket entirely if its summary rules out any results
+        if (BCFBucketSummarySkip(bucket_reader, query,
+                                 predicate == bcf_predicate_variant_records)) {
+            srq.nBucketsSkipped++;
+            return Status::OK();
+        }
+
+        // Scan: only the records within the index range found by the
+        //       interval index (or, for legacy buckets, from the position
+        //       informed by the skip index until encountering a record whose
+        //       beg position is >= query.end)
         auto records = bucket_reader.getRecords();
-        for (int scan_index = SearchBCFBucketSkipIndex(bucket_reader, query);
-             scan_index < records.size(); ++scan_index) {
+        int scan_lo, scan_hi;
+        SearchBCFBucketIndex(bucket_reader, query, scan_lo, scan_hi);
+        for (int scan_index = scan_lo; scan_index < scan_hi; ++scan_index) {
             srq.nBCFRecordsRead++;
 
             auto buf = records[scan_index];
@@ -575,6 +750,215 @@ Status BCFKeyValueData::dataset_range(const string& dataset,
 // (as in the base implementation). One iterator per underlying storage bucket
 // is produced.
 
+// Compare the dataset part of a bcf collection key, given as a slice, to a
+// dataset name, like std::string::compare but without allocating.
+static inline int compare_key_dataset(const KeyValue::Data& key, const string& dataset) {
+    assert(key.size >= BCFBucketRange::PREFIX_LENGTH);
+    const char* key_dataset = key.data + BCFBucketRange::PREFIX_LENGTH;
+    size_t key_dataset_size = key.size - BCFBucketRange::PREFIX_LENGTH;
+    int c = memcmp(key_dataset, dataset.data(), min(key_dataset_size, dataset.size()));
+    if (c != 0) {
+        return c;
+    }
+    return key_dataset_size < dataset.size() ? -1 : (key_dataset_size > dataset.size() ? 1 : 0);
+}
+
+// Number of keys to step over before resorting to KeyValue::Iterator::seek,
+// when advancing to a desired dataset within a bucket. Stepping is cheaper
+// than seeking over short distances; seeking wins when the sample set is a
+// sparse subset of the datasets in the database.
+const int BUCKET_ITERATOR_MAX_STEPS = 8;
+
+// Advance the KeyValue iterator, positioned within the bucket with the given
+// prefix (or beyond it), to the first key >= the bucket key for [dataset].
+// Sets [found] if the iterator is then positioned at the key for [dataset],
+// or [past_bucket] if it has advanced beyond the end of the bucket.
+static Status advance_to_bucket_dataset(BCFBucketRange& rangeHelper, KeyValue::Iterator& it,
+                                        const string& bucket_prefix, const string& dataset,
+                                        bool& found, bool& past_bucket) {
+    Status s;
+    found = past_bucket = false;
+    for (int steps = 0; true; steps++) {
+        if (!it.valid()) {
+            // the end of the whole bcf collection
+            past_bucket = true;
+            return Status::OK();
+        }
+        KeyValue::Data key = it.key();
+        if (key.size < BCFBucketRange::PREFIX_LENGTH ||
+            memcmp(key.data, bucket_prefix.data(), BCFBucketRange::PREFIX_LENGTH) != 0) {
+            // we've now advanced past the end of the bucket, so there are
+            // no records for this data set (or subsequent data sets)
+            assert(memcmp(key.data, bucket_prefix.data(), BCFBucketRange::PREFIX_LENGTH) > 0);
+            past_bucket = true;
+            return Status::OK();
+        }
+        int c = compare_key_dataset(key, dataset);
+        if (c >= 0) {
+            // if c > 0, the database contains no bucket corresponding to this
+            // dataset, but might have them for subsequent data sets
+            found = (c == 0);
+            return Status::OK();
+        }
+        if (steps < BUCKET_ITERATOR_MAX_STEPS) {
+            S(it.next());
+        } else {
+            S(it.seek(rangeHelper.bucket_key(bucket_prefix, dataset)));
+        }
+    }
+}
+
+// Reads ahead the values of one bucket for the desired datasets, in the
+// background on BCFKeyValueData_body::prefetch_pool, so that the I/O overlaps
+// with the caller's decoding and processing of the preceding values. Each fill
+// task reads until the queue holds [depth] values and then returns, rather
+// than blocking for the consumer, so that a slow or abandoned consumer can't
+// tie up the I/O threads. The consumer schedules another fill once it has
+// drained half of the queue.
+//
+// The values are read with get0 on the iterator's KeyValue::Reader, so they
+// come from the same snapshot as the other iterators over the query range,
+// and are pinned in the storage engine's cache instead of copied. The fill
+// task holds its own reference to the shared state, so the prefetcher can be
+// destroyed without waiting for a fill still sitting in the pool's queue;
+// that fill then sees the cancel flag and returns without reading anything.
+class BCFBucketPrefetcher {
+    struct shared_state {
+        BCFKeyValueData_body& body;
+        const shared_ptr<KeyValue::Reader> reader;
+        const string bucket_prefix;
+        shared_ptr<const vector<string>> datasets;
+        const size_t depth;
+        atomic<bool> cancel;
+
+        // protected by mu
+        mutex mu;
+        condition_variable cv;
+        deque<pair<size_t,shared_ptr<KeyValue::Data>>> queue; // (index in datasets, bucket value)
+        bool filling = false, done = false;
+        Status status;
+
+        // used only by the fill task in flight (at most one at a time)
+        size_t next_dataset = 0;
+
+        shared_state(BCFKeyValueData_body& body_, const shared_ptr<KeyValue::Reader>& reader_,
+                     const string& bucket_prefix_,
+                     const shared_ptr<const vector<string>>& datasets_, size_t depth_)
+            : body(body_), reader(reader_), bucket_prefix(bucket_prefix_), datasets(datasets_),
+              depth(depth_), cancel(false) {}
+    };
+    shared_ptr<shared_state> st_;
+
+    void schedule_fill() {
+        // precondition: st_->mu is held
+        if (!st_->filling && !st_->done) {
+            st_->filling = true;
+            auto st = st_;
+            st_->body.prefetch_pool->push([st](int tid) { fill(*st); });
+        }
+    }
+
+    static void fill(shared_state& st) {
+        Status s;
+        bool done = false;
+        KeyValue::CollectionHandle coll;
+        if (!st.cancel) {
+            s = st.body.db->collection("bcf",coll);
+        }
+        while (s.ok() && !st.cancel) {
+            if (st.next_dataset == st.datasets->size()) {
+                done = true;
+                break;
+            }
+            shared_ptr<KeyValue::Data> value;
+            s = st.reader->get0(coll,
+                                st.body.rangeHelper->bucket_key(st.bucket_prefix,
+                                                                (*st.datasets)[st.next_dataset]),
+                                value);
+            bool found = s.ok();
+            if (s == StatusCode::NOT_FOUND) {
+                s = Status::OK();
+            }
+            if (s.bad()) {
+                break;
+            }
+            bool full = false;
+            if (found) {
+                lock_guard<mutex> lock(st.mu);
+                st.queue.emplace_back(st.next_dataset, move(value));
+                full = st.queue.size() >= st.depth;
+                st.cv.notify_all();
+            }
+            st.next_dataset++;
+            if (full) {
+                break;
+            }
+        }
+
+        lock_guard<mutex> lock(st.mu);
+        if (s.bad()) {
+            st.status = move(s);
+            done = true;
+        }
+        if (done) {
+            st.done = true;
+        }
+        st.filling = false;
+        st.cv.notify_all();
+    }
+
+public:
+    BCFBucketPrefetcher(BCFKeyValueData_body& body, const shared_ptr<KeyValue::Reader>& reader,
+                        const string& bucket_prefix,
+                        const shared_ptr<const vector<string>>& datasets, size_t depth)
+        : st_(make_shared<shared_state>(body, reader, bucket_prefix, datasets,
+                                        max(depth, size_t(1)))) {
+        if (datasets->empty()) {
+            st_->done = true;
+        }
+    }
+
+    ~BCFBucketPrefetcher() {
+        // a fill in flight stops after its current read; a queued one
+        // returns immediately when the pool gets to it
+        st_->cancel = true;
+    }
+
+    // Get the bucket value for the i'th dataset, if any. Datasets must be
+    // requested in order.
+    Status get(size_t i, bool& found, shared_ptr<KeyValue::Data>& value) {
+        shared_state& st = *st_;
+        unique_lock<mutex> lock(st.mu);
+        found = false;
+        while (true) {
+            if (!st.queue.empty()) {
+                // The fill task enqueues values in dataset order; if the
+                // front is past the desired dataset, then there's no bucket
+                // for it.
+                assert(st.queue.front().first >= i);
+                if (st.queue.front().first == i) {
+                    value = move(st.queue.front().second);
+                    st.queue.pop_front();
+                    found = true;
+                }
+                break;
+            }
+            if (st.done) {
+                break;
+            }
+            schedule_fill();
+            st.cv.wait(lock);
+        }
+        if (st.status.bad()) {
+            return st.status;
+        }
+        if (st.queue.size() <= st.depth/2) {
+            schedule_fill();
+        }
+        return Status::OK();
+    }
+};
+
 class BCFBucketIterator : public RangeBCFIterator {
     BCFData& data_;
     BCFKeyValueData_body& body_;
@@ -584,25 +968,53 @@ class BCFBucketIterator : public RangeBCFIterator {
     bool include_danglers_ = true;
 
     range bucket_, query_;
-    shared_ptr<const set<string>> datasets_;
-    set<string>::const_iterator dataset_;
+    // the desired datasets in sorted order, shared by the iterators over all
+    // the buckets in the query range
+    shared_ptr<const vector<string>> datasets_;
+    size_t dataset_ = 0;
 
     string bucket_prefix_;
     shared_ptr<KeyValue::Reader> reader_;
     unique_ptr<KeyValue::Iterator> it_;
+    unique_ptr<BCFBucketPrefetcher> prefetch_;
 
     StatsRangeQuery stats_;
 
     Status next_impl(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
                       vector<shared_ptr<bcf1_t>>& records) {
-        // precondition: dataset_ != datasets_.end()
+        // precondition: dataset_ < datasets_->size()
 
-        // pull the desired data set ID (and increment the iterator for the next call)
-        dataset = *dataset_++;
+        // pull the desired data set ID (and increment the index for the next call)
+        const size_t dataset_i = dataset_++;
+        const string& desired = (*datasets_)[dataset_i];
+        dataset = desired;
 
         // get the data set header
         Status s;
-        S(data_.dataset_header(dataset, hdr));
+        S(data_.dataset_header(desired, hdr));
+
+        const size_t prefetch_depth = body_.prefetch_depth;
+        if (first_ && prefetch_depth > 0) {
+            // start reading ahead in the background
+            prefetch_ = make_unique<BCFBucketPrefetcher>(body_, reader_, bucket_prefix_, datasets_,
+                                                         prefetch_depth);
+            first_ = false;
+        }
+        if (prefetch_) {
+            records.clear();
+            bool found = false;
+            shared_ptr<KeyValue::Data> value;
+            S(prefetch_->get(dataset_i, found, value));
+            if (!found) {
+                return Status::OK();
+            }
+            s = ScanBCFBucket(bucket_, desired, *value, hdr.get(), query_, predicate_,
+                              include_danglers_, stats_, records);
+            if (s.ok()) {
+                stats_.nBCFRecordsInRange += records.size();
+            }
+            return s;
+        }
 
         if (first_) {
             // first call to next(): begin the iteration at the first dataset
@@ -610,14 +1022,14 @@ class BCFBucketIterator : public RangeBCFIterator {
             KeyValue::CollectionHandle coll;
             S(body_.db->collection("bcf",coll));
             S(body_.db->iterator(coll,
-                                 body_.rangeHelper->bucket_key(bucket_prefix_, dataset),
+                                 body_.rangeHelper->bucket_key(bucket_prefix_, desired),
                                  it_));
             assert(it_);
             first_ = false;
         }
 
         records.clear();
-        if (!it_ || !it_->valid()) {
+        if (!it_) {
             // we've already advanced the KeyValue iterator past the end of
             // the bucket, i.e. the bucket contains no further records for any
             // dataset, so we're now just returning empty results for each
@@ -626,38 +1038,19 @@ class BCFBucketIterator : public RangeBCFIterator {
         }
 
         // advance the KeyValue iterator to the desired dataset
-        string key_dataset;
-        for (; s.ok() && it_->valid(); s = it_->next()) {
-            string key_prefix;
-            S(body_.rangeHelper->parse_key(it_->key().str(), key_prefix, key_dataset));
-
-            if (key_prefix != bucket_prefix_) {
-                // we've now advanced past the end of the bucket, so there are
-                // no records for this data set (or subsequent data sets)
-                assert(key_prefix > bucket_prefix_);
-                it_.reset();
-                return Status::OK();
-            }
-
-            if (key_dataset >= dataset) {
-                break;
-            }
-        }
-        if (s.bad()) return s;
-        if (!it_->valid()) {
-            // wow, we've reached the end of the whole bcf collection
+        bool found = false, past_bucket = false;
+        S(advance_to_bucket_dataset(*body_.rangeHelper, *it_, bucket_prefix_, desired,
+                                    found, past_bucket));
+        if (past_bucket) {
             it_.reset();
             return Status::OK();
         }
-        if (key_dataset != dataset) {
-            // the database contains no bucket corresponding to this dataset,
-            // but might have them for subsequent data sets
-            assert(key_dataset > dataset);
+        if (!found) {
             return Status::OK();
         }
 
         // extract the records overlapping query_
-        s = ScanBCFBucket(bucket_, dataset, it_->value(), hdr.get(), query_, predicate_,
+        s = ScanBCFBucket(bucket_, desired, it_->value(), hdr.get(), query_, predicate_,
                           include_danglers_, stats_, records);
         if (s.ok()) {
             stats_.nBCFRecordsInRange += records.size();
@@ -669,12 +1062,11 @@ public:
     BCFBucketIterator(BCFData& data, BCFKeyValueData_body& body, const range& query,
                       const range& bucket, const std::string& bucket_prefix,
                       bcf_predicate predicate, bool include_danglers,
-                      shared_ptr<const set<string>>& datasets,
+                      const shared_ptr<const vector<string>>& datasets,
                       const shared_ptr<KeyValue::Reader>& reader)
         : data_(data), body_(body), predicate_(predicate), include_danglers_(include_danglers),
           bucket_(bucket), query_(query), datasets_(datasets),
-          dataset_(datasets->begin()), bucket_prefix_(bucket_prefix),
-          reader_(reader) {}
+          bucket_prefix_(bucket_prefix), reader_(reader) {}
 
     virtual ~BCFBucketIterator() {
         lock_guard<mutex> lock(body_.statsMutex);
@@ -683,9 +1075,10 @@ public:
 
     Status next(string& dataset, shared_ptr<const bcf_hdr_t>& hdr,
                 vector<shared_ptr<bcf1_t>>& records) override {
-        if (dataset_ == datasets_->end()) {
+        if (dataset_ == datasets_->size()) {
             // we've finished returning all desired results
             it_.reset();
+            prefetch_.reset();
             return Status::NotFound();
         }
 
@@ -726,6 +1119,9 @@ Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const str
     S(body_->db->current(ureader));
     shared_ptr<KeyValue::Reader> reader(move(ureader));
 
+    // the desired datasets in sorted order, shared by all the iterators
+    auto dataset_names = make_shared<const vector<string>>(datasets->begin(), datasets->end());
+
     // create one iterator per bucket
     bool first = true;
     shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(pos);
@@ -739,7 +1135,7 @@ Status BCFKeyValueData::sampleset_range(const MetadataCache& metadata, const str
         string bucket = body_->rangeHelper->bucket_prefix(r);
 
         iterators.push_back(make_unique<BCFBucketIterator>
-                            (*this, *body_, pos, r, bucket, predicate, first, datasets, reader));
+                            (*this, *body_, pos, r, bucket, predicate, first, dataset_names, reader));
         first = false;
     }
 
@@ -916,9 +1312,13 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
                                           const set<range>& range_filter,
                                           const bcf_hdr_t *hdr,
                                           vcfFile *vcf,
+                                          KeyValue::CollectionHandle journal,
                                           BCFKeyValueData::import_result& rslt) {
     Status s;
     BulkInsertBuffer buffer(*db);
+    if (journal) {
+        buffer.journal(journal, dataset);
+    }
     unique_ptr<bcf1_t, void(*)(bcf1_t*)> vt(bcf_init(), &bcf_destroy);
     int prev_pos = -1;
     int prev_rid = -1;
@@ -1020,6 +1420,130 @@ static Status bulk_insert_gvcf_key_values(BCFBucketRange& rangeHelper,
 //  sample -> dataset
 //       mapping from sample to dataset, each dataset can store multiple samples.
 //
+// The import journal holds, for each dataset being imported,
+//
+//  dataset -> gVCF filename
+//       written before any of its buckets
+//  dataset\0<seq> -> bucket prefixes
+//       the prefixes of the bucket keys written by each bulk insert batch
+//       (committed atomically with the batch)
+//  dataset\0header -> header
+//       written once all the buckets are
+//
+// These entries are all deleted in the write batch committing the metadata,
+// so any left in the journal belong to an import that failed or was
+// interrupted (see recover_imports).
+
+// Read a data set's import journal entries: their keys, the concatenated
+// bucket prefixes recorded, and the header if the bulk insert completed
+static Status read_import_journal(BCFKeyValueData_body *body_, const string& dataset,
+                                  vector<string>& keys, string& prefixes, string& hdr_data) {
+    Status s;
+    keys.clear();
+    prefixes.clear();
+    hdr_data.clear();
+
+    string ignore;
+    s = body_->db->get(body_->import_journal, dataset, ignore);
+    if (s.ok()) {
+        keys.push_back(dataset);
+    } else if (s != StatusCode::NOT_FOUND) {
+        return s;
+    }
+    s = Status::OK();
+
+    const string pfx = dataset + string(1, '\0');
+    const string header_key = import_journal_header_key(dataset);
+    unique_ptr<KeyValue::Iterator> it;
+    S(body_->db->iterator(body_->import_journal, pfx, it));
+    for (; s.ok() && it->valid(); s = it->next()) {
+        auto key = it->key();
+        if (key.size < pfx.size() || memcmp(key.data, pfx.data(), pfx.size())) {
+            break;
+        }
+        keys.push_back(key.str());
+        if (keys.back() == header_key) {
+            hdr_data = it->value().str();
+        } else {
+            auto value = it->value();
+            if (value.size % BCFBucketRange::PREFIX_LENGTH) {
+                return Status::Failure("BCFKeyValueData: corrupt import journal entry", dataset);
+            }
+            prefixes.append(value.data, value.size);
+        }
+    }
+    return s;
+}
+
+// Commit the metadata for a data set whose buckets have all been written,
+// and clear its import journal. Caller must hold body_->mutex.
+static Status commit_dataset_metadata(BCFKeyValueData_body *body_,
+                                      const string& dataset,
+                                      const string& hdr_data,
+                                      const set<string>& samples) {
+    Status s;
+
+    // Get collection handles and current * sample set version number
+    KeyValue::CollectionHandle coll_header, coll_sample_dataset, coll_sampleset;
+    S(body_->db->collection("header", coll_header));
+    S(body_->db->collection("sample_dataset", coll_sample_dataset));
+    S(body_->db->collection("sampleset", coll_sampleset));
+    string version_str;
+    S(body_->db->get(coll_sampleset, "*", version_str));
+    uint64_t version = strtoull(version_str.c_str(), nullptr, 10);
+
+    // Store header and metadata (with updated version number)
+    unique_ptr<KeyValue::WriteBatch> wb;
+    S(body_->db->begin_writes(wb));
+    S(wb->put(coll_header, dataset, hdr_data));
+    for (const auto& sample : samples) {
+        // place an entry for this sample in the special "*" sample set
+        S(wb->put(coll_sample_dataset, sample, dataset));
+        string key = "*" + string(1,'\0') + sample;
+        assert(key.size() == sample.size()+2);
+        S(wb->put(coll_sampleset, key, string()));
+    }
+    // update the * sample set version number
+    S(wb->put(coll_sampleset, "*", to_string(version+1)));
+
+    // clear the journal
+    if (body_->import_journal) {
+        vector<string> keys;
+        string ignore1, ignore2;
+        S(read_import_journal(body_, dataset, keys, ignore1, ignore2));
+        for (const auto& key : keys) {
+            S(wb->delete_key(body_->import_journal, key));
+        }
+    }
+
+    S(wb->commit());
+    body_->sample_count += samples.size();
+    return Status::OK();
+}
+
+// Delete the buckets recorded in a data set's import journal, along with the
+// journal itself.
+static Status rollback_import(BCFKeyValueData_body *body_, const string& dataset) {
+    Status s;
+    vector<string> keys;
+    string prefixes, ignore;
+    S(read_import_journal(body_, dataset, keys, prefixes, ignore));
+
+    KeyValue::CollectionHandle coll_bcf;
+    S(body_->db->collection("bcf", coll_bcf));
+    unique_ptr<KeyValue::WriteBatch> wb;
+    S(body_->db->begin_writes(wb));
+    for (size_t i = 0; i < prefixes.size(); i += BCFBucketRange::PREFIX_LENGTH) {
+        S(wb->delete_key(coll_bcf,
+                         body_->rangeHelper->bucket_key(prefixes.substr(i, BCFBucketRange::PREFIX_LENGTH),
+                                                        dataset)));
+    }
+    for (const auto& key : keys) {
+        S(wb->delete_key(body_->import_journal, key));
+    }
+    return wb->commit();
+}
+
 static Status import_gvcf_inner(BCFKeyValueData_body *body_,
                                 MetadataCache& metadata,
                                 const string& dataset,
@@ -1056,55 +1580,110 @@ static Status import_gvcf_inner(BCFKeyValueData_body *body_,
         body_->amd.add(dataset, rslt.samples);
     }
 
-    // bulk insert, non atomic
-    //
-    // Note: we are not dealing at all with mid-flight failures
-    S(bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
-                                  dataset, filename, range_filter,
-                                  hdr.get(), vcf.get(), rslt));
+    // bulk insert, non atomic, but journaled so that the buckets written can
+    // be removed if we fail here, or recovered upon reopening the database if
+    // we're interrupted.
+    if (body_->import_journal) {
+        S(body_->db->put(body_->import_journal, dataset, filename));
+    }
+    string hdr_data = bcf_write_header(hdr.get());
+    s = bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
+                                    dataset, filename, range_filter,
+                                    hdr.get(), vcf.get(), body_->import_journal, rslt);
+    if (s.ok() && body_->import_journal) {
+        s = body_->db->put(body_->import_journal, import_journal_header_key(dataset), hdr_data);
+    }
 
     // Update metadata atomically, now it will point to all the data
-    Status retval = Status::Invalid();
-    {
+    if (s.ok()) {
         std::lock_guard<std::mutex> lock(body_->mutex);
+        s = commit_dataset_metadata(body_, dataset, hdr_data, rslt.samples);
 
-        // Serialize header into a string
-        string hdr_data = bcf_write_header(hdr.get());
+        // Remove from active metadata
+        body_->amd.erase(dataset, rslt.samples);
+    }
 
-        // Get collection handles and current * sample set version number
-        KeyValue::CollectionHandle coll_header, coll_sample_dataset, coll_sampleset;
-        S(body_->db->collection("header", coll_header));
-        S(body_->db->collection("sample_dataset", coll_sample_dataset));
-        S(body_->db->collection("sampleset", coll_sampleset));
-        string version_str;
-        S(body_->db->get(coll_sampleset, "*", version_str));
-        uint64_t version = strtoull(version_str.c_str(), nullptr, 10);
-
-        // Store header and metadata (with updated version number)
-        unique_ptr<KeyValue::WriteBatch> wb;
-        S(body_->db->begin_writes(wb));
-        S(wb->put(coll_header, dataset, hdr_data));
-        for (const auto& sample : rslt.samples) {
-            // place an entry for this sample in the special "*" sample set
-            S(wb->put(coll_sample_dataset, sample, dataset));
-            string key = "*" + string(1,'\0') + sample;
-            assert(key.size() == sample.size()+2);
-            S(wb->put(coll_sampleset, key, string()));
+    if (s.bad() && body_->import_journal) {
+        // best effort; failing this, recover_imports will retry upon reopening
+        rollback_import(body_, dataset);
+    }
+    return s;
+}
+
+// Finish or roll back each import left in the journal by a failure or
+// interruption. An import whose buckets were all written is finished by
+// committing its metadata from the journal (unless its samples have since
+// been imported otherwise); any other is rolled back, so that the data set
+// can be imported again. A replacement staged by replace_dataset is always
+// rolled back, leaving the data set it was to replace as it was. The
+// outcomes are recorded in body_->recovered_imports.
+static Status recover_imports(BCFKeyValueData_body *body_) {
+    Status s;
+    assert(body_->import_journal);
+
+    set<string> datasets;
+    unique_ptr<KeyValue::Iterator> it;
+    S(body_->db->iterator(body_->import_journal, string(), it));
+    for (; s.ok() && it->valid(); s = it->next()) {
+        string key = it->key().str();
+        datasets.insert(key.substr(0, key.find('\0')));
+    }
+    S(s);
+    it.reset();
+
+    KeyValue::CollectionHandle coll_header, coll_sample_dataset;
+    S(body_->db->collection("header", coll_header));
+    S(body_->db->collection("sample_dataset", coll_sample_dataset));
+    for (const auto& dataset : datasets) {
+        vector<string> keys;
+        string prefixes, hdr_data, ignore;
+        S(read_import_journal(body_, dataset, keys, prefixes, hdr_data));
+
+        s = body_->db->get(coll_header, dataset, ignore);
+        if (s.ok()) {
+            // the metadata was committed after all (shouldn't happen, as it
+            // clears the journal in the same batch), just clear the journal
+            unique_ptr<KeyValue::WriteBatch> wb;
+            S(body_->db->begin_writes(wb));
+            for (const auto& key : keys) {
+                S(wb->delete_key(body_->import_journal, key));
+            }
+            S(wb->commit());
+            continue;
+        } else if (s != StatusCode::NOT_FOUND) {
+            return s;
         }
-        // update the * sample set version number
-        S(wb->put(coll_sampleset, "*", to_string(version+1)));
 
-        // Remove from active metadata
-        body_->amd.erase(dataset, rslt.samples);
+        bool finish = false;
+        set<string> samples;
+        if (!hdr_data.empty() && !is_replacement_dataset(dataset)) {
+            shared_ptr<bcf_hdr_t> hdr;
+            int consumed;
+            S(bcf_raw_read_header((const uint8_t*) hdr_data.c_str(), hdr_data.size(), consumed, hdr));
+            finish = true;
+            unsigned n = bcf_hdr_nsamples(hdr.get());
+            for (unsigned i = 0; i < n; i++) {
+                string sample(bcf_hdr_int2id(hdr.get(), BCF_DT_SAMPLE, i));
+                s = body_->db->get(coll_sample_dataset, sample, ignore);
+                if (s.ok()) {
+                    finish = false;
+                } else if (s != StatusCode::NOT_FOUND) {
+                    return s;
+                }
+                samples.insert(sample);
+            }
+        }
 
-        retval = wb->commit();
-        if (retval.ok()) {
-            body_->sample_count += rslt.samples.size();
+        if (finish) {
+            std::lock_guard<std::mutex> lock(body_->mutex);
+            S(commit_dataset_metadata(body_, dataset, hdr_data, samples));
+        } else {
+            S(rollback_import(body_, dataset));
         }
+        body_->recovered_imports[dataset] = finish;
     }
 
-    // good path
-    return retval;
+    return Status::OK();
 }
 
 Status BCFKeyValueData::import_gvcf(MetadataCache& metadata,
@@ -1129,10 +1708,301 @@ Status BCFKeyValueData::import_gvcf(MetadataCache& metadata,
         // We had a failure, remove from the active metadata
         std::lock_guard<std::mutex> lock(body_->mutex);
         body_->amd.erase(dataset, rslt.samples);
+        return s;
+    }
+
+    return metadata.register_dataset(dataset, rslt.samples);
+}
+
+
+// The sample names in a data set's header
+static set<string> header_samples(const bcf_hdr_t* hdr) {
+    set<string> ans;
+    unsigned n = bcf_hdr_nsamples(hdr);
+    for (unsigned i = 0; i < n; i++) {
+        ans.insert(string(bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, i)));
+    }
+    return ans;
+}
+
+// Delete a data set's key in every bucket. The keys of one data set are
+// interleaved with the other data sets' (bucket prefix first), so they can't
+// be deleted as a range. Reading which buckets are present would cost as
+// much as reading the whole data set, so instead we write a tombstone for
+// each possible bucket; RocksDB compacts away files dense with tombstones
+// (see RocksKeyValue ApplyColumnFamilyOptions).
+static Status delete_dataset_buckets(BCFKeyValueData_body *body_,
+                                     const vector<pair<string,size_t>>& contigs,
+                                     KeyValue::CollectionHandle coll_bcf,
+                                     const string& dataset,
+                                     KeyValue::WriteBatch& wb) {
+    Status s;
+    for (int rid = 0; rid < (int)contigs.size(); rid++) {
+        range end_bucket = body_->rangeHelper->bucket_at_end_of_chrom(rid, contigs);
+        shared_ptr<BucketExtent> bkExt = body_->rangeHelper->scan(range(rid, 0, end_bucket.beg));
+        for (range r = bkExt->begin(); r <= bkExt->end(); r = bkExt->next()) {
+            S(wb.delete_key(coll_bcf, body_->rangeHelper->bucket_key(r, dataset)));
+        }
+    }
+    return Status::OK();
+}
+
+static Status remove_dataset_inner(BCFKeyValueData_body *body_,
+                                   const vector<pair<string,size_t>>& contigs,
+                                   const string& dataset,
+                                   const set<string>& samples) {
+    Status s;
+    KeyValue::CollectionHandle coll_bcf, coll_header, coll_sample_dataset, coll_sampleset;
+    S(body_->db->collection("bcf", coll_bcf));
+    S(body_->db->collection("header", coll_header));
+    S(body_->db->collection("sample_dataset", coll_sample_dataset));
+    S(body_->db->collection("sampleset", coll_sampleset));
+
+    unique_ptr<KeyValue::WriteBatch> wb;
+    S(body_->db->begin_writes(wb));
+    S(delete_dataset_buckets(body_, contigs, coll_bcf, dataset, *wb));
+
+    // Delete the metadata atomically with the buckets
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    S(wb->delete_key(coll_header, dataset));
+    for (const auto& sample : samples) {
+        S(wb->delete_key(coll_sample_dataset, sample));
     }
 
+    // Remove the samples from the special "*" sample set and bump its
+    // version number, so that all_samples_sampleset starts a new version
+    // without them. Existing sample sets, including previous versions of the
+    // all-samples sample set, are immutable and left as they are.
+    for (const auto& sample : samples) {
+        S(wb->delete_key(coll_sampleset, "*" + string(1,'\0') + sample));
+    }
+    string version_str;
+    S(body_->db->get(coll_sampleset, "*", version_str));
+    uint64_t version = strtoull(version_str.c_str(), nullptr, 10);
+    S(wb->put(coll_sampleset, "*", to_string(version+1)));
+
+    // and persist the incremented metadata version
+    KeyValue::CollectionHandle coll_config;
+    S(body_->db->collection("config", coll_config));
+    S(wb->put(coll_config, "metadata_version", to_string(body_->metadata_version+1)));
+
+    S(wb->commit());
+    body_->sample_count -= samples.size();
+
+    // the data set's header may be cached, here and in any MetadataCache
+    atomic_store(&body_->header_cache, make_shared<BCFHeaderCache>(BCF_HEADER_CACHE_SIZE));
+    body_->metadata_version++;
+    return Status::OK();
+}
+
+Status BCFKeyValueData::remove_dataset(const string& dataset) {
+    Status s;
+    shared_ptr<const bcf_hdr_t> hdr;
+    S(dataset_header(dataset, hdr));
+    set<string> samples = header_samples(hdr.get());
+    vector<pair<string,size_t>> contigs;
+    S(this->contigs(contigs));
+
+    // Mark the data set and its samples active, so that they aren't
+    // concurrently re-imported or removed
+    {
+        std::lock_guard<std::mutex> lock(body_->mutex);
+        if (body_->amd.datasets.count(dataset) > 0) {
+            return Status::Exists("data set is currently being added or removed", dataset);
+        }
+        for (const auto& sample : samples) {
+            if (body_->amd.samples.count(sample) > 0) {
+                return Status::Exists("sample is currently being added or removed", sample);
+            }
+        }
+        body_->amd.add(dataset, samples);
+    }
+
+    s = remove_dataset_inner(body_.get(), contigs, dataset, samples);
+
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    body_->amd.erase(dataset, samples);
+    return s;
+}
+
+// Swap a replacement imported under replacement_dataset(dataset) (whose
+// buckets are listed in its import journal) in for the data set, in one
+// atomic batch: the data set's buckets are deleted and the replacement's
+// moved under its name, with the header and the samples' metadata updated
+// and the replacement's journal cleared. Caller must hold body_->mutex.
+static Status swap_in_replacement(BCFKeyValueData_body *body_,
+                                  const vector<pair<string,size_t>>& contigs,
+                                  const string& dataset,
+                                  const string& hdr_data,
+                                  const set<string>& old_samples,
+                                  const set<string>& new_samples) {
+    Status s;
+    const string staged = replacement_dataset(dataset);
+    KeyValue::CollectionHandle coll_bcf, coll_header, coll_sample_dataset, coll_sampleset, coll_config;
+    S(body_->db->collection("bcf", coll_bcf));
+    S(body_->db->collection("header", coll_header));
+    S(body_->db->collection("sample_dataset", coll_sample_dataset));
+    S(body_->db->collection("sampleset", coll_sampleset));
+    S(body_->db->collection("config", coll_config));
+
+    vector<string> journal_keys;
+    string prefixes, ignore;
+    S(read_import_journal(body_, staged, journal_keys, prefixes, ignore));
+
+    unique_ptr<KeyValue::WriteBatch> wb;
+    S(body_->db->begin_writes(wb));
+    S(delete_dataset_buckets(body_, contigs, coll_bcf, dataset, *wb));
+    // writes in a batch apply in order, so these override the deletions
+    for (size_t i = 0; i < prefixes.size(); i += BCFBucketRange::PREFIX_LENGTH) {
+        const string prefix = prefixes.substr(i, BCFBucketRange::PREFIX_LENGTH);
+        const string staged_key = body_->rangeHelper->bucket_key(prefix, staged);
+        string value;
+        S(body_->db->get(coll_bcf, staged_key, value));
+        S(wb->put(coll_bcf, body_->rangeHelper->bucket_key(prefix, dataset), value));
+        S(wb->delete_key(coll_bcf, staged_key));
+    }
+    for (const auto& key : journal_keys) {
+        S(wb->delete_key(body_->import_journal, key));
+    }
+
+    S(wb->put(coll_header, dataset, hdr_data));
+    for (const auto& sample : old_samples) {
+        if (new_samples.count(sample) == 0) {
+            S(wb->delete_key(coll_sample_dataset, sample));
+            S(wb->delete_key(coll_sampleset, "*" + string(1,'\0') + sample));
+        }
+    }
+    for (const auto& sample : new_samples) {
+        S(wb->put(coll_sample_dataset, sample, dataset));
+        S(wb->put(coll_sampleset, "*" + string(1,'\0') + sample, string()));
+    }
+    string version_str;
+    S(body_->db->get(coll_sampleset, "*", version_str));
+    uint64_t version = strtoull(version_str.c_str(), nullptr, 10);
+    S(wb->put(coll_sampleset, "*", to_string(version+1)));
+    S(wb->put(coll_config, "metadata_version", to_string(body_->metadata_version+1)));
+
+    S(wb->commit());
+    body_->sample_count += new_samples.size();
+    body_->sample_count -= old_samples.size();
+
+    // the data set's header may be cached, here and in any MetadataCache
+    atomic_store(&body_->header_cache, make_shared<BCFHeaderCache>(BCF_HEADER_CACHE_SIZE));
+    body_->metadata_version++;
+    return Status::OK();
+}
+
+static Status replace_dataset_inner(BCFKeyValueData_body *body_,
+                                    MetadataCache& metadata,
+                                    const vector<pair<string,size_t>>& contigs,
+                                    const string& dataset,
+                                    const set<string>& old_samples,
+                                    const string& filename,
+                                    const set<range>& range_filter,
+                                    BCFKeyValueData::import_result& rslt,
+                                    set<string>& added_samples) {
+    Status s;
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    if (!vcf) return Status::IOError("opening gVCF file", filename);
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+
+    S(vcf_validate_basic_facts(metadata, dataset, filename, hdr.get(), vcf.get(),
+                               rslt.samples));
+
+    // The replacement's samples may belong to the data set being replaced,
+    // but no other; mark those it adds active (the caller unmarks them).
+    {
+        std::lock_guard<std::mutex> lock(body_->mutex);
+        KeyValue::CollectionHandle coll_sample_dataset;
+        S(body_->db->collection("sample_dataset", coll_sample_dataset));
+        for (const auto& sample : rslt.samples) {
+            if (old_samples.count(sample)) {
+                continue;
+            }
+            if (body_->amd.samples.count(sample) > 0) {
+                return Status::Exists("sample is currently being added",
+                                      sample + " (" + filename + ")");
+            }
+            string sample_dataset;
+            s = body_->db->get(coll_sample_dataset, sample, sample_dataset);
+            if (s.ok()) {
+                return Status::Exists("sample already exists",
+                                      sample + " " + sample_dataset + " (" + filename + ")");
+            } else if (s != StatusCode::NOT_FOUND) {
+                return s;
+            }
+            added_samples.insert(sample);
+        }
+        body_->amd.samples.insert(added_samples.begin(), added_samples.end());
+    }
+
+    // Import the replacement under a staged name, journaled like any import
+    // (see import_gvcf_inner), leaving the existing data set in place until
+    // the replacement is swapped in.
+    const string staged = replacement_dataset(dataset);
+    S(body_->db->put(body_->import_journal, staged, filename));
+    string hdr_data = bcf_write_header(hdr.get());
+    s = bulk_insert_gvcf_key_values(*body_->rangeHelper, metadata, body_->db,
+                                    staged, filename, range_filter,
+                                    hdr.get(), vcf.get(), body_->import_journal, rslt);
+    if (s.ok()) {
+        s = body_->db->put(body_->import_journal, import_journal_header_key(staged), hdr_data);
+    }
+    if (s.ok()) {
+        std::lock_guard<std::mutex> lock(body_->mutex);
+        s = swap_in_replacement(body_, contigs, dataset, hdr_data, old_samples, rslt.samples);
+    }
+
+    if (s.bad()) {
+        // best effort; failing this, recover_imports will retry upon reopening
+        rollback_import(body_, staged);
+    }
     return s;
 }
 
+Status BCFKeyValueData::replace_dataset(const string& dataset,
+                                        const string& filename,
+                                        const set<range>& range_filter,
+                                        import_result& rslt) {
+    Status s;
+    rslt = import_result();
+    if (!body_->import_journal) {
+        return Status::NotImplemented("BCFKeyValueData::replace_dataset: database is read-only", dataset);
+    }
+
+    shared_ptr<const bcf_hdr_t> hdr;
+    S(dataset_header(dataset, hdr));
+    set<string> old_samples = header_samples(hdr.get());
+    vector<pair<string,size_t>> contigs;
+    S(this->contigs(contigs));
+    unique_ptr<MetadataCache> metadata;
+    S(MetadataCache::Start(*this, metadata));
+
+    // Mark the data set and its samples active, so that they aren't
+    // concurrently imported or removed. The replacement's samples are only
+    // known once its header is read; they may belong to the data set being
+    // replaced, but no other.
+    {
+        std::lock_guard<std::mutex> lock(body_->mutex);
+        if (body_->amd.datasets.count(dataset) > 0) {
+            return Status::Exists("data set is currently being added or removed", dataset);
+        }
+        for (const auto& sample : old_samples) {
+            if (body_->amd.samples.count(sample) > 0) {
+                return Status::Exists("sample is currently being added or removed", sample);
+            }
+        }
+        body_->amd.add(dataset, old_samples);
+    }
+    set<string> added_samples;
+    s = replace_dataset_inner(body_.get(), *metadata, contigs, dataset, old_samples,
+                              filename, range_filter, rslt, added_samples);
+
+    std::lock_guard<std::mutex> lock(body_->mutex);
+    body_->amd.erase(dataset, old_samples);
+    body_->amd.erase(dataset, added_samples);
+    return s;
+}
 
 } // namespace GLnexus
@@ -2,45 +2,68 @@
 
 namespace GLnexus {
 
+// Bucket boundaries for one contig: sorted, distinct begin positions, the
+// first of which is always zero. Bucket i spans [b[i], b[i+1]); beyond the
+// last boundary the buckets fall back to the fixed interval_len grid,
+// anchored at b.back(). An empty vector means a fixed grid for the whole
+// contig.
+using BucketBoundaries = std::vector<int>;
+
+// The bucket containing position pos on contig rid
+static inline range bucket_containing(int rid, int pos, int interval_len,
+                                      const BucketBoundaries* boundaries) {
+    if (boundaries && !boundaries->empty()) {
+        const BucketBoundaries& b = *boundaries;
+        if (pos < b.back()) {
+            auto it = std::upper_bound(b.begin(), b.end(), pos);
+            assert(it != b.begin() && it != b.end());
+            return range(rid, *(it-1), *it);
+        }
+        int base = b.back();
+        int bgn = base + ((pos - base) / interval_len) * interval_len;
+        return range(rid, bgn, bgn + interval_len);
+    }
+    int bgn = (pos / interval_len) * interval_len;
+    return range(rid, bgn, bgn + interval_len);
+}
+
 // Memory efficient representation of a bucket range. This could
 // be turned into a standard C++ iterator, although, that might be
 // a bit of an overkill.
 class BucketExtent {
 private:
-    int rid_ = 0;
-    int step_ = 0;
-    int bgn_ = 0;
-    int end_ = 0;
-    int current_ = 0;
+    int interval_len_ = 0;
+    const BucketBoundaries* boundaries_ = nullptr;
+    range bgn_, end_, current_;
 
     // disable copy and assignment constructors
     BucketExtent(const BucketExtent&);
     BucketExtent& operator=(const BucketExtent&);
 
 public:
-    BucketExtent(const range &query, int interval_len) {
-        rid_ = query.rid;
-        step_ = interval_len;
-        bgn_ = (query.beg / interval_len) * interval_len;
-        end_ = std::max(bgn_, ((query.end-1) / interval_len) * interval_len);
-        current_ = 0;
+    BucketExtent(const range &query, int interval_len,
+                 const BucketBoundaries* boundaries = nullptr)
+        : interval_len_(interval_len), boundaries_(boundaries),
+          bgn_(bucket_containing(query.rid, query.beg, interval_len, boundaries)),
+          end_(bgn_), current_(bgn_) {
+        if (query.end - 1 > query.beg) {
+            end_ = bucket_containing(query.rid, query.end - 1, interval_len, boundaries);
+        }
     }
 
     range begin() {
-        range r = range(rid_, bgn_, bgn_ + step_);
         current_ = bgn_;
-        return r;
+        return current_;
     }
 
     range next() {
-        current_ += step_;
-        range r = range(rid_, current_, current_ + step_);
-        return r;
+        // buckets tile the contig, so the next one begins where this one ends
+        current_ = bucket_containing(current_.rid, current_.end, interval_len_, boundaries_);
+        return current_;
     }
 
     range end() {
-        range r = range(rid_, end_, end_ + step_);
-        return r;
+        return end_;
     }
 };
 
@@ -52,18 +75,44 @@ public:
 // This class separates out the logic for answering the following questions:
 //   1) Which buckets should I scan for this query range?
 //   2) Which bucket does a bcf1_t with this range go into?
+//
+// By default the buckets are a fixed-size grid of interval_len bp. Optionally
+// the database may store per-contig bucket boundaries (see
+// BCFKeyValueData::InitializeDB), so that bucket size can track the density
+// of records: small buckets in dense regions, large ones in sparse regions.
 class BCFBucketRange {
 private:
+    // per-contig boundaries, indexed by rid; may be shorter than the number
+    // of contigs, in which case the remaining contigs use the fixed grid.
+    std::vector<BucketBoundaries> boundaries_;
+
     // disable copy and assignment constructors
     BCFBucketRange(const BCFBucketRange&);
     BCFBucketRange& operator=(const BCFBucketRange&);
 
+    const BucketBoundaries* contig_boundaries(int rid) const {
+        if (rid >= 0 && rid < (int)boundaries_.size() && !boundaries_[rid].empty()) {
+            return &boundaries_[rid];
+        }
+        return nullptr;
+    }
+
 public:
     static const size_t PREFIX_LENGTH = 8;
     int interval_len;
 
     // constructor
     BCFBucketRange(int interval_len) : interval_len(interval_len) {};
+    BCFBucketRange(int interval_len, std::vector<BucketBoundaries>&& boundaries)
+        : boundaries_(std::move(boundaries)), interval_len(interval_len) {
+        #ifndef NDEBUG
+        for (const auto& b : boundaries_) {
+            assert(b.empty() || b[0] == 0);
+            assert(std::is_sorted(b.begin(), b.end()));
+            assert(std::adjacent_find(b.begin(), b.end()) == b.end());
+        }
+        #endif
+    }
 
     // Given the range of a bucket, produce the key prefix for the bucket.
     // Important: the range must be exactly that of the bucket.
@@ -109,20 +158,17 @@ public:
     // query. This may be multiple buckets, even for small query ranges, to
     // account for the possibility of records spanning multiple buckets.
     std::shared_ptr<BucketExtent> scan(const range& query) {
-        return make_shared<BucketExtent>(query, interval_len);
+        return make_shared<BucketExtent>(query, interval_len, contig_boundaries(query.rid));
     }
 
     // Which bucket does this BCF record start in?
     range bucket(bcf1_t *rec) {
-        int bgn = (rec->pos / interval_len) * interval_len;
-        return range(rec->rid, bgn, bgn + interval_len);
+        return bucket_containing(rec->rid, rec->pos, interval_len, contig_boundaries(rec->rid));
     }
     // The bucket after [rng], assuming [rng] is a bucket.
     range inc_bucket(range &rng) {
-        assert((rng.end - rng.beg) == interval_len);
-        return range(rng.rid,
-                     rng.beg + interval_len,
-                     rng.end + interval_len);
+        assert(bucket_containing(rng.rid, rng.beg, interval_len, contig_boundaries(rng.rid)) == rng);
+        return bucket_containing(rng.rid, rng.end, interval_len, contig_boundaries(rng.rid));
     }
 
     // Create a ficticious bucket marking the end of a chromosome.
@@ -130,8 +176,10 @@ public:
                                  const std::vector<std::pair<std::string,size_t> >&contigs) {
         //const string &contig_name = contigs[rid].first;
         size_t contig_len = contigs[rid].second;
-        int bgn = ((contig_len / interval_len) + 2) * interval_len;
-        return range(rid, bgn, bgn + interval_len);
+        // boundaries never exceed the contig length, so this lies on the
+        // fixed grid past the last real bucket
+        return bucket_containing(rid, contig_len + 2*interval_len, interval_len,
+                                 contig_boundaries(rid));
     }
 };
 
@@ -139,31 +187,62 @@ public:
 // number of BCF records. The records are ordered by position and must all
 // lie on the same contig. They may overlap.
 //
-// Range queries within the bucket may be performed by a linear scan of the
-// records. Such a scan can be truncated upon seeing a record whose beg is
-// greater than the end of the query range. For further optimization, we
-// save a "skip index" along with the list of records. An entry in the skip
-// index has an index into the list of records, and the position.beg of the
-// corresponding record. A record may be represented in the skip index
-// only if no preceding records in the bucket overlap it. Given this, the
-// scan can begin at the index indicated by the last skip index entry whose
-// beg is <= the query beg, thus 'skipping' the preceding records.
+// Range queries within the bucket are answered using an interval index saved
+// along with the list of records: the begin position of each record, and the
+// running maximum of the record end positions. Since the records are sorted
+// by begin position, the records overlapping a query range [beg,end) are
+// confined to the index range [lo,hi), where lo is the first record whose
+// running max end exceeds beg (no earlier record reaches the query), and hi is
+// the first record beginning at or after end. Both are found by binary search.
+//
+// Buckets written by older versions have instead a sparse "skip index" (see
+// SearchBCFBucketSkipIndex), which we still support reading.
+//
+// Lastly, the bucket carries a small summary (BCFBucketSummary) of its
+// contents: the extent of all its records, and the number and approximate
+// locations of the variant records. A query can consult this to pass over the
+// bucket without examining the records at all (BCFBucketSummarySkip).
+
+const int BCF_BUCKET_OCCUPANCY_BITS = 64;
+
+// Width of the sub-intervals of [min_beg, max_end) in the occupancy bitmap
+static inline int BCFBucketOccupancyWidth(int min_beg, int max_end) {
+    return std::max(1, (max_end - min_beg + BCF_BUCKET_OCCUPANCY_BITS - 1) / BCF_BUCKET_OCCUPANCY_BITS);
+}
+
+// Occupancy bitmap bits covering [beg, end) intersected with [min_beg, max_end)
+static inline uint64_t BCFBucketOccupancyMask(int min_beg, int max_end, int beg, int end) {
+    beg = std::max(beg, min_beg);
+    end = std::min(end, max_end);
+    if (end <= beg) {
+        return 0;
+    }
+    int width = BCFBucketOccupancyWidth(min_beg, max_end);
+    int lo = std::min((beg - min_beg) / width, BCF_BUCKET_OCCUPANCY_BITS - 1);
+    int hi = std::min((end - 1 - min_beg) / width, BCF_BUCKET_OCCUPANCY_BITS - 1);
+    assert(lo <= hi);
+    uint64_t upto_hi = (hi == BCF_BUCKET_OCCUPANCY_BITS - 1) ? ~uint64_t(0) : ((uint64_t(1) << (hi+1)) - 1);
+    return upto_hi & ~((uint64_t(1) << lo) - 1);
+}
 
 class BCFBucketWriter {
     vector<vector<uint8_t>> records_;
-    int rid_, last_beg_, end_;
-    vector<pair<int,int>> skips_;
+    int rid_, end_;
+    vector<int32_t> begs_, max_ends_;
+    vector<pair<int,int>> variants_; // ranges of the variant records
 
 public:
     BCFBucketWriter()
-        : rid_(-1), last_beg_(-1), end_(-1)
+        : rid_(-1), end_(-1)
         {
     }
 
     void clear() {
         records_.clear();
-        skips_.clear();
-        rid_ = last_beg_ = end_ = -1;
+        begs_.clear();
+        max_ends_.clear();
+        variants_.clear();
+        rid_ = end_ = -1;
     }
 
     Status add(bcf1_t* rec) {
@@ -173,16 +252,18 @@ public:
         } else if (rid_ != rng.rid) {
             return Status::Invalid("BCFBucketWriter: contig mismatch (BUG)");
         }
-        if (rng.beg < last_beg_) {
+        if (!begs_.empty() && rng.beg < begs_.back()) {
             return Status::Invalid("BCFBucketWriter: records not sorted (BUG)");
         }
-        last_beg_ = rng.beg;
-        if (end_ <= rng.beg && records_.size()/10 > skips_.size()) {
-            // no preceding records in the bucket overlap this one, so record
-            // this skip index entry (for every 10th record, 10 arbitrary)
-            skips_.push_back(make_pair((int)records_.size(), rng.beg));
-        }
         end_ = max(end_, rng.end);
+        begs_.push_back(rng.beg);
+        max_ends_.push_back(end_);
+        if (bcf_unpack(rec, BCF_UN_STR) != 0) {
+            return Status::Invalid("BCFBucketWriter: bcf_unpack");
+        }
+        if (!is_gvcf_ref_record(rec)) {
+            variants_.push_back(make_pair(rng.beg, rng.end));
+        }
 
         size_t reclen = bcf_raw_calc_packed_len(rec);
         assert(reclen > 0);
@@ -206,12 +287,25 @@ public:
                 assert(records_b[i].begin() != nullptr); assert(records_b[i].size() == records_[i].size());
             }
 
-            if (skips_.size()) {
-                auto skips_b = msg_b.initSkips(skips_.size());
-                for (int i = 0; i < skips_.size(); i++) {
-                    skips_b[i].setRecordIndex(skips_[i].first);
-                    skips_b[i].setPosBeg(skips_[i].second);
+            assert(begs_.size() == records_.size() && max_ends_.size() == records_.size());
+            auto begs_b = msg_b.initBegs(begs_.size());
+            auto max_ends_b = msg_b.initMaxEnds(max_ends_.size());
+            for (int i = 0; i < begs_.size(); i++) {
+                begs_b.set(i, begs_[i]);
+                max_ends_b.set(i, max_ends_[i]);
+            }
+
+            if (!records_.empty()) {
+                auto summary_b = msg_b.initSummary();
+                int min_beg = begs_.front(), max_end = max_ends_.back();
+                uint64_t occupancy = 0;
+                for (const auto& v : variants_) {
+                    occupancy |= BCFBucketOccupancyMask(min_beg, max_end, v.first, v.second);
                 }
+                summary_b.setVariantRecords(variants_.size());
+                summary_b.setMinBeg(min_beg);
+                summary_b.setMaxEnd(max_end);
+                summary_b.setVariantOccupancy(occupancy);
             }
 
             auto msg_words = ::capnp::messageToFlatArray(b);
@@ -237,11 +331,19 @@ public:
                         assert(records[i].size() == records_[i].size());
                         assert(memcmp(records[i].begin(), records_[i].data(), records[i].size()) == 0);
                     }
-                    auto skips = bucket_reader.getSkips();
-                    assert(skips.size() == skips_.size());
-                    for (int i = 0; i < skips.size(); i++) {
-                        assert(skips[i].getRecordIndex() == skips_[i].first);
-                        assert(skips[i].getPosBeg() == skips_[i].second);
+                    auto begs = bucket_reader.getBegs();
+                    auto max_ends = bucket_reader.getMaxEnds();
+                    assert(begs.size() == begs_.size());
+                    assert(max_ends.size() == max_ends_.size());
+                    for (int i = 0; i < begs.size(); i++) {
+                        assert(begs[i] == begs_[i]);
+                        assert(max_ends[i] == max_ends_[i]);
+                    }
+                    if (records.size()) {
+                        auto summary = bucket_reader.getSummary();
+                        assert(summary.getVariantRecords() == variants_.size());
+                        assert(summary.getMinBeg() == begs_.front());
+                        assert(summary.getMaxEnd() == max_ends_.back());
                     }
                     free(buf);
                 }
@@ -255,8 +357,11 @@ public:
     }
 };
 
-// Search the bucket's 'skip index' to find the index of a record in the bucket
-// from which it's safe to begin a scan for records overlapping query.
+// Search the bucket's legacy 'skip index' to find the index of a record in
+// the bucket from which it's safe to begin a scan for records overlapping
+// query. An entry in the skip index has an index into the list of records, and
+// the position.beg of the corresponding record; a record may be represented in
+// the skip index only if no preceding records in the bucket overlap it.
 static int SearchBCFBucketSkipIndex(const capnp::BCFBucket::Reader& bucket, const range& query) {
     auto skips = bucket.getSkips();
     if (skips.size() == 0 || skips[0].getPosBeg() > query.beg) {
@@ -285,6 +390,70 @@ static int SearchBCFBucketSkipIndex(const capnp::BCFBucket::Reader& bucket, cons
     return skips[i].getRecordIndex();
 }
 
+// Determine from the bucket summary, if present, that the bucket holds no
+// records overlapping query (or, if variants_only, no such variant records).
+static bool BCFBucketSummarySkip(const capnp::BCFBucket::Reader& bucket, const range& query,
+                                 bool variants_only) {
+    if (!bucket.hasSummary()) {
+        return false;
+    }
+    auto summary = bucket.getSummary();
+    int min_beg = summary.getMinBeg(), max_end = summary.getMaxEnd();
+    if (query.end <= min_beg || query.beg >= max_end) {
+        return true;
+    }
+    if (variants_only) {
+        return summary.getVariantRecords() == 0 ||
+               (summary.getVariantOccupancy() &
+                BCFBucketOccupancyMask(min_beg, max_end, query.beg, query.end)) == 0;
+    }
+    return false;
+}
+
+// Find the index range [lo,hi) of the records in the bucket which may overlap
+// query. With the interval index, every record in [lo,hi) begins before
+// query.end and the first one (at least) reaches past query.beg; records in
+// between may still fall short of query.beg. Legacy buckets without the index
+// give hi = the number of records, leaving the caller to stop its scan at
+// the first record beginning at or after query.end.
+static void SearchBCFBucketIndex(const capnp::BCFBucket::Reader& bucket, const range& query,
+                                 int& lo, int& hi) {
+    int n = bucket.getRecords().size();
+    if (!bucket.hasBegs() || !bucket.hasMaxEnds()) {
+        lo = SearchBCFBucketSkipIndex(bucket, query);
+        hi = n;
+        return;
+    }
+    auto begs = bucket.getBegs();
+    auto max_ends = bucket.getMaxEnds();
+    assert(begs.size() == n && max_ends.size() == n);
+
+    // lo: first record whose running max end exceeds query.beg
+    int l = 0, h = n;
+    while (l < h) {
+        int mid = l + (h - l) / 2;
+        if (max_ends[mid] <= query.beg) {
+            l = mid + 1;
+        } else {
+            h = mid;
+        }
+    }
+    lo = l;
+
+    // hi: first record beginning at or after query.end
+    h = n;
+    while (l < h) {
+        int mid = l + (h - l) / 2;
+        if (begs[mid] < query.end) {
+            l = mid + 1;
+        } else {
+            h = mid;
+        }
+    }
+    hi = l;
+    assert(lo <= hi);
+}
+
 // test whether a gVCF file is compatible for deposition into the database
 static bool gvcf_compatible(const MetadataCache& metadata, const bcf_hdr_t *hdr) {
     Status s;
@@ -461,34 +630,88 @@ static Status vcf_validate_basic_facts(MetadataCache& metadata,
     return Status::OK();
 }
 
+// Key of the import journal entry for batch number seq of a data set's bulk
+// insert (see import_gvcf_inner). The sequence number is zero-padded so that
+// the entries sort in order, before the one under import_journal_header_key.
+static inline std::string import_journal_batch_key(const std::string& dataset, size_t seq) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08zu", seq);
+    return dataset + std::string(1, '\0') + buf;
+}
+
+static inline std::string import_journal_header_key(const std::string& dataset) {
+    return dataset + std::string(1, '\0') + "header";
+}
+
+// Name under which replace_dataset imports the replacement for a data set,
+// until swapping it in. '~' can't appear in a data set name (regex_id), so
+// this can't collide with one.
+static const std::string replacement_suffix = "~replacement";
+
+static inline std::string replacement_dataset(const std::string& dataset) {
+    return dataset + replacement_suffix;
+}
+
+static inline bool is_replacement_dataset(const std::string& name) {
+    return name.size() > replacement_suffix.size() &&
+           name.compare(name.size() - replacement_suffix.size(), std::string::npos, replacement_suffix) == 0;
+}
+
 // helper class for bulk_insert_gvcf_key_values: accumulate sizable batches of
 // key/value pairs before insertion into the KeyValue database.
 // This is to reduce database write lock contention during intense multi-
 // threaded bulk loads, as each thread makes fewer larger inserts instead
 // of many smaller inserts.
+//
+// The buffered bytes are charged to the memory governor, and the buffer is
+// flushed early (once it holds at least MIN_FLUSH) if the governor's budget
+// is exhausted.
+//
+// Optionally, each batch also records in a journal the bucket prefixes of
+// the keys it writes, so that the keys committed so far can be found if the
+// bulk insert fails or is interrupted.
 class BulkInsertBuffer {
     const size_t LIMIT = 16777216;
+    const size_t MIN_FLUSH = 1048576;
     KeyValue::DB& db_;
     std::unique_ptr<KeyValue::WriteBatch> buf_;
     size_t bufsz_ = 0;
 
+    KeyValue::CollectionHandle journal_coll_ = nullptr;
+    std::string journal_key_, journal_prefixes_;
+    size_t journal_seq_ = 0;
+
 public:
     BulkInsertBuffer(KeyValue::DB& db) : db_(db) {}
     ~BulkInsertBuffer() {
-        assert(!buf_);
+        // a batch left unflushed (after an error) is discarded
+        MemoryGovernor::global().release(MemoryGovernor::Component::BULK_INSERT, bufsz_);
+    }
+
+    // Journal each batch in the given collection, under the key
+    // import_journal_batch_key(key, seq) with sequence number seq = 0, 1, ...
+    void journal(KeyValue::CollectionHandle coll, const std::string& key) {
+        journal_coll_ = coll;
+        journal_key_ = key;
     }
 
     Status put(KeyValue::CollectionHandle coll, const std::string& key, const std::string& value) {
         Status s;
         size_t delta = key.size() + value.size() + 32;
-        if (bufsz_ + delta >= LIMIT) {
+        if (bufsz_ + delta >= LIMIT ||
+            (bufsz_ >= MIN_FLUSH && !MemoryGovernor::global().has_room(delta))) {
             S(flush());
         }
         if (!buf_) {
             S(db_.begin_writes(buf_));
         }
         S(buf_->put(coll, key, value));
+        if (journal_coll_) {
+            assert(key.size() >= BCFBucketRange::PREFIX_LENGTH);
+            journal_prefixes_.append(key, 0, BCFBucketRange::PREFIX_LENGTH);
+        }
         bufsz_ += delta;
+        MemoryGovernor::global().charge(MemoryGovernor::Component::BULK_INSERT, delta);
         return Status::OK();
     }
 
@@ -496,9 +719,16 @@ public:
     Status flush() {
         if (buf_ && bufsz_) {
             Status s;
+            if (journal_coll_) {
+                // the journal entry commits atomically with the keys it lists
+                S(buf_->put(journal_coll_, import_journal_batch_key(journal_key_, journal_seq_++),
+                            journal_prefixes_));
+                journal_prefixes_.clear();
+            }
             S(buf_->commit());
         }
         buf_.reset();
+        MemoryGovernor::global().release(MemoryGovernor::Component::BULK_INSERT, bufsz_);
         bufsz_ = 0;
         return Status::OK();
     }
@@ -31,4 +31,13 @@ namespace GLnexus { namespace KeyValue {
         S(batch->put(coll, key, value));
         return batch->commit();
     }
+
+    Status DB::delete_key(CollectionHandle coll, const std::string& key) {
+        Status s;
+        unique_ptr<WriteBatch> batch;
+        S(begin_writes(batch));
+        assert(batch);
+        S(batch->delete_key(coll, key));
+        return batch->commit();
+    }
 }}
@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include "KeyValue.h"
 #include "RocksKeyValue.h"
+#include "memory_governor.h"
 #include "rocksdb/db.h"
 #include "rocksdb/slice.h"
 #include "rocksdb/options.h"
@@ -19,6 +20,7 @@
 #include "rocksdb/memtablerep.h"
 #include "rocksdb/cache.h"
 #include "rocksdb/slice_transform.h"
+#include "rocksdb/utilities/table_properties_collectors.h"
 
 namespace GLnexus {
 namespace RocksKeyValue {
@@ -92,15 +94,25 @@ static Status convertStatus(const rocksdb::Status &s)
     }
 }
 
+size_t BlockCacheCapacity(OpenMode mode, size_t mem_budget) {
+    // In bulk-load mode we use a lot of memory for write buffers, so
+    // provision a smaller block cache to compensate.
+    return mode != OpenMode::BULK_LOAD ? mem_budget / 2 : mem_budget / 10;
+}
+
 // Create RocksDB block cache to be shared among all collections in one database
 std::shared_ptr<rocksdb::Cache> NewBlockCache(OpenMode mode, size_t mem_budget) {
     assert(mem_budget >= 4U*size_t(1<<30));
-    if (mode != OpenMode::BULK_LOAD) {
-        return rocksdb::NewLRUCache(mem_budget / 2, 8);
-    } else {
-        // In bulk-load mode we use a lot of memory for write buffers, so
-        // provision a smaller block cache to compensate.
-        return rocksdb::NewLRUCache(mem_budget / 10, 6);
+    return rocksdb::NewLRUCache(BlockCacheCapacity(mode, mem_budget),
+                                mode != OpenMode::BULK_LOAD ? 8 : 6);
+}
+
+// Memory provisioned for write buffers by ApplyColumnFamilyOptions
+size_t WriteBuffersSize(OpenMode mode, size_t mem_budget) {
+    switch (mode) {
+        case OpenMode::BULK_LOAD: return 4 * (mem_budget / 6);
+        case OpenMode::NORMAL: return size_t(1) << 30;
+        default: return 0;
     }
 }
 
@@ -142,6 +154,15 @@ void ApplyColumnFamilyOptions(OpenMode mode, size_t prefix_length, size_t mem_bu
 
     opts.table_factory.reset(rocksdb::NewBlockBasedTableFactory(bbto));
 
+    if (mode != OpenMode::READ_ONLY) {
+        // Mark files for compaction if any window of 4096 consecutive
+        // records in them includes 256+ deletion tombstones (e.g. left by
+        // BCFKeyValueData::remove_dataset), so that they're purged in the
+        // background rather than accumulating and slowing down scans.
+        opts.table_properties_collector_factories.push_back(
+            rocksdb::NewCompactOnDeletionCollectorFactory(4096, 256));
+    }
+
     if (mode == OpenMode::BULK_LOAD) {
         // Use RocksDB's vector memtable implementation instead of the default
         // skiplist. Insertion to the vector memtable is much faster than the
@@ -203,6 +224,12 @@ void ApplyDBOptions(OpenMode mode, size_t mem_budget, size_t thread_budget,
         // 6h default interval
         opts.delayed_write_rate = 10ULL * (1<<30);
         opts.delete_obsolete_files_period_micros = 15ULL * 60 * 1000000;
+
+        // The write-ahead log stays on (see DB), and a log file is retained
+        // until every collection with writes in it has been flushed. Bound
+        // the log by flushing the small collections (journal, metadata)
+        // rather than letting it grow with the bulk memtables.
+        opts.max_total_wal_size = mem_budget / 2;
     }
 }
 
@@ -250,6 +277,21 @@ public:
         }
         return Status::OK();
     }
+
+    Status seek(const std::string& target) override {
+        if (!iter_->status().ok()) {
+            return convertStatus(iter_->status());
+        }
+        iter_->Seek(target);
+        if (!iter_->status().ok()) {
+            return convertStatus(iter_->status());
+        }
+        if (iter_->Valid()) {
+            key_ = iter_->key();
+            value_ = iter_->value();
+        }
+        return Status::OK();
+    }
 };
 
 
@@ -334,6 +376,13 @@ public:
         return Status::OK();
     }
 
+    Status delete_key(KeyValue::CollectionHandle _coll,
+                      const std::string& key) override {
+        auto coll = reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll);
+        wb_->Delete(coll, key);
+        return Status::OK();
+    }
+
     Status commit() override {
         rocksdb::Status s = db_->Write(batch_write_options_, wb_);
         return convertStatus(s);
@@ -349,6 +398,8 @@ private:
     size_t mem_budget_ = 0;
     rocksdb::WriteOptions write_options_, batch_write_options_;
     std::shared_ptr<rocksdb::Cache> block_cache_;
+    // memory charged to the governor for the block cache & write buffers
+    size_t charged_block_cache_ = 0, charged_write_buffers_ = 0;
 
     // No copying allowed
     DB(const DB&);
@@ -361,15 +412,37 @@ private:
             if (pfx) {
                 prefix_spec_ = *pfx;
             }
-            // prepare write options
-            if (mode_ == OpenMode::BULK_LOAD) {
-                write_options_.disableWAL = true;
-                batch_write_options_.disableWAL = true;
-            } else {
+            // Prepare write options. In BULK_LOAD mode the write-ahead log
+            // is still used, just not synced: RocksDB 5.x flushes each column
+            // family's memtables independently (there's no atomic_flush), so
+            // without the log a crash could keep the metadata or import
+            // journal written by a batch while losing the buckets written by
+            // the same batch, or vice versa. With it, the collections recover
+            // to a consistent point, from which BCFKeyValueData's import
+            // journal finishes or rolls back interrupted imports.
+            if (mode_ != OpenMode::BULK_LOAD) {
                 batch_write_options_.sync = true;
             }
+
+            // account for the memory provisioned by ApplyColumnFamilyOptions
+            charge_memory();
         }
 
+    void charge_memory() {
+        charged_block_cache_ = block_cache_->GetCapacity();
+        charged_write_buffers_ = WriteBuffersSize(mode_, mem_budget_);
+        auto& governor = MemoryGovernor::global();
+        governor.charge(MemoryGovernor::Component::BLOCK_CACHE, charged_block_cache_);
+        governor.charge(MemoryGovernor::Component::WRITE_BUFFERS, charged_write_buffers_);
+    }
+
+    void release_memory() {
+        auto& governor = MemoryGovernor::global();
+        governor.release(MemoryGovernor::Component::BLOCK_CACHE, charged_block_cache_);
+        governor.release(MemoryGovernor::Component::WRITE_BUFFERS, charged_write_buffers_);
+        charged_block_cache_ = charged_write_buffers_ = 0;
+    }
+
 public:
     static Status Initialize(const std::string& dbPath, const config& opt,
                              std::unique_ptr<KeyValue::DB> &db) {
@@ -377,6 +450,9 @@ public:
             return Status::Invalid("RocksKeyValue::Initialize: invalid open mode");
         }
         size_t mem_budget = calculate_mem_budget(opt.mem_budget);
+        if (opt.mem_budget) {
+            MemoryGovernor::global().set_budget(mem_budget);
+        }
         auto block_cache = NewBlockCache(opt.mode, mem_budget);
         rocksdb::Options options;
         ApplyDBOptions(opt.mode, mem_budget, opt.thread_budget, block_cache, options);
@@ -403,6 +479,9 @@ public:
                        std::unique_ptr<KeyValue::DB> &db) {
         // prepare options
         size_t mem_budget = calculate_mem_budget(opt.mem_budget);
+        if (opt.mem_budget) {
+            MemoryGovernor::global().set_budget(mem_budget);
+        }
         auto block_cache = NewBlockCache(opt.mode, mem_budget);
         rocksdb::Options options;
         ApplyDBOptions(opt.mode, mem_budget, opt.thread_budget, block_cache, options);
@@ -487,6 +566,65 @@ public:
         }
         // delete database
         delete db_;
+
+        release_memory();
+    }
+
+    Status reconfigure(OpenMode mode) {
+        Status s;
+        if (mode == mode_) {
+            return Status::OK();
+        }
+        if (mode_ != OpenMode::BULK_LOAD || mode != OpenMode::NORMAL) {
+            return Status::Invalid("RocksKeyValue::Reconfigure: unsupported mode switch");
+        }
+
+        // Flush the bulk-loaded data, leaving the (vector) memtables empty;
+        // the memtable implementation isn't a mutable option, but empty ones
+        // don't hinder reads.
+        S(flush());
+
+        // Restore the NORMAL-mode settings that can be changed on the fly,
+        // including universal compaction's max_size_amplification_percent:
+        // data may be deleted from here on (e.g. a dataset removed or
+        // replaced), and compaction should then reclaim the space. The
+        // universal options are given in full so that none is left at a
+        // default.
+        for (const auto& p : coll2handle_) {
+            rocksdb::ColumnFamilyOptions colopts;
+            ApplyColumnFamilyOptions(mode, p.first == prefix_spec_.first ? prefix_spec_.second : 0,
+                                     mem_budget_, block_cache_, colopts);
+            const auto& univ = colopts.compaction_options_universal;
+            S(convertStatus(db_->SetOptions(p.second, {
+                {"compaction_options_universal",
+                 "compression_size_percent=" + std::to_string(univ.compression_size_percent) +
+                 ";max_size_amplification_percent=" + std::to_string(univ.max_size_amplification_percent) +
+                 ";size_ratio=" + std::to_string(univ.size_ratio) +
+                 ";min_merge_width=" + std::to_string(univ.min_merge_width) +
+                 ";max_merge_width=" + std::to_string(univ.max_merge_width)},
+                {"write_buffer_size", std::to_string(colopts.write_buffer_size)},
+                {"max_write_buffer_number", std::to_string(colopts.max_write_buffer_number)},
+                {"level0_slowdown_writes_trigger", std::to_string(colopts.level0_slowdown_writes_trigger)},
+                {"level0_stop_writes_trigger", std::to_string(colopts.level0_stop_writes_trigger)},
+                {"soft_pending_compaction_bytes_limit", std::to_string(colopts.soft_pending_compaction_bytes_limit)},
+                {"hard_pending_compaction_bytes_limit", std::to_string(colopts.hard_pending_compaction_bytes_limit)}
+            })));
+        }
+        rocksdb::DBOptions dbopts;
+        S(convertStatus(db_->SetDBOptions({
+            {"delayed_write_rate", std::to_string(dbopts.delayed_write_rate)},
+            {"delete_obsolete_files_period_micros", std::to_string(dbopts.delete_obsolete_files_period_micros)}
+        })));
+        write_options_ = rocksdb::WriteOptions();
+        batch_write_options_ = rocksdb::WriteOptions();
+        batch_write_options_.sync = true;
+
+        // grow the block cache, keeping what it holds already
+        release_memory();
+        mode_ = mode;
+        block_cache_->SetCapacity(BlockCacheCapacity(mode_, mem_budget_));
+        charge_memory();
+        return Status::OK();
     }
 
     Status collection(const std::string& name,
@@ -554,6 +692,13 @@ public:
         return convertStatus(s);
     }
 
+    Status delete_key(KeyValue::CollectionHandle _coll,
+                      const std::string& key) override {
+        auto coll = reinterpret_cast<rocksdb::ColumnFamilyHandle*>(_coll);
+        rocksdb::Status s = db_->Delete(write_options_, coll, key);
+        return convertStatus(s);
+    }
+
     Status flush() override {
         if (mode_ != OpenMode::READ_ONLY) {
             Status s;
@@ -576,6 +721,15 @@ Status Open(const std::string& dbPath, const config& opt, std::unique_ptr<KeyVal
     return DB::Open(dbPath, opt, db);
 }
 
+Status Reconfigure(KeyValue::DB* db, OpenMode mode)
+{
+    auto rdb = dynamic_cast<DB*>(db);
+    if (!rdb) {
+        return Status::Invalid("RocksKeyValue::Reconfigure: not a RocksDB database");
+    }
+    return rdb->reconfigure(mode);
+}
+
 Status destroy(const std::string dbPath)
 {
     rocksdb::Options options;
@@ -15,6 +15,8 @@
 #include "spdlog/sinks/null_sink.h"
 
 #include "BCFKeyValueData.h"
+#include "memory_governor.h"
+#include "scheduler.h"
 
 // This file has utilities employed by the glnexus applet.
 using namespace std;
@@ -889,12 +891,73 @@ RocksKeyValue::prefix_spec* GLnexus_prefix_spec() {
 }
 
 
+Status bucket_boundaries_of_gvcf(std::shared_ptr<spdlog::logger> logger,
+                                 const string &gvcf,
+                                 const vector<pair<string,size_t>> &contigs,
+                                 size_t bucket_records,
+                                 vector<range> &ans) {
+    ans.clear();
+    if (bucket_records == 0) {
+        return Status::Invalid("bucket_boundaries_of_gvcf: bucket_records must be positive");
+    }
+
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(gvcf.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    if (!vcf) {
+        return Status::IOError("Failed to open gVCF file at ", gvcf);
+    }
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    if (!hdr) {
+        return Status::IOError("Failed to read gVCF file header from", gvcf);
+    }
+    unique_ptr<bcf1_t, void(*)(bcf1_t*)> vt(bcf_init(), &bcf_destroy);
+
+    // Cut a new bucket each time bucket_records records have begun since the
+    // last cut, so that dense regions get small buckets and sparse regions
+    // large ones.
+    int rid = -1, bucket_beg = 0;
+    size_t n = 0;
+    int c;
+    for (c = bcf_read(vcf.get(), hdr.get(), vt.get());
+         c == 0 && vt->errcode == 0;
+         c = bcf_read(vcf.get(), hdr.get(), vt.get())) {
+        if (vt->rid < 0 || vt->rid >= (int)contigs.size()) {
+            return Status::Invalid("gVCF record on unknown contig", gvcf);
+        }
+        if (vt->rid != rid) {
+            if (rid >= 0 && (size_t)bucket_beg < contigs[rid].second) {
+                ans.push_back(range(rid, bucket_beg, contigs[rid].second));
+            }
+            rid = vt->rid;
+            bucket_beg = 0;
+            n = 0;
+        }
+        if (n >= bucket_records && vt->pos > bucket_beg) {
+            ans.push_back(range(rid, bucket_beg, vt->pos));
+            bucket_beg = vt->pos;
+            n = 0;
+        }
+        n++;
+    }
+    if (c != -1 || vt->errcode != 0) {
+        return Status::IOError("reading from gVCF file", gvcf);
+    }
+    if (rid >= 0 && (size_t)bucket_beg < contigs[rid].second) {
+        ans.push_back(range(rid, bucket_beg, contigs[rid].second));
+    }
+
+    logger->info("computed {} density-adaptive buckets from {}", ans.size(), gvcf);
+    return Status::OK();
+}
+
 // Initialize a database
 Status db_init(std::shared_ptr<spdlog::logger> logger,
                const string &dbpath,
                const string &exemplar_gvcf,
                vector<pair<string,size_t>> &contigs,
-               size_t bucket_size) {
+               size_t bucket_size,
+               size_t bucket_records,
+               const string &bucket_bedfilename) {
     Status s;
     logger->info("init database, exemplar_vcf={}", exemplar_gvcf);
     if (check_dir_exists(dbpath)) {
@@ -922,16 +985,27 @@ Status db_init(std::shared_ptr<spdlog::logger> logger,
     }
     free(contignames);
 
+    // density-adaptive bucket boundaries, if requested
+    vector<range> bucket_boundaries;
+    if (!bucket_bedfilename.empty()) {
+        S(parse_bed_file(logger, bucket_bedfilename, contigs, bucket_boundaries));
+    } else if (bucket_records) {
+        S(bucket_boundaries_of_gvcf(logger, exemplar_gvcf, contigs, bucket_records, bucket_boundaries));
+    }
+
     // create and initialize the database
     RocksKeyValue::config cfg;
     cfg.pfx = GLnexus_prefix_spec();
     unique_ptr<KeyValue::DB> db;
     S(RocksKeyValue::Initialize(dbpath, cfg, db));
-    S(BCFKeyValueData::InitializeDB(db.get(), contigs, bucket_size));
+    S(BCFKeyValueData::InitializeDB(db.get(), contigs, bucket_size, bucket_boundaries));
 
     // report success
     logger->info("Initialized GLnexus database in {}", dbpath);
     logger->info("bucket size: {}", bucket_size);
+    if (!bucket_boundaries.empty()) {
+        logger->info("bucket boundaries: {} ranges", bucket_boundaries.size());
+    }
 
     stringstream ss;
     ss << "contigs:";
@@ -966,34 +1040,100 @@ Status db_get_contigs(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+Status DBSession::Open(std::shared_ptr<spdlog::logger> logger,
+                       const string& dbpath, RocksKeyValue::OpenMode mode,
+                       size_t mem_budget, size_t nr_threads,
+                       unique_ptr<DBSession>& ans) {
+    Status s;
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+    unique_ptr<DBSession> session(new DBSession(logger, dbpath, mem_budget, nr_threads));
+
+    RocksKeyValue::config cfg;
+    cfg.mode = mode;
+    cfg.pfx = GLnexus_prefix_spec();
+    cfg.mem_budget = mem_budget;
+    cfg.thread_budget = nr_threads;
+    S(RocksKeyValue::Open(dbpath, cfg, session->db_));
+    S(BCFKeyValueData::Open(session->db_.get(), session->data_));
+    for (const auto& p : session->data_->recovered_imports()) {
+        if (p.second) {
+            logger->warn("Finished the interrupted import of {}", p.first);
+        } else {
+            logger->warn("Rolled back the interrupted import of {}", p.first);
+        }
+    }
+
+    ans = move(session);
+    return Status::OK();
+}
+
+Status DBSession::read_optimize() {
+    Status s;
+    S(RocksKeyValue::Reconfigure(db_.get(), RocksKeyValue::OpenMode::NORMAL));
+    logger_->info("database switched to read-optimized settings");
+    return Status::OK();
+}
+
+// When resuming a bulk load, check that the data set of the same name already
+// in the database was loaded from this gVCF, by comparing their headers
+// (which include the sample names, and usually the caller's command line).
+// The file may be gone if the interrupted run deleted it after loading.
+static Status check_resumed_dataset(const string& gvcf, const string& dataset,
+                                    const bcf_hdr_t* existing_hdr, bool delete_gvcf_after_load) {
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(gvcf.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    if (!vcf) {
+        if (delete_gvcf_after_load && errno == ENOENT) {
+            return Status::OK();
+        }
+        return Status::IOError("Failed to open gVCF file at ", gvcf);
+    }
+    unique_ptr<bcf_hdr_t, void(*)(bcf_hdr_t*)> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    if (!hdr) {
+        return Status::IOError("Failed to read gVCF file header from", gvcf);
+    }
+    if (bcf_write_header(hdr.get()) != bcf_write_header(existing_hdr)) {
+        return Status::Invalid("data set already in the database wasn't loaded from this gVCF (its header differs)",
+                               dataset + " (" + gvcf + ")");
+    }
+    return Status::OK();
+}
+
 Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
                     size_t mem_budget, size_t nr_threads,
                     const vector<string> &gvcfs,
                     const string &dbpath,
-                    const vector<range> &ranges_i,
+                    const vector<range> &ranges,
                     std::vector<std::pair<std::string,size_t> > &contigs, // output param
-                    bool delete_gvcf_after_load) {
+                    bool delete_gvcf_after_load,
+                    bool resume) {
     Status s;
+    unique_ptr<DBSession> session;
+    S(DBSession::Open(logger, dbpath, RocksKeyValue::OpenMode::BULK_LOAD, mem_budget, nr_threads, session));
+    S(db_bulk_load(logger, *session, gvcfs, ranges, contigs, delete_gvcf_after_load, resume));
+    logger->info("Compacting database...");
+    session.reset();
+    logger->info("Bulk load complete!");
+    return Status::OK();
+}
 
-    if (nr_threads == 0) {
-        nr_threads = std::thread::hardware_concurrency();
-    }
+Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
+                    DBSession& session,
+                    const vector<string> &gvcfs,
+                    const vector<range> &ranges_i,
+                    std::vector<std::pair<std::string,size_t> > &contigs, // output param
+                    bool delete_gvcf_after_load,
+                    bool resume) {
+    Status s;
+    size_t nr_threads = session.threads();
+    BCFKeyValueData* data = &session.data();
 
     set<range> ranges;
     for (auto &r : ranges_i)
         ranges.insert(r);
 
-    // open the database
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::BULK_LOAD;
-    cfg.pfx = GLnexus_prefix_spec();
-    cfg.mem_budget = mem_budget;
-    cfg.thread_budget = nr_threads;
-    unique_ptr<KeyValue::DB> db;
-    S(RocksKeyValue::Open(dbpath, cfg, db));
-    unique_ptr<BCFKeyValueData> data;
-    S(BCFKeyValueData::Open(db.get(), data));
-
     unique_ptr<MetadataCache> metadata;
     S(MetadataCache::Start(*data, metadata));
     contigs = metadata->contigs();
@@ -1010,7 +1150,8 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
 
     ctpl::thread_pool threadpool(nr_threads);
     vector<future<Status>> statuses;
-    set<string> datasets_loaded;
+    set<string> datasets_loaded, datasets_pushed;
+    size_t datasets_skipped = 0;
     BCFKeyValueData::import_result stats;
     mutex mu;
     string dataset;
@@ -1033,6 +1174,31 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
             }
         }
 
+        // when resuming, skip data sets already loaded by the interrupted run
+        // (but not duplicates within this run, which fail as before). A data
+        // set of the same name loaded from a different file fails instead.
+        shared_ptr<const bcf_hdr_t> existing_hdr;
+        if (resume && !datasets_pushed.count(dataset) && data->dataset_header(dataset, existing_hdr).ok()) {
+            Status ls = check_resumed_dataset(gvcf, dataset, existing_hdr.get(), delete_gvcf_after_load);
+            if (ls.bad()) {
+                statuses.push_back(async(launch::deferred, [ls]() { return ls; }));
+                dataset.clear();
+                continue;
+            }
+            if (datasets_skipped++ == 0) {
+                logger->info("Skipping {} and any other data sets already in the database", gvcf);
+            }
+            // the interrupted run may have loaded it without getting to
+            // delete it
+            if (delete_gvcf_after_load && unlink(gvcf.c_str()) && errno != ENOENT) {
+                logger->warn("Skipped {} as already loaded, but failed deleting it.", gvcf);
+            }
+            statuses.push_back(async(launch::deferred, []() { return Status::OK(); }));
+            dataset.clear();
+            continue;
+        }
+
+        datasets_pushed.insert(dataset);
         auto fut = threadpool.push([&, gvcf, dataset](int tid) {
                 BCFKeyValueData::import_result rslt;
                 Status ls = data->import_gvcf(*metadata, dataset, gvcf, ranges, rslt);
@@ -1067,6 +1233,9 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
     }
 
     // report results
+    if (datasets_skipped) {
+        logger->info("Skipped {} datasets already in the database", datasets_skipped);
+    }
     logger->info("Loaded {} datasets with {} samples; {} bytes in {} BCF records ({} duplicate) in {} buckets. Bucket max {} bytes, {} records. {} BCF records skipped due to caller-specific exceptions",
                  datasets_loaded.size(), stats.samples.size(), stats.bytes,
                  stats.records, stats.duplicate_records,
@@ -1088,10 +1257,8 @@ Status db_bulk_load(std::shared_ptr<spdlog::logger> logger,
         return Status::Failure("One or more gVCF inputs failed validation or database loading; check log for details.");
     }
 
-    logger->info("Flushing and compacting database...");
-    S(db->flush());
-    db.reset();
-    logger->info("Bulk load complete!");
+    logger->info("Flushing database...");
+    S(session.db().flush());
     return Status::OK();
 }
 
@@ -1101,33 +1268,34 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
                         const vector<range> &ranges,
                         const std::vector<std::pair<std::string,size_t> > &contigs,
                         discovered_alleles &dsals,
-                        unsigned &sample_count) {
+                        unsigned &sample_count,
+                        bool numa) {
     Status s;
-    unique_ptr<KeyValue::DB> db;
-    unique_ptr<BCFKeyValueData> data;
-    dsals.clear();
-
-    if (nr_threads == 0) {
-        nr_threads = std::thread::hardware_concurrency();
-    }
-
     // open the database in read-only mode
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
-    cfg.mem_budget = mem_budget;
-    cfg.thread_budget = nr_threads;
-    S(RocksKeyValue::Open(dbpath, cfg, db));
-    S(BCFKeyValueData::Open(db.get(), data));
+    unique_ptr<DBSession> session;
+    S(DBSession::Open(logger, dbpath, RocksKeyValue::OpenMode::READ_ONLY, mem_budget, nr_threads, session));
+    return discover_alleles(logger, *session, ranges, contigs, dsals, sample_count, numa);
+}
+
+Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
+                        DBSession& session,
+                        const vector<range> &ranges,
+                        const std::vector<std::pair<std::string,size_t> > &contigs,
+                        discovered_alleles &dsals,
+                        unsigned &sample_count,
+                        bool numa) {
+    Status s;
+    dsals.clear();
 
     // start service, discover alleles
     service_config svccfg;
-    svccfg.threads = nr_threads;
+    svccfg.threads = session.threads();
+    svccfg.numa = numa;
     unique_ptr<Service> svc;
-    S(Service::Start(svccfg, *data, *data, svc));
+    S(Service::Start(svccfg, session.data(), session.data(), svc));
 
     string sampleset;
-    S(data->all_samples_sampleset(sampleset));
+    S(session.data().all_samples_sampleset(sampleset));
     logger->info("found sample set {}", sampleset);
 
     logger->info("discovering alleles in {} range(s)", ranges.size());
@@ -1139,6 +1307,7 @@ Status discover_alleles(std::shared_ptr<spdlog::logger> logger,
         it->clear(); // free some memory
     }
     logger->info("discovered {} alleles", dsals.size());
+    logger->info("peak memory use: {}", MemoryGovernor::global().report());
     return Status::OK();
 }
 
@@ -1148,9 +1317,21 @@ Status unify_sites(std::shared_ptr<spdlog::logger> logger,
                    discovered_alleles &dsals,
                    unsigned sample_count,
                    vector<unified_site> &sites,
-                   unifier_stats& stats) {
+                   unifier_stats& stats,
+                   size_t nr_threads,
+                   bool stream) {
     Status s;
-    S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats));
+    if (nr_threads == 0) {
+        nr_threads = std::thread::hardware_concurrency();
+    }
+    if (nr_threads > 1) {
+        logger->info("unifying {} alleles with {} threads{}", dsals.size(), nr_threads,
+                     stream ? " (streaming)" : "");
+        Scheduler scheduler(nr_threads);
+        S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats, scheduler, stream));
+    } else {
+        S(unified_sites(unifier_cfg, sample_count, dsals, sites, stats));
+    }
 
     // sanity check, sites are in-order
     if (sites.size() > 1) {
@@ -1168,38 +1349,31 @@ Status unify_sites(std::shared_ptr<spdlog::logger> logger,
 }
 
 
-Status genotype(std::shared_ptr<spdlog::logger> logger,
-                size_t mem_budget, size_t nr_threads,
-                const string &dbpath,
+template<class sites_t>
+static Status genotype_impl(std::shared_ptr<spdlog::logger> logger,
+                DBSession& session,
                 const genotyper_config &genotyper_cfg,
-                const vector<unified_site> &sites,
+                const sites_t &sites,
                 const vector<string>& extra_header_lines,
-                const string &output_filename) {
+                const string &output_filename,
+                bool numa,
+                const string &checkpoint_dir) {
     Status s;
     logger->info("Lifting over {} fields", genotyper_cfg.liftover_fields.size());
-
-    if (nr_threads == 0) {
-        nr_threads = std::thread::hardware_concurrency();
-    }
-
-    // open the database in read-only mode
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
-    cfg.mem_budget = mem_budget;
-    cfg.thread_budget = nr_threads;
-    unique_ptr<KeyValue::DB> db;
-    S(RocksKeyValue::Open(dbpath, cfg, db));
-    unique_ptr<BCFKeyValueData> data;
-    S(BCFKeyValueData::Open(db.get(), data));
+    BCFKeyValueData* data = &session.data();
 
     std::vector<std::pair<std::string,size_t> > contigs;
     S(data->contigs(contigs));
 
     // start service, discover alleles, unify sites, genotype sites
     service_config svccfg;
-    svccfg.threads = nr_threads;
+    svccfg.threads = session.threads();
     svccfg.extra_header_lines = extra_header_lines;
+    svccfg.numa = numa;
+    svccfg.checkpoint_dir = checkpoint_dir;
+    if (!checkpoint_dir.empty()) {
+        logger->info("checkpointing genotyping progress in {}", checkpoint_dir);
+    }
     unique_ptr<Service> svc;
     S(Service::Start(svccfg, *data, *data, svc));
 
@@ -1214,6 +1388,7 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
     if (stalls_ms) {
         logger->info("worker threads were cumulatively stalled for {}ms", stalls_ms);
     }
+    logger->info("peak memory use: {}", MemoryGovernor::global().report());
 
     std::shared_ptr<StatsRangeQuery> statsRq = data->getRangeStats();
     logger->info(statsRq->str());
@@ -1221,19 +1396,84 @@ Status genotype(std::shared_ptr<spdlog::logger> logger,
     return Status::OK();
 }
 
+template<class sites_t>
+static Status genotype_impl(std::shared_ptr<spdlog::logger> logger,
+                size_t mem_budget, size_t nr_threads,
+                const string &dbpath,
+                const genotyper_config &genotyper_cfg,
+                const sites_t &sites,
+                const vector<string>& extra_header_lines,
+                const string &output_filename,
+                bool numa) {
+    Status s;
+    // open the database in read-only mode
+    unique_ptr<DBSession> session;
+    S(DBSession::Open(logger, dbpath, RocksKeyValue::OpenMode::READ_ONLY, mem_budget, nr_threads, session));
+    return genotype_impl(logger, *session, genotyper_cfg, sites, extra_header_lines, output_filename, numa, "");
+}
+
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                size_t mem_budget, size_t nr_threads,
+                const string &dbpath,
+                const genotyper_config &genotyper_cfg,
+                const vector<unified_site> &sites,
+                const vector<string>& extra_header_lines,
+                const string &output_filename,
+                bool numa) {
+    return genotype_impl(logger, mem_budget, nr_threads, dbpath, genotyper_cfg, sites,
+                         extra_header_lines, output_filename, numa);
+}
+
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                size_t mem_budget, size_t nr_threads,
+                const string &dbpath,
+                const genotyper_config &genotyper_cfg,
+                const unified_site_table &sites,
+                const vector<string>& extra_header_lines,
+                const string &output_filename,
+                bool numa) {
+    return genotype_impl(logger, mem_budget, nr_threads, dbpath, genotyper_cfg, sites,
+                         extra_header_lines, output_filename, numa);
+}
+
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                DBSession& session,
+                const genotyper_config &genotyper_cfg,
+                const vector<unified_site> &sites,
+                const vector<string>& extra_header_lines,
+                const string &output_filename,
+                bool numa,
+                const string &checkpoint_dir) {
+    return genotype_impl(logger, session, genotyper_cfg, sites,
+                         extra_header_lines, output_filename, numa, checkpoint_dir);
+}
+
+Status genotype(std::shared_ptr<spdlog::logger> logger,
+                DBSession& session,
+                const genotyper_config &genotyper_cfg,
+                const unified_site_table &sites,
+                const vector<string>& extra_header_lines,
+                const string &output_filename,
+                bool numa,
+                const string &checkpoint_dir) {
+    return genotype_impl(logger, session, genotyper_cfg, sites,
+                         extra_header_lines, output_filename, numa, checkpoint_dir);
+}
+
 Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
                                       const std::string &dbpath,
                                       int n_iter) {
     Status s;
+    unique_ptr<DBSession> session;
+    S(DBSession::Open(logger, dbpath, RocksKeyValue::OpenMode::READ_ONLY, 0, 0, session));
+    return compare_db_itertion_algorithms(logger, *session, n_iter);
+}
 
-    unique_ptr<KeyValue::DB> db;
-    RocksKeyValue::config cfg;
-    cfg.mode = RocksKeyValue::OpenMode::READ_ONLY;
-    cfg.pfx = GLnexus_prefix_spec();
-    S(RocksKeyValue::Open(dbpath, cfg, db));
-
-    unique_ptr<BCFKeyValueData> data;
-    S(BCFKeyValueData::Open(db.get(), data));
+Status compare_db_itertion_algorithms(std::shared_ptr<spdlog::logger> logger,
+                                      DBSession& session,
+                                      int n_iter) {
+    Status s;
+    BCFKeyValueData* data = &session.data();
 
     unique_ptr<MetadataCache> metadata;
     S(MetadataCache::Start(*data, metadata));
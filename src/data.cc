@@ -1,4 +1,8 @@
 #include <assert.h>
+#include <unordered_map>
+#include <deque>
+#include <mutex>
+#include <atomic>
 #include "data.h"
 #include "fcmm.hpp"
 #include "khash.h"
@@ -16,15 +20,91 @@ public:
 };
 using StringCache = fcmm::Fcmm<string,string,hash<string>,KStringHash>;
 using StringSetCache = fcmm::Fcmm<string,shared_ptr<const set<string>>,hash<string>,KStringHash>;
+using SampleColumnsCache = fcmm::Fcmm<string,shared_ptr<const unordered_map<string,int>>,hash<string>,KStringHash>;
+using SampleMappingCache = fcmm::Fcmm<string,shared_ptr<const SampleMapping>,hash<string>,KStringHash>;
+using SampleBitmapCache = fcmm::Fcmm<string,shared_ptr<const SampleBitmap>,hash<string>,KStringHash>;
 // this is not a hard limit but the FCMM performance degrades if it's too low
 const size_t CACHE_SIZE = 4096;
 
-struct MetadataCache::body {
-    Metadata* inner;
-    vector<pair<string,size_t> > contigs;
+// everything cached about sample sets and data sets, as of one
+// inner->metadata_version()
+struct metadata_caches {
+    const uint64_t version;
     unique_ptr<StringSetCache> sampleset_samples_cache;
     unique_ptr<StringCache> sample_dataset_cache;
     unique_ptr<StringSetCache> sampleset_datasets_cache;
+    // sampleset -> (sample -> column)
+    unique_ptr<SampleColumnsCache> sampleset_columns_cache;
+    // sampleset x dataset -> SampleMapping
+    unique_ptr<SampleMappingCache> sample_mapping_cache;
+    unique_ptr<SampleBitmapCache> sampleset_bitmap_cache;
+
+    // dense sample & dataset IDs, protected by ids_mutex. deques so that
+    // names stay put as IDs are added.
+    mutex ids_mutex;
+    deque<string> sample_names, dataset_names;
+    unordered_map<string,uint32_t> sample_ids, dataset_ids;
+    vector<uint32_t> sample_dataset_ids;
+
+    metadata_caches(uint64_t version_)
+        : version(version_),
+          sampleset_samples_cache(make_unique<StringSetCache>(CACHE_SIZE)),
+          sample_dataset_cache(make_unique<StringCache>(16 * CACHE_SIZE)),
+          sampleset_datasets_cache(make_unique<StringSetCache>(CACHE_SIZE)),
+          sampleset_columns_cache(make_unique<SampleColumnsCache>(CACHE_SIZE)),
+          sample_mapping_cache(make_unique<SampleMappingCache>(16 * CACHE_SIZE)),
+          sampleset_bitmap_cache(make_unique<SampleBitmapCache>(CACHE_SIZE)) {}
+
+    // assign IDs to the sample and its dataset, if not already done.
+    // caller must hold ids_mutex
+    uint32_t intern(const string& sample, const string& dataset) {
+        auto p = sample_ids.find(sample);
+        if (p != sample_ids.end()) {
+            return p->second;
+        }
+        uint32_t dataset_id;
+        auto q = dataset_ids.find(dataset);
+        if (q != dataset_ids.end()) {
+            dataset_id = q->second;
+        } else {
+            dataset_id = dataset_names.size();
+            dataset_names.push_back(dataset);
+            dataset_ids[dataset] = dataset_id;
+        }
+        uint32_t id = sample_names.size();
+        sample_names.push_back(sample);
+        sample_ids[sample] = id;
+        sample_dataset_ids.push_back(dataset_id);
+        assert(sample_dataset_ids.size() == sample_names.size());
+        return id;
+    }
+};
+
+struct MetadataCache::body {
+    Metadata* inner;
+    vector<pair<string,size_t> > contigs;
+
+    // The caches for the current metadata version. When the version changes,
+    // a new set replaces them. Each lookup holds a reference to the set it
+    // started with, so a retired set is freed once the last lookup using it
+    // finishes, and a long-lived cache doesn't accumulate them.
+    shared_ptr<metadata_caches> current;
+    mutex current_mutex;
+
+    shared_ptr<metadata_caches> get() {
+        shared_ptr<metadata_caches> c = atomic_load(&current);
+        uint64_t version = inner->metadata_version();
+        if (c && c->version == version) {
+            return c;
+        }
+        lock_guard<mutex> lock(current_mutex);
+        c = atomic_load(&current);
+        if (!c || c->version != version) {
+            c = make_shared<metadata_caches>(version);
+            atomic_store(&current, c);
+        }
+        return c;
+    }
 };
 
 MetadataCache::MetadataCache() = default;
@@ -34,9 +114,7 @@ Status MetadataCache::Start(Metadata& inner, unique_ptr<MetadataCache>& ptr) {
     ptr.reset(new MetadataCache);
     ptr->body_.reset(new MetadataCache::body);
     ptr->body_->inner = &inner;
-    ptr->body_->sampleset_samples_cache = make_unique<StringSetCache>(CACHE_SIZE);
-    ptr->body_->sample_dataset_cache = make_unique<StringCache>(16 * CACHE_SIZE);
-    ptr->body_->sampleset_datasets_cache = make_unique<StringSetCache>(CACHE_SIZE);
+    ptr->body_->get();
     return ptr->body_->inner->contigs(ptr->body_->contigs);
 }
 
@@ -45,35 +123,45 @@ Status MetadataCache::contigs(vector<pair<string,size_t> >& ans) const {
     return Status::OK();
 }
 
-Status MetadataCache::sampleset_samples(const string& sampleset, shared_ptr<const set<string> >& ans) const {
-    auto cached = body_->sampleset_samples_cache->end();
-    if ((cached = body_->sampleset_samples_cache->find(sampleset))
-            != body_->sampleset_samples_cache->end()) {
+static Status cached_sampleset_samples(Metadata& inner, metadata_caches& c,
+                                       const string& sampleset, shared_ptr<const set<string> >& ans) {
+    auto cached = c.sampleset_samples_cache->end();
+    if ((cached = c.sampleset_samples_cache->find(sampleset))
+            != c.sampleset_samples_cache->end()) {
         ans = cached->second;
         assert(ans);
         return Status::OK();
     }
 
     Status s;
-    S(body_->inner->sampleset_samples(sampleset, ans));
-    body_->sampleset_samples_cache->insert(make_pair(sampleset,ans));
+    S(inner.sampleset_samples(sampleset, ans));
+    c.sampleset_samples_cache->insert(make_pair(sampleset,ans));
     return Status::OK();
 }
 
-Status MetadataCache::sample_dataset(const string& sample, string& ans) const {
-    auto cached = body_->sample_dataset_cache->end();
-    if ((cached = body_->sample_dataset_cache->find(sample))
-            != body_->sample_dataset_cache->end()) {
+Status MetadataCache::sampleset_samples(const string& sampleset, shared_ptr<const set<string> >& ans) const {
+    return cached_sampleset_samples(*body_->inner, *body_->get(), sampleset, ans);
+}
+
+static Status cached_sample_dataset(Metadata& inner, metadata_caches& c,
+                                    const string& sample, string& ans) {
+    auto cached = c.sample_dataset_cache->end();
+    if ((cached = c.sample_dataset_cache->find(sample))
+            != c.sample_dataset_cache->end()) {
         ans = cached->second;
         return Status::OK();
     }
 
     Status s;
-    S(body_->inner->sample_dataset(sample, ans));
-    body_->sample_dataset_cache->insert(make_pair(sample,ans));
+    S(inner.sample_dataset(sample, ans));
+    c.sample_dataset_cache->insert(make_pair(sample,ans));
     return Status::OK();
 }
 
+Status MetadataCache::sample_dataset(const string& sample, string& ans) const {
+    return cached_sample_dataset(*body_->inner, *body_->get(), sample, ans);
+}
+
 Status MetadataCache::all_samples_sampleset(string& ans) {
     // not safe to cache this as it's not immutable
     return body_->inner->all_samples_sampleset(ans);
@@ -83,32 +171,210 @@ Status MetadataCache::sample_count(size_t& ans) const {
     return body_->inner->sample_count(ans);
 }
 
+uint64_t MetadataCache::metadata_version() const {
+    return body_->inner->metadata_version();
+}
+
 const vector<pair<string,size_t> >& MetadataCache::contigs() const {
     return body_->contigs;
 }
 
+static Status cached_sampleset_bitmap(Metadata& inner, metadata_caches& c,
+                                      const string& sampleset, shared_ptr<const SampleBitmap>& ans) {
+    auto cached = c.sampleset_bitmap_cache->end();
+    if ((cached = c.sampleset_bitmap_cache->find(sampleset))
+            != c.sampleset_bitmap_cache->end()) {
+        ans = cached->second;
+        assert(ans);
+        return Status::OK();
+    }
+
+    Status s;
+    shared_ptr<const set<string>> samples;
+    S(cached_sampleset_samples(inner, c, sampleset, samples));
+    auto bitmap = make_shared<SampleBitmap>();
+
+    // take the IDs of the samples already interned, in one critical section
+    vector<const string*> missing;
+    {
+        lock_guard<mutex> lock(c.ids_mutex);
+        for (const auto& sample : *samples) {
+            auto p = c.sample_ids.find(sample);
+            if (p != c.sample_ids.end()) {
+                bitmap->insert(p->second);
+            } else {
+                missing.push_back(&sample);
+            }
+        }
+    }
+
+    // look up the datasets of the others, then intern them all at once
+    if (!missing.empty()) {
+        vector<string> missing_datasets(missing.size());
+        for (size_t i = 0; i < missing.size(); i++) {
+            S(cached_sample_dataset(inner, c, *missing[i], missing_datasets[i]));
+        }
+        lock_guard<mutex> lock(c.ids_mutex);
+        for (size_t i = 0; i < missing.size(); i++) {
+            bitmap->insert(c.intern(*missing[i], missing_datasets[i]));
+        }
+    }
+
+    ans = bitmap;
+    c.sampleset_bitmap_cache->insert(make_pair(sampleset, ans));
+    return Status::OK();
+}
+
 Status MetadataCache::sampleset_datasets(const string& sampleset,
                                          shared_ptr<const set<string>>& samples,
                                          shared_ptr<const set<string>>& datasets_out) const {
     Status s;
-    S(sampleset_samples(sampleset, samples));
+    auto cp = body_->get();
+    auto& c = *cp;
+    S(cached_sampleset_samples(*body_->inner, c, sampleset, samples));
 
-    auto cached = body_->sampleset_datasets_cache->end();
-    if ((cached = body_->sampleset_datasets_cache->find(sampleset))
-            != body_->sampleset_datasets_cache->end()) {
+    auto cached = c.sampleset_datasets_cache->end();
+    if ((cached = c.sampleset_datasets_cache->find(sampleset))
+            != c.sampleset_datasets_cache->end()) {
         datasets_out = cached->second;
         assert(datasets_out);
         return Status::OK();
     }
 
+    // resolve the datasets through the dense IDs, so that each sample's
+    // dataset is looked up by name at most once
+    shared_ptr<const SampleBitmap> bitmap;
+    S(cached_sampleset_bitmap(*body_->inner, c, sampleset, bitmap));
     auto datasets = make_shared<set<string>>();
-    for (const auto& it : *samples) {
-        string dataset;
-        S(sample_dataset(it, dataset));
-        datasets->insert(dataset);
+    {
+        lock_guard<mutex> lock(c.ids_mutex);
+        SampleBitmap dataset_ids;
+        bitmap->for_each([&](uint32_t id) {
+            dataset_ids.insert(c.sample_dataset_ids[id]);
+        });
+        dataset_ids.for_each([&](uint32_t id) {
+            datasets->insert(c.dataset_names[id]);
+        });
     }
     datasets_out = datasets;
-    body_->sampleset_datasets_cache->insert(make_pair(sampleset,datasets_out));
+    c.sampleset_datasets_cache->insert(make_pair(sampleset,datasets_out));
+    return Status::OK();
+}
+
+Status MetadataCache::sampleset_dataset_mapping(const string& sampleset, const string& dataset,
+                                                const bcf_hdr_t* hdr,
+                                                shared_ptr<const SampleMapping>& ans) const {
+    auto cp = body_->get();
+    auto& c = *cp;
+    // length-prefix the sampleset name so that the key is unambiguous
+    string key = to_string(sampleset.size()) + ":" + sampleset + dataset;
+    auto cached = c.sample_mapping_cache->end();
+    if ((cached = c.sample_mapping_cache->find(key))
+            != c.sample_mapping_cache->end()) {
+        ans = cached->second;
+        assert(ans);
+        return Status::OK();
+    }
+
+    // index the sampleset's samples by column, once per sampleset
+    Status s;
+    shared_ptr<const unordered_map<string,int>> columns;
+    auto cached_columns = c.sampleset_columns_cache->end();
+    if ((cached_columns = c.sampleset_columns_cache->find(sampleset))
+            != c.sampleset_columns_cache->end()) {
+        columns = cached_columns->second;
+    } else {
+        shared_ptr<const set<string>> samples;
+        S(cached_sampleset_samples(*body_->inner, c, sampleset, samples));
+        auto new_columns = make_shared<unordered_map<string,int>>();
+        new_columns->reserve(samples->size());
+        int col = 0;
+        for (const auto& sample : *samples) {
+            (*new_columns)[sample] = col++;
+        }
+        columns = new_columns;
+        c.sampleset_columns_cache->insert(make_pair(sampleset, columns));
+    }
+    assert(columns);
+
+    int bcf_nsamples = bcf_hdr_nsamples(hdr);
+    vector<int> mapping(bcf_nsamples, -1);
+    for (int i = 0; i < bcf_nsamples; i++) {
+        const auto p = columns->find(string(bcf_hdr_int2id(hdr, BCF_DT_SAMPLE, i)));
+        if (p != columns->end()) {
+            mapping[i] = p->second;
+        }
+    }
+    ans = make_shared<SampleMapping>(move(mapping));
+    c.sample_mapping_cache->insert(make_pair(key, ans));
+    return Status::OK();
+}
+
+Status MetadataCache::sample_id(const string& sample, uint32_t& ans) const {
+    auto cp = body_->get();
+    auto& c = *cp;
+    {
+        lock_guard<mutex> lock(c.ids_mutex);
+        auto p = c.sample_ids.find(sample);
+        if (p != c.sample_ids.end()) {
+            ans = p->second;
+            return Status::OK();
+        }
+    }
+
+    Status s;
+    string dataset;
+    S(cached_sample_dataset(*body_->inner, c, sample, dataset));
+    lock_guard<mutex> lock(c.ids_mutex);
+    ans = c.intern(sample, dataset);
+    return Status::OK();
+}
+
+Status MetadataCache::sample_name(uint32_t sample_id, string& ans) const {
+    auto cp = body_->get();
+    auto& c = *cp;
+    lock_guard<mutex> lock(c.ids_mutex);
+    if (sample_id >= c.sample_names.size()) {
+        return Status::NotFound("MetadataCache::sample_name: unknown sample ID", to_string(sample_id));
+    }
+    ans = c.sample_names[sample_id];
+    return Status::OK();
+}
+
+Status MetadataCache::sample_dataset_id(uint32_t sample_id, uint32_t& ans) const {
+    auto cp = body_->get();
+    auto& c = *cp;
+    lock_guard<mutex> lock(c.ids_mutex);
+    if (sample_id >= c.sample_dataset_ids.size()) {
+        return Status::NotFound("MetadataCache::sample_dataset_id: unknown sample ID", to_string(sample_id));
+    }
+    ans = c.sample_dataset_ids[sample_id];
+    return Status::OK();
+}
+
+Status MetadataCache::dataset_name(uint32_t dataset_id, string& ans) const {
+    auto cp = body_->get();
+    auto& c = *cp;
+    lock_guard<mutex> lock(c.ids_mutex);
+    if (dataset_id >= c.dataset_names.size()) {
+        return Status::NotFound("MetadataCache::dataset_name: unknown dataset ID", to_string(dataset_id));
+    }
+    ans = c.dataset_names[dataset_id];
+    return Status::OK();
+}
+
+Status MetadataCache::sampleset_bitmap(const string& sampleset,
+                                       shared_ptr<const SampleBitmap>& ans) const {
+    return cached_sampleset_bitmap(*body_->inner, *body_->get(), sampleset, ans);
+}
+
+Status MetadataCache::register_dataset(const string& dataset, const set<string>& samples) {
+    auto cp = body_->get();
+    auto& c = *cp;
+    lock_guard<mutex> lock(c.ids_mutex);
+    for (const auto& sample : samples) {
+        c.intern(sample, dataset);
+    }
     return Status::OK();
 }
 
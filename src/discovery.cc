@@ -5,7 +5,7 @@ using namespace std;
 
 namespace GLnexus {
 
-Status discover_alleles_from_iterator(const set<string>& samples,
+Status discover_alleles_from_iterator(const MetadataCache& cache, const string& sampleset,
                                       const range& pos,
                                       RangeBCFIterator& iterator,
                                       discovered_alleles& final_dsals) {
@@ -19,14 +19,9 @@ Status discover_alleles_from_iterator(const set<string>& samples,
     while ((s = iterator.next(dataset, dataset_header, records)).ok()) {
         discovered_alleles dsals;
         // determine which of the dataset's samples are in the desired sample set
-        // TODO: FCMM-memoize this during the operation
-        size_t dataset_nsamples = bcf_hdr_nsamples(dataset_header.get());
-        vector<unsigned> dataset_relevant_samples;
-        for (unsigned i = 0; i < dataset_nsamples; i++) {
-            if (samples.find(string(bcf_hdr_int2id(dataset_header.get(), BCF_DT_SAMPLE, i))) != samples.end()) {
-                dataset_relevant_samples.push_back(i);
-            }
-        }
+        shared_ptr<const SampleMapping> sample_mapping;
+        S(cache.sampleset_dataset_mapping(sampleset, dataset, dataset_header.get(), sample_mapping));
+        const vector<unsigned>& dataset_relevant_samples = sample_mapping->bcf_samples();
 
         // for each BCF record
         vector<top_AQ> topAQ;
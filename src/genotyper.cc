@@ -1,6 +1,9 @@
 #include <assert.h>
 #include <math.h>
 #include <algorithm>
+#include <string.h>
+#include <unordered_map>
+#include <mutex>
 #include "genotyper.h"
 #include "diploid.h"
 
@@ -45,11 +48,62 @@ static inline bool is_deletion(const string& ref, const string& alt) {
     return true;
 }
 
+// Accessors letting the genotyper core work on either a unified_site or a
+// unified_site_view, reading the latter straight from its table rather than
+// materializing its full unification map
+static inline const range& site_pos(const unified_site& site) { return site.pos; }
+static inline const range& site_pos(const unified_site_view& site) { return site.pos(); }
+static inline int site_qual(const unified_site& site) { return site.qual; }
+static inline int site_qual(const unified_site_view& site) { return site.qual(); }
+static inline bool site_monoallelic(const unified_site& site) { return site.monoallelic; }
+static inline bool site_monoallelic(const unified_site_view& site) { return site.monoallelic(); }
+static inline float site_lost_allele_frequency(const unified_site& site) { return site.lost_allele_frequency; }
+static inline float site_lost_allele_frequency(const unified_site_view& site) { return site.lost_allele_frequency(); }
+static inline size_t site_allele_count(const unified_site& site) { return site.alleles.size(); }
+static inline size_t site_allele_count(const unified_site_view& site) { return site.allele_count(); }
+static inline const string& site_allele_dna(const unified_site& site, size_t k) { return site.alleles[k].dna; }
+static inline string site_allele_dna(const unified_site_view& site, size_t k) { return site.allele_dna(k); }
+static inline const allele& site_allele_normalized(const unified_site& site, size_t k) { return site.alleles[k].normalized; }
+static inline allele site_allele_normalized(const unified_site_view& site, size_t k) { return site.allele_normalized(k); }
+static inline int site_allele_quality(const unified_site& site, size_t k) { return site.alleles[k].quality; }
+static inline int site_allele_quality(const unified_site_view& site, size_t k) { return site.allele_quality(k); }
+static inline float site_allele_frequency(const unified_site& site, size_t k) { return site.alleles[k].frequency; }
+static inline float site_allele_frequency(const unified_site_view& site, size_t k) { return site.allele_frequency(k); }
+
+// Index of the unified allele onto which al maps, or -1 if none
+static inline int site_unify(const unified_site& site, const allele& al) {
+    auto p = site.unification.find(al);
+    return p != site.unification.end() ? p->second : -1;
+}
+static inline int site_unify(const unified_site_view& site, const allele& al) { return site.unify(al); }
+
+// The range encompassing all the original alleles unified into the site; we
+// need the gVCF records overlapping it
+static range site_query_range(const unified_site& site) {
+    range query_range(site.pos);
+    for (const auto& p : site.unification) {
+        const range& pr = p.first.pos;
+        assert(pr.rid == query_range.rid);
+        query_range.beg = min(query_range.beg, pr.beg);
+        query_range.end = max(query_range.end, pr.end);
+    }
+    return query_range;
+}
+static range site_query_range(const unified_site_view& site) { return site.unification_range(); }
+
+// The full unified_site, for the residuals (materialized into tmp if need be)
+static inline const unified_site& site_full(const unified_site& site, unified_site& tmp) { return site; }
+static inline const unified_site& site_full(const unified_site_view& site, unified_site& tmp) {
+    tmp = site.get();
+    return tmp;
+}
+
 // Pre-process a bcf1_t record to cache some useful info that we'll use repeatedly
- Status preprocess_record(const unified_site& site, const bcf_hdr_t* hdr, const shared_ptr<bcf1_t>& record,
-                          bcf1_t_plus& ans) {
+template<class site_t>
+static Status preprocess_site_record(const site_t& site, const bcf_hdr_t* hdr, const shared_ptr<bcf1_t>& record,
+                                     bcf1_t_plus& ans) {
     range rng(record);
-    assert(rng.rid == site.pos.rid);
+    assert(rng.rid == site_pos(site).rid);
 
     ans.p = record;
 
@@ -69,10 +123,7 @@ static inline bool is_deletion(const string& ref, const string& alt) {
     for (int i = 1; i < record->n_allele; i++) {
         string al(record->d.allele[i]);
         if (is_dna(al)) {
-            auto p = site.unification.find(allele(rng, al));
-            if (p != site.unification.end()) {
-                ans.allele_mapping[i] = p->second;
-            }
+            ans.allele_mapping[i] = site_unify(site, allele(rng, al));
         }
         if (al.size() < rng.size() && rng.size() == ref_al.size()) {
             ans.deletion_allele[i] = is_deletion(ref_al, al);
@@ -82,6 +133,11 @@ static inline bool is_deletion(const string& ref, const string& alt) {
     return Status::OK();
 }
 
+Status preprocess_record(const unified_site& site, const bcf_hdr_t* hdr, const shared_ptr<bcf1_t>& record,
+                         bcf1_t_plus& ans) {
+    return preprocess_site_record(site, hdr, record, ans);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Genotyper core
 ///////////////////////////////////////////////////////////////////////////////
@@ -95,9 +151,10 @@ static inline bool is_deletion(const string& ref, const string& alt) {
 ///   2) Low-quality homozygous calls of rare alleles (e.g. GT=1/1 DP=2 AD=0,2)
 ///      shrink to the next most likely heterozygous genotype.
 /// Mutates the vr.p pointer.
-Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
-                        const map<int, int>& sample_mapping,
-                        const bcf_hdr_t* hdr, bcf1_t_plus& vr) {
+template<class site_t>
+static Status revise_site_genotypes(const genotyper_config& cfg, const site_t& us,
+                                    const SampleMapping& sample_mapping,
+                                    const bcf_hdr_t* hdr, bcf1_t_plus& vr) {
     assert(!vr.is_ref);
     // Speed optimization: our prior on genotypes will be effectively flat
     // if there are no lost ALT alleles or homozygous-ALT genotypes called, so
@@ -152,14 +209,14 @@ Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
 
     // construct "prior" over genotypes which penalizes lost ALT alleles and
     // homozygous-ALT genotypes (otherwise flat)
-    const float lost_log_prior = log(std::max(us.lost_allele_frequency, cfg.min_assumed_allele_frequency));
+    const float lost_log_prior = log(std::max(site_lost_allele_frequency(us), cfg.min_assumed_allele_frequency));
     vector<double> gt_log_prior(nGT, 0.0);
     for (unsigned gt = 0; gt < gt_log_prior.size(); gt++) {
         auto als = diploid::gt_alleles(gt);
         if (vr.allele_mapping.at(als.first) == -1 || vr.allele_mapping.at(als.second) == -1) {
             gt_log_prior[gt] = lost_log_prior;
         } else if (als.first > 0 && als.first == als.second) {
-            gt_log_prior[gt] = log(std::max(us.alleles[vr.allele_mapping[als.first]].frequency,
+            gt_log_prior[gt] = log(std::max(site_allele_frequency(us, vr.allele_mapping[als.first]),
                                             cfg.min_assumed_allele_frequency));
         }
     }
@@ -203,6 +260,57 @@ Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
     return Status::OK();
 }
 
+Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
+                        const SampleMapping& sample_mapping,
+                        const bcf_hdr_t* hdr, bcf1_t_plus& vr) {
+    return revise_site_genotypes(cfg, us, sample_mapping, hdr, vr);
+}
+
+// A reference confidence record which alone covered a dataset's samples at
+// a site (see prepare_dataset_records). At later sites within the band, its
+// preprocessing, depths and calls are reused. The dataset's records are still
+// fetched at each site, as only they show whether another record breaks the
+// band; and the FORMAT fields are still lifted over from the band record at
+// each site, since their layout depends on the site's alleles.
+struct ref_band {
+    shared_ptr<bcf1_t_plus> rp;
+    vector<int> depth; // reference depth of each BCF sample
+
+    // the 0/0 (or InsufficientDepth) call of each BCF sample, for
+    // calls_required_dp; filled in upon the first hit
+    vector<one_call> calls;
+    int calls_required_dp = -1;
+
+    size_t hits = 0;
+
+    // Fill in the calls of the dataset's samples at a site within the band,
+    // as translate_genotypes would given the band record alone.
+    void fill_calls(const genotyper_config& cfg, const SampleMapping& sample_mapping,
+                    vector<one_call>& genotypes) {
+        if (calls.size() != depth.size() || calls_required_dp != cfg.required_dp) {
+            calls.clear();
+            for (int rd : depth) {
+                calls.push_back(rd >= cfg.required_dp
+                                ? one_call(bcf_gt_unphased(0), NoCallReason::N_A)
+                                : one_call(bcf_gt_missing, NoCallReason::InsufficientDepth));
+            }
+            calls_required_dp = cfg.required_dp;
+        }
+        for (const auto& ij : sample_mapping) {
+            genotypes[2*ij.second] = genotypes[2*ij.second+1] = calls[ij.first];
+        }
+    }
+};
+
+// Determine whether two BCF records are byte-for-byte identical
+static bool same_bcf_record(const bcf1_t* a, const bcf1_t* b) {
+    return a->rid == b->rid && a->pos == b->pos && a->rlen == b->rlen
+        && a->n_sample == b->n_sample && a->n_fmt == b->n_fmt
+        && a->shared.l > 0 && a->shared.l == b->shared.l && a->indiv.l == b->indiv.l
+        && memcmp(a->shared.s, b->shared.s, a->shared.l) == 0
+        && memcmp(a->indiv.s, b->indiv.s, a->indiv.l) == 0;
+}
+
 /// Given a unified site and the set of gVCF records overlapping it in some
 /// dataset, check that they span the site, preprocess them, and separate
 /// the reference and variant records.
@@ -236,21 +344,32 @@ Status revise_genotypes(const genotyper_config& cfg, const unified_site& us,
 ///      variant_records filled in, min_ref_depth updated accordingly, rnc = N_A
 ///
 ///
+/// If band is given, it remembers the dataset's reference confidence record
+/// whenever that is the only relevant record at the site. At subsequent sites
+/// within the same reference band (typically many consecutive sites), the
+/// record's preprocessing and depths are then reused instead of recomputed,
+/// and band_hit is set. Any other record at the site ends the band.
+///
 /// FIXME: detect & complain if the reference confidence records actually overlap the
 ///        variant records
-Status prepare_dataset_records(const genotyper_config& cfg, const unified_site& site,
+template<class site_t>
+Status prepare_dataset_records(const genotyper_config& cfg, const site_t& site,
                                const string& dataset, const bcf_hdr_t* hdr, int bcf_nsamples,
-                               const map<int, int>& sample_mapping,
+                               const SampleMapping& sample_mapping,
                                const vector<shared_ptr<bcf1_t>>& records,
                                AlleleDepthHelper& depth,
                                NoCallReason& rnc,
                                vector<int>& min_ref_depth,
                                vector<shared_ptr<bcf1_t_plus>>& all_records,
-                               vector<shared_ptr<bcf1_t_plus>>& variant_records) {
+                               vector<shared_ptr<bcf1_t_plus>>& variant_records,
+                               ref_band* band = nullptr, bool* band_hit = nullptr) {
     // initialize outputs
     rnc = NoCallReason::MissingData;
     all_records.clear();
     variant_records.clear();
+    if (band_hit) {
+        *band_hit = false;
+    }
 
     Status s;
 
@@ -262,14 +381,11 @@ Status prepare_dataset_records(const genotyper_config& cfg, const unified_site&
     for (const auto& record: records) {
         assert(bcf_nsamples == record->n_sample);
         range record_rng(record.get());
-        bool keep = record_rng.overlaps(site.pos);
+        bool keep = record_rng.overlaps(site_pos(site));
         for (int i = 1; !keep && i < record->n_allele; i++) {
             string al(record->d.allele[i]);
-            if (is_dna(al)) {
-                auto p = site.unification.find(allele(record_rng, al));
-                if (p != site.unification.end()) {
-                    keep = true;
-                }
+            if (is_dna(al) && site_unify(site, allele(record_rng, al)) >= 0) {
+                keep = true;
             }
         }
         if (keep) {
@@ -283,20 +399,38 @@ Status prepare_dataset_records(const genotyper_config& cfg, const unified_site&
     if (record_rngs.empty()) {
         return Status::OK(); // MissingData
     }
-    if (!cfg.allow_partial_data && !site.pos.spanned_by(record_rngs)) {
+    if (!cfg.allow_partial_data && !site_pos(site).spanned_by(record_rngs)) {
         rnc = NoCallReason::PartialData;
         return Status::OK();
     }
 
+    // reference band fast path: the only relevant record is the reference
+    // confidence record seen at a previous site. Its preprocessing doesn't
+    // depend on the site (no DNA ALT alleles to unify).
+    bool single_ref = relevant_records.size() == 1 && is_gvcf_ref_record(relevant_records[0].get());
+    if (band && single_ref && band->rp && same_bcf_record(band->rp->p.get(), relevant_records[0].get())) {
+        assert(band->depth.size() == bcf_nsamples);
+        all_records.push_back(band->rp);
+        for (const auto& ij : sample_mapping) {
+            min_ref_depth[ij.second] = band->depth[ij.first];
+        }
+        band->hits++;
+        if (band_hit) {
+            *band_hit = true;
+        }
+        rnc = NoCallReason::N_A;
+        return Status::OK();
+    }
+
     vector<shared_ptr<bcf1_t_plus>> ref_records;
     for (const auto& record : relevant_records) {
         auto rp = make_shared<bcf1_t_plus>();
-        S(preprocess_record(site, hdr, record, *rp));
+        S(preprocess_site_record(site, hdr, record, *rp));
         if (rp->is_ref) {
             ref_records.push_back(rp);
         } else {
             if (cfg.revise_genotypes) {
-                S(revise_genotypes(cfg, site, sample_mapping, hdr, *rp));
+                S(revise_site_genotypes(cfg, site, sample_mapping, hdr, *rp));
             }
             variant_records.push_back(rp);
         }
@@ -307,6 +441,21 @@ Status prepare_dataset_records(const genotyper_config& cfg, const unified_site&
     S(update_min_ref_depth(dataset, hdr, bcf_nsamples, sample_mapping,
                            ref_records, depth, min_ref_depth));
 
+    if (band) {
+        if (single_ref) {
+            // remember the band; depth is still loaded with its record
+            assert(ref_records.size() == 1);
+            band->rp = ref_records[0];
+            band->calls.clear();
+            band->depth.resize(bcf_nsamples);
+            for (int i = 0; i < bcf_nsamples; i++) {
+                band->depth[i] = depth.get(i, 0);
+            }
+        } else {
+            band->rp.reset();
+        }
+    }
+
     // Success...
     rnc = NoCallReason::N_A;
     return Status::OK();
@@ -321,16 +470,17 @@ Status prepare_dataset_records(const genotyper_config& cfg, const unified_site&
 /// the call(s) were actually made, if any.
 ///
 /// FIXME: not coded to deal with multi-sample gVCFs properly.
-static Status translate_genotypes(const genotyper_config& cfg, const unified_site& site,
+template<class site_t>
+static Status translate_genotypes(const genotyper_config& cfg, const site_t& site,
                                   const string& dataset, const bcf_hdr_t* dataset_header,
-                                  int bcf_nsamples, const map<int,int>& sample_mapping,
+                                  int bcf_nsamples, const SampleMapping& sample_mapping,
                                   const vector<shared_ptr<bcf1_t_plus>>& variant_records,
                                   AlleleDepthHelper& depth,
                                   vector<int>& min_ref_depth,
                                   vector<one_call>& genotypes,
                                   vector<shared_ptr<bcf1_t_plus>>& variant_records_used) {
     assert(genotypes.size() == 2*min_ref_depth.size());
-    assert(!site.monoallelic);
+    assert(!site_monoallelic(site));
     variant_records_used.clear();
     Status s;
 
@@ -550,17 +700,18 @@ static Status translate_genotypes(const genotyper_config& cfg, const unified_sit
 
 /// streamlined version of translate_genotypes for monoallelic sites
 /// FIXME: not coded to deal with multi-sample gVCFs properly.
-static Status translate_monoallelic(const genotyper_config& cfg, const unified_site& site,
+template<class site_t>
+static Status translate_monoallelic(const genotyper_config& cfg, const site_t& site,
                                     const string& dataset, const bcf_hdr_t* dataset_header,
-                                    int bcf_nsamples, const map<int,int>& sample_mapping,
+                                    int bcf_nsamples, const SampleMapping& sample_mapping,
                                     const vector<shared_ptr<bcf1_t_plus>>& variant_records,
                                     AlleleDepthHelper& depth,
                                     vector<int>& min_ref_depth,
                                     vector<one_call>& genotypes,
                                     vector<shared_ptr<bcf1_t_plus>>& variant_records_used) {
     assert(genotypes.size() == 2*min_ref_depth.size());
-    assert(site.monoallelic);
-    assert(site.alleles.size() == 2);
+    assert(site_monoallelic(site));
+    assert(site_allele_count(site) == 2);
     variant_records_used.clear();
     Status s;
     bcf1_t_plus* record = nullptr;
@@ -635,184 +786,224 @@ static Status translate_monoallelic(const genotyper_config& cfg, const unified_s
     return Status::OK();
 }
 
-Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site& site,
-                     const std::string& sampleset, const vector<string>& samples,
-                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
-                     bool residualsFlag, shared_ptr<string> &residual_rec,
-                     atomic<bool>* ext_abort) {
+// Genotype the samples of one dataset at a site, given the dataset's records
+// overlapping the site's query_range: fill in their columns of genotypes and
+// add their FORMAT data to the helpers. lost_calls is set if residualsFlag
+// and some of the dataset's calls were lost.
+//
+// min_ref_depth must be -1 for all samples (min_ref_depth_clean) on entry,
+// and is restored to that state on successful return.
+template<class site_t>
+static Status genotype_dataset(const genotyper_config& cfg, MetadataCache& cache,
+                               const site_t& site, const string& sampleset,
+                               const string& dataset, const shared_ptr<const bcf_hdr_t>& dataset_header,
+                               const vector<shared_ptr<bcf1_t>>& records,
+                               AlleleDepthHelper& adh, vector<int>& min_ref_depth, bool& min_ref_depth_clean,
+                               ref_band* band, vector<one_call>& genotypes,
+                               vector<unique_ptr<FormatFieldHelper>>& format_helpers,
+                               bool residualsFlag, bool& lost_calls) {
     Status s;
-
-    // Initialize a vector for the unified genotype calls for each sample,
-    // starting with everything missing. We'll then loop through BCF records
-    // overlapping this site and fill in the genotypes as we encounter them.
-    vector<one_call> genotypes(2*samples.size());
-
-    // Setup format field helpers
-    vector<unique_ptr<FormatFieldHelper>> format_helpers;
-    S(setup_format_helpers(format_helpers, cfg, site, samples));
-
-    // query database for pertinent records across the samples -- the range
-    // encompassing all the original alleles
-    range query_range(site.pos);
-    for (const auto& p : site.unification) {
-        const range& pr = p.first.pos;
-        assert(pr.rid == query_range.rid);
-        query_range.beg = min(query_range.beg, pr.beg);
-        query_range.end = max(query_range.end, pr.end);
-    }
-    shared_ptr<const set<string>> samples2, datasets;
-    vector<unique_ptr<RangeBCFIterator>> iterators;
-    S(data.sampleset_range(cache, sampleset, query_range, nullptr,
-                           samples2, datasets, iterators));
-    assert(samples.size() == samples2->size());
-
-    auto adh = NewAlleleDepthHelper(cfg);
-    vector<DatasetResidual> lost_calls_info;
-
-    map<string,int> samples_index;
-    for (int i = 0; i < samples.size(); i++) {
-        assert(samples_index.find(samples[i]) == samples_index.end());
-        samples_index[samples[i]] = i;
+    lost_calls = false;
+
+    // index the samples shared between the sample set and the BCFs
+    shared_ptr<const SampleMapping> sample_mapping_ptr;
+    S(cache.sampleset_dataset_mapping(sampleset, dataset, dataset_header.get(), sample_mapping_ptr));
+    const SampleMapping& sample_mapping = *sample_mapping_ptr;
+    int bcf_nsamples = bcf_hdr_nsamples(dataset_header.get());
+    if (sample_mapping.empty()) {
+        return Status::OK();
     }
 
-    // for each pertinent dataset
-    for (const auto& dataset : *datasets) {
-        if (ext_abort && *ext_abort) {
-            return Status::Aborted();
+    // pre-process the records
+    assert(min_ref_depth_clean);
+    min_ref_depth_clean = false;
+    vector<shared_ptr<bcf1_t_plus>> all_records, variant_records, variant_records_used;
+    NoCallReason rnc = NoCallReason::MissingData;
+    bool band_hit = false;
+    S(prepare_dataset_records(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                              sample_mapping, records, adh, rnc, min_ref_depth,
+                              all_records, variant_records, band, &band_hit));
+
+    if (rnc != NoCallReason::N_A) {
+        // no call for the samples in this dataset (several possible
+        // reasons)
+        for (const auto& p : sample_mapping) {
+            genotypes[p.second*2].RNC =
+                genotypes[p.second*2+1].RNC = rnc;
         }
-
-        // load BCF records overlapping the site by "merging" the iterators
-        shared_ptr<const bcf_hdr_t> dataset_header;
-        vector<vector<shared_ptr<bcf1_t>>> recordss(iterators.size());
-        vector<shared_ptr<bcf1_t>> records;
-
-        for (const auto& iter : iterators) {
-            string this_dataset;
-            vector<shared_ptr<bcf1_t>> these_records;
-            S(iter->next(this_dataset, dataset_header, these_records));
-            if (dataset != this_dataset) {
-                return Status::Failure("genotype_site: iterator returned unexpected dataset",
-                                       this_dataset + " instead of " + dataset);
+    } else if (band_hit && !site_monoallelic(site)) {
+        // same calls as at the band's previous sites
+        band->fill_calls(cfg, sample_mapping, genotypes);
+    } else if (!site_monoallelic(site)) {
+        // make genotype calls for the samples in this dataset
+        S(translate_genotypes(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                              sample_mapping, variant_records, adh, min_ref_depth,
+                              genotypes, variant_records_used));
+    } else {
+        S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
+                                sample_mapping, variant_records, adh, min_ref_depth,
+                                genotypes, variant_records_used));
+    }
+    for (const auto& p : sample_mapping) {
+        min_ref_depth[p.second] = -1;
+    }
+    min_ref_depth_clean = true;
+
+    // Update FORMAT fields for this dataset.
+    if (!(cfg.squeeze && variant_records.empty() && !all_records.empty())) {
+        S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site_allele_count(site),
+                            format_helpers, all_records, variant_records_used));
+        // But if rnc = MissingData, PartialData, UnphasedVariants, or OverlappingVariants, then
+        // we must censor the FORMAT fields as potentially unreliable/misleading.
+        for (const auto& p : sample_mapping) {
+            auto rnc1 = genotypes[p.second*2].RNC;
+            auto rnc2 = genotypes[p.second*2+1].RNC;
+            bool half_call = site_monoallelic(site) || genotypes[p.second*2].half_call || genotypes[p.second*2+1].half_call;
+
+            if (rnc1 == NoCallReason::MissingData || rnc1 == NoCallReason::PartialData) {
+                assert(rnc1 == rnc2);
+                for (const auto& fh : format_helpers) {
+                    S(fh->censor(p.second, false));
+                }
+            } else if (rnc1 == NoCallReason::UnphasedVariants || rnc2 == NoCallReason::UnphasedVariants ||
+                    rnc1 == NoCallReason::OverlappingVariants || rnc2 == NoCallReason::OverlappingVariants) {
+                for (const auto& fh : format_helpers) {
+                    if (fh->field_info.name != "DP" && fh->field_info.name != "FT") { // whitelist
+                        S(fh->censor(p.second, half_call));
+                    }
+                }
+            } else if (half_call) {
+                for (const auto& fh : format_helpers) {
+                    if (fh->field_info.name != "DP" && fh->field_info.name != "GQ"
+                        && fh->field_info.name != "FT") {
+                        S(fh->censor(p.second, true));
+                    }
+                }
             }
-            records.insert(records.end(), these_records.begin(), these_records.end());
         }
+    } else {
+        // Short path if cfg.squeeze && variant_records.empty() && !all_records.empty():
+        //   Update DP only and apply squeeze transform
+        S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site_allele_count(site),
+                               format_helpers, all_records, variant_records_used, true));
+        for (const auto& p : sample_mapping) {
+            genotypes[p.second*2].RNC = NoCallReason::N_A;
+            genotypes[p.second*2+1].RNC = NoCallReason::N_A;
+        }
+    }
 
-        assert(is_sorted(records.begin(), records.end(),
-                         [] (shared_ptr<bcf1_t>& p1, shared_ptr<bcf1_t>& p2) {
-                            return range(p1) < range(p2);
-                         }));
+    // Detect lost calls, for the residuals
+    if (residualsFlag) {
+        // TODO: don't emit residuals for lost alleles which will be represented in
+        // a separate monoallelic site
+        const set<NoCallReason> non_residual_RNCs = { NoCallReason::N_A, NoCallReason::MissingData,
+                                                      NoCallReason::PartialData, NoCallReason::InsufficientDepth,
+                                                      NoCallReason::MonoallelicSite };
 
-        // index the samples shared between the sample set and the BCFs.
-        // this could be cached on sampleset/dataset cross
-        map<int,int> sample_mapping;
-        int bcf_nsamples = bcf_hdr_nsamples(dataset_header.get());
         for (int i = 0; i < bcf_nsamples; i++) {
-            string sample_i(bcf_hdr_int2id(dataset_header.get(), BCF_DT_SAMPLE, i));
-            const auto p = samples_index.find(sample_i);
-            if (p != samples_index.end()) {
-                sample_mapping[i] = p->second;
+            if (non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2].RNC) == non_residual_RNCs.end() ||
+                non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2 + 1].RNC) == non_residual_RNCs.end()) {
+                lost_calls = true;
+                break;
             }
         }
-        if (sample_mapping.empty()) {
-            continue;
-        }
+    }
 
-        // pre-process the records
-        vector<int> min_ref_depth(samples.size(), -1);
-        vector<shared_ptr<bcf1_t_plus>> all_records, variant_records, variant_records_used;
-        NoCallReason rnc = NoCallReason::MissingData;
-        S(prepare_dataset_records(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                  sample_mapping, records, *adh, rnc, min_ref_depth,
-                                  all_records, variant_records));
+    return Status::OK();
+}
 
-        if (rnc != NoCallReason::N_A) {
-            // no call for the samples in this dataset (several possible
-            // reasons)
-            for (const auto& p : sample_mapping) {
-                genotypes[p.second*2].RNC =
-                    genotypes[p.second*2+1].RNC = rnc;
-            }
-        } else if (!site.monoallelic) {
-            // make genotype calls for the samples in this dataset
-            S(translate_genotypes(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                  sample_mapping, variant_records, *adh, min_ref_depth,
-                                  genotypes, variant_records_used));
-        } else {
-            S(translate_monoallelic(cfg, site, dataset, dataset_header.get(), bcf_nsamples,
-                                    sample_mapping, variant_records, *adh, min_ref_depth,
-                                    genotypes, variant_records_used));
-        }
-
-        // Update FORMAT fields for this dataset.
-        if (!(cfg.squeeze && variant_records.empty() && !all_records.empty())) {
-            S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
-                                format_helpers, all_records, variant_records_used));
-            // But if rnc = MissingData, PartialData, UnphasedVariants, or OverlappingVariants, then
-            // we must censor the FORMAT fields as potentially unreliable/misleading.
-            for (const auto& p : sample_mapping) {
-                auto rnc1 = genotypes[p.second*2].RNC;
-                auto rnc2 = genotypes[p.second*2+1].RNC;
-                bool half_call = site.monoallelic || genotypes[p.second*2].half_call || genotypes[p.second*2+1].half_call;
-
-                if (rnc1 == NoCallReason::MissingData || rnc1 == NoCallReason::PartialData) {
-                    assert(rnc1 == rnc2);
-                    for (const auto& fh : format_helpers) {
-                        S(fh->censor(p.second, false));
-                    }
-                } else if (rnc1 == NoCallReason::UnphasedVariants || rnc2 == NoCallReason::UnphasedVariants ||
-                        rnc1 == NoCallReason::OverlappingVariants || rnc2 == NoCallReason::OverlappingVariants) {
-                    for (const auto& fh : format_helpers) {
-                        if (fh->field_info.name != "DP" && fh->field_info.name != "FT") { // whitelist
-                            S(fh->censor(p.second, half_call));
-                        }
-                    }
-                } else if (half_call) {
-                    for (const auto& fh : format_helpers) {
-                        if (fh->field_info.name != "DP" && fh->field_info.name != "GQ"
-                            && fh->field_info.name != "FT") {
-                            S(fh->censor(p.second, true));
-                        }
-                    }
-                }
+struct GenotypingWorkspace::body {
+    vector<one_call> genotypes;
+    vector<unique_ptr<FormatFieldHelper>> format_helpers;
+
+    // min_ref_depth is reset to -1 only for the samples each dataset touched;
+    // if genotyping bailed out partway through a dataset, the whole vector
+    // needs to be reinitialized.
+    vector<int> min_ref_depth;
+    bool min_ref_depth_clean = false;
+
+    vector<string> alleles;
+    vector<int32_t> gt;
+    vector<const char*> rnc;
+
+    // header IDs of the output FORMAT fields (GT, format_helpers..., RNC),
+    // valid for ids_hdr & ids_cfg
+    const bcf_hdr_t* ids_hdr = nullptr;
+    const genotyper_config* ids_cfg = nullptr;
+    vector<int> format_ids;
+    // size of the last indiv block encoded, to presize the next one
+    size_t indiv_size_hint = 0;
+
+    // reference band of each dataset at the most recent site, on ref_bands_rid
+    unordered_map<string,ref_band> ref_bands;
+    int ref_bands_rid = -1;
+    size_t ref_band_hits = 0; // of the bands no longer in ref_bands
+
+    // look up the header IDs of the output FORMAT fields, if not already done
+    Status format_field_ids(const genotyper_config& cfg, const bcf_hdr_t* hdr,
+                            const vector<unique_ptr<FormatFieldHelper>>& helpers) {
+        if (ids_hdr == hdr && ids_cfg == &cfg) {
+            return Status::OK();
+        }
+        vector<string> names;
+        names.push_back("GT");
+        for (const auto& fh : helpers) {
+            names.push_back(fh->field_info.name);
+        }
+        names.push_back("RNC");
+        format_ids.clear();
+        for (const auto& name : names) {
+            int id = bcf_hdr_id2int(hdr, BCF_DT_ID, name.c_str());
+            if (!bcf_hdr_idinfo_exists(hdr, BCF_HL_FMT, id)) {
+                return Status::Failure("genotyper: output FORMAT field missing from header", name);
             }
-        } else {
-            // Short path if cfg.squeeze && variant_records.empty() && !all_records.empty():
-            //   Update DP only and apply squeeze transform
-            S(update_format_fields(cfg, dataset, dataset_header.get(), sample_mapping, site,
-                                   format_helpers, all_records, variant_records_used, true));
-            for (const auto& p : sample_mapping) {
-                genotypes[p.second*2].RNC = NoCallReason::N_A;
-                genotypes[p.second*2+1].RNC = NoCallReason::N_A;
+            if (find(format_ids.begin(), format_ids.end(), id) != format_ids.end()) {
+                return Status::Invalid("genotyper: duplicate output FORMAT field", name);
             }
+            format_ids.push_back(id);
         }
+        ids_hdr = hdr;
+        ids_cfg = &cfg;
+        return Status::OK();
+    }
 
-        // Handle residuals
-        if (residualsFlag) {
-            // TODO: don't emit residuals for lost alleles which will be represented in
-            // a separate monoallelic site
-            const set<NoCallReason> non_residual_RNCs = { NoCallReason::N_A, NoCallReason::MissingData,
-                                                          NoCallReason::PartialData, NoCallReason::InsufficientDepth,
-                                                          NoCallReason::MonoallelicSite };
+    // ensure min_ref_depth is -1 for each of the samples
+    void clean_min_ref_depth(size_t n_samples) {
+        if (!min_ref_depth_clean || min_ref_depth.size() != n_samples) {
+            min_ref_depth.assign(n_samples, -1);
+            min_ref_depth_clean = true;
+        }
+    }
 
-            bool any_lost_calls = false;
-            for (int i = 0; i < bcf_nsamples; i++) {
-                if (non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2].RNC) == non_residual_RNCs.end() ||
-                    non_residual_RNCs.find(genotypes[sample_mapping.at(i)*2 + 1].RNC) == non_residual_RNCs.end()) {
-                    any_lost_calls = true;
-                    break;
-                }
-            }
+    // prepare for genotyping a site with the given samples
+    void reset(const vector<string>& samples_) {
+        clean_min_ref_depth(samples_.size());
+        genotypes.assign(2*samples_.size(), one_call());
+        // format_helpers are reset by setup_format_helpers
+    }
+};
 
-            if (any_lost_calls) {
-                // missing call, keep it in memory
-                DatasetResidual dsr;
-                dsr.name = dataset;
-                dsr.header = dataset_header;
-                dsr.records = records;
-                lost_calls_info.push_back(dsr);
-            }
-        }
+GenotypingWorkspace::GenotypingWorkspace() : body_(new body) {}
+GenotypingWorkspace::~GenotypingWorkspace() = default;
+
+size_t GenotypingWorkspace::ref_band_hits() const {
+    size_t ans = body_->ref_band_hits;
+    for (const auto& p : body_->ref_bands) {
+        ans += p.second.hits;
     }
+    return ans;
+}
+
+// Produce the output record for a site, once genotype_dataset has processed
+// all the datasets
+template<class site_t>
+static Status emit_site_record(const genotyper_config& cfg, MetadataCache& cache, const site_t& site,
+                               const vector<string>& samples, const bcf_hdr_t* hdr,
+                               GenotypingWorkspace::body& ws, vector<one_call>& genotypes,
+                               vector<unique_ptr<FormatFieldHelper>>& format_helpers,
+                               const vector<DatasetResidual>& lost_calls_info, bool residualsFlag,
+                               shared_ptr<bcf1_t>& ans, shared_ptr<string>& residual_rec) {
+    Status s;
 
     // Clean up emission order of alleles
     for(size_t i=0; i < samples.size(); i++) {
@@ -823,15 +1014,20 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     }
     // Create the destination BCF record for this site.
     ans = shared_ptr<bcf1_t>(bcf_init(), &bcf_destroy);
-    ans->rid = site.pos.rid;
-    ans->pos = site.pos.beg;
-    ans->rlen = site.pos.end - site.pos.beg;
-    ans->qual = site.qual;
+    const range& pos = site_pos(site);
+    const size_t n_alleles = site_allele_count(site);
+    ans->rid = pos.rid;
+    ans->pos = pos.beg;
+    ans->rlen = pos.end - pos.beg;
+    ans->qual = site_qual(site);
 
     // alleles
+    vector<string>& alleles = ws.alleles;
     vector<const char*> c_alleles;
-    for (const auto& allele : site.alleles) {
-        c_alleles.push_back(allele.dna.c_str());
+    alleles.resize(n_alleles);
+    for (size_t i = 0; i < n_alleles; i++) {
+        alleles[i] = site_allele_dna(site, i);
+        c_alleles.push_back(alleles[i].c_str());
     }
     if (bcf_update_alleles(hdr, ans.get(), c_alleles.data(), c_alleles.size()) != 0) {
         return Status::Failure("bcf_update_alleles");
@@ -839,17 +1035,17 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
 
     // populate ID column with a normalized representation of each ALT
     ostringstream anr;
-    for (int i = 1; i < site.alleles.size(); i++) {
-        const auto& norm = site.alleles[i].normalized;
-        if (!site.pos.contains(norm.pos)) {
-            return Status::Failure("logic error: unified allele normalized representation isn't contained within site", site.pos.str());
+    for (int i = 1; i < n_alleles; i++) {
+        const allele& norm = site_allele_normalized(site, i);
+        if (!pos.contains(norm.pos)) {
+            return Status::Failure("logic error: unified allele normalized representation isn't contained within site", pos.str());
         }
         if (i > 1) {
             anr << ";";
         }
         anr << bcf_seqname(hdr, ans.get())
             << "_" << (norm.pos.beg+1)
-            << "_" << site.alleles[0].dna.substr(norm.pos.beg - site.pos.beg, norm.pos.size())
+            << "_" << alleles[0].substr(norm.pos.beg - pos.beg, norm.pos.size())
             << "_" << norm.dna;
     }
     if (bcf_update_id(hdr, ans.get(), anr.str().c_str())) {
@@ -859,8 +1055,8 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     // AF
     vector<float> af;
     bool output_af = true;
-    for (int i = 1; i < site.alleles.size(); i++) {
-        auto f = site.alleles[i].frequency;
+    for (int i = 1; i < n_alleles; i++) {
+        auto f = site_allele_frequency(site, i);
         if (f == f) {
             af.push_back(f);
         } else {
@@ -875,8 +1071,8 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
     // AQ
     vector<int32_t> aq;
     bool any_aq = false;
-    for (int i = 1; i < site.alleles.size(); i++) {
-        auto q = site.alleles[i].quality;
+    for (int i = 1; i < n_alleles; i++) {
+        auto q = site_allele_quality(site, i);
         aq.push_back(q);
         if (q) {
             any_aq = true;
@@ -886,23 +1082,39 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
         return Status::Failure("bcf_update_info_int32 AQ");
     }
 
+    // FORMAT fields: rather than going through bcf_update_genotypes and
+    // bcf_update_format_*, encode the record's indiv block directly (see
+    // encode_format_int32 etc.), producing the same bytes.
+    S(ws.format_field_ids(cfg, hdr, format_helpers));
+    const int n_sample = bcf_hdr_nsamples(hdr);
+    assert(n_sample == samples.size());
+    kstring_t* indiv = &(ans->indiv);
+    ks_resize(indiv, ws.indiv_size_hint);
+    int n_fmt = 0;
+
     // GT
-    vector<int32_t> gt;
+    vector<int32_t>& gt = ws.gt;
+    gt.clear();
     for (const auto& c : genotypes) {
         gt.push_back(c.allele);
     }
     assert(gt.size() == genotypes.size());
-    if (bcf_update_genotypes(hdr, ans.get(), gt.data(), gt.size()) != 0) {
-        return Status::Failure("bcf_update_genotypes");
+    if (encode_format_int32(indiv, ws.format_ids[0], gt.data(), gt.size(), n_sample)) {
+        n_fmt++;
     }
 
     // Lifted-over FORMAT fields (non-genotype based)
-    for (auto& format_helper : format_helpers) {
-        S(format_helper->update_record_format(hdr, ans.get()));
+    for (size_t i = 0; i < format_helpers.size(); i++) {
+        bool encoded = false;
+        S(format_helpers[i]->encode_record_format(ws.format_ids[i+1], indiv, encoded));
+        if (encoded) {
+            n_fmt++;
+        }
     }
 
     // RNC
-    vector<const char*> rnc;
+    vector<const char*>& rnc = ws.rnc;
+    rnc.clear();
     for (const auto& c : genotypes) {
         char* v = (char*) "M";
         #define RNC_CASE(reason,code) case NoCallReason::reason: v = (char*) code ; break;
@@ -921,11 +1133,15 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
         rnc.push_back(v);
     }
     assert (gt.size() == rnc.size());
-    if (bcf_update_format_string(hdr, ans.get(), "RNC", rnc.data(), rnc.size()) != 0) {
-        return Status::Failure("bcf_update_format_string RNC");
+    if (encode_format_string(indiv, ws.format_ids.back(), rnc.data(), rnc.size(), n_sample)) {
+        n_fmt++;
     }
 
-    if (site.monoallelic && bcf_add_filter(hdr, ans.get(), bcf_hdr_id2int(hdr, BCF_DT_ID, "MONOALLELIC")) != 1) {
+    ans->n_sample = n_sample;
+    ans->n_fmt = n_fmt;
+    ws.indiv_size_hint = max(ws.indiv_size_hint, indiv->l);
+
+    if (site_monoallelic(site) && bcf_add_filter(hdr, ans.get(), bcf_hdr_id2int(hdr, BCF_DT_ID, "MONOALLELIC")) != 1) {
         return Status::Failure("bcf_add_filter MONOALLELIC");
     }
 
@@ -933,22 +1149,353 @@ Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData&
         !lost_calls_info.empty()) {
         // Write loss record to the residuals file, useful for offline debugging.
         residual_rec = make_shared<string>();
-        S(residuals_gen_record(site, hdr, ans.get(), lost_calls_info,
+        unified_site tmp(pos);
+        S(residuals_gen_record(site_full(site, tmp), hdr, ans.get(), lost_calls_info,
                                cache, samples,
                                *residual_rec));
     }
 
-    // Overwrite the output BCF record with a duplicate. Why? This forces htslib to
-    // perform some internal serialization of the data (see the static bcf1_sync
-    // function in vcf.c, which we can't call directly, but is called by bcf_dup).
-    // htslib would otherwise do this serialization implicitly while writing the
-    // record out to a file, but by doing it explicitly here, we get to do some of the
-    // work in the current worker thread rather than the single thread responsible for
-    // writing out the file.
-    auto ans2 = shared_ptr<bcf1_t>(bcf_dup(ans.get()), &bcf_destroy);
-    ans = move(ans2);
+    // The indiv block, which is the bulk of the record, is already serialized
+    // (formerly we forced this by bcf_dup'ing the record). htslib serializes
+    // the small remainder (ID, alleles, FILTER, INFO) when writing it out.
+    return Status::OK();
+}
+
+template<class site_t>
+static Status genotype_site_impl(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const site_t& site,
+                                 const std::string& sampleset, const vector<string>& samples,
+                                 const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
+                                 bool residualsFlag, shared_ptr<string> &residual_rec,
+                                 atomic<bool>* ext_abort, GenotypingWorkspace* workspace) {
+    Status s;
+
+    unique_ptr<GenotypingWorkspace> local_workspace;
+    if (!workspace) {
+        local_workspace.reset(new GenotypingWorkspace);
+        workspace = local_workspace.get();
+    }
+    auto& ws = *(workspace->body_);
+    ws.reset(samples);
+    if (ws.ref_bands_rid != site_pos(site).rid) {
+        // the bands remembered from another contig are of no further use
+        for (const auto& p : ws.ref_bands) {
+            ws.ref_band_hits += p.second.hits;
+        }
+        ws.ref_bands.clear();
+        ws.ref_bands_rid = site_pos(site).rid;
+    }
+
+    // Initialize a vector for the unified genotype calls for each sample,
+    // starting with everything missing. We'll then loop through BCF records
+    // overlapping this site and fill in the genotypes as we encounter them.
+    vector<one_call>& genotypes = ws.genotypes;
+
+    // Setup format field helpers
+    vector<unique_ptr<FormatFieldHelper>>& format_helpers = ws.format_helpers;
+    S(setup_format_helpers(format_helpers, cfg, site_allele_count(site), samples));
+
+    // query database for pertinent records across the samples
+    shared_ptr<const set<string>> samples2, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    S(data.sampleset_range(cache, sampleset, site_query_range(site), nullptr,
+                           samples2, datasets, iterators));
+    assert(samples.size() == samples2->size());
+
+    auto adh = NewAlleleDepthHelper(cfg);
+    vector<DatasetResidual> lost_calls_info;
+
+
+    // for each pertinent dataset
+    for (const auto& dataset : *datasets) {
+        if (ext_abort && *ext_abort) {
+            return Status::Aborted();
+        }
+
+        // load BCF records overlapping the site by "merging" the iterators
+        shared_ptr<const bcf_hdr_t> dataset_header;
+        vector<shared_ptr<bcf1_t>> records;
+
+        for (const auto& iter : iterators) {
+            string this_dataset;
+            vector<shared_ptr<bcf1_t>> these_records;
+            S(iter->next(this_dataset, dataset_header, these_records));
+            if (dataset != this_dataset) {
+                return Status::Failure("genotype_site: iterator returned unexpected dataset",
+                                       this_dataset + " instead of " + dataset);
+            }
+            records.insert(records.end(), these_records.begin(), these_records.end());
+        }
+
+        assert(is_sorted(records.begin(), records.end(),
+                         [] (shared_ptr<bcf1_t>& p1, shared_ptr<bcf1_t>& p2) {
+                            return range(p1) < range(p2);
+                         }));
+
+        bool lost_calls = false;
+        S(genotype_dataset(cfg, cache, site, sampleset, dataset, dataset_header, records,
+                           *adh, ws.min_ref_depth, ws.min_ref_depth_clean, &ws.ref_bands[dataset],
+                           genotypes, format_helpers, residualsFlag, lost_calls));
+        if (lost_calls) {
+            // missing call, keep it in memory
+            DatasetResidual dsr;
+            dsr.name = dataset;
+            dsr.header = dataset_header;
+            dsr.records = records;
+            lost_calls_info.push_back(dsr);
+        }
+    }
+
+    return emit_site_record(cfg, cache, site, samples, hdr, ws, genotypes, format_helpers,
+                            lost_calls_info, residualsFlag, ans, residual_rec);
+}
+
+Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site& site,
+                     const std::string& sampleset, const vector<string>& samples,
+                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
+                     bool residualsFlag, shared_ptr<string> &residual_rec,
+                     atomic<bool>* ext_abort, GenotypingWorkspace* workspace) {
+    return genotype_site_impl(cfg, cache, data, site, sampleset, samples, hdr, ans,
+                              residualsFlag, residual_rec, ext_abort, workspace);
+}
+
+Status genotype_site(const genotyper_config& cfg, MetadataCache& cache, BCFData& data, const unified_site_view& site,
+                     const std::string& sampleset, const vector<string>& samples,
+                     const bcf_hdr_t* hdr, shared_ptr<bcf1_t>& ans,
+                     bool residualsFlag, shared_ptr<string> &residual_rec,
+                     atomic<bool>* ext_abort, GenotypingWorkspace* workspace) {
+    return genotype_site_impl(cfg, cache, data, site, sampleset, samples, hdr, ans,
+                              residualsFlag, residual_rec, ext_abort, workspace);
+}
+
+struct GenotypingWindow::body {
+    const genotyper_config& cfg;
+    MetadataCache& cache;
+    // the sites are in one or the other
+    const vector<unified_site>* sites_vector;
+    const unified_site_table* sites_table;
+    const size_t lo, hi;
+    const string sampleset;
+    const vector<string>& samples;
+    const bool residualsFlag;
+
+    vector<string> datasets;
+    range window_range;
+
+    // state of each site in the window (indexed by i-lo) while the datasets
+    // are processed
+    vector<range> query_ranges;
+    vector<vector<one_call>> genotypes;
+    vector<vector<unique_ptr<FormatFieldHelper>>> format_helpers;
+    // records of each dataset with lost calls at the site, indexed like
+    // datasets (if residualsFlag)
+    vector<vector<unique_ptr<DatasetResidual>>> lost_calls;
+
+    body(const genotyper_config& cfg_, MetadataCache& cache_,
+         const vector<unified_site>* sites_vector_, const unified_site_table* sites_table_,
+         size_t lo_, size_t hi_, const string& sampleset_, const vector<string>& samples_,
+         bool residualsFlag_)
+        : cfg(cfg_), cache(cache_), sites_vector(sites_vector_), sites_table(sites_table_),
+          lo(lo_), hi(hi_), sampleset(sampleset_), samples(samples_), residualsFlag(residualsFlag_),
+          window_range(-1,-1,-1) {}
+
+    // Call f on sites[i], as a unified_site or a unified_site_view
+    template<class F>
+    Status with_site(size_t i, F f) const {
+        if (sites_vector) {
+            return f((*sites_vector)[i]);
+        }
+        return f((*sites_table)[i]);
+    }
+
+    Status setup();
+};
+
+GenotypingWindow::GenotypingWindow() = default;
+GenotypingWindow::~GenotypingWindow() = default;
+
+Status GenotypingWindow::Open(const genotyper_config& cfg, MetadataCache& cache,
+                              const vector<unified_site>& sites, size_t lo, size_t hi,
+                              const string& sampleset, const vector<string>& samples,
+                              bool residualsFlag, unique_ptr<GenotypingWindow>& ans) {
+    Status s;
+    if (lo >= hi || hi > sites.size()) {
+        return Status::Invalid("GenotypingWindow::Open: invalid window");
+    }
+
+    unique_ptr<GenotypingWindow> window(new GenotypingWindow());
+    window->body_.reset(new body(cfg, cache, &sites, nullptr, lo, hi, sampleset, samples, residualsFlag));
+    S(window->body_->setup());
+    ans = move(window);
+    return Status::OK();
+}
+
+Status GenotypingWindow::Open(const genotyper_config& cfg, MetadataCache& cache,
+                              const unified_site_table& sites, size_t lo, size_t hi,
+                              const string& sampleset, const vector<string>& samples,
+                              bool residualsFlag, unique_ptr<GenotypingWindow>& ans) {
+    Status s;
+    if (lo >= hi || hi > sites.size()) {
+        return Status::Invalid("GenotypingWindow::Open: invalid window");
+    }
+
+    unique_ptr<GenotypingWindow> window(new GenotypingWindow());
+    window->body_.reset(new body(cfg, cache, nullptr, &sites, lo, hi, sampleset, samples, residualsFlag));
+    S(window->body_->setup());
+    ans = move(window);
+    return Status::OK();
+}
+
+Status GenotypingWindow::body::setup() {
+    Status s;
+    body& b = *this;
+
+    shared_ptr<const set<string>> samples2, datasets;
+    S(cache.sampleset_datasets(sampleset, samples2, datasets));
+    assert(samples.size() == samples2->size());
+    b.datasets.assign(datasets->begin(), datasets->end());
+
+    // the window range encompasses the query ranges of all its sites
+    for (size_t i = lo; i < hi; i++) {
+        range q(-1,-1,-1);
+        size_t n_alleles = 0;
+        S(with_site(i, [&](const auto& site) {
+            q = site_query_range(site);
+            n_alleles = site_allele_count(site);
+            return Status::OK();
+        }));
+        if (i == lo) {
+            b.window_range = q;
+        } else if (q.rid != b.window_range.rid) {
+            return Status::Invalid("GenotypingWindow::Open: sites span multiple contigs", q.str());
+        }
+        b.window_range.beg = min(b.window_range.beg, q.beg);
+        b.window_range.end = max(b.window_range.end, q.end);
+        b.query_ranges.push_back(q);
+
+        b.genotypes.emplace_back(2*samples.size(), one_call());
+        b.format_helpers.emplace_back();
+        S(setup_format_helpers(b.format_helpers.back(), cfg, n_alleles, samples));
+        b.lost_calls.emplace_back(residualsFlag ? b.datasets.size() : 0);
+    }
+
+    return Status::OK();
+}
+
+size_t GenotypingWindow::dataset_count() const {
+    return body_->datasets.size();
+}
+
+size_t GenotypingWindow::memory_size() const {
+    const body& b = *body_;
+    size_t ans = sizeof(body);
+    for (size_t i = 0; i < b.genotypes.size(); i++) {
+        ans += b.genotypes[i].capacity() * sizeof(one_call);
+        for (const auto& helper : b.format_helpers[i]) {
+            ans += helper->memory_size();
+        }
+        ans += b.lost_calls[i].capacity() * sizeof(unique_ptr<DatasetResidual>);
+    }
+    return ans;
+}
+
+Status GenotypingWindow::genotype_datasets(BCFData& data, size_t dataset_lo, size_t dataset_hi,
+                                           GenotypingWorkspace& workspace, atomic<bool>* ext_abort) {
+    Status s;
+    body& b = *body_;
+    if (dataset_lo > dataset_hi || dataset_hi > b.datasets.size()) {
+        return Status::Invalid("GenotypingWindow::genotype_datasets: invalid dataset range");
+    }
+
+    auto& ws = *(workspace.body_);
+    ws.clean_min_ref_depth(b.samples.size());
+    auto adh = NewAlleleDepthHelper(b.cfg);
+    vector<int> max_end;
+    vector<shared_ptr<bcf1_t>> site_records;
+
+    for (size_t d = dataset_lo; d < dataset_hi; d++) {
+        if (ext_abort && *ext_abort) {
+            return Status::Aborted();
+        }
+        const string& dataset = b.datasets[d];
+
+        // read the dataset's records across the whole window in one pass
+        shared_ptr<const bcf_hdr_t> dataset_header;
+        vector<shared_ptr<bcf1_t>> records;
+        S(data.dataset_range_and_header(dataset, b.window_range, nullptr, dataset_header, records));
+        assert(is_sorted(records.begin(), records.end(),
+                         [] (const shared_ptr<bcf1_t>& p1, const shared_ptr<bcf1_t>& p2) {
+                            return range(p1) < range(p2);
+                         }));
+
+        // The records are sorted by begin position; the running maximum of
+        // their end positions lets us binary-search for the first record
+        // which might overlap a site.
+        max_end.clear();
+        for (const auto& record : records) {
+            int end = record->pos + record->rlen;
+            max_end.push_back(max_end.empty() ? end : max(max_end.back(), end));
+        }
+
+        // merge-join the records with the sites
+        ref_band band;
+        for (size_t i = 0; i < b.query_ranges.size(); i++) {
+            const range& q = b.query_ranges[i];
+            auto first = upper_bound(max_end.begin(), max_end.end(), q.beg) - max_end.begin();
+            auto last = lower_bound(records.begin(), records.end(), q.end,
+                                    [] (const shared_ptr<bcf1_t>& record, int end) {
+                                        return record->pos < end;
+                                    }) - records.begin();
+            site_records.clear();
+            for (auto j = first; j < last; j++) {
+                if (range(records[j].get()).overlaps(q)) {
+                    site_records.push_back(records[j]);
+                }
+            }
+
+            bool lost_calls = false;
+            S(b.with_site(b.lo+i, [&](const auto& site) {
+                return genotype_dataset(b.cfg, b.cache, site, b.sampleset, dataset, dataset_header,
+                                        site_records, *adh, ws.min_ref_depth, ws.min_ref_depth_clean, &band,
+                                        b.genotypes[i], b.format_helpers[i], b.residualsFlag, lost_calls);
+            }));
+            if (lost_calls) {
+                auto dsr = make_unique<DatasetResidual>();
+                dsr->name = dataset;
+                dsr->header = dataset_header;
+                dsr->records = site_records;
+                b.lost_calls[i][d] = move(dsr);
+            }
+        }
+        ws.ref_band_hits += band.hits;
+    }
 
     return Status::OK();
 }
 
+Status GenotypingWindow::finish_site(size_t i, const bcf_hdr_t* hdr, GenotypingWorkspace& workspace,
+                                     shared_ptr<bcf1_t>& ans, shared_ptr<string>& residual_rec) {
+    body& b = *body_;
+    if (i < b.lo || i >= b.hi) {
+        return Status::Invalid("GenotypingWindow::finish_site: site outside window");
+    }
+    size_t k = i - b.lo;
+
+    vector<DatasetResidual> lost_calls_info;
+    for (const auto& dsr : b.lost_calls[k]) {
+        if (dsr) {
+            lost_calls_info.push_back(*dsr);
+        }
+    }
+    Status s = b.with_site(i, [&](const auto& site) {
+        return emit_site_record(b.cfg, b.cache, site, b.samples, hdr, *(workspace.body_),
+                                b.genotypes[k], b.format_helpers[k], lost_calls_info,
+                                b.residualsFlag, ans, residual_rec);
+    });
+
+    // release the site's state
+    b.genotypes[k] = vector<one_call>();
+    b.format_helpers[k].clear();
+    b.lost_calls[k].clear();
+    return s;
+}
 }
@@ -1,6 +1,61 @@
-// Helper classes/functions for the genotyper algorithm (included only by genotyper.cc)
+// Helper classes/functions for the genotyper algorithm (included only by
+// genotyper.cc, and by test/genotyper.cc to unit-test them)
 namespace GLnexus {
 
+///////////////////////////////////////////////////////////////////////////////
+// Direct encoding of FORMAT fields into the indiv block of a BCF record under
+// construction. Each appends exactly the bytes which bcf_update_format_* would
+// have produced for a new field (and bcf1_sync would then have copied into
+// the indiv block), without the header lookup and the per-field buffers.
+// n is the total number of values across n_sample samples. Returns false if
+// n is zero, in which case htslib would have omitted the field.
+///////////////////////////////////////////////////////////////////////////////
+
+static bool encode_format_int32(kstring_t* indiv, int fmt_id, int32_t* values, int n, int n_sample) {
+    if (n == 0) return false;
+    bcf_enc_int1(indiv, fmt_id);
+    bcf_enc_vint(indiv, n, values, n / n_sample);
+    return true;
+}
+
+static bool encode_format_float(kstring_t* indiv, int fmt_id, const float* values, int n, int n_sample) {
+    if (n == 0) return false;
+    bcf_enc_int1(indiv, fmt_id);
+    bcf_enc_size(indiv, n / n_sample, BCF_BT_FLOAT);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // BCF floats are little-endian, like the host
+    kputsn((const char*) values, n * sizeof(float), indiv);
+#else
+    for (int i = 0; i < n; i++) {
+        uint32_t u;
+        memcpy(&u, &values[i], sizeof(u));
+        for (int b = 0; b < 4; b++) {
+            kputc((u >> (8*b)) & 0xff, indiv);
+        }
+    }
+#endif
+    return true;
+}
+
+// As bcf_update_format_string: the strings are NUL-padded to a common width
+static bool encode_format_string(kstring_t* indiv, int fmt_id, const char* const* values, int n, int n_sample) {
+    size_t max_len = 0;
+    for (int i = 0; i < n; i++) {
+        max_len = max(max_len, strlen(values[i]));
+    }
+    if (max_len * n == 0) return false;
+    bcf_enc_int1(indiv, fmt_id);
+    bcf_enc_size(indiv, max_len * n / n_sample, BCF_BT_CHAR);
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(values[i]);
+        kputsn(values[i], len, indiv);
+        for (; len < max_len; len++) {
+            kputc('\0', indiv);
+        }
+    }
+    return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Helpers for lifting over FORMAT fields from input to output VCF records
 // e.g. GQ, AD, SB, etc.
@@ -14,32 +69,33 @@ public:
 
 
     // Expected number of samples in output bcf record
-    const int n_samples;
+    int n_samples;
 
     // Expected number of values per sample in the **output** (ie unified site)
     // Note this may differ from the count of input for RetainedFieldNumber::ALLELES
     // and RetainedFieldNumber::ALT since the number of alleles may differ in input and
     // output
-    const int count;
+    int count;
 
     FormatFieldHelper(const retained_format_field& field_info_, int n_samples_, int count_) : field_info(field_info_), n_samples(n_samples_), count(count_) {}
 
     FormatFieldHelper() = default;
 
     virtual Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header, bcf1_t* record,
-                                   const map<int, int>& sample_mapping, const vector<int>& allele_mapping,
+                                   const SampleMapping& sample_mapping, const vector<int>& allele_mapping,
                                    const int n_allele_out, const vector<string>& field_names, int n_val_per_sample) = 0;
 
     // Wrapper with default values populated for
     // field_names and n_val_per_sample
     virtual Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header, bcf1_t* record,
-                                   const map<int, int>& sample_mapping, const vector<int>& allele_mapping,
+                                   const SampleMapping& sample_mapping, const vector<int>& allele_mapping,
                                    const int n_allele_out) {
         return add_record_data(dataset, dataset_header, record, sample_mapping, allele_mapping, n_allele_out, {}, -1);
     }
 
     virtual Status censor(int sample, bool half_call) {
         if (sample < 0 || sample >= n_samples) return Status::Invalid("genotyper::FormatFieldHelper::censor");
+        lock_guard<mutex> lock(censored_samples_mutex);
         censored_samples.insert(make_pair(sample, half_call));
         return Status::OK();
     }
@@ -48,7 +104,20 @@ public:
         return Status::OK();
     }
 
-    virtual Status update_record_format(const bcf_hdr_t* hdr, bcf1_t* record) = 0;
+    // Discard the values accumulated for the previous site and prepare for
+    // another with the given output dimensions, keeping the buffers.
+    virtual void reset(int n_samples_, int count_) {
+        n_samples = n_samples_;
+        count = count_;
+        censored_samples.clear();
+    }
+
+    // Approximate bytes held by the helper's buffers, for memory accounting
+    virtual size_t memory_size() const = 0;
+
+    // Append the combined values to the indiv block of the output record as
+    // FORMAT field fmt_id, setting encoded=false if the field is omitted.
+    virtual Status encode_record_format(int fmt_id, kstring_t* indiv, bool& encoded) = 0;
 
     virtual ~FormatFieldHelper() = default;
 
@@ -59,6 +128,8 @@ protected:
     // be unreliable/misleading. In some cases we have a flag to censor
     // only fields discussing the reference allele (for "half-calls")
     set<pair<int,bool>> censored_samples;
+    // the dataset-major genotyper may censor different samples concurrently
+    mutex censored_samples_mutex;
 
     /// For a given record, give the number of expected values
     /// per sample, based on the format type
@@ -84,7 +155,7 @@ protected:
     /// (e.g. allele-specific info for a trimmed allele), and raises error
     /// if the sample cannot be mapped
     int get_out_ind_of_value(int unmapped_i, int unmapped_j,
-                                const map<int, int>& sample_mapping,
+                                const SampleMapping& sample_mapping,
                                 const vector<int>& allele_mapping,
                                 const int n_allele_out) {
         int mapped_i = sample_mapping.at(unmapped_i);
@@ -134,57 +205,104 @@ protected:
     }
 };
 
+// Per-thread free lists of the flat buffers used by the numeric helpers below,
+// so that a worker genotyping one site after another reuses the same storage
+// instead of reallocating it for every site and retained field.
+template<class V>
+static vector<vector<V>>& recycled_vectors() {
+    static thread_local vector<vector<V>> free_list;
+    return free_list;
+}
+
+template<class V>
+static vector<V> take_recycled_vector() {
+    auto& free_list = recycled_vectors<V>();
+    if (free_list.empty()) {
+        return vector<V>();
+    }
+    vector<V> ans = std::move(free_list.back());
+    free_list.pop_back();
+    return ans;
+}
+
+template<class V>
+static void recycle_vector(vector<V>&& v) {
+    auto& free_list = recycled_vectors<V>();
+    if (free_list.size() < 64) {
+        v.clear();
+        free_list.push_back(std::move(v));
+    }
+}
+
 template <class T>
 class NumericFormatFieldHelper : public FormatFieldHelper {
 protected:
-    // A vector of length n_samples * count, where each element
-    // is a vector consisting of format field value from
-    // record(s) related to the given sample, at a specified
-    // position (for fields with more than 1 value per sample).
-    // The second layer is a vector containing up to n_record values
-    // whereby 0 or 1 value is pushed to it for every record processed by
-    // add_record_data
-    vector<vector<T>> format_v;
-
-    // Combination function to handle combining multiple format values
-    // from multiple records
-    T (*combine_f) (const vector<T>&, T);
-
-    static T max_element_wrapper(const vector<T>& v, T missing) {
-        return (*max_element(v.begin(), v.end()));
+    // Flat accumulator of length n_samples * count, holding for each output
+    // value the combination (so far) of the values from record(s) related to
+    // the given sample, at a specified position (for fields with more than 1
+    // value per sample).
+    vector<T> values_;
+
+    // Number of values observed for each entry of values_, saturating at 2;
+    // the combination methods only need to distinguish none, one and many.
+    vector<uint8_t> n_obs_;
+
+    // Combine kernel folding one more value into an accumulator entry
+    void (*accumulate_f) (T&, uint8_t&, T);
+
+    static void accumulate_max(T& acc, uint8_t& n, T v) {
+        if (n == 0 || acc < v) acc = v;
+        n = std::min(n+1, 2);
     }
 
-    static T min_element_wrapper(const vector<T>& v, T missing) {
-        return (*min_element(v.begin(), v.end()));
+    static void accumulate_min(T& acc, uint8_t& n, T v) {
+        if (n == 0 || v < acc) acc = v;
+        n = std::min(n+1, 2);
     }
 
-    static T missing_element_wrapper(const vector<T>& v, T missing) {
-        return v.size() == 1 ? v[0] : missing;
+    static void accumulate_single(T& acc, uint8_t& n, T v) {
+        if (n == 0) acc = v;
+        n = std::min(n+1, 2);
     }
 
+    // Output buffer for update_record_format
+    vector<T> ans_;
+
     // Overloaded wrapper function to call bcf_get_format of the correct
-    // format field type
-    htsvecbox<int32_t> iv_;
-    htsvecbox<float> fv_;
+    // format field type. The scratch buffers are per-thread, as the
+    // dataset-major genotyper adds different datasets' records to the same
+    // helper concurrently.
+    static htsvecbox<int32_t>& iv_() {
+        static thread_local htsvecbox<int32_t> iv;
+        return iv;
+    }
+    static htsvecbox<float>& fv_() {
+        static thread_local htsvecbox<float> fv;
+        return fv;
+    }
     int bcf_get_format_wrapper(const bcf_hdr_t* dataset_header, bcf1_t* record, const char* field_name, int32_t** v) {
-        int ans = bcf_get_format_int32(dataset_header, record, field_name, &iv_.v, &iv_.capacity);
-        *v = iv_.v;
+        auto& iv = iv_();
+        int ans = bcf_get_format_int32(dataset_header, record, field_name, &iv.v, &iv.capacity);
+        *v = iv.v;
         return ans;
     }
     int bcf_get_format_wrapper(const bcf_hdr_t* dataset_header, bcf1_t* record, const char* field_name, float** v) {
-        int ans = bcf_get_format_float(dataset_header, record, field_name, &fv_.v, &fv_.capacity);
-        *v = fv_.v;
+        auto& fv = fv_();
+        int ans = bcf_get_format_float(dataset_header, record, field_name, &fv.v, &fv.capacity);
+        *v = fv.v;
         return ans;
     }
 
     int bcf_get_info_wrapper(const bcf_hdr_t* dataset_header, bcf1_t* record, const char* field_name, int32_t** v) {
-        int ans = bcf_get_info_int32(dataset_header, record, field_name, &iv_.v, &iv_.capacity);
-        *v = iv_.v;
+        auto& iv = iv_();
+        int ans = bcf_get_info_int32(dataset_header, record, field_name, &iv.v, &iv.capacity);
+        *v = iv.v;
         return ans;
     }
     int bcf_get_info_wrapper(const bcf_hdr_t* dataset_header, bcf1_t* record, const char* field_name, float** v) {
-        int ans = bcf_get_info_float(dataset_header, record, field_name, &fv_.v, &fv_.capacity);
-        *v = fv_.v;
+        auto& fv = fv_();
+        int ans = bcf_get_info_float(dataset_header, record, field_name, &fv.v, &fv.capacity);
+        *v = fv.v;
         return ans;
     }
 
@@ -223,24 +341,26 @@ protected:
     }
     virtual Status combine_format_data(vector<T>& ans) {
         Status s;
-        ans.clear();
 
         // Templatized missing & default values
         T missing_value, default_value;
         S(get_missing_value(missing_value));
         S(get_default_value(default_value));
 
-        for (auto& v : format_v) {
-            if (v.empty()) {
-                v.push_back(default_value);
-            }
-        }
+        assert(values_.size() == n_samples * count);
+        ans.resize(values_.size());
 
-        assert(format_v.size() == n_samples * count);
-
-        // Combine values using the combine_f function given
-        for (auto& format_one : format_v) {
-            ans.push_back(combine_f(format_one, missing_value));
+        for (size_t i = 0; i < values_.size(); i++) {
+            switch (n_obs_[i]) {
+                case 0:
+                    ans[i] = default_value;
+                    break;
+                case 1:
+                    ans[i] = values_[i];
+                    break;
+                default:
+                    ans[i] = accumulate_f == accumulate_single ? missing_value : values_[i];
+            }
         }
 
         return Status::OK();
@@ -266,23 +386,41 @@ public:
 
         switch (field_info.combi_method) {
             case FieldCombinationMethod::MIN:
-                combine_f = min_element_wrapper;
+                accumulate_f = accumulate_min;
                 break;
             case FieldCombinationMethod::MAX:
-                combine_f = max_element_wrapper;
+                accumulate_f = accumulate_max;
                 break;
             default:
-                combine_f = missing_element_wrapper;
+                accumulate_f = accumulate_single;
                 break;
         }
 
-        format_v.resize(n_samples_ * count_);
+        values_ = take_recycled_vector<T>();
+        values_.resize(n_samples_ * count_);
+        n_obs_ = take_recycled_vector<uint8_t>();
+        n_obs_.assign(n_samples_ * count_, 0);
+        ans_ = take_recycled_vector<T>();
+    }
+
+    virtual ~NumericFormatFieldHelper() {
+        recycle_vector(std::move(values_));
+        recycle_vector(std::move(n_obs_));
+        recycle_vector(std::move(ans_));
     }
 
-    virtual ~NumericFormatFieldHelper() = default;
+    void reset(int n_samples_, int count_) override {
+        FormatFieldHelper::reset(n_samples_, count_);
+        values_.assign(n_samples_ * count_, T());
+        n_obs_.assign(n_samples_ * count_, 0);
+    }
+
+    size_t memory_size() const override {
+        return (values_.capacity() + ans_.capacity()) * sizeof(T) + n_obs_.capacity();
+    }
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                           bcf1_t* record, const map<int, int>& sample_mapping,
+                           bcf1_t* record, const SampleMapping& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
                            const vector<string>& field_names, int n_val_per_sample) override {
 
@@ -342,9 +480,9 @@ public:
                            continue;
                         }
 
-                        assert(out_ind < format_v.size());
+                        assert(out_ind < values_.size());
                         assert(in_ind < rv);
-                        format_v[out_ind].push_back(v[in_ind]);
+                        accumulate_f(values_[out_ind], n_obs_[out_ind], v[in_ind]);
                     } // close for j loop
                 } // close for i loop
             } // close rv >= 0
@@ -353,14 +491,13 @@ public:
         return found ? Status::OK() : Status::NotFound();
     }
 
-    Status update_record_format(const bcf_hdr_t* hdr, bcf1_t* record) override {
+    Status encode_record_format(int fmt_id, kstring_t* indiv, bool& encoded) override {
         Status s;
-        vector<T> ans;
+        vector<T>& ans = ans_;
         S(combine_format_data(ans));
         assert(ans.size() == n_samples*count);
         S(perform_censor(ans));
 
-        int retval  = 0;
         switch (field_info.type) {
             case RetainedFieldType::INT:
                 for (int i = 0; i < n_samples; i++) {
@@ -377,16 +514,13 @@ public:
                         ans[i*count+1] = bcf_int32_vector_end;
                     }
                 }
-                retval = bcf_update_format_int32(hdr, record, field_info.name.c_str(), ans.data(), n_samples * count);
+                encoded = encode_format_int32(indiv, fmt_id, (int32_t*) ans.data(), n_samples * count, n_samples);
                 break;
             case RetainedFieldType::FLOAT:
-                retval = bcf_update_format_float(hdr, record, field_info.name.c_str(), ans.data(), n_samples * count);
+                encoded = encode_format_float(indiv, fmt_id, (const float*) ans.data(), n_samples * count, n_samples);
                 break;
             default:
-                return Status::Invalid("genotyper: Unexpected RetainedFieldType when executing update_record_format.", field_info.name);
-        }
-        if (retval != 0) {
-            return Status::Failure("genotyper: failed to update record format when executing update_record_format.", field_info.name);
+                return Status::Invalid("genotyper: Unexpected RetainedFieldType when executing encode_record_format.", field_info.name);
         }
         return Status::OK();
     }
@@ -400,13 +534,14 @@ public:
     }
 
     Status squeeze(int sample) override {
-        // round DP values down to a power of two
-        assert(sample < format_v.size());
-        for (auto& dp : format_v[sample]) {
-            if (dp > 2) {
-                auto odp = dp;
-                for (dp=2; dp*2 <= odp; dp *= 2);
-            }
+        // round DP values down to a power of two. The rounding is monotone,
+        // so applying it to the min/max accumulated so far is equivalent to
+        // applying it to each value.
+        assert(sample < values_.size());
+        auto& dp = values_[sample];
+        if (n_obs_[sample] && dp > 2) {
+            auto odp = dp;
+            for (dp=2; dp*2 <= odp; dp *= 2);
         }
         return Status::OK();
     }
@@ -421,7 +556,7 @@ public:
     }
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                           bcf1_t* record, const map<int, int>& sample_mapping,
+                           bcf1_t* record, const SampleMapping& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
                            const vector<string>& field_names, int n_val_per_sample) override {
         Status s = NumericFormatFieldHelper<int32_t>::add_record_data(dataset, dataset_header, record, sample_mapping, allele_mapping, n_allele_out, field_names, n_val_per_sample);
@@ -472,10 +607,8 @@ public:
 
 protected:
     Status combine_format_data(vector<int32_t>& ans) override {
-        Status s;
-        ans.clear();
-
-        assert(format_v.size() == n_samples * count);
+        assert(values_.size() == n_samples * count);
+        ans.resize(values_.size());
 
         // for each sample, if we don't have at least one entry equal to zero,
         // then censor all. Also, censor if we have a zero but no other values,
@@ -484,24 +617,24 @@ protected:
             int zeroes = 0, nonzeroes = 0;
             bool multi = false;
             for (int j = 0; j < count; j++) {
-                const auto& v = format_v[i*count+j];
-                if (v.size() == 1) {
-                    if (v[0] == 0) {
+                const int k = i*count+j;
+                if (n_obs_[k] == 1) {
+                    if (values_[k] == 0) {
                         zeroes++;
                     } else {
                         nonzeroes++;
                     }
-                } else if (v.size() > 1) {
+                } else if (n_obs_[k] > 1) {
                     multi = true;
                 }
             }
 
             for (int j = 0; j < count; j++) {
-                if (multi || zeroes == 0 || (zeroes == 1 && nonzeroes == 0)) {
-                    ans.push_back(bcf_int32_missing);
+                const int k = i*count+j;
+                if (multi || zeroes == 0 || (zeroes == 1 && nonzeroes == 0) || n_obs_[k] != 1) {
+                    ans[k] = bcf_int32_missing;
                 } else {
-                    const auto& v = format_v[i*count+j];
-                    ans.push_back(v.size() == 1 ? v[0] : bcf_int32_missing);
+                    ans[k] = values_[k];
                 }
             }
         }
@@ -565,8 +698,21 @@ public:
 
     virtual ~StringFormatFieldHelper() = default;
 
+    void reset(int n_samples_, int count_) override {
+        FormatFieldHelper::reset(n_samples_, count_);
+        for (auto& format_one : format_v) {
+            format_one.clear();
+        }
+        format_v.resize(n_samples_ * count_);
+    }
+
+    size_t memory_size() const override {
+        // the strings themselves are usually short enough to be inline
+        return format_v.capacity() * sizeof(vector<string>);
+    }
+
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                           bcf1_t* record, const map<int, int>& sample_mapping,
+                           bcf1_t* record, const SampleMapping& sample_mapping,
                            const vector<int>& allele_mapping, const int n_allele_out,
                            const vector<string>& field_names, int n_val_per_sample) override {
         return Status::NotImplemented("genotyper StringFormatFieldHelper::add_record_data");
@@ -630,7 +776,7 @@ public:
         return found ? Status::OK() : Status::NotFound();*/
     }
 
-    Status update_record_format(const bcf_hdr_t* hdr, bcf1_t* record) override {
+    Status encode_record_format(int fmt_id, kstring_t* indiv, bool& encoded) override {
         Status s;
         vector<string> ans;
         S(combine_format_data(ans));
@@ -642,12 +788,8 @@ public:
             cstrs.push_back(s.c_str());
         }
         assert(cstrs.size() == n_samples*count);
-        //cstrs = {"foo","bar"};
 
-        int retval  = bcf_update_format_string(hdr, record, field_info.name.c_str(), cstrs.data(), n_samples*count);
-        if (retval != 0) {
-            return Status::Failure("genotyper: failed to update record format when executing update_record_format.", field_info.name);
-        }
+        encoded = encode_format_string(indiv, fmt_id, cstrs.data(), n_samples*count, n_samples);
         return Status::OK();
     }
 };
@@ -663,7 +805,7 @@ public:
     virtual ~FilterFormatFieldHelper() = default;
 
     Status add_record_data(const string& dataset, const bcf_hdr_t* dataset_header,
-                            bcf1_t* record, const map<int, int>& sample_mapping,
+                            bcf1_t* record, const SampleMapping& sample_mapping,
                             const vector<int>& allele_mapping, const int n_allele_out,
                             const vector<string>& field_names, int n_val_per_sample) override {
         if (n_val_per_sample < 0) {
@@ -697,27 +839,54 @@ public:
 };
 
 
+// Number of values per sample of the retained field in the output record for
+// a site with n_alleles alleles (incl. REF)
+static Status format_field_count(const retained_format_field& format_field_info,
+                                 size_t n_alleles, int& count) {
+    count = -1;
+    if (format_field_info.number == RetainedFieldNumber::BASIC) {
+        count = format_field_info.count;
+    } else if (format_field_info.number == RetainedFieldNumber::ALT) {
+        count = (n_alleles - 1);
+    } else if (format_field_info.number == RetainedFieldNumber::ALLELES) {
+        count = n_alleles;
+    } else if (format_field_info.number == RetainedFieldNumber::GENOTYPE) {
+        count = diploid::genotypes(n_alleles);
+        // TODO: censor if count > 15 (5 alleles) to prevent explosion
+    }
+
+    if (count < 0) {
+        return Status::Failure("setup_format_helpers: failed to identify count for format field");
+    }
+    return Status::OK();
+}
+
+// Set up the format helpers for a site with n_alleles alleles (incl. REF).
+// If format_helpers already holds the helpers for cfg (from a previous site
+// genotyped with the same workspace), they're reset and reused rather than
+// reconstructed.
 Status setup_format_helpers(vector<unique_ptr<FormatFieldHelper>>& format_helpers,
                             const genotyper_config& cfg,
-                            const unified_site& site,
+                            size_t n_alleles,
                             const vector<string>& samples) {
-    for (const auto& format_field_info : cfg.liftover_fields) {
-        int count = -1;
-        if (format_field_info.number == RetainedFieldNumber::BASIC) {
-            count = format_field_info.count;
-        } else if (format_field_info.number == RetainedFieldNumber::ALT) {
-            // site.alleles.size() gives # alleles incl. REF
-            count = (site.alleles.size() - 1);
-        } else if (format_field_info.number == RetainedFieldNumber::ALLELES) {
-            count = (site.alleles.size());
-        } else if (format_field_info.number == RetainedFieldNumber::GENOTYPE) {
-            count = diploid::genotypes(site.alleles.size());
-            // TODO: censor if count > 15 (5 alleles) to prevent explosion
+    Status s;
+    bool reuse = format_helpers.size() == cfg.liftover_fields.size();
+    for (size_t i = 0; reuse && i < format_helpers.size(); i++) {
+        reuse = &(format_helpers[i]->field_info) == &(cfg.liftover_fields[i]);
+    }
+    if (reuse) {
+        for (size_t i = 0; i < format_helpers.size(); i++) {
+            int count;
+            S(format_field_count(cfg.liftover_fields[i], n_alleles, count));
+            format_helpers[i]->reset(samples.size(), count);
         }
+        return Status::OK();
+    }
 
-        if (count < 0) {
-            return Status::Failure("setup_format_helpers: failed to identify count for format field");
-        }
+    format_helpers.clear();
+    for (const auto& format_field_info : cfg.liftover_fields) {
+        int count;
+        S(format_field_count(format_field_info, n_alleles, count));
 
         if (format_field_info.name == "AD") {
             if (format_field_info.type != RetainedFieldType::INT || format_field_info.number != RetainedFieldNumber::ALLELES) {
@@ -762,7 +931,7 @@ Status setup_format_helpers(vector<unique_ptr<FormatFieldHelper>>& format_helper
 }
 
 Status update_format_fields(const genotyper_config& cfg, const string& dataset, const bcf_hdr_t* dataset_header,
-                            const map<int,int>& sample_mapping, const unified_site& site,
+                            const SampleMapping& sample_mapping, size_t n_alleles,
                             vector<unique_ptr<FormatFieldHelper>>& format_helpers,
                             const vector<shared_ptr<bcf1_t_plus>>& all_records,
                             const vector<shared_ptr<bcf1_t_plus>>& variant_records,
@@ -790,7 +959,7 @@ Status update_format_fields(const genotyper_config& cfg, const string& dataset,
 
         for (const auto& record : *records_to_use) {
             s = format_helper->add_record_data(dataset, dataset_header, record->p.get(),
-                                               sample_mapping, record->allele_mapping, site.alleles.size());
+                                               sample_mapping, record->allele_mapping, n_alleles);
             if (s.bad() && s != StatusCode::NOT_FOUND) {
                 return s;
             }
@@ -959,7 +1128,7 @@ public:
 
 // The AlleleDepthHelper is constructed into an undefined state. Load()
 // must be invoked, successfully, before it can be used.
-unique_ptr<AlleleDepthHelper> NewAlleleDepthHelper(const genotyper_config& cfg) {
+inline unique_ptr<AlleleDepthHelper> NewAlleleDepthHelper(const genotyper_config& cfg) {
     if (cfg.ref_dp_format == "RR" && cfg.allele_dp_format == "VR") {
         return xAtlasAlleleDepthHelper::Make(cfg);
     }
@@ -972,7 +1141,7 @@ unique_ptr<AlleleDepthHelper> NewAlleleDepthHelper(const genotyper_config& cfg)
 /// should be initialized to -1 before any reference confidence records are
 /// seen.
 static Status update_min_ref_depth(const string& dataset, const bcf_hdr_t* dataset_header,
-                                   int bcf_nsamples, const map<int,int>& sample_mapping,
+                                   int bcf_nsamples, const SampleMapping& sample_mapping,
                                    const vector<shared_ptr<bcf1_t_plus>>& ref_records,
                                    AlleleDepthHelper& depth,
                                    vector<int>& min_ref_depth) {
@@ -0,0 +1,65 @@
+#include "memory_governor.h"
+#include <assert.h>
+#include <sstream>
+#include <iomanip>
+
+using namespace std;
+
+namespace GLnexus {
+
+MemoryGovernor& MemoryGovernor::global() {
+    static MemoryGovernor governor;
+    return governor;
+}
+
+MemoryGovernor::MemoryGovernor(size_t budget) : budget_(budget), total_(0) {
+    for (int i = 0; i < N_COMPONENTS; i++) {
+        used_[i] = 0;
+        high_water_[i] = 0;
+    }
+}
+
+void MemoryGovernor::charge(Component c, size_t bytes) {
+    size_t used = (used_[int(c)] += bytes);
+    total_ += bytes;
+    size_t hw = high_water_[int(c)];
+    while (used > hw && !high_water_[int(c)].compare_exchange_weak(hw, used)) {}
+}
+
+void MemoryGovernor::release(Component c, size_t bytes) {
+    assert(used_[int(c)] >= bytes);
+    used_[int(c)] -= bytes;
+    total_ -= bytes;
+}
+
+bool MemoryGovernor::has_room(size_t bytes) const {
+    size_t budget = budget_;
+    if (budget == 0) {
+        return true;
+    }
+    size_t in_flight = 0;
+    for (Component c : { Component::BULK_INSERT, Component::DISCOVERY, Component::GENOTYPING }) {
+        in_flight += used_[int(c)];
+    }
+    return in_flight + bytes <= budget;
+}
+
+string MemoryGovernor::report() const {
+    static const char* names[N_COMPONENTS] = {
+        "block cache", "write buffers", "bulk insert", "discovery", "genotyping"
+    };
+    ostringstream ans;
+    ans << fixed << setprecision(2);
+    for (int i = 0; i < N_COMPONENTS; i++) {
+        if (i) {
+            ans << ", ";
+        }
+        ans << names[i] << " " << double(high_water_[i]) / double(1<<30) << " GiB";
+    }
+    if (budget_) {
+        ans << " (budget " << double(budget_) / double(1<<30) << " GiB)";
+    }
+    return ans.str();
+}
+
+} // namespace GLnexus
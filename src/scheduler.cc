@@ -0,0 +1,283 @@
+#include "scheduler.h"
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fstream>
+#include <map>
+
+using namespace std;
+
+namespace GLnexus {
+
+bool parse_cpu_list(const string& cpulist, vector<int>& ans) {
+    ans.clear();
+    size_t i = 0;
+    while (i < cpulist.size() && cpulist[i] != '\n') {
+        size_t len = 0;
+        int lo, hi;
+        try {
+            lo = stoi(cpulist.substr(i), &len);
+        } catch (exception&) {
+            return false;
+        }
+        i += len;
+        hi = lo;
+        if (i < cpulist.size() && cpulist[i] == '-') {
+            i++;
+            try {
+                hi = stoi(cpulist.substr(i), &len);
+            } catch (exception&) {
+                return false;
+            }
+            i += len;
+        }
+        if (lo < 0 || hi < lo) {
+            return false;
+        }
+        for (int cpu = lo; cpu <= hi; cpu++) {
+            ans.push_back(cpu);
+        }
+        if (i < cpulist.size() && cpulist[i] == ',') {
+            i++;
+        }
+    }
+    return true;
+}
+
+vector<vector<int>> detect_numa_nodes(const string& sys_node_dir) {
+    map<int,vector<int>> nodes;
+    DIR* dir = opendir(sys_node_dir.c_str());
+    if (!dir) {
+        return {};
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        int node;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &node, &extra) != 1 || node < 0) {
+            continue;
+        }
+        ifstream cpulist_file(sys_node_dir + "/" + entry->d_name + "/cpulist");
+        string cpulist;
+        vector<int> cpus;
+        if (getline(cpulist_file, cpulist) && parse_cpu_list(cpulist, cpus) && !cpus.empty()) {
+            // (nodes without CPUs, e.g. memory-only, are of no use here)
+            nodes[node] = move(cpus);
+        }
+    }
+    closedir(dir);
+
+    vector<vector<int>> ans;
+    for (auto& p : nodes) {
+        ans.push_back(move(p.second));
+    }
+    return ans;
+}
+
+// the scheduler & index of the worker running on this thread, if any
+static thread_local const Scheduler* tls_scheduler = nullptr;
+static thread_local int tls_worker = -1;
+
+Scheduler::Scheduler(size_t threads, const vector<vector<int>>& numa_nodes)
+    : pending_(0), pending_forked_(0), joiners_(0), next_worker_(0) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers_.push_back(unique_ptr<worker>(new worker));
+    }
+
+    // divide the workers among the NUMA nodes, if there's more than one (and
+    // enough workers to go around)
+    size_t n_nodes = 1;
+    if (numa_nodes.size() > 1 && threads > 1) {
+        n_nodes = min(numa_nodes.size(), threads);
+        node_cpus_.assign(numa_nodes.begin(), numa_nodes.begin() + n_nodes);
+    }
+    node_workers_.resize(n_nodes);
+    for (size_t k = 0; k < n_nodes; k++) {
+        injected_.push_back(unique_ptr<worker>(new worker));
+    }
+    for (size_t i = 0; i < threads; i++) {
+        worker_node_.push_back(i % n_nodes);
+        node_workers_[i % n_nodes].push_back(i);
+    }
+    // steal from the workers on the same node first
+    for (size_t i = 0; i < threads; i++) {
+        vector<int> order;
+        for (size_t k = 1; k < threads; k++) {
+            int j = (i + k) % threads;
+            if (worker_node_[j] == worker_node_[i]) {
+                order.push_back(j);
+            }
+        }
+        for (size_t k = 1; k < threads; k++) {
+            int j = (i + k) % threads;
+            if (worker_node_[j] != worker_node_[i]) {
+                order.push_back(j);
+            }
+        }
+        steal_order_.push_back(move(order));
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        threads_.push_back(thread([this, i]() { work(i); }));
+    }
+}
+
+Scheduler::~Scheduler() {
+    {
+        lock_guard<mutex> lock(sleep_mutex_);
+        stop_ = true;
+    }
+    sleep_cv_.notify_all();
+    for (auto& t : threads_) {
+        t.join();
+    }
+}
+
+int Scheduler::current_worker() const {
+    return tls_scheduler == this ? tls_worker : -1;
+}
+
+void Scheduler::enqueue(TaskLane lane, int node, task_t task) {
+    int tid = current_worker();
+    worker* w;
+    if (node >= 0 && node_workers_.size() > 1) {
+        node %= node_workers_.size();
+        w = (tid >= 0 && worker_node_[tid] == node) ? workers_[tid].get() : injected_[node].get();
+    } else if (tid >= 0) {
+        w = workers_[tid].get();
+    } else {
+        w = injected_[next_worker_++ % injected_.size()].get();
+    }
+    bool forked = tid >= 0 && w == workers_[tid].get();
+    // count the task before it becomes visible to run_one
+    pending_++;
+    if (forked) {
+        pending_forked_++;
+    }
+    {
+        lock_guard<mutex> lock(w->mutex);
+        w->lanes[int(lane)].push_back(move(task));
+    }
+    {
+        // synchronize with a worker about to go to sleep, lest it miss the
+        // notification
+        lock_guard<mutex> lock(sleep_mutex_);
+    }
+    if (forked && joiners_ > 0) {
+        // the task may be what a worker sleeping in join() is waiting for
+        sleep_cv_.notify_all();
+    } else {
+        sleep_cv_.notify_one();
+    }
+}
+
+// Pop a task from the given lane of a deque, from the back or the front.
+static bool pop_task(mutex& mu, deque<function<void(int)>>& q, bool back, function<void(int)>& task) {
+    lock_guard<mutex> lock(mu);
+    if (q.empty()) {
+        return false;
+    }
+    if (back) {
+        task = move(q.back());
+        q.pop_back();
+    } else {
+        task = move(q.front());
+        q.pop_front();
+    }
+    return true;
+}
+
+// Run one pending task, if any: for each lane in priority order, pop the
+// newest task from the worker's own deque, or else steal the oldest task of
+// another worker on the same node, or else take the oldest task pushed from
+// outside to this node, or else look on the other nodes likewise.
+bool Scheduler::run_one(int tid, bool take_injected) {
+    const auto& victims = steal_order_[tid];
+    int node = worker_node_[tid];
+    for (int lane = 0; lane < N_LANES; lane++) {
+        task_t task;
+        bool found = pop_task(workers_[tid]->mutex, workers_[tid]->lanes[lane], true, task);
+        size_t k = 0;
+        for (; !found && k < victims.size() && worker_node_[victims[k]] == node; k++) {
+            found = pop_task(workers_[victims[k]]->mutex, workers_[victims[k]]->lanes[lane], false, task);
+        }
+        bool injected = false;
+        if (!found && take_injected) {
+            found = injected = pop_task(injected_[node]->mutex, injected_[node]->lanes[lane], false, task);
+        }
+        for (; !found && k < victims.size(); k++) {
+            found = pop_task(workers_[victims[k]]->mutex, workers_[victims[k]]->lanes[lane], false, task);
+        }
+        for (size_t j = 1; !found && take_injected && j < injected_.size(); j++) {
+            worker& inj = *injected_[(node + j) % injected_.size()];
+            found = injected = pop_task(inj.mutex, inj.lanes[lane], false, task);
+        }
+        if (found) {
+            assert(pending_ > 0);
+            pending_--;
+            if (!injected) {
+                assert(pending_forked_ > 0);
+                pending_forked_--;
+            }
+            task(tid);
+            if (joiners_ > 0) {
+                // wake any worker waiting in join() for this task's result
+                {
+                    lock_guard<mutex> lock(sleep_mutex_);
+                }
+                sleep_cv_.notify_all();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Run forked tasks on worker tid until ready(), sleeping whenever there are
+// none to run. ready() must become true upon the completion of some task
+// (which notifies the joiners). New tasks from outside aren't taken, as they
+// might wait on the very task that's waiting here.
+void Scheduler::join(int tid, const function<bool()>& ready) {
+    while (!ready()) {
+        if (run_one(tid, false)) {
+            continue;
+        }
+        unique_lock<mutex> lock(sleep_mutex_);
+        joiners_++;
+        sleep_cv_.wait(lock, [&]() { return ready() || pending_forked_ > 0; });
+        joiners_--;
+    }
+}
+
+void Scheduler::work(int tid) {
+    tls_scheduler = this;
+    tls_worker = tid;
+    if (!node_cpus_.empty()) {
+        // pin the thread to its node's CPUs (best-effort), so that the memory
+        // it first touches is allocated on that node
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : node_cpus_[worker_node_[tid]]) {
+            if (cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    while (true) {
+        if (run_one(tid)) {
+            continue;
+        }
+        unique_lock<mutex> lock(sleep_mutex_);
+        sleep_cv_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+        if (stop_ && pending_ == 0) {
+            return;
+        }
+    }
+}
+
+} // namespace GLnexus
@@ -0,0 +1,456 @@
+#include "server.h"
+#include "unifier.h"
+#include "cli_utils.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace GLnexus {
+
+// longest request line we'll accept
+static const size_t MAX_REQUEST = 1 << 20;
+
+string server_metrics::yaml() const {
+    YAML::Emitter out;
+    out << YAML::BeginMap;
+    out << YAML::Key << "requests" << YAML::Value << requests;
+    out << YAML::Key << "failed" << YAML::Value << failed;
+    out << YAML::Key << "rejected" << YAML::Value << rejected;
+    out << YAML::Key << "bytes_out" << YAML::Value << bytes_out;
+    out << YAML::Key << "total_ms" << YAML::Value << total_ms;
+    out << YAML::Key << "max_ms" << YAML::Value << max_ms;
+    out << YAML::EndMap;
+    return string(out.c_str()) + "\n";
+}
+
+static Status write_all(int fd, const char* buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return Status::IOError("socket send", strerror(errno));
+        }
+        buf += n;
+        len -= n;
+    }
+    return Status::OK();
+}
+
+// read until EOF, or just the first line if line is set
+static Status read_all(int fd, string& ans, bool line, size_t limit) {
+    ans.clear();
+    char buf[65536];
+    while (!line || ans.find('\n') == string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return Status::IOError("socket recv", strerror(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        ans.append(buf, n);
+        if (ans.size() > limit) {
+            return Status::Invalid("request too long");
+        }
+    }
+    if (line) {
+        size_t p = ans.find('\n');
+        if (p == string::npos) {
+            return Status::Invalid("incomplete request");
+        }
+        ans.resize(p);
+    }
+    return Status::OK();
+}
+
+struct Server::body {
+    shared_ptr<spdlog::logger> logger;
+    server_config cfg;
+    Metadata* metadata;
+    BCFData* data;
+    unique_ptr<Service> svc;
+    vector<pair<string,size_t>> contigs;
+
+    int listen_fd = -1;
+    atomic<bool> stopping;
+    bool stopped = false;
+    thread acceptor;
+
+    mutable mutex mu;
+    // connection threads, by ID; finished ones are listed in done until joined
+    map<uint64_t,thread> conns;
+    vector<uint64_t> done;
+    // sockets of the connections being served, which Stop shuts down to wake
+    // threads blocked reading from or writing to them
+    set<int> conn_fds;
+    size_t active = 0;
+    uint64_t next_id = 0;
+    server_metrics metrics;
+};
+
+Server::Server() {}
+
+Status Server::Start(shared_ptr<spdlog::logger> logger, const server_config& cfg,
+                     Metadata& metadata, BCFData& data, unique_ptr<Server>& ans) {
+    Status s;
+    unique_ptr<Server> server(new Server());
+    server->body_.reset(new body);
+    auto& b = *(server->body_);
+    b.logger = logger;
+    b.cfg = cfg;
+    b.cfg.max_concurrent_requests = max(b.cfg.max_concurrent_requests, size_t(1));
+    // residuals are written alongside the output file, which we don't keep
+    b.cfg.genotyper.output_residuals = false;
+    b.metadata = &metadata;
+    b.data = &data;
+    b.stopping = false;
+
+    S(metadata.contigs(b.contigs));
+    if (b.cfg.sampleset.empty()) {
+        S(metadata.all_samples_sampleset(b.cfg.sampleset));
+    }
+    S(Service::Start(b.cfg.service, metadata, data, b.svc));
+
+    // bind the socket
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (cfg.socket_path.empty() || cfg.socket_path.size() >= sizeof(addr.sun_path)) {
+        return Status::Invalid("Server: invalid socket path", cfg.socket_path);
+    }
+    strcpy(addr.sun_path, cfg.socket_path.c_str());
+    // replace a stale socket (e.g. left by a server that was killed), but
+    // nothing else which may be at the path
+    struct stat st;
+    if (lstat(cfg.socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            return Status::Exists("Server: socket path exists and isn't a socket", cfg.socket_path);
+        }
+        unlink(cfg.socket_path.c_str());
+    }
+    b.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (b.listen_fd < 0) {
+        return Status::IOError("Server: socket", strerror(errno));
+    }
+    if (bind(b.listen_fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(b.listen_fd, 64) != 0) {
+        s = Status::IOError("Server: bind/listen", cfg.socket_path + " " + strerror(errno));
+        close(b.listen_fd);
+        b.listen_fd = -1;
+        return s;
+    }
+
+    Server* srv = server.get();
+    b.acceptor = thread([srv]() { srv->accept_loop(); });
+    logger->info("serving sample set {} on {} ({} concurrent requests)",
+                 b.cfg.sampleset, cfg.socket_path, b.cfg.max_concurrent_requests);
+    ans = move(server);
+    return Status::OK();
+}
+
+void Server::reap(bool all) {
+    auto& b = *body_;
+    vector<thread> finished;
+    {
+        lock_guard<mutex> lock(b.mu);
+        if (all) {
+            for (auto& p : b.conns) {
+                finished.push_back(move(p.second));
+            }
+            b.conns.clear();
+        } else {
+            for (auto id : b.done) {
+                finished.push_back(move(b.conns[id]));
+                b.conns.erase(id);
+            }
+        }
+        b.done.clear();
+    }
+    for (auto& t : finished) {
+        t.join();
+    }
+}
+
+void Server::accept_loop() {
+    auto& b = *body_;
+    while (!b.stopping) {
+        pollfd p;
+        p.fd = b.listen_fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        int rc = poll(&p, 1, 100);
+        reap(false);
+        if (rc <= 0) {
+            continue;
+        }
+        int conn = accept(b.listen_fd, nullptr, nullptr);
+        if (conn < 0) {
+            continue;
+        }
+
+        unique_lock<mutex> lock(b.mu);
+        if (b.active >= b.cfg.max_concurrent_requests) {
+            b.metrics.rejected++;
+            lock.unlock();
+            string msg = "ERROR server busy\n";
+            write_all(conn, msg.c_str(), msg.size());
+            close(conn);
+            continue;
+        }
+        b.active++;
+        b.conn_fds.insert(conn);
+        uint64_t id = b.next_id++;
+        b.conns[id] = thread([this, conn, id]() {
+            serve_connection(conn);
+            auto& b = *body_;
+            lock_guard<mutex> lock(b.mu);
+            b.active--;
+            b.done.push_back(id);
+        });
+    }
+}
+
+void Server::serve_connection(int conn) {
+    // don't let a stalled client hold a request slot indefinitely
+    timeval tv;
+    tv.tv_sec = 30;
+    tv.tv_usec = 0;
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    string request, payload, response;
+    Status s = read_all(conn, request, true, MAX_REQUEST);
+    if (s.ok()) {
+        s = handle(request, payload);
+    }
+    if (s.ok()) {
+        response = "OK " + to_string(payload.size()) + "\n";
+    } else {
+        string msg = s.str();
+        replace(msg.begin(), msg.end(), '\n', ' ');
+        response = "ERROR " + msg + "\n";
+    }
+    if (write_all(conn, response.c_str(), response.size()).ok() && s.ok()) {
+        write_all(conn, payload.c_str(), payload.size());
+    }
+    // close under the lock, so that Stop can't shut down a reused descriptor
+    auto& b = *body_;
+    lock_guard<mutex> lock(b.mu);
+    b.conn_fds.erase(conn);
+    close(conn);
+}
+
+Status Server::process(const string& verb, const string& args, string& payload, string& detail) {
+    Status s;
+    auto& b = *body_;
+    if (verb == "METRICS") {
+        payload = metrics().yaml();
+        return Status::OK();
+    }
+    if (verb != "DISCOVER" && verb != "UNIFY" && verb != "GENOTYPE") {
+        return Status::Invalid("unknown request", verb);
+    }
+
+    vector<range> ranges;
+    if (!cli::utils::parse_ranges(b.contigs, args, ranges) || ranges.empty()) {
+        return Status::Invalid("invalid ranges", args);
+    }
+    sort(ranges.begin(), ranges.end());
+    for (size_t i = 1; i < ranges.size(); i++) {
+        if (ranges[i].overlaps(ranges[i-1])) {
+            return Status::Invalid("overlapping ranges", args);
+        }
+    }
+
+    // discover alleles
+    unsigned N = 0;
+    vector<discovered_alleles> valleles;
+    S(b.svc->discover_alleles(b.cfg.sampleset, ranges, N, valleles, &b.stopping));
+    discovered_alleles dsals;
+    for (auto& als : valleles) {
+        S(merge_discovered_alleles(als, dsals));
+        als.clear();
+    }
+    detail = to_string(dsals.size()) + " alleles";
+    if (verb == "DISCOVER") {
+        ostringstream os;
+        S(cli::utils::yaml_stream_of_discovered_alleles(N, b.contigs, dsals, os));
+        payload = os.str();
+        return Status::OK();
+    }
+
+    // unify sites
+    vector<unified_site> sites;
+    unifier_stats stats;
+    S(unified_sites(b.cfg.unifier, N, dsals, sites, stats));
+    detail += ", " + to_string(sites.size()) + " sites";
+    if (verb == "UNIFY") {
+        ostringstream os;
+        S(cli::utils::yaml_stream_of_unified_sites(sites, b.contigs, os));
+        payload = os.str();
+        return Status::OK();
+    }
+
+    // genotype, via a temporary file since the genotyper writes through htslib
+    char tmpfn[] = "/tmp/GLnexus_server_XXXXXX";
+    int fd = mkstemp(tmpfn);
+    if (fd < 0) {
+        return Status::IOError("mkstemp", strerror(errno));
+    }
+    close(fd);
+    s = b.svc->genotype_sites(b.cfg.genotyper, b.cfg.sampleset, sites, tmpfn, &b.stopping);
+    if (s.ok()) {
+        ifstream tmp(tmpfn, ios::binary);
+        payload.assign(istreambuf_iterator<char>(tmp), istreambuf_iterator<char>());
+        if (tmp.bad()) {
+            s = Status::IOError("reading genotyper output", tmpfn);
+        }
+    }
+    unlink(tmpfn);
+    return s;
+}
+
+Status Server::handle(const string& request, string& payload) {
+    auto& b = *body_;
+    auto t0 = chrono::steady_clock::now();
+
+    string verb, args, detail;
+    size_t sp = request.find(' ');
+    verb = request.substr(0, sp);
+    if (sp != string::npos) {
+        args = request.substr(sp+1);
+    }
+    auto space = [](char c) { return isspace((unsigned char) c); };
+    verb.erase(remove_if(verb.begin(), verb.end(), space), verb.end());
+    args.erase(remove_if(args.begin(), args.end(), space), args.end());
+
+    payload.clear();
+    Status s = process(verb, args, payload, detail);
+    if (s.bad()) {
+        payload.clear();
+    }
+
+    uint64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - t0).count();
+    uint64_t id;
+    {
+        lock_guard<mutex> lock(b.mu);
+        id = b.metrics.requests++;
+        if (s.bad()) {
+            b.metrics.failed++;
+        }
+        b.metrics.bytes_out += payload.size();
+        b.metrics.total_ms += ms;
+        b.metrics.max_ms = max(b.metrics.max_ms, ms);
+    }
+    if (s.ok()) {
+        b.logger->info("request {}: {} {} -> {} bytes{}{} in {}ms", id, verb, args, payload.size(),
+                       detail.empty() ? "" : ", ", detail, ms);
+    } else {
+        b.logger->warn("request {}: {} {} -> {} in {}ms", id, verb, args, s.str(), ms);
+    }
+    return s;
+}
+
+server_metrics Server::metrics() const {
+    lock_guard<mutex> lock(body_->mu);
+    return body_->metrics;
+}
+
+void Server::Stop() {
+    auto& b = *body_;
+    if (b.stopped) {
+        return;
+    }
+    b.stopped = true;
+    b.stopping = true;
+    if (b.acceptor.joinable()) {
+        b.acceptor.join();
+    }
+    {
+        // wake connection threads waiting on their clients (requests being
+        // processed see stopping instead)
+        lock_guard<mutex> lock(b.mu);
+        for (int fd : b.conn_fds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    reap(true);
+    if (b.listen_fd >= 0) {
+        close(b.listen_fd);
+        unlink(b.cfg.socket_path.c_str());
+        b.listen_fd = -1;
+    }
+    server_metrics m = metrics();
+    b.logger->info("server stopped after {} requests ({} failed, {} rejected)", m.requests, m.failed, m.rejected);
+}
+
+Server::~Server() {
+    if (body_) {
+        Stop();
+    }
+}
+
+Status server_request(const string& socket_path, const string& request, string& payload) {
+    Status s;
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        return Status::Invalid("server_request: invalid socket path", socket_path);
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return Status::IOError("server_request: socket", strerror(errno));
+    }
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        s = Status::IOError("server_request: connect", socket_path + " " + strerror(errno));
+        close(fd);
+        return s;
+    }
+    // A server turning us away may hang up without reading the request, so
+    // that sending fails or the connection is reset after its response; so
+    // look for the response regardless.
+    string line = request + "\n", response;
+    Status ws = write_all(fd, line.c_str(), line.size());
+    if (ws.ok()) {
+        shutdown(fd, SHUT_WR);
+    }
+    Status rs = read_all(fd, response, false, SIZE_MAX);
+    close(fd);
+
+    size_t p = response.find('\n');
+    if (p == string::npos) {
+        S(ws);
+        S(rs);
+        return Status::IOError("server_request: incomplete response");
+    }
+    string header = response.substr(0, p);
+    if (header.compare(0, 3, "OK ") != 0) {
+        return Status::Failure("server_request", header);
+    }
+    S(rs);
+    size_t n = strtoull(header.c_str()+3, nullptr, 10);
+    if (response.size() - p - 1 != n) {
+        return Status::IOError("server_request: truncated response");
+    }
+    payload = response.substr(p+1);
+    return Status::OK();
+}
+
+}
@@ -12,7 +12,13 @@
 #include <map>
 #include <assert.h>
 #include <tuple>
-#include "ctpl_stl.h"
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bgzf.h"
+#include "hfile.h"
+#include "scheduler.h"
+#include "memory_governor.h"
 
 using namespace std;
 
@@ -24,15 +30,17 @@ struct Service::body {
     BCFData& data_;
     std::unique_ptr<MetadataCache> metadata_;
 
-    // thread pool for executing discover_alleles and genotype_sites operations
-    ctpl::thread_pool threadpool_;
-
-    // "meta" thread pool for driving multiple concurrent discover_alleles and
-    // "genotype_sites operations
-    ctpl::thread_pool metapool_;
+    // scheduler for the tasks of discover_alleles and genotype_sites
+    // operations, including the nested tasks of multi-range discover_alleles
+    unique_ptr<Scheduler> scheduler_;
 
     atomic<uint64_t> threads_stalled_ms_;
 
+    // pVCF headers (and the sample lists they were made from) for
+    // genotype_variant, keyed by sample set and lifted-over fields
+    mutex variant_headers_mutex_;
+    map<string,pair<shared_ptr<const vector<string>>,shared_ptr<const bcf_hdr_t>>> variant_headers_;
+
     body(BCFData& data) : data_(data) {}
 };
 
@@ -42,13 +50,28 @@ Service::Service(const service_config& cfg, BCFData& data) {
     if (body_->cfg_.threads == 0) {
         body_->cfg_.threads = thread::hardware_concurrency();
     }
-    body_->threadpool_.resize(body_->cfg_.threads);
-    body_->metapool_.resize(body_->cfg_.threads);
+    vector<vector<int>> numa_nodes;
+    if (body_->cfg_.numa) {
+        // (on a single-node host this is just the one node, which the
+        // scheduler ignores)
+        numa_nodes = detect_numa_nodes();
+    }
+    body_->scheduler_ = make_unique<Scheduler>(body_->cfg_.threads, numa_nodes);
     body_->threads_stalled_ms_ = 0;
 }
 
 Service::~Service() = default;
 
+// In NUMA mode, tasks for nearby genomic ranges are routed to the same node,
+// so that its workers reuse the storage buckets they've already cached.
+static const int NUMA_ROUTING_SPAN = 1<<15;
+static int numa_node_for(const Scheduler& scheduler, const range& pos) {
+    if (scheduler.nodes() < 2) {
+        return -1;
+    }
+    return (size_t(pos.rid)*7919 + size_t(pos.beg/NUMA_ROUTING_SPAN)) % scheduler.nodes();
+}
+
 Status Service::Start(const service_config& cfg, Metadata& metadata, BCFData& data,
                       unique_ptr<Service>& svc) {
     svc.reset(new Service(cfg, data));
@@ -67,18 +90,11 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     // Query for (iterators to) records overlapping pos in all the data sets.
     // We query for variant records only (excluding reference confidence records
     // which have only a symbolic ALT allele)
-    bcf_predicate predicate = [](const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
-        if (bcf_unpack(bcf, BCF_UN_STR)) {
-            return Status::IOError("bcf_unpack");
-        }
-        retval = !is_gvcf_ref_record(bcf);
-        return Status::OK();
-    };
-    S(body_->data_.sampleset_range(*(body_->metadata_), sampleset, pos, predicate,
+    S(body_->data_.sampleset_range(*(body_->metadata_), sampleset, pos, bcf_predicate_variant_records,
                                    samples, datasets, iterators));
     N = samples->size();
 
-    // Enqueue processing of each dataset on the thread pool.
+    // Enqueue processing of each dataset on the scheduler.
     // TODO: improve cache-friendliness for long ranges
     atomic<bool> abort(false);
     vector<future<Status>> statuses;
@@ -90,14 +106,14 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     size_t i = 0;
     for (const auto& iterator : iterators) {
         RangeBCFIterator* raw_iter = iterator.get();
-        auto fut = body_->threadpool_.push([&, i, raw_iter](int tid){
+        auto fut = body_->scheduler_->push(TaskLane::DISCOVERY, [&, i, raw_iter](int tid){
             if (abort || (ext_abort && *ext_abort)) {
                 abort = true;
                 return Status::Aborted();
             }
 
             discovered_alleles dsals;
-            Status ls = discover_alleles_from_iterator(*samples, pos, *raw_iter, dsals);
+            Status ls = discover_alleles_from_iterator(*(body_->metadata_), sampleset, pos, *raw_iter, dsals);
             results[i] = move(dsals);
             return ls;
         });
@@ -113,7 +129,7 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     s = Status::OK();
     for (size_t i = 0; i < iterators.size(); i++) {
         // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
+        Status s_i(body_->scheduler_->get(statuses[i]));
         discovered_alleles dsals = move(results[i]);
 
         if (s.ok() && s_i.ok()) {
@@ -133,21 +149,47 @@ Status Service::discover_alleles(const string& sampleset, const range& pos,
     return discovered_alleles_refcheck(ans, body_->metadata_->contigs());
 }
 
+// rough estimate of the memory held by discovered alleles (map nodes,
+// including the allele DNA strings)
+static size_t discovered_alleles_bytes(const discovered_alleles& dsals) {
+    size_t ans = 0;
+    for (const auto& dsal : dsals) {
+        ans += sizeof(discovered_alleles::value_type) + 64 + dsal.first.dna.capacity();
+    }
+    return ans;
+}
+
 Status Service::discover_alleles(const string& sampleset, const vector<range>& ranges,
                                  unsigned& N, vector<discovered_alleles>& ans, atomic<bool>* ext_abort) {
+    auto& governor = MemoryGovernor::global();
     atomic<bool> abort(false);
     vector<future<Status>> statuses;
     vector<discovered_alleles> results(ranges.size());
+    vector<size_t> results_bytes(ranges.size(), 0);
+    atomic<size_t> results_retrieved(0);
     N = 0;
 
     size_t i = 0;
     for (const auto& range : ranges) {
-        auto fut = body_->metapool_.push([&, i, range](int tid){
+        auto fut = body_->scheduler_->push(TaskLane::DISCOVERY, numa_node_for(*(body_->scheduler_), range),
+                                           [&, i, range](int tid){
             if (abort || (ext_abort && *ext_abort)) {
                 abort = true;
                 return Status::Aborted();
             }
 
+            // hold off while the results in flight exhaust the memory budget,
+            // unless these are the results to be retrieved next (which are
+            // awaited before the others can be released)
+            while (i > results_retrieved && !governor.has_room()) {
+                if (abort || (ext_abort && *ext_abort)) {
+                    abort = true;
+                    return Status::Aborted();
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                body_->threads_stalled_ms_ += 10;
+            }
+
             discovered_alleles dsals;
             unsigned tmpN;
             Status ls = discover_alleles(sampleset, range, tmpN, dsals, &abort);
@@ -156,6 +198,8 @@ Status Service::discover_alleles(const string& sampleset, const vector<range>& r
                     // tmpN should be the same across all ranges
                     N = tmpN;
                 }
+                results_bytes[i] = discovered_alleles_bytes(dsals);
+                governor.charge(MemoryGovernor::Component::DISCOVERY, results_bytes[i]);
                 results[i] = move(dsals);
             }
             return ls;
@@ -169,8 +213,10 @@ Status Service::discover_alleles(const string& sampleset, const vector<range>& r
     Status s = Status::OK();
     for (i = 0; i < ranges.size(); i++) {
         // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
+        Status s_i(body_->scheduler_->get(statuses[i]));
         discovered_alleles dsals = move(results[i]);
+        // the results now belong to the caller
+        governor.release(MemoryGovernor::Component::DISCOVERY, results_bytes[i]);
 
         if (s.ok() && s_i.ok()) {
             ans.push_back(move(dsals));
@@ -179,6 +225,7 @@ Status Service::discover_alleles(const string& sampleset, const vector<range>& r
             s = move(s_i);
             abort = true;
         }
+        results_retrieved++;
     }
     assert(s.bad() || ans.size() == ranges.size());
 
@@ -235,9 +282,10 @@ class BCFFileSink {
     const string& filename_;
     bcf_hdr_t* header_;
     vcfFile *outfile_;;
+    bool bgzf_;
 
-    BCFFileSink(const std::string& filename, bcf_hdr_t* hdr, vcfFile* outfile)
-        : filename_(filename), header_(hdr), outfile_(outfile)
+    BCFFileSink(const std::string& filename, bcf_hdr_t* hdr, vcfFile* outfile, bool bgzf)
+        : filename_(filename), header_(hdr), outfile_(outfile), bgzf_(bgzf)
         {}
 
 public:
@@ -264,7 +312,8 @@ public:
             return Status::IOError("bcf_hdr_write", filename);
         }
 
-        ans.reset(new BCFFileSink(filename, hdr, outfile));
+        ans.reset(new BCFFileSink(filename, hdr, outfile,
+                                  cfg.output_format == GLnexusOutputFormat::BCF));
         return Status::OK();
     }
 
@@ -274,6 +323,25 @@ public:
         }
     }
 
+    // Flush the header written by Open, so that it ends on a BGZF block
+    // boundary, and report its length in (compressed) bytes. Call before
+    // writing any records.
+    Status end_header(uint64_t& ans) {
+        if (!open_) return Status::Invalid("BCFFileSink::end_header() called on closed writer");
+        if (bgzf_) {
+            if (bgzf_flush(outfile_->fp.bgzf) != 0) {
+                return Status::IOError("bgzf_flush", filename_);
+            }
+            ans = bgzf_tell(outfile_->fp.bgzf) >> 16;
+        } else {
+            if (hflush(outfile_->fp.hfile) != 0) {
+                return Status::IOError("hflush", filename_);
+            }
+            ans = htell(outfile_->fp.hfile);
+        }
+        return Status::OK();
+    }
+
     virtual Status write(bcf1_t* record) {
         if (!open_) return Status::Invalid("BCFFilkSink::write() called on closed writer");
         return bcf_write(outfile_, header_, record) == 0
@@ -289,10 +357,20 @@ public:
     }
 };
 
-Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
-                               const vector<unified_site>& sites,
-                               const string& filename,
-                               atomic<bool>* ext_abort) {
+// Accessors letting the genotype_sites implementation work on either a vector
+// of unified_sites or a unified_site_table
+static const range& site_pos(const vector<unified_site>& sites, size_t i) {
+    return sites[i].pos;
+}
+static const range& site_pos(const unified_site_table& sites, size_t i) {
+    return sites[i].pos();
+}
+
+template<class sites_t>
+Status Service::genotype_sites_impl(const genotyper_config& cfg, const string& sampleset,
+                                    const sites_t& sites,
+                                    const string& filename,
+                                    atomic<bool>* ext_abort) {
     Status s;
     shared_ptr<const set<string>> samples;
     S(body_->metadata_->sampleset_samples(sampleset, samples));
@@ -304,6 +382,14 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
     S(prepare_bcf_header(body_->metadata_->contigs(), sample_names, cfg.liftover_fields,
                          body_->cfg_.extra_header_lines, hdr));
 
+    if (!body_->cfg_.checkpoint_dir.empty()) {
+        if (cfg.output_residuals) {
+            return Status::Invalid("genotype_sites: residuals output isn't supported with checkpointing");
+        }
+        return genotype_sites_checkpointed(cfg, sampleset, sample_names, sites, hdr.get(),
+                                           filename, ext_abort);
+    }
+
     // open output BCF file
     unique_ptr<BCFFileSink> bcf_out;
     S(BCFFileSink::Open(cfg, filename, hdr.get(), bcf_out));
@@ -322,28 +408,105 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
         S(ResidualsFile::Open(res_filename, residualsFile));
     }
 
-    // Enqueue processing of each site as a task on the thread pool.
+    if (body_->cfg_.dataset_major_window) {
+        S(genotype_sites_dataset_major(cfg, sampleset, sample_names, sites, 0, sites.size(),
+                                       hdr.get(), *bcf_out, residualsFile.get(), ext_abort));
+    } else {
+        S(genotype_sites_site_major(cfg, sampleset, sample_names, sites, 0, sites.size(),
+                                    hdr.get(), *bcf_out, residualsFile.get(), ext_abort));
+    }
+
+    // TODO: for very large sample sets, bucket cache-friendliness might be
+    // improved by genotyping in grid squares of N>1 sites and M>1 samples
+
+    // close the output file
+    return bcf_out->close();
+}
+
+// A charge to the memory governor for the genotyping state of a window of
+// sites, released when it goes out of scope. Before charging, acquire() waits
+// while the budget is exhausted and other genotyping results are in flight,
+// since they'll be released as they're written out; without any, it proceeds
+// regardless, so that a window larger than the whole budget still progresses.
+class GenotypingCharge {
+    size_t bytes_ = 0;
+
+public:
+    ~GenotypingCharge() { release(); }
+
+    Status acquire(size_t bytes, atomic<bool>* ext_abort, atomic<uint64_t>& stalled_ms) {
+        auto& governor = MemoryGovernor::global();
+        release();
+        uint64_t ms = 0;
+        while (!governor.has_room(bytes) &&
+               governor.in_use(MemoryGovernor::Component::GENOTYPING) > 0) {
+            if (ext_abort && *ext_abort) {
+                stalled_ms += ms;
+                return Status::Aborted();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            ms += 10;
+        }
+        stalled_ms += ms;
+        governor.charge(MemoryGovernor::Component::GENOTYPING, bytes);
+        bytes_ = bytes;
+        return Status::OK();
+    }
+
+    void release() {
+        if (bytes_) {
+            MemoryGovernor::global().release(MemoryGovernor::Component::GENOTYPING, bytes_);
+            bytes_ = 0;
+        }
+    }
+};
+
+// Genotype sites[lo,hi) site by site, writing the records to bcf_out in order
+template<class sites_t>
+Status Service::genotype_sites_site_major(const genotyper_config& cfg, const string& sampleset,
+                                          const vector<string>& sample_names,
+                                          const sites_t& sites, size_t lo, size_t hi,
+                                          const bcf_hdr_t* hdr, BCFFileSink& bcf_out,
+                                          ResidualsFile* residualsFile,
+                                          atomic<bool>* ext_abort) {
+    Status s;
+    assert(lo <= hi && hi <= sites.size());
+    const size_t n = hi - lo;
+
+    // Enqueue processing of each site as a task on the scheduler.
     vector<future<Status>> statuses;
-    vector<tuple<shared_ptr<bcf1_t>,shared_ptr<string>>> results(sites.size());
+    vector<tuple<shared_ptr<bcf1_t>,shared_ptr<string>>> results(n);
     // ^^^ results to be filled by side-effect in the individual tasks below.
     // We assume that by virtue of preallocating, no mutex is necessary to
     // use it as follows because writes and reads of individual elements are
     // serialized by the futures.
     atomic<size_t> results_retrieved(0);
     atomic<bool> abort(false);
-    for (size_t i = 0; i < sites.size(); i++) {
-        auto fut = body_->threadpool_.push([&, i](int tid){
+    // bytes charged to the memory governor for each result in flight
+    auto& governor = MemoryGovernor::global();
+    vector<size_t> results_bytes(n, 0);
+    // one genotyping workspace per worker thread, indexed by tid
+    vector<GenotypingWorkspace> workspaces(body_->scheduler_->size());
+    for (size_t i = 0; i < n; i++) {
+        auto fut = body_->scheduler_->push(TaskLane::GENOTYPING, numa_node_for(*(body_->scheduler_), site_pos(sites, lo+i)),
+                                           [&, i](int tid){
             if (abort || (ext_abort && *ext_abort)) {
                 abort = true;
                 return Status::Aborted();
             }
 
             uint64_t stalled_ms = 0;
-            while (i > results_retrieved+4*body_->cfg_.threads) {
+            while (i > results_retrieved+4*body_->cfg_.threads ||
+                   (i > results_retrieved && !governor.has_room())) {
                 // throttle worker thread if the results retrieval, below, is falling
                 // too far behind. Otherwise memory usage would be unbounded because
                 // the results have to be retrieved and written out before they can
-                // be deallocated.
+                // be deallocated. Likewise if the results in flight exhaust the
+                // memory budget, except for the result to be retrieved next.
+                if (abort || (ext_abort && *ext_abort)) {
+                    abort = true;
+                    return Status::Aborted();
+                }
                 std::this_thread::sleep_for(std::chrono::milliseconds(10));
                 stalled_ms += 10;
             }
@@ -356,28 +519,31 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
 
             shared_ptr<string> residual_rec = nullptr;
             shared_ptr<bcf1_t> bcf;
-            Status ls = genotype_site(cfg, *(body_->metadata_), body_->data_, sites[i],
-                                      sampleset, sample_names, hdr.get(), bcf,
+            Status ls = genotype_site(cfg, *(body_->metadata_), body_->data_, sites[lo+i],
+                                      sampleset, sample_names, hdr, bcf,
                                       residualsFile != nullptr, residual_rec,
-                                      &abort);
+                                      &abort, &workspaces[tid]);
             if (ls.bad()) {
                 return ls;
             }
 
+            results_bytes[i] = sizeof(bcf1_t) + bcf->shared.m + bcf->indiv.m
+                               + (residual_rec ? residual_rec->capacity() : 0);
+            governor.charge(MemoryGovernor::Component::GENOTYPING, results_bytes[i]);
             results[i] = make_tuple(move(bcf), residual_rec);
             return ls;
         });
         statuses.push_back(move(fut));
     }
-    assert(statuses.size() == sites.size());
+    assert(statuses.size() == n);
 
     // Retrieve the resulting BCF records, and write them to the output file,
     // in the given order. Record the first error that occurs, if any, but
     // always wait for all tasks to finish.
     s = Status::OK();
-    for (size_t i = 0; i < sites.size(); i++) {
+    for (size_t i = 0; i < n; i++) {
         // wait for task i to complete and find out its status
-        Status s_i(statuses[i].get());
+        Status s_i(body_->scheduler_->get(statuses[i]));
         // always retrieve the result BCF record, if any, to ensure we'll free
         // the memory it takes ASAP
         shared_ptr<bcf1_t> bcf_i = move(std::get<0>(results[i]));
@@ -388,7 +554,7 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
         if (s.ok() && s_i.ok()) {
             // if everything's OK, proceed to write the record
             assert(bcf_i);
-            s = bcf_out->write(bcf_i.get());
+            s = bcf_out.write(bcf_i.get());
             if (s.bad()) {
                 abort = true;
             }
@@ -404,17 +570,556 @@ Status Service::genotype_sites(const genotyper_config& cfg, const string& sample
             s = move(s_i);
             abort = true;
         }
+        bcf_i.reset();
+        residual_rec.reset();
+        governor.release(MemoryGovernor::Component::GENOTYPING, results_bytes[i]);
         results_retrieved++;
     }
+    return s;
+}
+
+// Checkpointing: the output is produced in segments of up to
+// checkpoint_chunk consecutive sites, each a complete BCF/VCF file in the
+// checkpoint directory. Once a segment is closed, a line recording it (site
+// range, header length & file size) is appended to the manifest, which thus
+// serves as the cursor for a subsequent run to resume from. The manifest's
+// first line identifies the run (a fingerprint of its inputs: see
+// checkpoint_fingerprint), so that progress isn't resumed into a different
+// one.
+// Finally the segments are concatenated into the output, dropping all but
+// the first header (and for BCF, all but the last BGZF EOF marker); no
+// records are re-encoded.
+
+static const char* CHECKPOINT_MANIFEST = "GLnexus.checkpoint";
+// the empty BGZF block htslib writes at the end of a compressed file
+static const string BGZF_EOF("\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0", 28);
+
+struct checkpoint_segment {
+    size_t lo = 0, hi = 0;
+    uint64_t header_bytes = 0, bytes = 0;
+};
+
+static uint64_t fnv1a(uint64_t h, const void* p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= ((const uint8_t*)p)[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t fnv1a(uint64_t h, const string& str) {
+    uint64_t len = str.size();
+    h = fnv1a(h, &len, sizeof(len));
+    return fnv1a(h, str.data(), str.size());
+}
+
+static uint64_t fnv1a(uint64_t h, const range& pos) {
+    int32_t v[3] = { pos.rid, pos.beg, pos.end };
+    return fnv1a(h, v, sizeof(v));
+}
+
+// Fold everything the genotyper reads of a site into the hash
+static uint64_t fnv1a(uint64_t h, const unified_site& site) {
+    h = fnv1a(h, site.pos);
+    h = fnv1a(h, site.in_target);
+    h = fnv1a(h, &site.lost_allele_frequency, sizeof(site.lost_allele_frequency));
+    h = fnv1a(h, &site.qual, sizeof(site.qual));
+    uint8_t mono = site.monoallelic;
+    h = fnv1a(h, &mono, sizeof(mono));
+    uint64_t n = site.alleles.size();
+    h = fnv1a(h, &n, sizeof(n));
+    for (const auto& ua : site.alleles) {
+        h = fnv1a(h, ua.dna);
+        h = fnv1a(h, ua.normalized.pos);
+        h = fnv1a(h, ua.normalized.dna);
+        h = fnv1a(h, &ua.quality, sizeof(ua.quality));
+        h = fnv1a(h, &ua.frequency, sizeof(ua.frequency));
+    }
+    n = site.unification.size();
+    h = fnv1a(h, &n, sizeof(n));
+    for (const auto& p : site.unification) {
+        h = fnv1a(h, p.first.pos);
+        h = fnv1a(h, p.first.dna);
+        h = fnv1a(h, &p.second, sizeof(p.second));
+    }
+    return h;
+}
+
+// sites[i] as a unified_site (materialized into tmp if need be)
+static const unified_site& site_at(const vector<unified_site>& sites, size_t i, unified_site& tmp) {
+    return sites[i];
+}
+static const unified_site& site_at(const unified_site_table& sites, size_t i, unified_site& tmp) {
+    tmp = sites[i].get();
+    return tmp;
+}
+
+// Identify the run by the output header, the genotyper configuration, the
+// metadata version (which changes when data sets are removed or replaced)
+// and all the sites' contents, so that progress is only resumed for the same
+// inputs
+template<class sites_t>
+static Status checkpoint_fingerprint(const bcf_hdr_t* hdr, const genotyper_config& cfg,
+                                     uint64_t metadata_version, const sites_t& sites, string& ans) {
+    Status s;
+    int hlen = 0;
+    char* htxt = bcf_hdr_fmt_text(hdr, 0, &hlen);
+    if (!htxt) {
+        return Status::Failure("bcf_hdr_fmt_text");
+    }
+    uint64_t h = fnv1a(14695981039346656037ULL, htxt, hlen);
+    free(htxt);
+    YAML::Emitter cfg_yaml;
+    S(cfg.yaml(cfg_yaml));
+    h = fnv1a(h, string(cfg_yaml.c_str()));
+    // (exactly, whatever precision the YAML has)
+    h = fnv1a(h, &cfg.min_assumed_allele_frequency, sizeof(cfg.min_assumed_allele_frequency));
+    h = fnv1a(h, &metadata_version, sizeof(metadata_version));
+    unified_site tmp(range(-1,-1,-1));
+    for (size_t i = 0; i < sites.size(); i++) {
+        h = fnv1a(h, site_at(sites, i, tmp));
+    }
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) h);
+    ans = buf;
+    return Status::OK();
+}
+
+static uint64_t file_size(const string& filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return UINT64_MAX;
+    }
+    return st.st_size;
+}
+
+static string segment_filename(const string& dir, size_t index, const genotyper_config& cfg) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "/segment.%06zu", index);
+    return dir + buf + (cfg.output_format == GLnexusOutputFormat::VCF ? ".vcf" : ".bcf");
+}
+
+// Load the segments completed in a previous run from the manifest, or
+// start a new one. Segments whose file is missing or has the wrong size are
+// left out (to be redone).
+static Status checkpoint_load(const string& dir, const string& run, const genotyper_config& cfg,
+                              size_t chunk, map<size_t,checkpoint_segment>& ans) {
+    ans.clear();
+    const string manifest = dir + "/" + CHECKPOINT_MANIFEST;
+    ifstream in(manifest);
+    if (!in.good()) {
+        ofstream out(manifest);
+        out << run << endl;
+        out.close();
+        return out.good() ? Status::OK() : Status::IOError("writing checkpoint manifest", manifest);
+    }
+
+    string line;
+    if (!getline(in, line) || line != run) {
+        return Status::Invalid("checkpoint directory holds the progress of a different run", dir);
+    }
+    while (getline(in, line)) {
+        istringstream ls(line);
+        size_t index;
+        checkpoint_segment seg;
+        if (!(ls >> index >> seg.lo >> seg.hi >> seg.header_bytes >> seg.bytes) ||
+            seg.lo != index*chunk || seg.hi <= seg.lo) {
+            // (a line cut short by a crash)
+            continue;
+        }
+        if (file_size(segment_filename(dir, index, cfg)) == seg.bytes) {
+            ans[index] = seg;
+        }
+    }
+    return Status::OK();
+}
+
+// Append a completed segment to the manifest, durably
+static Status checkpoint_record(const string& dir, size_t index, const checkpoint_segment& seg) {
+    const string manifest = dir + "/" + CHECKPOINT_MANIFEST;
+    FILE* fp = fopen(manifest.c_str(), "a");
+    if (!fp) {
+        return Status::IOError("opening checkpoint manifest", manifest);
+    }
+    bool ok = fprintf(fp, "%zu %zu %zu %llu %llu\n", index, seg.lo, seg.hi,
+                      (unsigned long long) seg.header_bytes, (unsigned long long) seg.bytes) > 0;
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+    return ok ? Status::OK() : Status::IOError("writing checkpoint manifest", manifest);
+}
+
+// Concatenate the segments into the output file ("-" for standard output)
+static Status checkpoint_concatenate(const string& dir, const genotyper_config& cfg,
+                                     const map<size_t,checkpoint_segment>& segments,
+                                     const string& filename) {
+    const bool bgzf = cfg.output_format == GLnexusOutputFormat::BCF;
+    FILE* out = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
+    if (!out) {
+        return Status::IOError("failed to open output file for writing", filename);
+    }
+    Status s;
+    vector<char> buf(1 << 20);
+    for (auto p = segments.begin(); s.ok() && p != segments.end(); p++) {
+        const string segfile = segment_filename(dir, p->first, cfg);
+        const bool first = p == segments.begin(), last = next(p) == segments.end();
+        uint64_t beg = first ? 0 : p->second.header_bytes;
+        uint64_t end = p->second.bytes;
+        FILE* in = fopen(segfile.c_str(), "rb");
+        if (!in) {
+            s = Status::IOError("failed to open checkpoint segment", segfile);
+            break;
+        }
+        if (bgzf && !last) {
+            // drop the EOF marker, after making sure that's what it is
+            string tail(BGZF_EOF.size(), 0);
+            if (end < beg + BGZF_EOF.size() || fseeko(in, end - BGZF_EOF.size(), SEEK_SET) != 0 ||
+                fread(&tail[0], 1, tail.size(), in) != tail.size() || tail != BGZF_EOF) {
+                fclose(in);
+                s = Status::IOError("checkpoint segment lacks BGZF EOF marker", segfile);
+                break;
+            }
+            end -= BGZF_EOF.size();
+        }
+        if (fseeko(in, beg, SEEK_SET) != 0) {
+            s = Status::IOError("reading checkpoint segment", segfile);
+        }
+        while (s.ok() && beg < end) {
+            size_t n = fread(buf.data(), 1, min(uint64_t(buf.size()), end - beg), in);
+            if (n == 0) {
+                s = Status::IOError("reading checkpoint segment", segfile);
+            } else if (fwrite(buf.data(), 1, n, out) != n) {
+                s = Status::IOError("writing output file", filename);
+            }
+            beg += n;
+        }
+        fclose(in);
+    }
+    if (fflush(out) != 0 && s.ok()) {
+        s = Status::IOError("writing output file", filename);
+    }
+    if (out != stdout && fclose(out) != 0 && s.ok()) {
+        s = Status::IOError("closing output file", filename);
+    }
+    return s;
+}
+
+template<class sites_t>
+Status Service::genotype_sites_checkpointed(const genotyper_config& cfg, const string& sampleset,
+                                            const vector<string>& sample_names,
+                                            const sites_t& sites, const bcf_hdr_t* hdr,
+                                            const string& filename,
+                                            atomic<bool>* ext_abort) {
+    Status s;
+    const string& dir = body_->cfg_.checkpoint_dir;
+    const size_t chunk = max(size_t(1), body_->cfg_.checkpoint_chunk);
+
+    string fingerprint;
+    S(checkpoint_fingerprint(hdr, cfg, body_->metadata_->metadata_version(), sites, fingerprint));
+    ostringstream run;
+    run << "GLnexus genotype_sites checkpoint " << fingerprint << " " << sites.size() << " " << chunk
+        << " " << (cfg.output_format == GLnexusOutputFormat::VCF ? "VCF" : "BCF");
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        return Status::IOError("creating checkpoint directory", dir);
+    }
+    map<size_t,checkpoint_segment> segments;
+    S(checkpoint_load(dir, run.str(), cfg, chunk, segments));
+
+    // an empty site list still yields one (header-only) segment
+    const size_t n_segments = max(size_t(1), (sites.size() + chunk - 1) / chunk);
+    for (size_t index = 0; index < n_segments; index++) {
+        if (segments.find(index) != segments.end()) {
+            continue;
+        }
+        if (ext_abort && *ext_abort) {
+            return Status::Aborted();
+        }
+        checkpoint_segment seg;
+        seg.lo = index*chunk;
+        seg.hi = min(sites.size(), seg.lo + chunk);
+
+        // write the segment to a temporary file, renamed once complete
+        const string segfile = segment_filename(dir, index, cfg);
+        const string tmpfile = segfile + ".tmp";
+        unique_ptr<BCFFileSink> bcf_out;
+        S(BCFFileSink::Open(cfg, tmpfile, const_cast<bcf_hdr_t*>(hdr), bcf_out));
+        S(bcf_out->end_header(seg.header_bytes));
+        if (body_->cfg_.dataset_major_window) {
+            S(genotype_sites_dataset_major(cfg, sampleset, sample_names, sites, seg.lo, seg.hi,
+                                           hdr, *bcf_out, nullptr, ext_abort));
+        } else {
+            S(genotype_sites_site_major(cfg, sampleset, sample_names, sites, seg.lo, seg.hi,
+                                        hdr, *bcf_out, nullptr, ext_abort));
+        }
+        S(bcf_out->close());
+        if (rename(tmpfile.c_str(), segfile.c_str()) != 0) {
+            return Status::IOError("renaming checkpoint segment", tmpfile);
+        }
+        seg.bytes = file_size(segfile);
+        S(checkpoint_record(dir, index, seg));
+        segments[index] = seg;
+    }
+
+    S(checkpoint_concatenate(dir, cfg, segments, filename));
+
+    // the run is complete; clean up
+    for (const auto& p : segments) {
+        remove(segment_filename(dir, p.first, cfg).c_str());
+    }
+    remove((dir + "/" + CHECKPOINT_MANIFEST).c_str());
+    return Status::OK();
+}
+
+Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
+                               const vector<unified_site>& sites,
+                               const string& filename,
+                               atomic<bool>* ext_abort) {
+    return genotype_sites_impl(cfg, sampleset, sites, filename, ext_abort);
+}
+
+Status Service::genotype_sites(const genotyper_config& cfg, const string& sampleset,
+                               const unified_site_table& sites,
+                               const string& filename,
+                               atomic<bool>* ext_abort) {
+    return genotype_sites_impl(cfg, sampleset, sites, filename, ext_abort);
+}
+
+// Dataset-major alternative to the site-by-site processing in genotype_sites:
+// for each window of consecutive sites in sites[begin,end), spread the datasets across the worker
+// threads to genotype all the window's sites at once, then assemble the
+// sites' records (also in parallel) and write them out in order.
+template<class sites_t>
+Status Service::genotype_sites_dataset_major(const genotyper_config& cfg, const string& sampleset,
+                                             const vector<string>& sample_names,
+                                             const sites_t& sites, size_t begin, size_t end,
+                                             const bcf_hdr_t* hdr, BCFFileSink& bcf_out,
+                                             ResidualsFile* residualsFile,
+                                             atomic<bool>* ext_abort) {
+    Status s;
+    atomic<bool> abort(false);
+    // one genotyping workspace per worker thread, indexed by tid
+    vector<GenotypingWorkspace> workspaces(body_->scheduler_->size());
+    auto& governor = MemoryGovernor::global();
+
+    assert(begin <= end && end <= sites.size());
+    size_t lo = begin;
+    while (lo < end) {
+        if (ext_abort && *ext_abort) {
+            return Status::Aborted();
+        }
+        size_t hi = lo+1;
+        while (hi < end && hi-lo < body_->cfg_.dataset_major_window &&
+               site_pos(sites, hi).rid == site_pos(sites, lo).rid) {
+            hi++;
+        }
+
+        unique_ptr<GenotypingWindow> window;
+        S(GenotypingWindow::Open(cfg, *(body_->metadata_), sites, lo, hi,
+                                 sampleset, sample_names, residualsFile != nullptr, window));
+        GenotypingCharge window_charge;
+        S(window_charge.acquire(window->memory_size(), ext_abort, body_->threads_stalled_ms_));
+
+        // Enqueue the datasets in chunks, several per worker thread so that
+        // the load stays balanced. The whole window is routed to one NUMA
+        // node, like the neighbouring sites in genotype_sites.
+        const int node = numa_node_for(*(body_->scheduler_), site_pos(sites, lo));
+        const size_t n_datasets = window->dataset_count();
+        const size_t chunk = max(size_t(1), n_datasets / (4*body_->cfg_.threads));
+        vector<future<Status>> statuses;
+        for (size_t d = 0; d < n_datasets; d += chunk) {
+            auto fut = body_->scheduler_->push(TaskLane::GENOTYPING, node, [&, d](int tid){
+                if (abort || (ext_abort && *ext_abort)) {
+                    abort = true;
+                    return Status::Aborted();
+                }
+                Status ls = window->genotype_datasets(body_->data_, d, min(d+chunk, n_datasets),
+                                                      workspaces[tid], &abort);
+                if (ls.bad()) {
+                    abort = true;
+                }
+                return ls;
+            });
+            statuses.push_back(move(fut));
+        }
+        // wait for all the tasks, recording the first error
+        s = Status::OK();
+        for (auto& fut : statuses) {
+            Status s_i(body_->scheduler_->get(fut));
+            if (s.ok() && s_i.bad()) {
+                s = move(s_i);
+            }
+        }
+        if (s.bad()) {
+            return s;
+        }
+
+        // Assemble the sites' records
+        statuses.clear();
+        vector<tuple<shared_ptr<bcf1_t>,shared_ptr<string>>> results(hi-lo);
+        // bytes charged to the memory governor for each record in flight
+        vector<size_t> results_bytes(hi-lo, 0);
+        for (size_t i = lo; i < hi; i++) {
+            auto fut = body_->scheduler_->push(TaskLane::GENOTYPING, node, [&, i](int tid){
+                if (abort || (ext_abort && *ext_abort)) {
+                    abort = true;
+                    return Status::Aborted();
+                }
+                shared_ptr<string> residual_rec = nullptr;
+                shared_ptr<bcf1_t> bcf;
+                Status ls = window->finish_site(i, hdr, workspaces[tid], bcf, residual_rec);
+                if (ls.bad()) {
+                    return ls;
+                }
+                results_bytes[i-lo] = sizeof(bcf1_t) + bcf->shared.m + bcf->indiv.m
+                                      + (residual_rec ? residual_rec->capacity() : 0);
+                governor.charge(MemoryGovernor::Component::GENOTYPING, results_bytes[i-lo]);
+                results[i-lo] = make_tuple(move(bcf), residual_rec);
+                return ls;
+            });
+            statuses.push_back(move(fut));
+        }
+
+        // Write them out in order, as in genotype_sites
+        for (size_t i = lo; i < hi; i++) {
+            Status s_i(body_->scheduler_->get(statuses[i-lo]));
+            shared_ptr<bcf1_t> bcf_i = move(std::get<0>(results[i-lo]));
+            shared_ptr<string> residual_rec = move(std::get<1>(results[i-lo]));
+
+            if (s.ok() && s_i.ok()) {
+                assert(bcf_i);
+                s = bcf_out.write(bcf_i.get());
+                if (s.bad()) {
+                    abort = true;
+                } else if (residual_rec != nullptr) {
+                    s = residualsFile->write_record(*residual_rec);
+                    if (s.bad()) {
+                        abort = true;
+                    }
+                }
+            } else if (s.ok() && s_i.bad()) {
+                s = move(s_i);
+                abort = true;
+            }
+            bcf_i.reset();
+            residual_rec.reset();
+            governor.release(MemoryGovernor::Component::GENOTYPING, results_bytes[i-lo]);
+        }
+        if (s.bad()) {
+            return s;
+        }
+
+        lo = hi;
+    }
+
+    return Status::OK();
+}
+
+Status Service::genotype_variant(const genotyper_config& cfg, const string& sampleset,
+                                 const range& pos, const string& ref, const vector<string>& alts,
+                                 shared_ptr<const bcf_hdr_t>& hdr, shared_ptr<bcf1_t>& ans,
+                                 atomic<bool>* ext_abort) {
+    Status s;
+    const auto& contigs = body_->metadata_->contigs();
+    if (pos.rid < 0 || pos.rid >= (int)contigs.size() || pos.beg < 0 || pos.end <= pos.beg ||
+        (contigs[pos.rid].second && pos.end > (int)contigs[pos.rid].second)) {
+        return Status::Invalid("genotype_variant: invalid position", pos.str());
+    }
+    if (ref.size() != (size_t)pos.size() || !is_iupac_nucleotides(ref)) {
+        return Status::Invalid("genotype_variant: REF allele doesn't match position", pos.str() + " " + ref);
+    }
+    if (alts.empty()) {
+        return Status::Invalid("genotype_variant: no ALT alleles", pos.str());
+    }
+
+    // build the site directly, as the unifier would for these alleles
+    unified_site us(pos);
+    us.alleles.push_back(unified_allele(pos, ref));
+    for (const auto& alt : alts) {
+        if (!is_iupac_nucleotides(alt)) {
+            return Status::Invalid("genotype_variant: invalid ALT allele", alt);
+        }
+        for (const auto& ua : us.alleles) {
+            if (ua.dna == alt) {
+                return Status::Invalid("genotype_variant: duplicate allele", alt);
+            }
+        }
+        us.alleles.push_back(unified_allele(pos, alt));
+    }
+    us.fill_implicit_unification();
+
+    // look up or prepare the header for this sample set
+    string hdr_key = sampleset;
+    for (const auto& field : cfg.liftover_fields) {
+        hdr_key += "\n" + field.description;
+    }
+    shared_ptr<const vector<string>> sample_names;
+    {
+        lock_guard<mutex> lock(body_->variant_headers_mutex_);
+        auto p = body_->variant_headers_.find(hdr_key);
+        if (p != body_->variant_headers_.end()) {
+            sample_names = p->second.first;
+            hdr = p->second.second;
+        }
+    }
+    if (!sample_names) {
+        shared_ptr<const set<string>> samples;
+        S(body_->metadata_->sampleset_samples(sampleset, samples));
+        auto names = make_shared<vector<string>>(samples->begin(), samples->end());
+        shared_ptr<bcf_hdr_t> new_hdr;
+        S(prepare_bcf_header(contigs, *names, cfg.liftover_fields,
+                             body_->cfg_.extra_header_lines, new_hdr));
+        sample_names = names;
+        hdr = new_hdr;
+        lock_guard<mutex> lock(body_->variant_headers_mutex_);
+        body_->variant_headers_[hdr_key] = make_pair(sample_names, hdr);
+    }
+
+    // A one-site GenotypingWindow: each dataset's records overlapping the
+    // site are fetched with a direct dataset_range lookup (rather than the
+    // sample set iterators used by genotype_site, which are geared to
+    // scanning), with the datasets spread across the worker threads.
+    vector<unified_site> sites = { us };
+    unique_ptr<GenotypingWindow> window;
+    S(GenotypingWindow::Open(cfg, *(body_->metadata_), sites, 0, 1,
+                             sampleset, *sample_names, false, window));
+    GenotypingCharge window_charge;
+    S(window_charge.acquire(window->memory_size(), ext_abort, body_->threads_stalled_ms_));
+
+    atomic<bool> abort(false);
+    vector<GenotypingWorkspace> workspaces(body_->scheduler_->size());
+    const size_t n_datasets = window->dataset_count();
+    const size_t chunk = max(size_t(1), n_datasets / (4*body_->cfg_.threads));
+    vector<future<Status>> statuses;
+    for (size_t d = 0; d < n_datasets; d += chunk) {
+        auto fut = body_->scheduler_->push(TaskLane::GENOTYPING, numa_node_for(*(body_->scheduler_), pos),
+                                           [&, d](int tid){
+            if (abort || (ext_abort && *ext_abort)) {
+                abort = true;
+                return Status::Aborted();
+            }
+            Status ls = window->genotype_datasets(body_->data_, d, min(d+chunk, n_datasets),
+                                                  workspaces[tid], &abort);
+            if (ls.bad()) {
+                abort = true;
+            }
+            return ls;
+        });
+        statuses.push_back(move(fut));
+    }
+    // wait for all the tasks, recording the first error
+    for (auto& fut : statuses) {
+        Status s_i(body_->scheduler_->get(fut));
+        if (s.ok() && s_i.bad()) {
+            s = move(s_i);
+        }
+    }
     if (s.bad()) {
         return s;
     }
 
-    // TODO: for very large sample sets, bucket cache-friendliness might be
-    // improved by genotyping in grid squares of N>1 sites and M>1 samples
-
-    // close the output file
-    return bcf_out->close();
+    GenotypingWorkspace workspace;
+    shared_ptr<string> residual_rec;
+    return window->finish_site(0, hdr.get(), workspace, ans, residual_rec);
 }
 
 uint64_t Service::threads_stalled_ms() const { return body_->threads_stalled_ms_; }
@@ -935,4 +935,12 @@ bool is_gvcf_ref_record(const bcf1_t* record) {
     return record->n_allele == 1 || (record->n_allele == 2 && is_symbolic_allele(record->d.allele[1]));
 }
 
+Status bcf_predicate_variant_records(const bcf_hdr_t* hdr, bcf1_t* bcf, bool &retval) {
+    if (bcf_unpack(bcf, BCF_UN_STR)) {
+        return Status::IOError("bcf_unpack");
+    }
+    retval = !is_gvcf_ref_record(bcf);
+    return Status::OK();
+}
+
 } // namespace GLnexus
@@ -0,0 +1,204 @@
+#include "unified_site_table.h"
+#include <algorithm>
+
+using namespace std;
+
+namespace GLnexus {
+
+unified_site_table::dna_ref unified_site_table::store(const string& dna) {
+    dna_ref ans;
+    ans.offset = arena_.size();
+    ans.length = dna.size();
+    arena_.append(dna);
+    return ans;
+}
+
+void unified_site_table::clear() {
+    sites_.clear();
+    alleles_.clear();
+    unification_.clear();
+    arena_.clear();
+}
+
+void unified_site_table::shrink_to_fit() {
+    sites_.shrink_to_fit();
+    alleles_.shrink_to_fit();
+    unification_.shrink_to_fit();
+    arena_.shrink_to_fit();
+}
+
+void unified_site_table::push_back(const unified_site& site) {
+    site_rec rec;
+    rec.pos = site.pos;
+    rec.in_target = site.in_target;
+    rec.lost_allele_frequency = site.lost_allele_frequency;
+    rec.qual = site.qual;
+    rec.monoallelic = site.monoallelic;
+    rec.alleles_begin = alleles_.size();
+    rec.allele_count = site.alleles.size();
+    rec.unification_begin = unification_.size();
+
+    for (const auto& ua : site.alleles) {
+        allele_rec arec;
+        arec.dna = store(ua.dna);
+        arec.normalized_pos = ua.normalized.pos;
+        // the normalized allele usually has the same DNA (e.g. SNVs)
+        arec.normalized_dna = ua.normalized.dna == ua.dna ? arec.dna : store(ua.normalized.dna);
+        arec.quality = ua.quality;
+        arec.frequency = ua.frequency;
+        alleles_.push_back(arec);
+    }
+    sites_.push_back(rec);
+
+    // keep only the unification entries that the view can't derive from the
+    // alleles; the map iterates in allele order, so they're stored sorted.
+    unified_site_view view(*this, sites_.size()-1);
+    for (const auto& p : site.unification) {
+        if (view.unify(p.first) != p.second) {
+            unification_rec urec;
+            urec.pos = p.first.pos;
+            urec.dna = store(p.first.dna);
+            urec.index = p.second;
+            unification_.push_back(urec);
+            sites_.back().unification_count++;
+        }
+    }
+}
+
+size_t unified_site_table::memory_usage() const {
+    return sizeof(*this) + sites_.capacity()*sizeof(site_rec) + alleles_.capacity()*sizeof(allele_rec)
+           + unification_.capacity()*sizeof(unification_rec) + arena_.capacity();
+}
+
+void unified_site_table_of_vector(vector<unified_site>& sites, unified_site_table& ans) {
+    ans.clear();
+    for (auto& site : sites) {
+        ans.push_back(site);
+        // release each site as we go, so the two representations don't have
+        // to coexist in full
+        site = unified_site(site.pos);
+    }
+    sites.clear();
+    sites.shrink_to_fit();
+    ans.shrink_to_fit();
+}
+
+const range& unified_site_view::pos() const {
+    return table_->sites_[i_].pos;
+}
+
+const range& unified_site_view::in_target() const {
+    return table_->sites_[i_].in_target;
+}
+
+float unified_site_view::lost_allele_frequency() const {
+    return table_->sites_[i_].lost_allele_frequency;
+}
+
+int unified_site_view::qual() const {
+    return table_->sites_[i_].qual;
+}
+
+bool unified_site_view::monoallelic() const {
+    return table_->sites_[i_].monoallelic;
+}
+
+size_t unified_site_view::allele_count() const {
+    return table_->sites_[i_].allele_count;
+}
+
+string unified_site_view::allele_dna(size_t k) const {
+    assert(k < allele_count());
+    return table_->str(table_->alleles_[table_->sites_[i_].alleles_begin + k].dna);
+}
+
+allele unified_site_view::allele_normalized(size_t k) const {
+    assert(k < allele_count());
+    const auto& arec = table_->alleles_[table_->sites_[i_].alleles_begin + k];
+    return allele(arec.normalized_pos, table_->str(arec.normalized_dna));
+}
+
+int unified_site_view::allele_quality(size_t k) const {
+    assert(k < allele_count());
+    return table_->alleles_[table_->sites_[i_].alleles_begin + k].quality;
+}
+
+float unified_site_view::allele_frequency(size_t k) const {
+    assert(k < allele_count());
+    return table_->alleles_[table_->sites_[i_].alleles_begin + k].frequency;
+}
+
+int unified_site_view::unify(const allele& al) const {
+    const auto& t = *table_;
+    const auto& rec = t.sites_[i_];
+
+    // explicit entries (binary search)
+    auto ubeg = t.unification_.begin() + rec.unification_begin;
+    auto uend = ubeg + rec.unification_count;
+    auto it = lower_bound(ubeg, uend, al,
+                          [&t](const unified_site_table::unification_rec& u, const allele& al) {
+        if (u.pos != al.pos) {
+            return u.pos < al.pos;
+        }
+        return t.arena_.compare(u.dna.offset, u.dna.length, al.dna) < 0;
+    });
+    if (it != uend && it->pos == al.pos && t.eq(it->dna, al.dna)) {
+        return it->index;
+    }
+
+    // implicit entries: as in unified_site::fill_implicit_unification, a
+    // later allele takes precedence over an earlier one
+    for (int k = int(rec.allele_count)-1; k >= 0; k--) {
+        const auto& arec = t.alleles_[rec.alleles_begin + k];
+        if ((al.pos == rec.pos && t.eq(arec.dna, al.dna)) ||
+            (al.pos == arec.normalized_pos && t.eq(arec.normalized_dna, al.dna))) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+range unified_site_view::unification_range() const {
+    const auto& t = *table_;
+    const auto& rec = t.sites_[i_];
+    range ans(rec.pos);
+    auto widen = [&ans](const range& r) {
+        assert(r.rid == ans.rid);
+        ans.beg = min(ans.beg, r.beg);
+        ans.end = max(ans.end, r.end);
+    };
+    for (size_t k = 0; k < rec.allele_count; k++) {
+        widen(t.alleles_[rec.alleles_begin + k].normalized_pos);
+    }
+    for (size_t j = 0; j < rec.unification_count; j++) {
+        widen(t.unification_[rec.unification_begin + j].pos);
+    }
+    return ans;
+}
+
+unified_site unified_site_view::get() const {
+    const auto& t = *table_;
+    const auto& rec = t.sites_[i_];
+    unified_site ans(rec.pos);
+    ans.in_target = rec.in_target;
+    ans.lost_allele_frequency = rec.lost_allele_frequency;
+    ans.qual = rec.qual;
+    ans.monoallelic = rec.monoallelic;
+    ans.alleles.reserve(rec.allele_count);
+    for (size_t k = 0; k < rec.allele_count; k++) {
+        const auto& arec = t.alleles_[rec.alleles_begin + k];
+        unified_allele ua(rec.pos, t.str(arec.dna));
+        ua.normalized = allele(arec.normalized_pos, t.str(arec.normalized_dna));
+        ua.quality = arec.quality;
+        ua.frequency = arec.frequency;
+        ans.alleles.push_back(move(ua));
+    }
+    ans.fill_implicit_unification();
+    for (size_t j = 0; j < rec.unification_count; j++) {
+        const auto& urec = t.unification_[rec.unification_begin + j];
+        ans.unification[allele(urec.pos, t.str(urec.dna))] = urec.index;
+    }
+    return ans;
+}
+
+} // namespace GLnexus
@@ -2,53 +2,18 @@
 #include <assert.h>
 #include <math.h>
 #include "unifier.h"
+#include "scheduler.h"
 #include <iostream>
+#include <deque>
+#include <limits>
+#include <functional>
+#include "unifier_utils.h"
 
 using namespace std;
 
 namespace GLnexus {
 
-using discovered_allele = pair<allele,discovered_allele_info>;
-
-// ALT alleles discovered across numerous samples may represent the same edit
-// to the reference genome in different ways, specifically if they have
-// different amounts of reference padding on either end. (Individual gVCF ALT
-// alleles may be reference-padded to unify their representation with other
-// ALT alleles observed in the same sample.) So we introduce a notion of
-// "minimized" ALT allele, which strips any reference padding so that
-// equivalent ALT alleles can be combined, while still remembering the
-// original representations.
-struct minimized_allele_info {
-    set<allele> originals;
-    bool all_filtered = false;
-    top_AQ topAQ;
-    unsigned copy_number = 0;
-    range in_target = range(-1,-1,-1);
-
-    string str() const {
-        ostringstream os;
-        os << "Minimized from originals: " << endl;
-        for (auto& al : originals) {
-            os << "  " << al.str() << endl;
-        }
-        os << "Max AQ: " << topAQ.V[0] << endl;
-        os << "Copy number: " << copy_number << endl;
-        return os.str();
-    }
-
-    void operator+=(const minimized_allele_info& rhs) {
-        originals.insert(rhs.originals.begin(), rhs.originals.end());
-        all_filtered = all_filtered && rhs.all_filtered;
-        topAQ += rhs.topAQ;
-        copy_number += rhs.copy_number;
-        if (!in_target.overlaps(rhs.in_target) ||
-            in_target.size() < rhs.in_target.size()) {
-            in_target = rhs.in_target;
-        }
-    }
-};
-using minimized_alleles = map<allele,minimized_allele_info>;
-using minimized_allele = pair<allele,minimized_allele_info>;
+overlap_lookups overlap_lookups_for_testing;
 
 // orders on minimized alleles corresponding to the UnifierPreferences
 
@@ -113,23 +78,26 @@ Status minimize_allele(const allele& ref, allele& alt) {
     return Status::OK();
 }
 
-// Separate discovered alleles into the REF alleles and minimized ALT alleles
-Status minimize_alleles(const unifier_config& cfg, const discovered_alleles& src,
+// Separate discovered alleles into the REF alleles and minimized ALT alleles.
+// The input src is cleared by side-effect.
+Status minimize_alleles(const unifier_config& cfg, discovered_alleles& src,
                         map<range,discovered_allele>& refs, minimized_alleles& alts) {
     Status s;
 
     // separate the ref and alt alleles
     discovered_alleles dalts;
     refs.clear();
-    for (const auto& dal : src) {
-        if (dal.second.is_ref) {
-            const auto p = refs.find(dal.first.pos);
-            if (p != refs.end() && dal.first.dna != p->second.first.dna) {
-                return Status::Invalid("detected inconsistent REF alleles", dal.first.pos.str());
+    for (auto pal = src.begin(); pal != src.end(); src.erase(pal++)) {
+        if (pal->second.is_ref) {
+            const auto p = refs.find(pal->first.pos);
+            if (p != refs.end() && pal->first.dna != p->second.first.dna) {
+                return Status::Invalid("detected inconsistent REF alleles", pal->first.pos.str());
+            }
+            if (p == refs.end()) {
+                refs.insert(p, make_pair(pal->first.pos, discovered_allele(pal->first, move(pal->second))));
             }
-            refs.insert(make_pair(dal.first.pos,dal));
         } else {
-            dalts.insert(dal);
+            dalts.insert(dalts.end(), make_pair(pal->first, move(pal->second)));
         }
     }
 
@@ -158,7 +126,7 @@ Status minimize_alleles(const unifier_config& cfg, const discovered_alleles& src
         info.in_target = dal.second.in_target;
         auto ap = alts.find(min_alt);
         if (ap == alts.end()) {
-            alts[min_alt] = info;
+            alts.insert(ap, make_pair(move(min_alt), move(info)));
         } else {
             ap->second += info;
         }
@@ -196,39 +164,22 @@ Status find_target_range(const std::set<range>& ranges, const range& pos, range&
 // alleles in an active region are transitively connected through overlap
 // or adjacency. (However, individual pairs of alleles within an active
 // region might be separated.)
-// The input is cleared by side-effect to save memory.
-template<class discovered_or_minimized_alleles>
-auto partition(discovered_or_minimized_alleles& alleles) {
-    map<range,discovered_or_minimized_alleles> ans;
-
-    range rng(-1,-1,-1);
-    discovered_or_minimized_alleles als;
-
+// Move the first active region from alleles (nonempty) into region, which
+// is appended to, and return its range.
+range pop_active_region(discovered_alleles& alleles, discovered_alleles& region) {
+    assert(!alleles.empty());
+    range rng = alleles.begin()->first.pos;
     for (auto pit = alleles.begin(); pit != alleles.end(); alleles.erase(pit++)) {
-        const auto& it = *pit;
-        assert(rng <= it.first.pos);
-        if (rng.rid != it.first.pos.rid || rng.end < it.first.pos.beg) {
-            if (rng.rid != -1) {
-                assert(!als.empty());
-                ans[rng] = als;
-            }
-            rng = it.first.pos;
-            als.clear();
+        const range& pos = pit->first.pos;
+        assert(rng <= pos);
+        if (rng.rid != pos.rid || rng.end < pos.beg) {
+            break;
         }
-
-        assert(rng.end >= it.first.pos.beg);
-        assert(rng <= it.first.pos);
-        rng.end = max(rng.end, it.first.pos.end);
-        assert(it.first.pos.within(rng));
-        als.insert(it);
-    }
-
-    if (rng.rid != -1) {
-        assert(!als.empty());
-        ans[rng] = als;
+        rng.end = max(rng.end, pos.end);
+        assert(pos.within(rng));
+        region.insert(region.end(), make_pair(pit->first, move(pit->second)));
     }
-
-    return ans;
+    return rng;
 }
 
 bool check_filtered(const unifier_config& cfg, const minimized_allele& al) {
@@ -243,15 +194,45 @@ bool check_copy_number(const unifier_config& cfg, const minimized_allele& al) {
     return al.second.copy_number >= cfg.min_allele_copy_number;
 }
 
+// Find the site overlapping pos, if any, among non-overlapping sites; set
+// multiple if pos overlaps more than one of them (returning the first).
+// Because the sites don't overlap, ordering them by beginning also orders
+// them by end, so the sites overlapping pos are consecutive: at most one
+// beginning before pos does, followed by any beginning within pos. Thus a
+// lookup costs O(log n) rather than a scan of all the sites.
+map<range,minimized_alleles>::iterator find_overlapping_site(map<range,minimized_alleles>& sites,
+                                                             const range& pos, bool& multiple) {
+    multiple = false;
+    auto ans = sites.end();
+    auto it = sites.lower_bound(range(pos.rid, pos.beg, pos.beg));
+    if (it != sites.begin() && prev(it)->first.overlaps(pos)) {
+        ans = prev(it);
+    }
+    for (; it != sites.end() && it->first.rid == pos.rid && it->first.beg < pos.end; it++) {
+        if (it->first.overlaps(pos)) {
+            if (ans != sites.end()) {
+                multiple = true;
+                break;
+            }
+            ans = it;
+        }
+    }
+    return ans;
+}
+
 // Given an active region, decompose it into "sites" by heuristically pruning
-// rare or lengthy alleles to avoid excessive collapsing
-auto prune_alleles(const unifier_config& cfg, const minimized_alleles& alleles, minimized_alleles& pruned) {
+// rare or lengthy alleles to avoid excessive collapsing. The input alleles is
+// cleared by side-effect.
+map<range,minimized_alleles> prune_alleles(const unifier_config& cfg, minimized_alleles& alleles,
+                                           minimized_alleles& pruned) {
+    const size_t alleles_count = alleles.size();
     vector<minimized_allele> valleles;
     valleles.reserve(alleles.size());
     pruned.clear();
 
     // filter alleles with insufficient copy number or AQ
-    for (auto al : alleles) {
+    for (auto pal = alleles.begin(); pal != alleles.end(); alleles.erase(pal++)) {
+        minimized_allele al(pal->first, move(pal->second));
         // fix-up pass: ensure copy_number is >=1 for any allele with sufficient AQ.
         // this might not be the case up until this point, in the rare case when all
         // individuals carrying an allele have weak, homozygous-alt genotype calls
@@ -263,9 +244,9 @@ auto prune_alleles(const unifier_config& cfg, const minimized_alleles& alleles,
         }
 
         if (check_filtered(cfg, al) && check_AQ(cfg, al) && check_copy_number(cfg, al)) {
-            valleles.push_back(al);
+            valleles.push_back(move(al));
         } else {
-            pruned.insert(al);
+            pruned.insert(pruned.end(), move(al));
         }
     }
 
@@ -280,30 +261,22 @@ auto prune_alleles(const unifier_config& cfg, const minimized_alleles& alleles,
     // alleles that overlap multiple existing sites.
     unsigned kept_allele_count = 0;
     map<range,minimized_alleles> sites;
-    for (const minimized_allele& mal : valleles) {
+    for (minimized_allele& mal : valleles) {
         // find existing site(s) overlapping this allele
-        auto related_site = sites.end();
         bool multiple_sites = false;
-        for (auto site = sites.begin(); site != sites.end(); site++) {
-            if (mal.first.pos.overlaps(site->first)) {
-                if (related_site == sites.end()) {
-                    related_site = site;
-                } else {
-                    multiple_sites = true;
-                    break;
-                }
-            }
-        }
+        auto related_site = overlap_lookups_for_testing.site
+                                ? overlap_lookups_for_testing.site(sites, mal.first.pos, multiple_sites)
+                                : find_overlapping_site(sites, mal.first.pos, multiple_sites);
         if (multiple_sites) {
             // reject since this allele overlaps multiple existing sites
-            pruned.insert(mal);
+            pruned.insert(move(mal));
             continue;
         }
         if (related_site != sites.end()) {
             // enforce max_alleles_per_site; NB, we count the ref allele toward
             // this limit, while related_site.size() is the # of ALT alleles.
             if (cfg.max_alleles_per_site > 1 && related_site->second.size()+1 >= cfg.max_alleles_per_site) {
-                pruned.insert(mal);
+                pruned.insert(move(mal));
                 continue;
             }
             // merge this allele into the related site
@@ -311,16 +284,17 @@ auto prune_alleles(const unifier_config& cfg, const minimized_alleles& alleles,
                        min(mal.first.pos.beg, related_site->first.beg),
                        max(mal.first.pos.end, related_site->first.end));
             minimized_alleles mals(move(related_site->second));
-            mals.insert(mal);
+            mals.insert(move(mal));
             sites.erase(related_site);
             sites[urng] = move(mals);
         } else {
             // no related site: insert a new site
-            sites[mal.first.pos] = minimized_alleles({mal});
+            range pos = mal.first.pos;
+            sites[pos].insert(move(mal));
         }
         kept_allele_count++;
     }
-    assert(kept_allele_count+pruned.size() == alleles.size());
+    assert(kept_allele_count+pruned.size() == alleles_count);
 
     return sites;
 }
@@ -372,120 +346,164 @@ Status pad_alt_allele(const allele& ref, allele& alt) {
 // region as so far defined. A non-left-aligned indel could be distant from
 // its left-aligned position e.g. in lengthy tandem repeats, and this will
 // not deal with those.
-Status unify_nonaligned_alts(const allele& ref, const minimized_alleles& alts,
+// The input alts is cleared by side-effect.
+Status unify_nonaligned_alts(const allele& ref, minimized_alleles& alts,
                              minimized_alleles& aligned_alts) {
     Status s;
     map<allele,minimized_allele> unified_alts;
-    for (const auto& p : alts) {
-        UNPAIR(p, alt, alt_info);
-        allele unified_alt(alt);
+    for (auto p = alts.begin(); p != alts.end(); alts.erase(p++)) {
+        allele unified_alt(p->first);
         S(pad_alt_allele(ref, unified_alt));
         assert(unified_alt.pos == ref.pos);
 
         auto q = unified_alts.find(unified_alt);
         if (q == unified_alts.end()) {
-            unified_alts.insert(make_pair(unified_alt,p));
+            unified_alts.insert(q, make_pair(move(unified_alt), minimized_allele(p->first, move(p->second))));
         } else {
-            q->second.second += alt_info;
+            q->second.second += p->second;
         }
     }
     aligned_alts.clear();
-    for (const auto& p : unified_alts) {
+    for (auto& p : unified_alts) {
         aligned_alts.insert(move(p.second));
     }
     return Status::OK();
 }
 
-// Delineate sites given all discovered alleles, potentially pruning some as
-// described above. The result maps the range of each site to a tuple of the
-// discovered REF alleles, the minimized ALT alleles, and any pruned alleles
-// overlapping the site. It is possible (even likely) that one pruned allele
-// overlaps multiple sites, and thus appears in more than one of those entries.
-// all_pruned_alleles is a unique list of the pruned alleles, each with the
-// corresponding reference allele.
-// The input alleles is cleared by side-effect to save memory.
-Status delineate_sites(const unifier_config& cfg, discovered_alleles& alleles,
-                       map<range,tuple<discovered_alleles,minimized_alleles,minimized_alleles>>& ans,
-                       vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles) {
-    Status s;
-
-    // Start by coarsely partitioning "active regions" (allele clusters)
-    auto active_regions = partition<discovered_alleles>(alleles);
-    // alleles has been cleared by side effect
+// Index of alleles (ordered by position) for finding those overlapping a
+// given range, without scanning them all: alongside each allele, the
+// greatest end position of it and all preceding alleles, which bounds how
+// far back an overlapping allele may lie.
+template<class alleles_map>
+class overlap_index {
+    std::vector<const typename alleles_map::value_type*> alleles_;
+    std::vector<int> max_end_;
+
+public:
+    overlap_index(const alleles_map& alleles) {
+        alleles_.reserve(alleles.size());
+        max_end_.reserve(alleles.size());
+        for (const auto& al : alleles) {
+            const range& pos = al.first.pos;
+            assert(alleles_.empty() || alleles_.back()->first.pos <= pos);
+            int max_end = pos.end;
+            if (!alleles_.empty() && alleles_.back()->first.pos.rid == pos.rid) {
+                max_end = std::max(max_end, max_end_.back());
+            }
+            alleles_.push_back(&al);
+            max_end_.push_back(max_end);
+        }
+    }
 
-    // Decompose each active region into sites
-    ans.clear();
-    all_pruned_alleles.clear();
-    for (auto par = active_regions.begin(); par != active_regions.end(); active_regions.erase(par++)) {
-        const auto& active_region = *par;
-
-        // minimize the alt alleles
-        map<range,discovered_allele> refs_by_range;
-        minimized_alleles alts, pruned;
-        S(minimize_alleles(cfg, active_region.second, refs_by_range, alts));
-
-        // exclude alleles not overlapping the discovery target range, if any,
-        // after minimization.
-        for (auto it = alts.begin(); it != alts.end(); ) {
-            auto trg = it->second.in_target;
-            if (trg.rid < 0 || trg.overlaps(it->first.pos)) {
-                ++it;
-            } else {
-                alts.erase(it++);
+    // call f on each allele overlapping pos (in reverse order)
+    template<class F>
+    void overlapping(const range& pos, F f) const {
+        // the alleles beginning before pos ends
+        auto hi = upper_bound(alleles_.begin(), alleles_.end(), pos,
+                              [](const range& p, const typename alleles_map::value_type* al) {
+                                  const range& q = al->first.pos;
+                                  return p.rid < q.rid || (p.rid == q.rid && p.end <= q.beg);
+                              });
+        for (size_t i = hi - alleles_.begin(); i > 0; i--) {
+            const auto& al = *alleles_[i-1];
+            if (al.first.pos.rid != pos.rid || max_end_[i-1] <= pos.beg) {
+                break;
+            }
+            if (al.first.pos.overlaps(pos)) {
+                f(al);
             }
         }
+    }
+};
+
+// Delineate the sites in one active region, potentially pruning some alleles
+// as described above, and pass the inputs for each site in turn to site_fn.
+// It is possible (even likely) that one pruned allele overlaps multiple
+// sites, and thus is passed for more than one of them. all_pruned_alleles
+// is a unique list of the pruned alleles, each with the corresponding
+// reference allele.
+// The input alleles is cleared by side-effect to save memory.
+Status delineate_region(const unifier_config& cfg, const range& rng, discovered_alleles& alleles,
+                        const site_inputs_fn& site_fn,
+                        vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles) {
+    Status s;
+    all_pruned_alleles.clear();
 
-        // reconstruct the active region's reference allele
-        discovered_alleles refs;
-        for (const auto& p : refs_by_range) {
-            refs.insert(p.second);
+    // minimize the alt alleles
+    map<range,discovered_allele> refs_by_range;
+    minimized_alleles alts, pruned;
+    S(minimize_alleles(cfg, alleles, refs_by_range, alts));
+
+    // exclude alleles not overlapping the discovery target range, if any,
+    // after minimization.
+    for (auto it = alts.begin(); it != alts.end(); ) {
+        auto trg = it->second.in_target;
+        if (trg.rid < 0 || trg.overlaps(it->first.pos)) {
+            ++it;
+        } else {
+            alts.erase(it++);
         }
-        allele active_region_ref(active_region.first,"A");
-        S(unify_ref(active_region.first, refs, active_region_ref));
-
-        // detect equivalent alt alleles at different positions, and collapse them
-        minimized_alleles aligned_alts;
-        S(unify_nonaligned_alts(active_region_ref, alts, aligned_alts));
-        alts = move(aligned_alts);
-
-        // prune alt alleles as necessary to yield sites
-        const auto sites = prune_alleles(cfg, alts, pruned);
-
-        for (const auto& site : sites) {
-            // find the ref alleles overlapping this site
-            discovered_alleles site_refs;
-            for (const auto& ref : refs) {
-                if (ref.first.pos.overlaps(site.first)) {
-                    site_refs.insert(ref);
-                }
-            }
+    }
 
-            // and the pruned alleles
-            minimized_alleles site_pruned;
-            for (const auto& p : pruned) {
-                if (p.first.pos.overlaps(site.first)) {
-                    site_pruned.insert(p);
-                }
-            }
+    // collect the ref alleles (in the same order, since their ranges are
+    // distinct), and reconstruct the active region's reference allele
+    discovered_alleles refs;
+    map<range,const discovered_alleles::value_type*> ref_at;
+    for (auto& p : refs_by_range) {
+        auto it = refs.insert(refs.end(), make_pair(p.second.first, move(p.second.second)));
+        ref_at[p.first] = &*it;
+    }
+    refs_by_range.clear();
+    allele active_region_ref(rng,"A");
+    S(unify_ref(rng, refs, active_region_ref));
+
+    // detect equivalent alt alleles at different positions, and collapse them
+    minimized_alleles aligned_alts;
+    S(unify_nonaligned_alts(active_region_ref, alts, aligned_alts));
+
+    // prune alt alleles as necessary to yield sites
+    auto sites = prune_alleles(cfg, aligned_alts, pruned);
+
+    const overlap_index<discovered_alleles> refs_index(refs);
+    const overlap_index<minimized_alleles> pruned_index(pruned);
+    for (auto site = sites.begin(); site != sites.end(); sites.erase(site++)) {
+        // find the ref alleles overlapping this site
+        discovered_alleles site_refs;
+        if (overlap_lookups_for_testing.refs) {
+            overlap_lookups_for_testing.refs(refs, site->first, site_refs);
+        } else {
+            refs_index.overlapping(site->first, [&](const discovered_alleles::value_type& ref) {
+                site_refs.insert(ref);
+            });
+        }
 
-            assert(ans.find(site.first) == ans.end());
-            ans[site.first] = make_tuple(site_refs,site.second,site_pruned);
+        // and the pruned alleles
+        minimized_alleles site_pruned;
+        if (overlap_lookups_for_testing.pruned) {
+            overlap_lookups_for_testing.pruned(pruned, site->first, site_pruned);
+        } else {
+            pruned_index.overlapping(site->first, [&](const minimized_alleles::value_type& p) {
+                site_pruned.insert(p);
+            });
         }
 
-        for (const auto& pa : pruned) {
-            discovered_allele *longest_original_ref = nullptr;
-            for (const auto& al : pa.second.originals) {
-                const auto r = refs_by_range.find(al.pos);
-                if (r == refs_by_range.end()) {
-                    return Status::Invalid("delineate_sites: missing REF allele for ", al.pos.str());
-                }
-                if (!longest_original_ref || longest_original_ref->first.dna.size() < r->second.first.dna.size()) {
-                    longest_original_ref = &(r->second);
-                }
+        S(site_fn(site->first, site_refs, site->second, site_pruned));
+    }
+
+    for (auto pa = pruned.begin(); pa != pruned.end(); pruned.erase(pa++)) {
+        const discovered_alleles::value_type *longest_original_ref = nullptr;
+        for (const auto& al : pa->second.originals) {
+            const auto r = ref_at.find(al.pos);
+            if (r == ref_at.end()) {
+                return Status::Invalid("delineate_region: missing REF allele for ", al.pos.str());
+            }
+            if (!longest_original_ref || longest_original_ref->first.dna.size() < r->second->first.dna.size()) {
+                longest_original_ref = r->second;
             }
-            assert(longest_original_ref);
-            all_pruned_alleles.push_back(make_pair(pa, *longest_original_ref));
         }
+        assert(longest_original_ref);
+        all_pruned_alleles.push_back(make_pair(minimized_allele(pa->first, move(pa->second)),
+                                               discovered_allele(*longest_original_ref)));
     }
     return Status::OK();
 }
@@ -575,45 +593,128 @@ Status unified_sites(const unifier_config& cfg,
     Status s;
     unifier_stats stats;
 
-    map<range,tuple<discovered_alleles,minimized_alleles,minimized_alleles>> sites;
-    vector<pair<minimized_allele,discovered_allele>> all_pruned_alleles;
-    S(delineate_sites(cfg, alleles, sites, all_pruned_alleles));
-    // at this point, alleles has been cleared to save memory usage
-
-    for (auto psite = sites.begin(); psite != sites.end(); sites.erase(psite++)) {
-        UNPAIR(*psite, pos, site_alleles);
-        const auto& ref_alleles = get<0>(site_alleles);
-        const auto& alt_alleles = get<1>(site_alleles);
-        auto pruned_alleles = get<2>(site_alleles);
+    auto unify_site = [&](const range& pos, const discovered_alleles& ref_alleles,
+                          const minimized_alleles& alt_alleles, const minimized_alleles& pruned_alleles) {
+        Status s;
         unified_site us(pos);
         S(unify_alleles(cfg, N, pos, ref_alleles, alt_alleles, pruned_alleles, us));
-        ans.push_back(us);
+        ans.push_back(move(us));
         stats.unified_alleles += alt_alleles.size();
-    }
+        return Status::OK();
+    };
 
-    auto k = ans.size();
-    for (const auto& pa : all_pruned_alleles) {
-        if (check_filtered(cfg, pa.first) && check_AQ(cfg, pa.first) && check_copy_number(cfg, pa.first)) {
-            if (cfg.monoallelic_sites_for_lost_alleles) {
-                unified_site ms(pa.first.first.pos);
-                S(unify_alleles(cfg, N, pa.first.first.pos, discovered_alleles{pa.second},
-                                minimized_alleles{pa.first}, minimized_alleles(), ms));
-                ms.monoallelic = true;
-                ms.in_target = pa.first.second.in_target;
-                ans.push_back(ms);
+    // Process one active region (allele cluster) at a time, so that only its
+    // intermediate state is held at once
+    discovered_alleles region;
+    vector<pair<minimized_allele,discovered_allele>> all_pruned_alleles;
+    while (!alleles.empty()) {
+        region.clear();
+        range rng = pop_active_region(alleles, region);
+        auto k0 = ans.size();
+        S(delineate_region(cfg, rng, region, unify_site, all_pruned_alleles));
+
+        auto k = ans.size();
+        for (const auto& pa : all_pruned_alleles) {
+            if (check_filtered(cfg, pa.first) && check_AQ(cfg, pa.first) && check_copy_number(cfg, pa.first)) {
+                if (cfg.monoallelic_sites_for_lost_alleles) {
+                    unified_site ms(pa.first.first.pos);
+                    S(unify_alleles(cfg, N, pa.first.first.pos, discovered_alleles{pa.second},
+                                    minimized_alleles{pa.first}, minimized_alleles(), ms));
+                    ms.monoallelic = true;
+                    ms.in_target = pa.first.second.in_target;
+                    ans.push_back(move(ms));
+                }
+                stats.lost_alleles++;
+            } else {
+                stats.filtered_alleles++;
             }
-            stats.lost_alleles++;
-        } else {
-            stats.filtered_alleles++;
         }
+        // merge any the newly added monoallelic sites in position order with
+        // the others (in linear time). Since active regions don't overlap,
+        // this yields the same order as merging those of all regions at once.
+        std::inplace_merge(ans.begin()+k0, ans.begin()+k, ans.end());
     }
-    // merge any the newly added monoallelic sites in position order with the others
-    // (in linear time)
-    std::inplace_merge(ans.begin(), ans.begin()+k, ans.end());
     assert(std::is_sorted(ans.begin(), ans.end()));
 
     stats_out = stats;
     return Status::OK();
 }
 
+// Move alleles from the front of src to dest: whole active regions, until
+// dest has at least n alleles (or src is exhausted).
+static void take_active_regions(discovered_alleles& src, size_t n, discovered_alleles& dest) {
+    while (!src.empty() && dest.size() < n) {
+        pop_active_region(src, dest);
+    }
+}
+
+Status unified_sites(const unifier_config& cfg,
+                     unsigned N, discovered_alleles& alleles,
+                     vector<unified_site>& ans,
+                     unifier_stats& stats_out,
+                     Scheduler& scheduler, bool stream) {
+    // Active regions are independent by construction, so we can unify
+    // chunks of them in parallel and concatenate the results in order, which
+    // are then exactly those of unifying everything at once.
+    struct chunk {
+        discovered_alleles alleles;
+        vector<unified_site> sites;
+        unifier_stats stats;
+    };
+
+    // aim for several chunks per thread to balance the load
+    size_t chunk_alleles = max(size_t(1), alleles.size() / (4*scheduler.size()));
+    size_t max_in_flight = numeric_limits<size_t>::max();
+    if (stream) {
+        chunk_alleles = min(chunk_alleles, size_t(65536));
+        max_in_flight = 2*scheduler.size();
+    }
+
+    Status s;
+    unifier_stats stats;
+    atomic<bool> abort(false);
+    deque<pair<unique_ptr<chunk>,future<Status>>> in_flight;
+
+    // wait for the oldest chunk in flight and collect its results
+    auto retire = [&]() {
+        Status s_i(scheduler.get(in_flight.front().second));
+        chunk& c = *(in_flight.front().first);
+        if (s.ok() && s_i.ok()) {
+            ans.insert(ans.end(), make_move_iterator(c.sites.begin()), make_move_iterator(c.sites.end()));
+            stats += c.stats;
+        } else if (s.ok()) {
+            // record the first error, and tell remaining tasks to abort
+            s = move(s_i);
+            abort = true;
+        }
+        in_flight.pop_front();
+    };
+
+    while (!alleles.empty()) {
+        while (in_flight.size() >= max_in_flight) {
+            retire();
+        }
+
+        unique_ptr<chunk> c(new chunk);
+        take_active_regions(alleles, chunk_alleles, c->alleles);
+        chunk* pc = c.get();
+        auto fut = scheduler.push(TaskLane::UNIFICATION, [&cfg, N, pc, &abort](int tid) {
+            if (abort) {
+                return Status::Aborted();
+            }
+            return unified_sites(cfg, N, pc->alleles, pc->sites, pc->stats);
+        });
+        in_flight.push_back(make_pair(move(c), move(fut)));
+    }
+    while (!in_flight.empty()) {
+        retire();
+    }
+    if (s.bad()) {
+        return s;
+    }
+
+    stats_out = stats;
+    return Status::OK();
+}
+
 }
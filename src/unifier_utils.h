@@ -0,0 +1,88 @@
+// Internals of the unifier (included only by unifier.cc, and by
+// test/unifier.cc to check them against reference implementations)
+
+namespace GLnexus {
+
+using discovered_allele = std::pair<allele,discovered_allele_info>;
+
+// ALT alleles discovered across numerous samples may represent the same edit
+// to the reference genome in different ways, specifically if they have
+// different amounts of reference padding on either end. (Individual gVCF ALT
+// alleles may be reference-padded to unify their representation with other
+// ALT alleles observed in the same sample.) So we introduce a notion of
+// "minimized" ALT allele, which strips any reference padding so that
+// equivalent ALT alleles can be combined, while still remembering the
+// original representations.
+struct minimized_allele_info {
+    std::set<allele> originals;
+    bool all_filtered = false;
+    top_AQ topAQ;
+    unsigned copy_number = 0;
+    range in_target = range(-1,-1,-1);
+
+    std::string str() const {
+        std::ostringstream os;
+        os << "Minimized from originals: " << std::endl;
+        for (auto& al : originals) {
+            os << "  " << al.str() << std::endl;
+        }
+        os << "Max AQ: " << topAQ.V[0] << std::endl;
+        os << "Copy number: " << copy_number << std::endl;
+        return os.str();
+    }
+
+    void operator+=(const minimized_allele_info& rhs) {
+        originals.insert(rhs.originals.begin(), rhs.originals.end());
+        all_filtered = all_filtered && rhs.all_filtered;
+        topAQ += rhs.topAQ;
+        copy_number += rhs.copy_number;
+        if (!in_target.overlaps(rhs.in_target) ||
+            in_target.size() < rhs.in_target.size()) {
+            in_target = rhs.in_target;
+        }
+    }
+};
+using minimized_alleles = std::map<allele,minimized_allele_info>;
+using minimized_allele = std::pair<allele,minimized_allele_info>;
+
+// The steps of delineating the sites in an active region; see unifier.cc.
+// Each clears its input alleles by side-effect (unify_ref has none).
+Status minimize_alleles(const unifier_config& cfg, discovered_alleles& src,
+                        std::map<range,discovered_allele>& refs, minimized_alleles& alts);
+Status unify_ref(const range& pos, const discovered_alleles& refs, allele& ref);
+Status unify_nonaligned_alts(const allele& ref, minimized_alleles& alts,
+                             minimized_alleles& aligned_alts);
+std::map<range,minimized_alleles> prune_alleles(const unifier_config& cfg, minimized_alleles& alleles,
+                                                minimized_alleles& pruned);
+
+// Move the first active region from alleles (nonempty) into region, which
+// is appended to, and return its range.
+range pop_active_region(discovered_alleles& alleles, discovered_alleles& region);
+
+// the inputs to unify one site: its range, the discovered REF alleles, the
+// minimized ALT alleles, and any pruned alleles overlapping it
+using site_inputs_fn = std::function<Status(const range&, const discovered_alleles&,
+                                            const minimized_alleles&, const minimized_alleles&)>;
+
+// Delineate the sites in one active region; see unifier.cc
+Status delineate_region(const unifier_config& cfg, const range& rng, discovered_alleles& alleles,
+                        const site_inputs_fn& site_fn,
+                        std::vector<std::pair<minimized_allele,discovered_allele>>& all_pruned_alleles);
+
+// Overlap lookups made while delineating sites, which a test may set to
+// reference implementations (scanning everything) to check the ordered
+// lookups used when they're unset. They mustn't be changed while any
+// unification is in progress.
+struct overlap_lookups {
+    // the site overlapping pos among non-overlapping sites (sites.end() if
+    // none), setting multiple if pos overlaps more than one
+    std::function<std::map<range,minimized_alleles>::iterator(std::map<range,minimized_alleles>& sites,
+                                                              const range& pos, bool& multiple)> site;
+    // insert into ans the REF alleles overlapping pos
+    std::function<void(const discovered_alleles& refs, const range& pos, discovered_alleles& ans)> refs;
+    // insert into ans the pruned alleles overlapping pos
+    std::function<void(const minimized_alleles& pruned, const range& pos, minimized_alleles& ans)> pruned;
+};
+extern overlap_lookups overlap_lookups_for_testing;
+
+}
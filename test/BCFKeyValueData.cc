@@ -1,5 +1,6 @@
 #include <iostream>
 #include <map>
+#include <set>
 #include <chrono>
 #include "BCFKeyValueData.h"
 #include "BCFSerialize.h"
@@ -75,6 +76,7 @@ namespace KeyValueMem {
 
     class WriteBatch : public KeyValue::WriteBatch {
         std::vector<std::map<std::string,std::string>> data_;
+        std::vector<std::set<std::string>> deletes_;
         DB* db_;
         friend class DB;
 
@@ -83,6 +85,14 @@ namespace KeyValueMem {
             auto coll = reinterpret_cast<uint64_t>(_coll);
             assert(coll < data_.size());
             data_[coll][key] = value.str();
+            deletes_[coll].erase(key);
+            return Status::OK();
+        }
+        Status delete_key(CollectionHandle _coll, const std::string& key) override {
+            auto coll = reinterpret_cast<uint64_t>(_coll);
+            assert(coll < data_.size());
+            data_[coll].erase(key);
+            deletes_[coll].insert(key);
             return Status::OK();
         }
         Status commit() override;
@@ -131,6 +141,7 @@ namespace KeyValueMem {
             auto p = std::make_unique<KeyValueMem::WriteBatch>();
             p->db_ = this;
             p->data_ = std::vector<std::map<std::string,std::string>>(data_.size());
+            p->deletes_ = std::vector<std::set<std::string>>(data_.size());
             writes = std::move(p);
             return Status::OK();
         }
@@ -149,6 +160,9 @@ namespace KeyValueMem {
     Status WriteBatch::commit() {
         assert(data_.size() <= db_->data_.size());
         for (size_t i = 0; i < data_.size(); i++) {
+            for (const auto& key : deletes_[i]) {
+                db_->data_[i].erase(key);
+            }
             for (const auto& p : data_[i]) {
                 db_->data_[i][p.first] = p.second;
             }
@@ -401,6 +415,58 @@ TEST_CASE("BCFKeyValueData::import_gvcf") {
         s = cache->sampleset_samples(sampleset, all);
         REQUIRE(s.ok());
         REQUIRE(all->size() == 6);
+
+        // map the trio2 header samples (fa, mo, ch) onto sample set columns
+        shared_ptr<const bcf_hdr_t> hdr;
+        REQUIRE(data->dataset_header("2", hdr).ok());
+        shared_ptr<const SampleMapping> mapping;
+        REQUIRE(cache->sampleset_dataset_mapping(sampleset, "2", hdr.get(), mapping).ok());
+        REQUIRE(mapping->size() == 3);
+        REQUIRE(mapping->at(0) == 4);
+        REQUIRE(mapping->at(1) == 5);
+        REQUIRE(mapping->at(2) == 3);
+        REQUIRE(mapping->bcf_samples() == vector<unsigned>({0, 1, 2}));
+
+        shared_ptr<const SampleMapping> mapping2;
+        REQUIRE(cache->sampleset_dataset_mapping(sampleset, "2", hdr.get(), mapping2).ok());
+        REQUIRE(mapping2.get() == mapping.get());
+
+        REQUIRE(data->new_sampleset(*cache, "mo2", set<string>{"trio2.mo"}).ok());
+        REQUIRE(cache->sampleset_dataset_mapping("mo2", "2", hdr.get(), mapping).ok());
+        REQUIRE(mapping->size() == 1);
+        REQUIRE(mapping->at(1) == 0);
+        REQUIRE_THROWS(mapping->at(0));
+        REQUIRE(mapping->bcf_samples() == vector<unsigned>({1}));
+
+        // integer IDs & sample set bitmaps
+        uint32_t mo2_id, ch1_id, ds_id;
+        string name;
+        REQUIRE(cache->sample_id("trio2.mo", mo2_id).ok());
+        REQUIRE(cache->sample_id("trio1.ch", ch1_id).ok());
+        REQUIRE(mo2_id != ch1_id);
+        REQUIRE(cache->sample_name(mo2_id, name).ok());
+        REQUIRE(name == "trio2.mo");
+        REQUIRE(cache->sample_dataset_id(mo2_id, ds_id).ok());
+        REQUIRE(cache->dataset_name(ds_id, name).ok());
+        REQUIRE(name == "2");
+        REQUIRE(cache->sample_id("bogus", mo2_id) == StatusCode::NOT_FOUND);
+
+        shared_ptr<const SampleBitmap> all_bitmap, mo2_bitmap;
+        REQUIRE(cache->sampleset_bitmap(sampleset, all_bitmap).ok());
+        REQUIRE(all_bitmap->count() == 6);
+        REQUIRE(cache->sampleset_bitmap("mo2", mo2_bitmap).ok());
+        REQUIRE(mo2_bitmap->count() == 1);
+        REQUIRE(mo2_bitmap->contains(mo2_id));
+        REQUIRE(!mo2_bitmap->contains(ch1_id));
+        REQUIRE(mo2_bitmap->subset_of(*all_bitmap));
+        REQUIRE(!all_bitmap->subset_of(*mo2_bitmap));
+        SampleBitmap u(*mo2_bitmap);
+        u |= *all_bitmap;
+        REQUIRE(u == *all_bitmap);
+
+        shared_ptr<const set<string>> samples, datasets;
+        REQUIRE(cache->sampleset_datasets("mo2", samples, datasets).ok());
+        REQUIRE(*datasets == set<string>({"2"}));
     }
 
     SECTION("range filter") {
@@ -526,6 +592,371 @@ TEST_CASE("BCFKeyValueData::import_gvcf") {
     }
 }
 
+// KeyValueMem::DB failing a given commit (counting from 1), as if the process
+// had crashed there if crash is set (then failing all further commits too).
+class FailingKeyValueMem : public KeyValueMem::DB {
+    class WriteBatch : public KeyValue::WriteBatch {
+        unique_ptr<KeyValue::WriteBatch> inner_;
+        FailingKeyValueMem* db_;
+
+    public:
+        WriteBatch(unique_ptr<KeyValue::WriteBatch>&& inner, FailingKeyValueMem* db)
+            : inner_(move(inner)), db_(db) {}
+        Status put(KeyValue::CollectionHandle coll, const string& key, const KeyValue::Data& value) override {
+            return inner_->put(coll, key, value);
+        }
+        Status delete_key(KeyValue::CollectionHandle coll, const string& key) override {
+            return inner_->delete_key(coll, key);
+        }
+        Status commit() override {
+            size_t n = ++db_->commits;
+            if (db_->fail_commit && (n == db_->fail_commit || (db_->crash && n > db_->fail_commit))) {
+                return Status::Failure("simulated failure");
+            }
+            return inner_->commit();
+        }
+    };
+
+public:
+    size_t commits = 0, fail_commit = 0;
+    bool crash = false;
+
+    FailingKeyValueMem() : KeyValueMem::DB({}) {}
+
+    Status begin_writes(unique_ptr<KeyValue::WriteBatch>& writes) override {
+        Status s;
+        unique_ptr<KeyValue::WriteBatch> inner;
+        S(KeyValueMem::DB::begin_writes(inner));
+        writes = make_unique<WriteBatch>(move(inner), this);
+        return Status::OK();
+    }
+};
+
+static size_t collection_size(KeyValue::DB& db, const string& collection) {
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection(collection, coll).ok());
+    unique_ptr<KeyValue::Iterator> it;
+    REQUIRE(db.iterator(coll, string(), it).ok());
+    size_t ans = 0;
+    for (; it->valid(); it->next()) {
+        ans++;
+    }
+    return ans;
+}
+
+TEST_CASE("BCFKeyValueData interrupted import") {
+    FailingKeyValueMem db;
+    vector<pair<string,uint64_t>> contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    REQUIRE(data->recovered_imports().empty());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    const string gvcf = "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf";
+
+    // The import commits (1) the journal entry for the data set, (2) the
+    // buckets, (3) the journal entry for the header, and (4) the metadata.
+    db.commits = 0;
+
+    SECTION("failure") {
+        // the buckets are removed upon the failure
+        db.fail_commit = db.commits + 3;
+        Status s = data->import_gvcf(*cache, "x", gvcf, samples_imported);
+        REQUIRE(s == StatusCode::FAILURE);
+        REQUIRE(collection_size(db, "bcf") == 0);
+        REQUIRE(collection_size(db, "import_journal") == 0);
+
+        s = data->import_gvcf(*cache, "x", gvcf, samples_imported);
+        REQUIRE(s.ok());
+        REQUIRE(collection_size(db, "bcf") > 0);
+        REQUIRE(collection_size(db, "import_journal") == 0);
+    }
+
+    SECTION("crash before buckets complete") {
+        db.fail_commit = db.commits + 3;
+        db.crash = true;
+        Status s = data->import_gvcf(*cache, "x", gvcf, samples_imported);
+        REQUIRE(s == StatusCode::FAILURE);
+        REQUIRE(collection_size(db, "bcf") > 0);
+        REQUIRE(collection_size(db, "import_journal") > 0);
+
+        // reopen: the import is rolled back
+        db.fail_commit = 0;
+        data.reset();
+        REQUIRE(T::Open(&db, data).ok());
+        REQUIRE(data->recovered_imports().size() == 1);
+        REQUIRE(data->recovered_imports().at("x") == false);
+        REQUIRE(collection_size(db, "bcf") == 0);
+        REQUIRE(collection_size(db, "import_journal") == 0);
+        string dataset;
+        REQUIRE(data->sample_dataset("NA12878", dataset) == StatusCode::NOT_FOUND);
+
+        // and can be done again
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        s = data->import_gvcf(*cache, "x", gvcf, samples_imported);
+        REQUIRE(s.ok());
+        size_t ct;
+        REQUIRE(data->sample_count(ct).ok());
+        REQUIRE(ct == 1);
+    }
+
+    SECTION("crash before metadata") {
+        db.fail_commit = db.commits + 4;
+        db.crash = true;
+        Status s = data->import_gvcf(*cache, "x", gvcf, samples_imported);
+        REQUIRE(s == StatusCode::FAILURE);
+        size_t buckets = collection_size(db, "bcf");
+        REQUIRE(buckets > 0);
+
+        // reopen: the import is finished
+        db.fail_commit = 0;
+        data.reset();
+        REQUIRE(T::Open(&db, data).ok());
+        REQUIRE(data->recovered_imports().size() == 1);
+        REQUIRE(data->recovered_imports().at("x") == true);
+        REQUIRE(collection_size(db, "bcf") == buckets);
+        REQUIRE(collection_size(db, "import_journal") == 0);
+        string dataset;
+        REQUIRE(data->sample_dataset("NA12878", dataset).ok());
+        REQUIRE(dataset == "x");
+        size_t ct;
+        REQUIRE(data->sample_count(ct).ok());
+        REQUIRE(ct == 1);
+
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        shared_ptr<const bcf_hdr_t> hdr;
+        vector<shared_ptr<bcf1_t>> records;
+        s = data->dataset_range_and_header("x", range(0, 10009461, 10009471), nullptr, hdr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() > 0);
+
+        s = data->import_gvcf(*cache, "x", gvcf, samples_imported);
+        REQUIRE(s == StatusCode::EXISTS);
+    }
+}
+
+TEST_CASE("BCFKeyValueData::remove_dataset") {
+    FailingKeyValueMem db;
+    vector<pair<string,uint64_t>> contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+
+    Status s = data->import_gvcf(*cache, "1", "test/data/sampleset_range1.gvcf", samples_imported);
+    REQUIRE(s.ok());
+    size_t buckets1 = collection_size(db, "bcf");
+    s = data->import_gvcf(*cache, "2", "test/data/sampleset_range2.gvcf", samples_imported);
+    REQUIRE(s.ok());
+    REQUIRE(collection_size(db, "bcf") > buckets1);
+    REQUIRE(data->new_sampleset(*cache, "pair", {"HX0001", "HX0002"}).ok());
+
+    KeyValue::CollectionHandle coll;
+    REQUIRE(db.collection("sampleset", coll).ok());
+    string version, dataset, sampleset;
+    shared_ptr<const bcf_hdr_t> hdr;
+    vector<shared_ptr<bcf1_t>> records;
+    size_t ct;
+
+    SECTION("remove") {
+        REQUIRE(data->metadata_version() == 0);
+        REQUIRE(data->remove_dataset("2").ok());
+        REQUIRE(data->metadata_version() == 1);
+        REQUIRE(collection_size(db, "bcf") == buckets1);
+        REQUIRE(data->dataset_header("2", hdr) == StatusCode::NOT_FOUND);
+        REQUIRE(data->sample_dataset("HX0002", dataset) == StatusCode::NOT_FOUND);
+        REQUIRE(data->sample_count(ct).ok());
+        REQUIRE(ct == 1);
+        REQUIRE(db.get(coll, "*", version).ok());
+        REQUIRE(version == "3");
+
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        shared_ptr<const set<string>> samples;
+        REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+        REQUIRE(sampleset == "*@3");
+        REQUIRE(cache->sampleset_samples(sampleset, samples).ok());
+        REQUIRE(*samples == set<string>({"HX0001"}));
+
+        // existing sample sets are left as they were
+        REQUIRE(cache->sampleset_samples("pair", samples).ok());
+        REQUIRE(*samples == set<string>({"HX0001", "HX0002"}));
+        REQUIRE(cache->sampleset_samples("*@2", samples).ok());
+        REQUIRE(*samples == set<string>({"HX0001", "HX0002"}));
+
+        // the other data set is unaffected
+        s = data->dataset_range_and_header("1", range(0, 0, 1000000), nullptr, hdr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() > 0);
+
+        REQUIRE(data->remove_dataset("2") == StatusCode::NOT_FOUND);
+        REQUIRE(data->metadata_version() == 1);
+
+        // the metadata version persists
+        unique_ptr<T> data2;
+        REQUIRE(T::Open(&db, data2).ok());
+        REQUIRE(data2->metadata_version() == 1);
+
+        // the data set can be imported again
+        s = data->import_gvcf(*cache, "2", "test/data/sampleset_range2.gvcf", samples_imported);
+        REQUIRE(s.ok());
+        REQUIRE(data->sample_count(ct).ok());
+        REQUIRE(ct == 2);
+        s = data->dataset_range_and_header("2", range(0, 0, 1000000), nullptr, hdr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() > 0);
+    }
+
+    SECTION("MetadataCache") {
+        // a cache started beforehand notices the removal, even with
+        // everything about the data set already cached & interned
+        shared_ptr<const set<string>> samples, datasets;
+        REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+        REQUIRE(cache->sampleset_datasets(sampleset, samples, datasets).ok());
+        REQUIRE(*datasets == set<string>({"1", "2"}));
+        uint32_t id, dataset_id;
+        REQUIRE(cache->sample_id("HX0002", id).ok());
+        REQUIRE(cache->sample_dataset("HX0002", dataset).ok());
+        REQUIRE(dataset == "2");
+
+        REQUIRE(data->remove_dataset("2").ok());
+        REQUIRE(cache->sample_dataset("HX0002", dataset) == StatusCode::NOT_FOUND);
+
+        // import the same sample under another data set name
+        s = data->import_gvcf(*cache, "2b", "test/data/sampleset_range2.gvcf", samples_imported);
+        REQUIRE(s.ok());
+        REQUIRE(cache->sample_dataset("HX0002", dataset).ok());
+        REQUIRE(dataset == "2b");
+        REQUIRE(cache->sample_id("HX0002", id).ok());
+        REQUIRE(cache->sample_dataset_id(id, dataset_id).ok());
+        REQUIRE(cache->dataset_name(dataset_id, dataset).ok());
+        REQUIRE(dataset == "2b");
+        REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+        REQUIRE(cache->sampleset_datasets(sampleset, samples, datasets).ok());
+        REQUIRE(*samples == set<string>({"HX0001", "HX0002"}));
+        REQUIRE(*datasets == set<string>({"1", "2b"}));
+
+        // repeated removals retire the cached state each time
+        for (int i = 0; i < 8; i++) {
+            const string prev = i ? "2c" + to_string(i-1) : "2b";
+            const string next = "2c" + to_string(i);
+            REQUIRE(data->remove_dataset(prev).ok());
+            REQUIRE(cache->sample_dataset("HX0002", dataset) == StatusCode::NOT_FOUND);
+            s = data->import_gvcf(*cache, next, "test/data/sampleset_range2.gvcf", samples_imported);
+            REQUIRE(s.ok());
+            REQUIRE(cache->sample_dataset("HX0002", dataset).ok());
+            REQUIRE(dataset == next);
+        }
+    }
+
+    SECTION("replace") {
+        T::import_result rslt;
+        s = data->replace_dataset("2", "test/data/sampleset_range3.gvcf", {}, rslt);
+        REQUIRE(s.ok());
+        REQUIRE(rslt.samples == set<string>({"HX0003"}));
+        REQUIRE(db.get(coll, "*", version).ok());
+        REQUIRE(version == "3");
+        REQUIRE(data->metadata_version() == 1);
+        REQUIRE(collection_size(db, "import_journal") == 0);
+        REQUIRE(data->sample_dataset("HX0002", dataset) == StatusCode::NOT_FOUND);
+        REQUIRE(data->sample_dataset("HX0003", dataset).ok());
+        REQUIRE(dataset == "2");
+        REQUIRE(data->sample_count(ct).ok());
+        REQUIRE(ct == 2);
+
+        s = data->dataset_range_and_header("2", range(0, 0, 1000000), nullptr, hdr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() > 0);
+        REQUIRE(bcf_hdr_nsamples(hdr.get()) == 1);
+        REQUIRE(string(bcf_hdr_int2id(hdr.get(), BCF_DT_SAMPLE, 0)) == "HX0003");
+        REQUIRE(records[0]->pos == 198999);
+
+        // the replacement's samples can't belong to another data set, and
+        // the data set stays in place if the replacement is rejected
+        s = data->replace_dataset("2", "test/data/sampleset_range1.gvcf", {}, rslt);
+        REQUIRE(s == StatusCode::EXISTS);
+        s = data->replace_dataset("2", "test/data/bogus.gvcf", {}, rslt);
+        REQUIRE(s == StatusCode::IO_ERROR);
+        REQUIRE(data->sample_dataset("HX0003", dataset).ok());
+        REQUIRE(data->dataset_header("2", hdr).ok());
+    }
+
+    SECTION("failed replacement") {
+        // the replacement's header is fine but a record isn't; the existing
+        // data set must survive the failed import
+        T::import_result rslt;
+        s = data->replace_dataset("2", "test/data/bogus_END.gvcf", {}, rslt);
+        REQUIRE(s == StatusCode::INVALID);
+        REQUIRE(data->sample_dataset("HX0002", dataset).ok());
+        REQUIRE(dataset == "2");
+        REQUIRE(data->sample_dataset("NA12878", dataset) == StatusCode::NOT_FOUND);
+        REQUIRE(data->sample_count(ct).ok());
+        REQUIRE(ct == 2);
+        s = data->dataset_range_and_header("2", range(0, 0, 1000000), nullptr, hdr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() > 0);
+        REQUIRE(string(bcf_hdr_int2id(hdr.get(), BCF_DT_SAMPLE, 0)) == "HX0002");
+    }
+
+    SECTION("replacement failing after validation") {
+        // The replacement commits (1) its journal entry, (2) its staged
+        // buckets, (3) the journal entry for its header, and (4) the swap.
+        // Whichever fails, the existing data set is left as it was.
+        size_t buckets = collection_size(db, "bcf");
+        for (size_t fail = 1; fail <= 4; fail++) {
+            db.commits = 0;
+            db.fail_commit = fail;
+            T::import_result rslt;
+            s = data->replace_dataset("2", "test/data/sampleset_range3.gvcf", {}, rslt);
+            REQUIRE(s == StatusCode::FAILURE);
+            REQUIRE(db.commits >= fail);
+
+            REQUIRE(collection_size(db, "bcf") == buckets);
+            REQUIRE(collection_size(db, "import_journal") == 0);
+            REQUIRE(db.get(coll, "*", version).ok());
+            REQUIRE(version == "2");
+            REQUIRE(data->metadata_version() == 0);
+            REQUIRE(data->sample_dataset("HX0002", dataset).ok());
+            REQUIRE(dataset == "2");
+            REQUIRE(data->sample_dataset("HX0003", dataset) == StatusCode::NOT_FOUND);
+            REQUIRE(data->sample_count(ct).ok());
+            REQUIRE(ct == 2);
+            s = data->dataset_range_and_header("2", range(0, 0, 1000000), nullptr, hdr, records);
+            REQUIRE(s.ok());
+            REQUIRE(records.size() > 0);
+            REQUIRE(string(bcf_hdr_int2id(hdr.get(), BCF_DT_SAMPLE, 0)) == "HX0002");
+        }
+
+        // a crash before the swap is rolled back upon reopening
+        db.commits = 0;
+        db.fail_commit = 4;
+        db.crash = true;
+        T::import_result rslt;
+        s = data->replace_dataset("2", "test/data/sampleset_range3.gvcf", {}, rslt);
+        REQUIRE(s == StatusCode::FAILURE);
+        REQUIRE(collection_size(db, "import_journal") > 0);
+        db.fail_commit = 0;
+        db.crash = false;
+        data.reset();
+        REQUIRE(T::Open(&db, data).ok());
+        REQUIRE(data->recovered_imports().size() == 1);
+        REQUIRE(data->recovered_imports().at("2~replacement") == false);
+        REQUIRE(collection_size(db, "bcf") == buckets);
+        REQUIRE(collection_size(db, "import_journal") == 0);
+        REQUIRE(data->sample_dataset("HX0002", dataset).ok());
+        REQUIRE(dataset == "2");
+
+        // and the replacement can then succeed
+        s = data->replace_dataset("2", "test/data/sampleset_range3.gvcf", {}, rslt);
+        REQUIRE(s.ok());
+        REQUIRE(data->sample_dataset("HX0003", dataset).ok());
+        REQUIRE(dataset == "2");
+    }
+}
+
 TEST_CASE("BCFKeyValueData BCF retrieval") {
     KeyValueMem::DB db({});
     auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
@@ -702,6 +1133,112 @@ TEST_CASE("BCFKeyValueData range overlap with a single dataset") {
     }
 }
 
+// Same cases as above, with density-adaptive bucket boundaries instead of a
+// fixed interval length: a mix of tiny buckets straddling the records of
+// interest, and large buckets elsewhere.
+TEST_CASE("BCFKeyValueData range overlap with bucket boundaries") {
+    std::vector<std::vector<range>> boundary_sets = {
+        { range(0, 0, 1004), range(0, 1004, 1007), range(0, 1007, 2004), range(0, 2004, 2005),
+          range(0, 3000, 3005) },
+        { range(0, 1000, 1001), range(0, 1001, 1002), range(0, 2000, 2100), range(0, 3003, 3004),
+          range(0, 3004, 3005), range(0, 3005, 3006) },
+        { range(0, 10000, 48129895) }
+    };
+
+    for (const auto& boundaries : boundary_sets) {
+        KeyValueMem::DB db({});
+        auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+
+        REQUIRE(T::InitializeDB(&db, contigs, 11, boundaries).ok());
+        unique_ptr<T> data;
+        REQUIRE(T::Open(&db, data).ok());
+        unique_ptr<MetadataCache> cache;
+        REQUIRE(MetadataCache::Start(*data, cache).ok());
+        set<string> samples_imported;
+
+        Status s = data->import_gvcf(*cache, "synth_A", "test/data/synthetic_A.21.gvcf", samples_imported);
+        REQUIRE(s.ok());
+        shared_ptr<const bcf_hdr_t> hdr;
+        s = data->dataset_header("synth_A", hdr);
+        REQUIRE(s.ok());
+
+        vector<shared_ptr<bcf1_t>> records;
+        s = data->dataset_range("synth_A", hdr.get(), range(0, 1005, 1010), nullptr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() == 0);
+
+        s = data->dataset_range("synth_A", hdr.get(), range(0, 2003, 2006), nullptr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() == 3);
+
+        s = data->dataset_range("synth_A", hdr.get(), range(0, 3004, 3006), nullptr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() == 3);
+
+        // the boundaries persist in the database
+        unique_ptr<T> data2;
+        REQUIRE(T::Open(&db, data2).ok());
+        s = data2->dataset_range("synth_A", hdr.get(), range(0, 3004, 3006), nullptr, records);
+        REQUIRE(s.ok());
+        REQUIRE(records.size() == 3);
+    }
+
+    SECTION("invalid boundaries") {
+        KeyValueMem::DB db({});
+        auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+        REQUIRE(T::InitializeDB(&db, contigs, 11, { range(0, 100, 50) }) == StatusCode::INVALID);
+        KeyValueMem::DB db2({});
+        REQUIRE(T::InitializeDB(&db2, contigs, 11, { range(0, 100, 48129896) }) == StatusCode::INVALID);
+        KeyValueMem::DB db3({});
+        REQUIRE(T::InitializeDB(&db3, contigs, 11, { range(1, 0, 100) }) == StatusCode::INVALID);
+    }
+}
+
+TEST_CASE("BCFKeyValueData bucket summary") {
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "NA12878D", "test/data/NA12878D_HiSeqX.21.10009462-10009469.gvcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "synth_A", "test/data/synthetic_A.21.gvcf", samples_imported).ok());
+    shared_ptr<const bcf_hdr_t> hdr, hdr_A;
+    REQUIRE(data->dataset_header("NA12878D", hdr).ok());
+    REQUIRE(data->dataset_header("synth_A", hdr_A).ok());
+    vector<shared_ptr<bcf1_t>> records;
+
+    // the only variant record is at 10009464-10009465
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 10009463, 10009464), bcf_predicate_variant_records, records).ok());
+    REQUIRE(records.size() == 1);
+    REQUIRE(records[0]->pos == 10009463);
+    REQUIRE(data->getRangeStats()->nBucketsSkipped == 0);
+
+    // variant query next to, but not overlapping the variant record
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 10009466, 10009469), bcf_predicate_variant_records, records).ok());
+    REQUIRE(records.size() == 0);
+    REQUIRE(data->getRangeStats()->nBucketsSkipped == 1);
+
+    // the reference bands there are still found without the predicate
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 10009466, 10009469), nullptr, records).ok());
+    REQUIRE(records.size() == 2);
+    REQUIRE(data->getRangeStats()->nBucketsSkipped == 1);
+
+    // query outside the extent of the bucket's records
+    REQUIRE(data->dataset_range("NA12878D", hdr.get(), range(0, 10009500, 10009600), nullptr, records).ok());
+    REQUIRE(records.size() == 0);
+    REQUIRE(data->getRangeStats()->nBucketsSkipped == 2);
+
+    // bucket with no variant records at all
+    REQUIRE(data->dataset_range("synth_A", hdr_A.get(), range(0, 1000, 4000), bcf_predicate_variant_records, records).ok());
+    REQUIRE(records.size() == 0);
+    REQUIRE(data->getRangeStats()->nBucketsSkipped == 3);
+    REQUIRE(data->dataset_range("synth_A", hdr_A.get(), range(0, 1000, 4000), nullptr, records).ok());
+    REQUIRE(records.size() == 10);
+}
+
 // --------------------------------------------------------------------
 // Confidence intervals are VCF records that reflect identify with the
 // reference genome. Such a record could be very long, nearly the
@@ -1340,6 +1877,101 @@ TEST_CASE("BCFKeyValueData::sampleset_range") {
     REQUIRE(records.size() == 0);
 }
 
+TEST_CASE("BCFKeyValueData::sampleset_range with read-ahead") {
+    // The results of the bucket iterators should be the same regardless of
+    // the read-ahead depth (including none)
+
+    KeyValueMem::DB db({});
+    auto contigs = {make_pair<string,uint64_t>("21", 48129895)};
+    REQUIRE(T::InitializeDB(&db, contigs, 25000).ok());
+    unique_ptr<T> data;
+    REQUIRE(T::Open(&db, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    set<string> samples_imported;
+    REQUIRE(data->import_gvcf(*cache, "1", "test/data/sampleset_range1.gvcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "2", "test/data/sampleset_range2.gvcf", samples_imported).ok());
+    REQUIRE(data->import_gvcf(*cache, "3", "test/data/sampleset_range3.gvcf", samples_imported).ok());
+    string sampleset;
+    REQUIRE(cache->all_samples_sampleset(sampleset).ok());
+
+    auto results = [&](size_t depth) {
+        data->set_prefetch_depth(depth);
+        vector<tuple<size_t,string,vector<int>>> ans;
+        for (const range& rng : { range(0, 190000, 200050), range(0, 290000, 300050),
+                                  range(0, 5999998, 6000001), range(0, 0, 10000000) }) {
+            shared_ptr<const set<string>> samples, datasets;
+            vector<unique_ptr<RangeBCFIterator>> iterators;
+            REQUIRE(data->sampleset_range(*cache, sampleset, rng, nullptr,
+                                          samples, datasets, iterators).ok());
+            for (size_t i = 0; i < iterators.size(); i++) {
+                string dataset;
+                shared_ptr<const bcf_hdr_t> hdr;
+                vector<shared_ptr<bcf1_t>> records;
+                Status s;
+                while ((s = iterators[i]->next(dataset, hdr, records)).ok()) {
+                    vector<int> positions;
+                    for (const auto& rec : records) {
+                        positions.push_back(rec->pos);
+                    }
+                    ans.push_back(make_tuple(i, dataset, positions));
+                }
+                REQUIRE(s == StatusCode::NOT_FOUND);
+            }
+            // abandon some iterators partway through
+            REQUIRE(data->sampleset_range(*cache, sampleset, rng, nullptr,
+                                          samples, datasets, iterators).ok());
+            for (auto& it : iterators) {
+                string dataset;
+                shared_ptr<const bcf_hdr_t> hdr;
+                vector<shared_ptr<bcf1_t>> records;
+                REQUIRE(it->next(dataset, hdr, records).ok());
+            }
+        }
+        return ans;
+    };
+
+    auto expected = results(0);
+    REQUIRE(expected.size() > 3);
+    for (size_t depth : {1, 2, 16}) {
+        REQUIRE(results(depth) == expected);
+    }
+
+    // the values read ahead come from the iterators' snapshot, even if the
+    // buckets are deleted in the meantime
+    data->set_prefetch_depth(16);
+    Status s;
+    shared_ptr<const set<string>> samples, datasets;
+    vector<unique_ptr<RangeBCFIterator>> iterators;
+    REQUIRE(data->sampleset_range(*cache, sampleset, range(0, 190000, 200050), nullptr,
+                                  samples, datasets, iterators).ok());
+    KeyValue::CollectionHandle coll_bcf;
+    REQUIRE(db.collection("bcf", coll_bcf).ok());
+    unique_ptr<KeyValue::Reader> reader;
+    REQUIRE(db.current(reader).ok());
+    unique_ptr<KeyValue::Iterator> kvit;
+    REQUIRE(reader->iterator(coll_bcf, string(), kvit).ok());
+    unique_ptr<KeyValue::WriteBatch> wb;
+    REQUIRE(db.begin_writes(wb).ok());
+    for (; kvit->valid(); s = kvit->next()) {
+        REQUIRE(wb->delete_key(coll_bcf, kvit->key().str()).ok());
+    }
+    REQUIRE(s.ok());
+    REQUIRE(wb->commit().ok());
+    REQUIRE(collection_size(db, "bcf") == 0);
+    size_t nrecords = 0;
+    for (auto& it : iterators) {
+        string dataset;
+        shared_ptr<const bcf_hdr_t> hdr;
+        vector<shared_ptr<bcf1_t>> records;
+        while ((s = it->next(dataset, hdr, records)).ok()) {
+            nrecords += records.size();
+        }
+        REQUIRE(s == StatusCode::NOT_FOUND);
+    }
+    REQUIRE(nrecords > 0);
+}
+
 TEST_CASE("BCFKeyValueData compare iterator implementations") {
     // This tests the optimized bucket-based range slicing in BCFKeyValueData
     int nRegions = 13;
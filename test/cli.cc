@@ -125,6 +125,63 @@ TEST_CASE("cli") {
         REQUIRE(contigs[3].second == 4000);
     }
 
+    SECTION("one session for all stages") {
+        Status s;
+        string db_path = DB_DIR + "/DB_session";
+        REQUIRE(system(("rm -rf " + db_path).c_str()) == 0);
+
+        string basedir = "test/data/cli";
+        vector<pair<string,size_t>> contigs;
+        s = cli::utils::db_init(console, db_path, basedir + "/F1.gvcf.gz", contigs);
+        REQUIRE(s.ok());
+        vector<string> gvcfs;
+        for (auto fname : {"F1.gvcf.gz", "F2.gvcf.gz", "F3.gvcf.gz", "F4.gvcf.gz"}) {
+            gvcfs.push_back(basedir + "/" + fname);
+        }
+
+        unique_ptr<cli::utils::DBSession> session;
+        s = cli::utils::DBSession::Open(console, db_path, RocksKeyValue::OpenMode::BULK_LOAD, 0, nr_threads, session);
+        REQUIRE(s.ok());
+        vector<range> ranges;
+        s = cli::utils::db_bulk_load(console, *session, gvcfs, ranges, contigs);
+        REQUIRE(s.ok());
+        s = session->read_optimize();
+        REQUIRE(s.ok());
+
+        for (int rid=0; rid < contigs.size(); rid++) {
+            ranges.push_back(range(rid, 0, contigs[rid].second));
+        }
+        discovered_alleles dsals;
+        unsigned sample_count = 0;
+        s = cli::utils::discover_alleles(console, *session, ranges, contigs, dsals, sample_count);
+        REQUIRE(s.ok());
+        REQUIRE(sample_count == 4);
+        discovered_alleles dsals_copy = dsals;
+
+        GLnexus::unifier_config unifier_cfg;
+        GLnexus::genotyper_config genotyper_cfg;
+        string config_crc32c;
+        REQUIRE(cli::utils::load_config(console, "gatk", unifier_cfg, genotyper_cfg, config_crc32c).ok());
+        vector<GLnexus::unified_site> sites;
+        unifier_stats stats;
+        s = cli::utils::unify_sites(console, unifier_cfg, contigs, dsals, sample_count, sites, stats);
+        REQUIRE(s.ok());
+        s = cli::utils::genotype(console, *session, genotyper_cfg, sites, {}, DB_DIR + "/session.bcf");
+        REQUIRE(s.ok());
+        session.reset();
+
+        // the database reopened afresh gives the same alleles
+        discovered_alleles dsals2;
+        s = cli::utils::discover_alleles(console, 0, nr_threads, db_path, ranges, contigs, dsals2, sample_count);
+        REQUIRE(s.ok());
+        REQUIRE(dsals2 == dsals_copy);
+
+        // in-place mode switches are only from bulk load
+        s = cli::utils::DBSession::Open(console, db_path, RocksKeyValue::OpenMode::READ_ONLY, 0, nr_threads, session);
+        REQUIRE(s.ok());
+        REQUIRE(session->read_optimize().bad());
+    }
+
     SECTION("describe config presets") {
         cout << cli::utils::describe_config_presets();
     }
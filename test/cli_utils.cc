@@ -567,3 +567,43 @@ TEST_CASE("iter_compare") {
     s = cli::utils::compare_db_itertion_algorithms(console, dbpath, n_iter);
     console->info("Passed {} iterator comparison tests", n_iter);
 }
+
+TEST_CASE("db_bulk_load restart") {
+    Status s;
+
+    string dbdir = "/tmp/bulk_load_restart";
+    REQUIRE(system(("rm -rf " + dbdir).c_str()) == 0);
+    REQUIRE(system(("mkdir -p " + dbdir).c_str()) == 0);
+    string dbpath = dbdir + "/DB";
+
+    string basedir = "test/data/cli";
+    vector<pair<string,size_t>> contigs;
+    s = cli::utils::db_init(console, dbpath, basedir + "/F1.gvcf.gz", contigs);
+    REQUIRE(s.ok());
+
+    vector<range> ranges;
+    vector<string> gvcfs = { basedir + "/F1.gvcf.gz" };
+    s = cli::utils::db_bulk_load(console, 0, 8, gvcfs, dbpath, ranges, contigs);
+    REQUIRE(s.ok());
+
+    // loading it again fails...
+    gvcfs.push_back(basedir + "/F2.gvcf.gz");
+    s = cli::utils::db_bulk_load(console, 0, 8, gvcfs, dbpath, ranges, contigs);
+    REQUIRE(s.bad());
+
+    // ...unless resuming, which skips the data set already loaded
+    s = cli::utils::db_bulk_load(console, 0, 8, gvcfs, dbpath, ranges, contigs, false, true);
+    REQUIRE(s.ok());
+
+    // but not a data set of the same name loaded from a different file
+    REQUIRE(system(("cp " + basedir + "/F2.gvcf.gz " + dbdir + "/F1.gvcf.gz").c_str()) == 0);
+    s = cli::utils::db_bulk_load(console, 0, 8, {dbdir + "/F1.gvcf.gz"}, dbpath, ranges, contigs, false, true);
+    REQUIRE(s.bad());
+
+    unique_ptr<cli::utils::DBSession> session;
+    s = cli::utils::DBSession::Open(console, dbpath, RocksKeyValue::OpenMode::READ_ONLY, 0, 8, session);
+    REQUIRE(s.ok());
+    size_t ct;
+    REQUIRE(session->data().sample_count(ct).ok());
+    REQUIRE(ct == 2);
+}
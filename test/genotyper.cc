@@ -1,11 +1,15 @@
 #include <iostream>
+#include <mutex>
 #include "genotyper.h"
+#include "diploid.h"
 #include "types.h"
 #include "catch.hpp"
 #include "utils.cc"
 using namespace std;
 using namespace GLnexus;
 
+#include "genotyper_utils.h"
+
 TEST_CASE("One_call_ordering") {
 
     SECTION("Numerical calls") {
@@ -78,8 +82,7 @@ unification: []
 #CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT	A
 )eof";
 
-    map<int,int> sample_mapping;
-    sample_mapping[0] = 0;
+    SampleMapping sample_mapping(vector<int>{0});
 
     shared_ptr<bcf_hdr_t> hdr;
     shared_ptr<bcf1_t> rec;
@@ -171,3 +174,313 @@ unification:
         REVISE_GENOTYPES_CASE(1, 1, 14, "21	1000	.	T	A,<NON_REF>	.	.	.	GT:AD:DP:GQ:PL	1/1:0,2,0:2:16:32,16,0,240,46,246");
     }
 }
+
+TEST_CASE("genotype_site reference bands") {
+    unique_ptr<VCFData> data;
+    REQUIRE(VCFData::Open({"NA12878D_HiSeqX.21.10009462-10009469.gvcf"}, data).ok());
+    unique_ptr<MetadataCache> cache;
+    REQUIRE(MetadataCache::Start(*data, cache).ok());
+    const string sampleset("NA12878D_HiSeqX.21.10009462-10009469");
+    shared_ptr<const set<string>> samples_set;
+    REQUIRE(cache->sampleset_samples(sampleset, samples_set).ok());
+    vector<string> samples(samples_set->begin(), samples_set->end());
+
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_init("w"), &bcf_hdr_destroy);
+    REQUIRE(bcf_hdr_append(hdr.get(), "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">") == 0);
+    REQUIRE(bcf_hdr_append(hdr.get(), "##FORMAT=<ID=RNC,Number=2,Type=Character,Description=\"Reason for No Call in GT\">") == 0);
+    for (const auto& ctg : cache->contigs()) {
+        string line = "##contig=<ID=" + ctg.first + ",length=" + to_string(ctg.second) + ">";
+        REQUIRE(bcf_hdr_append(hdr.get(), line.c_str()) == 0);
+    }
+    for (const auto& sample : samples) {
+        REQUIRE(bcf_hdr_add_sample(hdr.get(), sample.c_str()) == 0);
+    }
+    REQUIRE(bcf_hdr_sync(hdr.get()) == 0);
+
+    auto site = [](int beg, const string& ref, const string& alt) {
+        range pos(0, beg, beg + ref.size());
+        unified_site us(pos);
+        us.alleles.push_back(unified_allele(pos, ref));
+        us.alleles.push_back(unified_allele(pos, alt));
+        us.fill_implicit_unification();
+        return us;
+    };
+    auto genotype = [&](const genotyper_config& cfg, const unified_site& us, GenotypingWorkspace* ws) {
+        shared_ptr<bcf1_t> record;
+        shared_ptr<string> residual_rec;
+        REQUIRE(genotype_site(cfg, *cache, *data, us, sampleset, samples, hdr.get(), record,
+                              false, residual_rec, nullptr, ws).ok());
+        kstring_t ks = {0, 0, nullptr};
+        REQUIRE(vcf_format(hdr.get(), record.get(), &ks) == 0);
+        string ans(ks.s, ks.l);
+        free(ks.s);
+        return ans;
+    };
+
+    // (site, expected total hits after it)
+    vector<pair<unified_site,size_t>> sites = {
+        make_pair(site(10009461, "T", "A"), 0),   // reference record 10009462-10009463: miss
+        make_pair(site(10009462, "C", "G"), 1),   // same record: hit
+        make_pair(site(10009463, "TA", "T"), 1),  // variant record breaks the band
+        make_pair(site(10009462, "C", "G"), 1),   // so the reference record misses again
+        make_pair(site(10009462, "C", "G"), 2),   // and then hits
+        make_pair(site(10009466, "A", "G"), 2),   // reference record 10009467-10009468: miss
+        make_pair(site(10009467, "A", "G"), 3)    // hit
+    };
+
+    for (int required_dp : {0, 13, 14}) {
+        genotyper_config cfg;
+        cfg.required_dp = required_dp;
+        GenotypingWorkspace ws;
+        for (const auto& p : sites) {
+            // the records produced within a band are the same as without one
+            string expected = genotype(cfg, p.first, nullptr);
+            REQUIRE(genotype(cfg, p.first, &ws) == expected);
+            REQUIRE(ws.ref_band_hits() == p.second);
+        }
+    }
+}
+
+// Expose the combined (and censored) values of a numeric FORMAT field helper
+template<class H, class T = int32_t>
+class FormatFieldProbe : public H {
+public:
+    using H::H;
+
+    vector<T> combined() {
+        vector<T> ans;
+        REQUIRE(this->combine_format_data(ans).ok());
+        REQUIRE(this->perform_censor(ans).ok());
+        return ans;
+    }
+};
+
+TEST_CASE("numeric FORMAT field accumulators") {
+    const char* header_txt = 1 + R"eof(
+##fileformat=VCFv4.1
+##ALT=<ID=NON_REF,Description="Represents any possible alternative allele at this location">
+##FORMAT=<ID=DP,Number=1,Type=Integer,Description="Read depth">
+##FORMAT=<ID=FQ,Number=1,Type=Float,Description="Some float">
+##FORMAT=<ID=GQ,Number=1,Type=Integer,Description="Genotype Quality">
+##FORMAT=<ID=GT,Number=1,Type=String,Description="Genotype">
+##FORMAT=<ID=PL,Number=G,Type=Integer,Description="Phred-scaled genotype likelihoods">
+##INFO=<ID=END,Number=1,Type=Integer,Description="Stop position of the interval">
+##contig=<ID=21,length=48129895>
+#CHROM	POS	ID	REF	ALT	QUAL	FILTER	INFO	FORMAT	A	B
+)eof";
+    // variant record with a missing DP & FQ for B
+    const char* rec1 = "21	1000	.	T	A,<NON_REF>	.	.	.	GT:DP:GQ:PL:FQ	0/1:20:50:50,0,300,90,310,400:1.5	0/0:.:30:0,30,300,30,300,300:.";
+    // single-allele reference record
+    const char* rec2 = "21	1000	.	T	.	.	.	END=1100	GT:DP:GQ:PL	0/0:17:40:0,40,400	0/0:33:20:0,20,200";
+    const char* rec3 = "21	1000	.	T	<NON_REF>	.	.	END=1100	GT:DP:GQ:FQ	0/0:9:10:2.5	0/0:3:5:0.5";
+
+    struct input {
+        shared_ptr<bcf_hdr_t> hdr;
+        shared_ptr<bcf1_t> rec;
+    };
+    auto load = [&](const char* txt) {
+        input ans;
+        REQUIRE(TestUtils::load_vcf1((string(header_txt) + txt + "\n").c_str(), ans.hdr, ans.rec).ok());
+        return ans;
+    };
+    input in1 = load(rec1), in2 = load(rec2), in3 = load(rec3);
+
+    // samples A and B go to output columns 0 and 2; column 1 is unobserved
+    SampleMapping sample_mapping(vector<int>{0, 2});
+    const int n_samples = 3;
+    auto add = [&](FormatFieldHelper& helper, const input& in) {
+        vector<int> allele_mapping = { 0, 1, -1 };
+        allele_mapping.resize(in.rec->n_allele);
+        return helper.add_record_data("x", in.hdr.get(), in.rec.get(), sample_mapping,
+                                      allele_mapping, 2);
+    };
+    const int32_t M = bcf_int32_missing;
+
+    SECTION("min, with missing values and squeeze") {
+        retained_format_field dp({"DP"}, "DP", RetainedFieldFrom::FORMAT, RetainedFieldType::INT,
+                                 FieldCombinationMethod::MIN, RetainedFieldNumber::BASIC, 1);
+        FormatFieldProbe<DPFieldHelper> helper(dp, n_samples, 1);
+        REQUIRE(add(helper, in1).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({20, M, M}));
+        REQUIRE(add(helper, in3).ok());
+        // a missing input value is the least of all (as with min_element)
+        REQUIRE(helper.combined() == vector<int32_t>({9, M, M}));
+        REQUIRE(add(helper, in2).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({9, M, M}));
+
+        // squeeze rounds down to a power of two, per sample
+        helper.reset(n_samples, 1);
+        REQUIRE(add(helper, in2).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({17, M, 33}));
+        REQUIRE(helper.squeeze(2).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({17, M, 32}));
+        REQUIRE(helper.squeeze(0).ok());
+        REQUIRE(helper.squeeze(1).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({16, M, 32}));
+
+        // censoring
+        REQUIRE(helper.censor(0, false).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({M, M, 32}));
+    }
+
+    SECTION("max, with zero default") {
+        retained_format_field gq({"GQ"}, "GQ", RetainedFieldFrom::FORMAT, RetainedFieldType::INT,
+                                 FieldCombinationMethod::MAX, RetainedFieldNumber::BASIC, 1,
+                                 DefaultValueFiller::ZERO);
+        FormatFieldProbe<NumericFormatFieldHelper<int32_t>> helper(gq, n_samples, 1);
+        REQUIRE(add(helper, in2).ok());
+        REQUIRE(add(helper, in1).ok());
+        REQUIRE(add(helper, in3).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({50, 0, 30}));
+    }
+
+    SECTION("max float") {
+        retained_format_field fq({"FQ"}, "FQ", RetainedFieldFrom::FORMAT, RetainedFieldType::FLOAT,
+                                 FieldCombinationMethod::MAX, RetainedFieldNumber::BASIC, 1);
+        FormatFieldProbe<NumericFormatFieldHelper<float>, float> helper(fq, n_samples, 1);
+        REQUIRE(add(helper, in2) == StatusCode::NOT_FOUND);
+        REQUIRE(add(helper, in3).ok());
+        REQUIRE(add(helper, in1).ok());
+        auto ans = helper.combined();
+        REQUIRE(ans.size() == 3);
+        REQUIRE(ans[0] == 2.5);
+        REQUIRE(bcf_float_is_missing(ans[1]));
+        REQUIRE(ans[2] == 0.5);
+
+        // a missing value seen first sticks (as with max_element)
+        helper.reset(n_samples, 1);
+        REQUIRE(add(helper, in1).ok());
+        REQUIRE(add(helper, in3).ok());
+        ans = helper.combined();
+        REQUIRE(ans[0] == 2.5);
+        REQUIRE(bcf_float_is_missing(ans[2]));
+    }
+
+    SECTION("single value") {
+        retained_format_field gq({"GQ"}, "GQ", RetainedFieldFrom::FORMAT, RetainedFieldType::INT,
+                                 FieldCombinationMethod::MISSING, RetainedFieldNumber::BASIC, 1);
+        FormatFieldProbe<NumericFormatFieldHelper<int32_t>> helper(gq, n_samples, 1);
+        REQUIRE(add(helper, in1).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({50, M, 30}));
+        // a second value makes it missing
+        REQUIRE(add(helper, in3).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({M, M, M}));
+    }
+
+    SECTION("PL") {
+        const int count = diploid::genotypes(2);
+        retained_format_field pl({"PL"}, "PL", RetainedFieldFrom::FORMAT, RetainedFieldType::INT,
+                                 FieldCombinationMethod::MISSING, RetainedFieldNumber::GENOTYPE);
+        FormatFieldProbe<PLFieldHelper> helper(pl, n_samples, count);
+
+        // single-allele record: the PLs are taken as those of REF/NON_REF
+        REQUIRE(add(helper, in2).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({0, 40, 400, M, M, M, 0, 20, 200}));
+
+        // the PLs involving the dropped allele are dropped
+        helper.reset(n_samples, count);
+        REQUIRE(add(helper, in1).ok());
+        REQUIRE(helper.combined() == vector<int32_t>({50, 0, 300, M, M, M, 0, 30, 300}));
+
+        // multiple records can't be combined
+        REQUIRE(add(helper, in2).ok());
+        REQUIRE(helper.combined() == vector<int32_t>(9, M));
+    }
+}
+
+TEST_CASE("direct FORMAT field encoding") {
+    // encode_format_* should produce exactly the bytes which htslib would
+    // for the same fields set by bcf_update_format_*
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_init("w"), &bcf_hdr_destroy);
+    for (const char* line : {
+            "##contig=<ID=21,length=48129895>",
+            "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">",
+            "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Read depth\">",
+            "##FORMAT=<ID=AD,Number=R,Type=Integer,Description=\"Allele depths\">",
+            "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype quality\">",
+            "##FORMAT=<ID=FQ,Number=1,Type=Float,Description=\"Some float\">",
+            "##FORMAT=<ID=FT,Number=1,Type=String,Description=\"Some string\">",
+            "##FORMAT=<ID=RNC,Number=1,Type=String,Description=\"Reason for no call\">" }) {
+        REQUIRE(bcf_hdr_append(hdr.get(), line) == 0);
+    }
+    for (const char* sample : {"A", "B", "C"}) {
+        REQUIRE(bcf_hdr_add_sample(hdr.get(), sample) == 0);
+    }
+    REQUIRE(bcf_hdr_sync(hdr.get()) == 0);
+    const int n_sample = 3;
+    auto id = [&](const char* key) {
+        int ans = bcf_hdr_id2int(hdr.get(), BCF_DT_ID, key);
+        REQUIRE(ans >= 0);
+        return ans;
+    };
+
+    vector<int32_t> gt = { bcf_gt_unphased(0), bcf_gt_unphased(1),
+                           bcf_gt_missing, bcf_gt_missing,
+                           bcf_gt_unphased(1), bcf_int32_vector_end };
+    vector<int32_t> dp = { 20, bcf_int32_missing, 300 };
+    vector<int32_t> ad = { 10, 5, bcf_int32_missing, bcf_int32_vector_end, 0, 70000 };
+    vector<float> fq(3);
+    fq[0] = 1.5;
+    bcf_float_set_missing(fq[1]);
+    fq[2] = -2.25;
+    vector<const char*> ft = { "", "", "" };
+    vector<const char*> rnc = { "M", ".", "LO" };
+
+    // the htslib way
+    shared_ptr<bcf1_t> expected(bcf_init(), &bcf_destroy);
+    expected->rid = 0;
+    expected->pos = 999;
+    REQUIRE(bcf_update_alleles_str(hdr.get(), expected.get(), "T,A") == 0);
+    expected->n_sample = n_sample;
+    REQUIRE(bcf_update_genotypes(hdr.get(), expected.get(), gt.data(), gt.size()) == 0);
+    REQUIRE(bcf_update_format_int32(hdr.get(), expected.get(), "DP", dp.data(), dp.size()) == 0);
+    REQUIRE(bcf_update_format_int32(hdr.get(), expected.get(), "GQ", nullptr, 0) == 0);
+    REQUIRE(bcf_update_format_int32(hdr.get(), expected.get(), "AD", ad.data(), ad.size()) == 0);
+    REQUIRE(bcf_update_format_float(hdr.get(), expected.get(), "FQ", fq.data(), fq.size()) == 0);
+    REQUIRE(bcf_update_format_string(hdr.get(), expected.get(), "FT", ft.data(), ft.size()) == 0);
+    REQUIRE(bcf_update_format_string(hdr.get(), expected.get(), "RNC", rnc.data(), rnc.size()) == 0);
+    // bcf_dup serializes the record
+    shared_ptr<bcf1_t> expected_dup(bcf_dup(expected.get()), &bcf_destroy);
+
+    // directly
+    shared_ptr<bcf1_t> direct(bcf_init(), &bcf_destroy);
+    direct->rid = 0;
+    direct->pos = 999;
+    REQUIRE(bcf_update_alleles_str(hdr.get(), direct.get(), "T,A") == 0);
+    kstring_t* indiv = &(direct->indiv);
+    int n_fmt = 0;
+    REQUIRE(encode_format_int32(indiv, id("GT"), gt.data(), gt.size(), n_sample));
+    n_fmt++;
+    REQUIRE(encode_format_int32(indiv, id("DP"), dp.data(), dp.size(), n_sample));
+    n_fmt++;
+    REQUIRE(!encode_format_int32(indiv, id("GQ"), nullptr, 0, n_sample));
+    REQUIRE(encode_format_int32(indiv, id("AD"), ad.data(), ad.size(), n_sample));
+    n_fmt++;
+    REQUIRE(encode_format_float(indiv, id("FQ"), fq.data(), fq.size(), n_sample));
+    n_fmt++;
+    REQUIRE(!encode_format_string(indiv, id("FT"), ft.data(), ft.size(), n_sample));
+    REQUIRE(encode_format_string(indiv, id("RNC"), rnc.data(), rnc.size(), n_sample));
+    n_fmt++;
+    direct->n_sample = n_sample;
+    direct->n_fmt = n_fmt;
+    shared_ptr<bcf1_t> direct_dup(bcf_dup(direct.get()), &bcf_destroy);
+
+    REQUIRE(direct_dup->n_fmt == expected_dup->n_fmt);
+    REQUIRE(direct_dup->n_sample == expected_dup->n_sample);
+    REQUIRE(string(direct_dup->indiv.s, direct_dup->indiv.l)
+            == string(expected_dup->indiv.s, expected_dup->indiv.l));
+    REQUIRE(string(direct_dup->shared.s, direct_dup->shared.l)
+            == string(expected_dup->shared.s, expected_dup->shared.l));
+
+    // and htslib reads it back the same
+    auto format = [&](bcf1_t* rec) {
+        kstring_t ks = {0, 0, nullptr};
+        REQUIRE(vcf_format(hdr.get(), rec, &ks) == 0);
+        string ans(ks.s, ks.l);
+        free(ks.s);
+        return ans;
+    };
+    string txt = format(expected_dup.get());
+    REQUIRE(format(direct_dup.get()) == txt);
+    REQUIRE(txt.find("GT:DP:AD:FQ:RNC") != string::npos);
+}
@@ -392,43 +392,54 @@ public:
         REQUIRE(!sites.empty());
 
         genotyper_cfg.output_format = GLnexusOutputFormat::VCF;
-        string out_vcf_path = temp_dir_path + "output.vcf";
-        s = svc->genotype_sites(genotyper_cfg, string("<ALL>"), sites, out_vcf_path);
-        if (! s.ok()) {
-            cout << s.str() << endl;
-        }
+
+        // The dataset-major genotyper must produce the same output; use a
+        // small window so that the sites span several windows.
+        service_config dm_cfg;
+        dm_cfg.dataset_major_window = 4;
+        unique_ptr<Service> dm_svc;
+        s = Service::Start(dm_cfg, *data, *data, dm_svc);
         REQUIRE(s.ok());
 
-        string diff_out_path = temp_dir_path +  "output.diff";
+        for (Service* service : {svc.get(), dm_svc.get()}) {
+            string out_vcf_path = temp_dir_path + (service == svc.get() ? "output.vcf" : "output_dm.vcf");
+            s = service->genotype_sites(genotyper_cfg, string("<ALL>"), sites, out_vcf_path);
+            if (! s.ok()) {
+                cout << s.str() << endl;
+            }
+            REQUIRE(s.ok());
+
+            string diff_out_path = temp_dir_path +  "output.diff";
 
-        string diff_cmd = "python " + string(GVCFTestCaseRootDir()) +  "/test/testOutputVcf.py --input " + out_vcf_path + " --truth " + truth_vcf_path;
-        diff_cmd += " --quiet";
-        if (!validated_formats.empty()) {
-            diff_cmd += " --formats ";
-            for (auto& validated_format : validated_formats) {
-                diff_cmd += validated_format + " ";
+            string diff_cmd = "python " + string(GVCFTestCaseRootDir()) +  "/test/testOutputVcf.py --input " + out_vcf_path + " --truth " + truth_vcf_path;
+            diff_cmd += " --quiet";
+            if (!validated_formats.empty()) {
+                diff_cmd += " --formats ";
+                for (auto& validated_format : validated_formats) {
+                    diff_cmd += validated_format + " ";
+                }
             }
-        }
-        if (!validated_infos.empty()) {
-            diff_cmd += " --infos ";
-            for (auto& validated_info : validated_infos) {
-                diff_cmd +=  validated_info + " ";
+            if (!validated_infos.empty()) {
+                diff_cmd += " --infos ";
+                for (auto& validated_info : validated_infos) {
+                    diff_cmd +=  validated_info + " ";
+                }
+            }
+            diff_cmd += " > " + diff_out_path;
+            int retval = system(diff_cmd.c_str());
+            REQUIRE (WIFEXITED(retval));
+
+            int exit_status = WEXITSTATUS(retval);
+            if (exit_status != 0) {
+                print_header();
+                cout << "^^^^^ Output vcf and truth differs. Diff file: " << endl;
+                retval = system(("cat " + diff_out_path).c_str());
+                REQUIRE(retval == 0);
             }
-        }
-        diff_cmd += " > " + diff_out_path;
-        int retval = system(diff_cmd.c_str());
-        REQUIRE (WIFEXITED(retval));
 
-        int exit_status = WEXITSTATUS(retval);
-        if (exit_status != 0) {
-            print_header();
-            cout << "^^^^^ Output vcf and truth differs. Diff file: " << endl;
-            retval = system(("cat " + diff_out_path).c_str());
-            REQUIRE(retval == 0);
+            REQUIRE(exit_status == 0);
         }
 
-        REQUIRE(exit_status == 0);
-
         return Status::OK();
     }
 
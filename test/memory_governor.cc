@@ -0,0 +1,63 @@
+#include <iostream>
+#include "memory_governor.h"
+#include "catch.hpp"
+using namespace std;
+using namespace GLnexus;
+
+using Component = MemoryGovernor::Component;
+
+TEST_CASE("MemoryGovernor accounting") {
+    MemoryGovernor governor(1000);
+    REQUIRE(governor.budget() == 1000);
+    REQUIRE(governor.in_use() == 0);
+    REQUIRE(governor.has_room());
+
+    governor.charge(Component::BLOCK_CACHE, 500);
+    governor.charge(Component::GENOTYPING, 300);
+    REQUIRE(governor.in_use() == 800);
+    REQUIRE(governor.in_use(Component::BLOCK_CACHE) == 500);
+    REQUIRE(governor.in_use(Component::GENOTYPING) == 300);
+    REQUIRE(governor.in_use(Component::DISCOVERY) == 0);
+    // the block cache doesn't count against the headroom
+    REQUIRE(governor.has_room());
+    REQUIRE(governor.has_room(700));
+    REQUIRE_FALSE(governor.has_room(701));
+
+    governor.charge(Component::GENOTYPING, 800);
+    REQUIRE(governor.in_use() == 1600);
+    REQUIRE_FALSE(governor.has_room());
+
+    governor.release(Component::GENOTYPING, 1000);
+    REQUIRE(governor.in_use() == 600);
+    REQUIRE(governor.in_use(Component::GENOTYPING) == 100);
+    REQUIRE(governor.has_room(900));
+    REQUIRE_FALSE(governor.has_room(901));
+
+    // the high-water marks persist after release
+    REQUIRE(governor.high_water(Component::GENOTYPING) == 1100);
+    REQUIRE(governor.high_water(Component::BLOCK_CACHE) == 500);
+    REQUIRE(governor.high_water(Component::BULK_INSERT) == 0);
+    REQUIRE(governor.report().find("genotyping") != string::npos);
+    REQUIRE(governor.report().find("budget") != string::npos);
+
+    // the write buffers don't count either, but the other in-flight
+    // components do
+    governor.charge(Component::WRITE_BUFFERS, 1000);
+    REQUIRE(governor.has_room(900));
+    governor.charge(Component::BULK_INSERT, 400);
+    governor.charge(Component::DISCOVERY, 400);
+    REQUIRE(governor.has_room(100));
+    REQUIRE_FALSE(governor.has_room(101));
+    governor.release(Component::WRITE_BUFFERS, 1000);
+    governor.release(Component::BULK_INSERT, 400);
+    governor.release(Component::DISCOVERY, 400);
+
+    SECTION("zero budget is unlimited") {
+        governor.set_budget(0);
+        governor.charge(Component::DISCOVERY, size_t(1) << 40);
+        REQUIRE(governor.has_room(size_t(1) << 40));
+        REQUIRE(governor.report().find("budget") == string::npos);
+        governor.release(Component::DISCOVERY, size_t(1) << 40);
+        REQUIRE(governor.in_use() == 600);
+    }
+}
@@ -0,0 +1,191 @@
+#include <iostream>
+#include <atomic>
+#include <fstream>
+#include <numeric>
+#include "scheduler.h"
+#include "catch.hpp"
+using namespace std;
+using namespace GLnexus;
+
+TEST_CASE("Scheduler basics") {
+    Scheduler sched(4);
+    REQUIRE(sched.size() == 4);
+    REQUIRE(sched.current_worker() == -1);
+
+    vector<future<int>> futs;
+    atomic<bool> bad_tid(false);
+    for (int i = 0; i < 1000; i++) {
+        futs.push_back(sched.push(TaskLane::GENOTYPING, [&, i](int tid) {
+            if (tid < 0 || tid >= 4) {
+                bad_tid = true;
+            }
+            return i*i;
+        }));
+    }
+    for (int i = 0; i < 1000; i++) {
+        REQUIRE(sched.get(futs[i]) == i*i);
+    }
+    REQUIRE_FALSE(bad_tid);
+
+    SECTION("exceptions propagate through the future") {
+        auto fut = sched.push(TaskLane::DISCOVERY, [](int tid) -> int {
+            throw runtime_error("task failed");
+        });
+        REQUIRE_THROWS(sched.get(fut));
+    }
+}
+
+TEST_CASE("Scheduler nested fork/join") {
+    // With a single worker, an outer task waiting on its subtasks would
+    // deadlock unless get() runs them in the meantime.
+    Scheduler sched(1);
+
+    atomic<bool> bad_tid(false);
+    vector<future<int>> outer;
+    for (int i = 0; i < 8; i++) {
+        outer.push_back(sched.push(TaskLane::DISCOVERY, [&, i](int tid) {
+            if (sched.current_worker() != tid) {
+                bad_tid = true;
+            }
+            vector<future<int>> inner;
+            for (int j = 0; j < 10; j++) {
+                inner.push_back(sched.push(TaskLane::DISCOVERY, [i, j](int) { return i*10+j; }));
+            }
+            int sum = 0;
+            for (auto& fut : inner) {
+                sum += sched.get(fut);
+            }
+            return sum;
+        }));
+    }
+    for (int i = 0; i < 8; i++) {
+        REQUIRE(sched.get(outer[i]) == 100*i + 45);
+    }
+    REQUIRE_FALSE(bad_tid);
+}
+
+TEST_CASE("Scheduler starts outside tasks in order") {
+    // Like Service::genotype_sites, each task waits until the results of all
+    // but the few preceding it have been consumed; this would deadlock if
+    // the workers started later tasks ahead of earlier ones.
+    Scheduler sched(4);
+    atomic<int> consumed(0);
+    vector<future<int>> futs;
+    for (int i = 0; i < 200; i++) {
+        futs.push_back(sched.push(TaskLane::GENOTYPING, [&, i](int) {
+            while (i > consumed + 4) {
+                this_thread::sleep_for(chrono::microseconds(100));
+            }
+            return i;
+        }));
+    }
+    for (int i = 0; i < 200; i++) {
+        REQUIRE(sched.get(futs[i]) == i);
+        consumed++;
+    }
+}
+
+TEST_CASE("Scheduler lane priority") {
+    Scheduler sched(1);
+
+    // occupy the worker while the other tasks are queued
+    promise<void> started, release;
+    shared_future<void> released(release.get_future());
+    auto blocker = sched.push(TaskLane::GENOTYPING, [&started, released](int) {
+        started.set_value();
+        released.wait();
+    });
+    started.get_future().wait();
+
+    mutex mu;
+    vector<TaskLane> order;
+    vector<future<void>> futs;
+    for (int i = 0; i < 5; i++) {
+        futs.push_back(sched.push(TaskLane::GENOTYPING, [&](int) {
+            lock_guard<mutex> lock(mu);
+            order.push_back(TaskLane::GENOTYPING);
+        }));
+        futs.push_back(sched.push(TaskLane::DISCOVERY, [&](int) {
+            lock_guard<mutex> lock(mu);
+            order.push_back(TaskLane::DISCOVERY);
+        }));
+    }
+    release.set_value();
+    sched.get(blocker);
+    for (auto& fut : futs) {
+        sched.get(fut);
+    }
+
+    REQUIRE(order.size() == 10);
+    for (int i = 0; i < 10; i++) {
+        REQUIRE(order[i] == (i < 5 ? TaskLane::DISCOVERY : TaskLane::GENOTYPING));
+    }
+}
+
+TEST_CASE("NUMA topology detection") {
+    vector<int> cpus;
+    REQUIRE(parse_cpu_list("0-3,8-11\n", cpus));
+    REQUIRE(cpus == vector<int>({0, 1, 2, 3, 8, 9, 10, 11}));
+    REQUIRE(parse_cpu_list("5", cpus));
+    REQUIRE(cpus == vector<int>({5}));
+    REQUIRE(parse_cpu_list("", cpus));
+    REQUIRE(cpus.empty());
+    REQUIRE_FALSE(parse_cpu_list("0-x", cpus));
+    REQUIRE_FALSE(parse_cpu_list("3-1", cpus));
+
+    string sys_node_dir = "/tmp/GLnexus_scheduler_test_nodes";
+    REQUIRE(system(("rm -rf " + sys_node_dir + " && mkdir -p " + sys_node_dir + "/node0 "
+                    + sys_node_dir + "/node1 " + sys_node_dir + "/node2 " + sys_node_dir + "/possible").c_str()) == 0);
+    ofstream(sys_node_dir + "/node0/cpulist") << "0-1,4-5" << endl;
+    ofstream(sys_node_dir + "/node1/cpulist") << "2-3,6-7" << endl;
+    ofstream(sys_node_dir + "/node2/cpulist") << endl; // memory-only node
+
+    auto nodes = detect_numa_nodes(sys_node_dir);
+    REQUIRE(nodes.size() == 2);
+    REQUIRE(nodes[0] == vector<int>({0, 1, 4, 5}));
+    REQUIRE(nodes[1] == vector<int>({2, 3, 6, 7}));
+
+    REQUIRE(detect_numa_nodes("/nonexistent").empty());
+}
+
+TEST_CASE("Scheduler NUMA routing") {
+    SECTION("single node") {
+        Scheduler sched(4, {{0, 1, 2, 3}});
+        REQUIRE(sched.nodes() == 1);
+    }
+
+    SECTION("two nodes") {
+        // (pin every worker to CPU 0, which surely exists)
+        Scheduler sched(4, {{0}, {0}});
+        REQUIRE(sched.nodes() == 2);
+
+        REQUIRE(sched.worker_node(0) == 0);
+        REQUIRE(sched.worker_node(1) == 1);
+        REQUIRE(sched.worker_node(2) == 0);
+        REQUIRE(sched.worker_node(3) == 1);
+
+        // hold the tasks back until they've all been queued, so that each
+        // node's workers find their own queue non-empty until near the end
+        promise<void> go;
+        shared_future<void> started(go.get_future());
+        atomic<int> elsewhere(0);
+        vector<future<int>> futs;
+        for (int i = 0; i < 1000; i++) {
+            futs.push_back(sched.push(TaskLane::GENOTYPING, i % 2, [&, i](int tid) {
+                started.wait();
+                if (sched.worker_node(tid) != i % 2) {
+                    elsewhere++;
+                }
+                this_thread::sleep_for(chrono::microseconds(50));
+                return i;
+            }));
+        }
+        go.set_value();
+        for (int i = 0; i < 1000; i++) {
+            REQUIRE(sched.get(futs[i]) == i);
+        }
+        // idle workers may steal across nodes, but only once their own node
+        // runs dry, so nearly every task runs on the node it was pushed to
+        REQUIRE(elsewhere < 100);
+    }
+}
@@ -0,0 +1,195 @@
+#include <iostream>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+#include "utils.cc"
+#include "catch.hpp"
+#include "spdlog/sinks/null_sink.h"
+using namespace std;
+using namespace GLnexus;
+
+static auto server_log = spdlog::create<spdlog::sinks::null_sink_st>("test_server_null");
+
+// connect to the socket without sending anything
+static int idle_connection(const string& socket_path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    REQUIRE(fd >= 0);
+    REQUIRE(connect(fd, (sockaddr*) &addr, sizeof(addr)) == 0);
+    return fd;
+}
+
+TEST_CASE("Server") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+
+    server_config cfg;
+    cfg.socket_path = "/tmp/GLnexus_server_test.sock";
+    cfg.sampleset = "<ALL>";
+    cfg.max_concurrent_requests = 2;
+    unique_ptr<Server> server;
+    s = Server::Start(server_log, cfg, *data, *data, server);
+    REQUIRE(s.ok());
+
+    SECTION("requests") {
+        string payload, payload2;
+        s = server_request(cfg.socket_path, "DISCOVER A:1001-1012,B:1001-1020", payload);
+        REQUIRE(s.ok());
+        REQUIRE(payload.find("dna: AG") != string::npos);
+        REQUIRE(server->handle("DISCOVER A:1001-1012,B:1001-1020", payload2).ok());
+        REQUIRE(payload == payload2);
+
+        s = server_request(cfg.socket_path, "UNIFY A:1001-1012", payload);
+        REQUIRE(s.ok());
+        REQUIRE(payload.find("alleles") != string::npos);
+        REQUIRE(server->handle("UNIFY A:1001-1012", payload2).ok());
+        REQUIRE(payload == payload2);
+
+        s = server_request(cfg.socket_path, "GENOTYPE A:1001-1012", payload);
+        REQUIRE(s.ok());
+        // BGZF-compressed BCF
+        REQUIRE(payload.size() > 2);
+        REQUIRE(uint8_t(payload[0]) == 0x1f);
+        REQUIRE(uint8_t(payload[1]) == 0x8b);
+
+        s = server_request(cfg.socket_path, "GENOTYPE Z:1-100", payload);
+        REQUIRE(s == StatusCode::FAILURE);
+        REQUIRE(s.str().find("invalid ranges") != string::npos);
+        s = server_request(cfg.socket_path, "GENOTYPE A:1001-1012,A:1010-1020", payload);
+        REQUIRE(s.str().find("overlapping ranges") != string::npos);
+        s = server_request(cfg.socket_path, "FROBNICATE A:1001-1012", payload);
+        REQUIRE(s.str().find("unknown request") != string::npos);
+
+        s = server_request(cfg.socket_path, "METRICS", payload);
+        REQUIRE(s.ok());
+        REQUIRE(payload.find("requests: 8") != string::npos);
+        REQUIRE(payload.find("failed: 3") != string::npos);
+        auto m = server->metrics();
+        REQUIRE(m.requests == 9);
+        REQUIRE(m.failed == 3);
+        REQUIRE(m.rejected == 0);
+        REQUIRE(m.bytes_out > 0);
+    }
+
+    SECTION("concurrent requests") {
+        vector<thread> clients;
+        atomic<int> ok(0), busy(0);
+        for (int i = 0; i < 8; i++) {
+            clients.push_back(thread([&]() {
+                string payload;
+                Status ls = server_request(cfg.socket_path, "UNIFY A:1-100000,B:1-100000,C:1-100000", payload);
+                if (ls.ok()) {
+                    ok++;
+                } else if (ls.str().find("busy") != string::npos) {
+                    busy++;
+                }
+            }));
+        }
+        for (auto& t : clients) {
+            t.join();
+        }
+        REQUIRE(ok + busy == 8);
+        REQUIRE(ok >= 1);
+        REQUIRE(server->metrics().rejected == busy);
+    }
+
+    SECTION("concurrency limit") {
+        // occupy both request slots with idle clients
+        int fd1 = idle_connection(cfg.socket_path);
+        int fd2 = idle_connection(cfg.socket_path);
+        string payload;
+        Status s2;
+        for (int i = 0; i < 100; i++) {
+            // (the server may not have accepted both yet)
+            s2 = server_request(cfg.socket_path, "METRICS", payload);
+            if (s2.bad()) break;
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        REQUIRE(s2.bad());
+        REQUIRE(s2.str().find("busy") != string::npos);
+        REQUIRE(server->metrics().rejected >= 1);
+
+        // hanging up frees the slots
+        close(fd1);
+        close(fd2);
+        for (int i = 0; i < 100; i++) {
+            s2 = server_request(cfg.socket_path, "METRICS", payload);
+            if (s2.ok()) break;
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        REQUIRE(s2.ok());
+    }
+
+    SECTION("stop with idle clients") {
+        int fd1 = idle_connection(cfg.socket_path);
+        int fd2 = idle_connection(cfg.socket_path);
+        string payload;
+        for (int i = 0; i < 100; i++) {
+            // wait until the server is serving both
+            if (server_request(cfg.socket_path, "METRICS", payload).bad()) break;
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        // Stop doesn't wait for the clients (or the receive timeout)
+        auto t0 = chrono::steady_clock::now();
+        server->Stop();
+        REQUIRE(chrono::steady_clock::now() - t0 < chrono::seconds(5));
+        close(fd1);
+        close(fd2);
+    }
+
+    server->Stop();
+    REQUIRE(access(cfg.socket_path.c_str(), F_OK) != 0);
+    string payload;
+    REQUIRE(server_request(cfg.socket_path, "METRICS", payload).bad());
+}
+
+TEST_CASE("Server socket path") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+
+    server_config cfg;
+    cfg.socket_path = "/tmp/GLnexus_server_test_path.sock";
+    cfg.sampleset = "<ALL>";
+    unlink(cfg.socket_path.c_str());
+    unique_ptr<Server> server;
+
+    SECTION("not a socket") {
+        // a regular file at the path is left alone
+        {
+            ofstream ofs(cfg.socket_path);
+            ofs << "precious" << endl;
+        }
+        s = Server::Start(server_log, cfg, *data, *data, server);
+        REQUIRE(s == StatusCode::EXISTS);
+        ifstream ifs(cfg.socket_path);
+        string line;
+        REQUIRE(getline(ifs, line));
+        REQUIRE(line == "precious");
+        REQUIRE(unlink(cfg.socket_path.c_str()) == 0);
+    }
+
+    SECTION("stale socket") {
+        // a socket left behind, with nothing listening, is replaced
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        REQUIRE(fd >= 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, cfg.socket_path.c_str());
+        REQUIRE(bind(fd, (sockaddr*) &addr, sizeof(addr)) == 0);
+        close(fd);
+
+        s = Server::Start(server_log, cfg, *data, *data, server);
+        REQUIRE(s.ok());
+        string payload;
+        REQUIRE(server_request(cfg.socket_path, "METRICS", payload).ok());
+        server->Stop();
+    }
+}
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <algorithm>
+#include <fstream>
+#include <unistd.h>
 #include <vcf.h>
 #include "service.h"
 #include "unifier.h"
@@ -598,3 +600,377 @@ TEST_CASE("genotype residuals") {
     // are parsed as a yaml map.
     REQUIRE(resFile.IsMap());
 }
+
+// format a record as a VCF text line
+static string vcf_line(const bcf_hdr_t* hdr, bcf1_t* record) {
+    kstring_t ks = {0, 0, nullptr};
+    REQUIRE(vcf_format(hdr, record, &ks) == 0);
+    string ans(ks.s, ks.l);
+    free(ks.s);
+    return ans;
+}
+
+// read the records of a VCF/BCF file as text lines
+static vector<string> read_vcf_lines(const string& filename) {
+    unique_ptr<vcfFile, void(*)(vcfFile*)> vcf(bcf_open(filename.c_str(), "r"),
+                                               [](vcfFile* f) { bcf_close(f); });
+    REQUIRE(vcf);
+    shared_ptr<bcf_hdr_t> hdr(bcf_hdr_read(vcf.get()), &bcf_hdr_destroy);
+    REQUIRE(hdr);
+    vector<string> ans;
+    shared_ptr<bcf1_t> record(bcf_init(), &bcf_destroy);
+    while (bcf_read(vcf.get(), hdr.get(), record.get()) == 0) {
+        ans.push_back(vcf_line(hdr.get(), record.get()));
+    }
+    return ans;
+}
+
+// genotype the sites with genotype_sites (in VCF format) and read back the
+// records as text lines
+static vector<string> genotype_sites_lines(Service& svc, const string& sampleset,
+                                           const vector<unified_site>& sites) {
+    const string tfn("/tmp/GLnexus_unit_tests.vcf");
+    genotyper_config cfg;
+    cfg.output_format = GLnexusOutputFormat::VCF;
+    REQUIRE(svc.genotype_sites(cfg, sampleset, sites, tfn).ok());
+    return read_vcf_lines(tfn);
+}
+
+TEST_CASE("Service::genotype_variant") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    genotyper_config cfg;
+    cfg.output_format = GLnexusOutputFormat::VCF;
+
+    SECTION("same records as genotype_sites") {
+        vector<tuple<range,string,vector<string>>> variants = {
+            make_tuple(range(0, 1000, 1001), "A", vector<string>{"G"}),
+            make_tuple(range(0, 1001, 1002), "C", vector<string>{"G", "T", "A"}),
+            make_tuple(range(0, 1010, 1012), "CC", vector<string>{"AG"}),
+            make_tuple(range(1, 1001, 1002), "C", vector<string>{"G"}),
+            make_tuple(range(2, 1000, 1001), "A", vector<string>{"G"})
+        };
+        for (const string sampleset : {"<ALL>", "trio1", "trio2.ch"}) {
+            for (const auto& v : variants) {
+                unified_site us(get<0>(v));
+                us.alleles.push_back(unified_allele(get<0>(v), get<1>(v)));
+                for (const auto& alt : get<2>(v)) {
+                    us.alleles.push_back(unified_allele(get<0>(v), alt));
+                }
+                us.fill_implicit_unification();
+                vector<string> expected = genotype_sites_lines(*svc, sampleset, {us});
+                REQUIRE(expected.size() == 1);
+
+                shared_ptr<const bcf_hdr_t> hdr;
+                shared_ptr<bcf1_t> record;
+                s = svc->genotype_variant(cfg, sampleset, get<0>(v), get<1>(v), get<2>(v), hdr, record);
+                REQUIRE(s.ok());
+                REQUIRE(vcf_line(hdr.get(), record.get()) == expected[0]);
+            }
+        }
+    }
+
+    SECTION("invalid variants") {
+        shared_ptr<const bcf_hdr_t> hdr;
+        shared_ptr<bcf1_t> record;
+        REQUIRE(svc->genotype_variant(cfg, "<ALL>", range(9, 1000, 1001), "A", {"G"}, hdr, record)
+                == StatusCode::INVALID);
+        REQUIRE(svc->genotype_variant(cfg, "<ALL>", range(0, 1000, 1001), "AC", {"G"}, hdr, record)
+                == StatusCode::INVALID);
+        REQUIRE(svc->genotype_variant(cfg, "<ALL>", range(0, 1000, 1001), "A", {}, hdr, record)
+                == StatusCode::INVALID);
+        REQUIRE(svc->genotype_variant(cfg, "<ALL>", range(0, 1000, 1001), "A", {"G", "G"}, hdr, record)
+                == StatusCode::INVALID);
+        REQUIRE(svc->genotype_variant(cfg, "<ALL>", range(0, 1000, 1001), "A", {"A"}, hdr, record)
+                == StatusCode::INVALID);
+        REQUIRE(svc->genotype_variant(cfg, "<ALL>", range(0, 1000, 1001), "A", {"<*>"}, hdr, record)
+                == StatusCode::INVALID);
+        REQUIRE(svc->genotype_variant(cfg, "bogus", range(0, 1000, 1001), "A", {"G"}, hdr, record).bad());
+    }
+}
+
+TEST_CASE("genotype_sites reuses format helpers across sites") {
+    // A single worker genotypes the sites one after another with the same
+    // workspace, resetting its format helpers for each site's allele count;
+    // the output should be the same as genotyping each site on its own.
+    const char* genotyper_cfg_yml = 1 + R"(
+output_format: VCF
+liftover_fields:
+- orig_names: [MIN_DP, DP]
+  name: DP
+  description: '##FORMAT=<ID=DP,Number=1,Type=Integer,Description="Approximate read depth">'
+  type: int
+  combi_method: min
+  number: basic
+  count: 1
+- orig_names: [AD]
+  name: AD
+  description: '##FORMAT=<ID=AD,Number=.,Type=Integer,Description="Allelic depths">'
+  type: int
+  number: alleles
+  combi_method: min
+  default_type: zero
+  count: 0
+- orig_names: [PL]
+  name: PL
+  description: '##FORMAT=<ID=PL,Number=G,Type=Integer,Description="Phred-scaled genotype likelihoods">'
+  type: int
+  number: genotype
+  combi_method: missing
+  count: 0
+- orig_names: [FILTER]
+  name: FT
+  description: '##FORMAT=<ID=FT,Number=1,Type=String,Description="FILTER field from sample gVCF">'
+  type: string
+  combi_method: semicolon
+  number: basic
+  count: 1
+)";
+    genotyper_config gcfg;
+    REQUIRE(genotyper_config::of_yaml(YAML::Load(genotyper_cfg_yml), gcfg).ok());
+
+    unique_ptr<VCFData> data;
+    REQUIRE(VCFData::Open({"NA12878D_HiSeqX.21.10009462-10009469.gvcf"}, data).ok());
+    service_config cfg;
+    cfg.threads = 1;
+    unique_ptr<Service> svc;
+    REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+
+    vector<unified_site> sites;
+    for (const auto& v : { make_tuple(range(0,10009461,10009462), "T", vector<string>{"A"}),
+                           make_tuple(range(0,10009463,10009465), "TA", vector<string>{"T", "TAA"}),
+                           make_tuple(range(0,10009466,10009467), "A", vector<string>{"G"}) }) {
+        unified_site us(get<0>(v));
+        us.alleles.push_back(unified_allele(get<0>(v), get<1>(v)));
+        for (const auto& alt : get<2>(v)) {
+            us.alleles.push_back(unified_allele(get<0>(v), alt));
+        }
+        us.fill_implicit_unification();
+        sites.push_back(us);
+    }
+
+    const string tfn("/tmp/GLnexus_unit_tests.vcf");
+    const string sampleset("NA12878D_HiSeqX.21.10009462-10009469");
+    vector<string> expected;
+    for (const auto& site : sites) {
+        REQUIRE(svc->genotype_sites(gcfg, sampleset, {site}, tfn).ok());
+        vector<string> lines = read_vcf_lines(tfn);
+        REQUIRE(lines.size() == 1);
+        expected.push_back(lines[0]);
+    }
+
+    REQUIRE(svc->genotype_sites(gcfg, sampleset, sites, tfn).ok());
+    REQUIRE(read_vcf_lines(tfn) == expected);
+}
+
+static size_t manifest_segments(const string& dir) {
+    ifstream in(dir + "/GLnexus.checkpoint");
+    size_t n = 0;
+    string line;
+    while (getline(in, line)) {
+        n++;
+    }
+    return n ? n-1 : 0;
+}
+
+TEST_CASE("genotype_sites checkpointing") {
+    unique_ptr<VCFData> data;
+    Status s = VCFData::Open({"discover_alleles_trio1.vcf", "discover_alleles_trio2.vcf"}, data);
+    REQUIRE(s.ok());
+    unique_ptr<Service> svc;
+    s = Service::Start(service_config(), *data, *data, svc);
+    REQUIRE(s.ok());
+
+    discovered_alleles als;
+    unsigned N;
+    for (int rid = 0; rid < 3; rid++) {
+        discovered_alleles als_rid;
+        REQUIRE(svc->discover_alleles("<ALL>", range(rid, 0, 1000000), N, als_rid).ok());
+        REQUIRE(merge_discovered_alleles(als_rid, als).ok());
+    }
+    vector<unified_site> sites;
+    unifier_stats stats;
+    REQUIRE(unified_sites(unifier_config(), N, als, sites, stats).ok());
+    REQUIRE(sites.size() > 6);
+
+    const string tfn("/tmp/GLnexus_unit_tests.bcf");
+    const string dir("/tmp/GLnexus_checkpoint_test");
+    REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+    REQUIRE(svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn).ok());
+    vector<string> expected = read_vcf_lines(tfn);
+    REQUIRE(expected.size() == sites.size());
+
+    service_config cfg;
+    cfg.checkpoint_dir = dir;
+    cfg.checkpoint_chunk = 2;
+
+    SECTION("uninterrupted") {
+        for (auto fmt : {GLnexusOutputFormat::BCF, GLnexusOutputFormat::VCF}) {
+            genotyper_config gcfg;
+            gcfg.output_format = fmt;
+            REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+            REQUIRE(svc->genotype_sites(gcfg, "<ALL>", sites, tfn).ok());
+            REQUIRE(read_vcf_lines(tfn) == expected);
+            // cleaned up
+            REQUIRE(access((dir + "/GLnexus.checkpoint").c_str(), F_OK) != 0);
+        }
+
+        // also with the dataset-major genotyper, and the sites in a table
+        cfg.dataset_major_window = 3;
+        unified_site_table table;
+        for (const auto& site : sites) {
+            table.push_back(site);
+        }
+        REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+        REQUIRE(svc->genotype_sites(genotyper_config(), "<ALL>", table, tfn).ok());
+        REQUIRE(read_vcf_lines(tfn) == expected);
+    }
+
+    SECTION("resume") {
+        // fail partway through, after at least one segment is complete
+        unique_ptr<SimFailBCFData> faildata;
+        size_t completed = 0;
+        for (size_t fail_every = 2; fail_every < 1000 && !completed; fail_every++) {
+            REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+            REQUIRE(SimFailBCFData::Open(*data, fail_every, faildata).ok());
+            REQUIRE(Service::Start(cfg, *data, *faildata, svc).ok());
+            s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn);
+            if (s.bad()) {
+                REQUIRE(s == StatusCode::IO_ERROR);
+                completed = manifest_segments(dir);
+            }
+        }
+        REQUIRE(completed > 0);
+        REQUIRE(completed < (sites.size()+1)/2);
+
+        // a different run can't pick up this progress
+        vector<unified_site> sites2(sites.begin()+1, sites.end());
+        REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites2, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+
+        // nor one with different alleles at the same positions
+        vector<unified_site> sites3(sites);
+        auto& alt = sites3.back().alleles.back();
+        alt.dna = alt.dna == "A" ? "C" : "A";
+        REQUIRE(sites3.back().pos == sites.back().pos);
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites3, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+
+        // or a different unification
+        vector<unified_site> sites4(sites);
+        sites4.back().unification[allele(sites4.back().pos, "NNNN")] = 1;
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites4, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+
+        // nor one with a different genotyper configuration (not reflected in
+        // the output header)
+        genotyper_config gcfg;
+        gcfg.required_dp = 1;
+        s = svc->genotype_sites(gcfg, "<ALL>", sites, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+        gcfg = genotyper_config();
+        gcfg.allow_partial_data = true;
+        s = svc->genotype_sites(gcfg, "<ALL>", sites, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+
+        // resume
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn);
+        REQUIRE(s.ok());
+        REQUIRE(read_vcf_lines(tfn) == expected);
+    }
+
+    SECTION("data set removed or replaced") {
+        // interrupt a run, then change the metadata version
+        unique_ptr<SimFailBCFData> faildata;
+        size_t completed = 0;
+        for (size_t fail_every = 2; fail_every < 1000 && !completed; fail_every++) {
+            REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+            REQUIRE(SimFailBCFData::Open(*data, fail_every, faildata).ok());
+            REQUIRE(Service::Start(cfg, *data, *faildata, svc).ok());
+            if (svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn).bad()) {
+                completed = manifest_segments(dir);
+            }
+        }
+        REQUIRE(completed > 0);
+
+        data->bump_metadata_version();
+        REQUIRE(Service::Start(cfg, *data, *data, svc).ok());
+        s = svc->genotype_sites(genotyper_config(), "<ALL>", sites, tfn);
+        REQUIRE(s == StatusCode::INVALID);
+    }
+
+    REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+}
+
+// Write a single-sample gVCF for a synthetic cohort: reference blocks with a
+// SNV every 100bp, which the sample carries with some probability.
+static void write_synthetic_gvcf(const string& filename, const string& sample,
+                                 int n_variants, unsigned seed) {
+    ofstream out(filename);
+    out << "##fileformat=VCFv4.1" << endl
+        << "##ALT=<ID=NON_REF,Description=\"Represents any possible alternative allele at this location\">" << endl
+        << "##INFO=<ID=END,Number=1,Type=Integer,Description=\"Stop position of the interval\">" << endl
+        << "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">" << endl
+        << "##FORMAT=<ID=AD,Number=.,Type=Integer,Description=\"Allelic depths for the ref and alt alleles in the order listed\">" << endl
+        << "##FORMAT=<ID=DP,Number=1,Type=Integer,Description=\"Approximate read depth\">" << endl
+        << "##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Genotype Quality\">" << endl
+        << "##FORMAT=<ID=MIN_DP,Number=1,Type=Integer,Description=\"Minimum DP observed within the GVCF block\">" << endl
+        << "##FORMAT=<ID=PL,Number=G,Type=Integer,Description=\"Normalized, Phred-scaled likelihoods for genotypes\">" << endl
+        << "##contig=<ID=21,length=48129895>" << endl
+        << "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\t" << sample << endl;
+    int pos = 1;
+    for (int i = 1; i <= n_variants; i++) {
+        int vpos = 100*i;
+        out << "21\t" << pos << "\t.\tA\t<NON_REF>\t.\t.\tEND=" << vpos-1
+            << "\tGT:DP:GQ:MIN_DP:PL\t0/0:30:60:25:0,60,900" << endl;
+        seed = seed*1103515245 + 12345;
+        if ((seed >> 16) % 4 == 0) {
+            out << "21\t" << vpos << "\t.\tA\tG,<NON_REF>\t200\t.\t.\tGT:AD:DP:GQ:PL\t0/1:15,15,0:30:99:200,0,200,300,300,600" << endl;
+        } else {
+            out << "21\t" << vpos << "\t.\tA\t<NON_REF>\t.\t.\tEND=" << vpos
+                << "\tGT:DP:GQ:MIN_DP:PL\t0/0:30:60:25:0,60,900" << endl;
+        }
+        pos = vpos+1;
+    }
+}
+
+// latency benchmark; run explicitly with: unit_tests "[benchmark]"
+TEST_CASE("Service::genotype_variant latency", "[.][benchmark]") {
+    const string dir = "/tmp/GLnexus_genotype_variant_benchmark/";
+    const int n_variants = 1000;
+    REQUIRE(system(("rm -rf " + dir + " && mkdir -p " + dir).c_str()) == 0);
+
+    set<string> names;
+    for (int n_samples : {10, 100, 1000}) {
+        for (int i = names.size(); i < n_samples; i++) {
+            string name = "synth" + to_string(i) + ".gvcf";
+            write_synthetic_gvcf(dir + name, "sample" + to_string(i), n_variants, i+1);
+            names.insert(name);
+        }
+        unique_ptr<VCFData> data;
+        REQUIRE(VCFData::Open(names, data, dir).ok());
+        unique_ptr<Service> svc;
+        REQUIRE(Service::Start(service_config(), *data, *data, svc).ok());
+
+        vector<double> ms;
+        for (int i = 0; i < 200; i++) {
+            range pos(0, 100*(1 + (i*7919) % n_variants) - 1, 100*(1 + (i*7919) % n_variants));
+            shared_ptr<const bcf_hdr_t> hdr;
+            shared_ptr<bcf1_t> record;
+            auto t0 = chrono::steady_clock::now();
+            REQUIRE(svc->genotype_variant(genotyper_config(), "<ALL>", pos, "A", {"G"}, hdr, record).ok());
+            ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+            REQUIRE(record->n_sample == (unsigned) n_samples);
+        }
+        sort(ms.begin(), ms.end());
+        cout << "genotype_variant over " << n_samples << " samples: median " << ms[ms.size()/2]
+             << "ms, p99 " << ms[ms.size()*99/100] << "ms" << endl;
+    }
+    REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+}
@@ -0,0 +1,130 @@
+#include <iostream>
+#include <random>
+#include "unified_site_table.h"
+#include "catch.hpp"
+using namespace std;
+using namespace GLnexus;
+
+// a site with a deletion and an insertion (padded to the site's REF), plus
+// some alternative representations of them
+static unified_site deletion_site(int rid, int beg) {
+    range pos(rid, beg, beg+4);
+    unified_site us(pos);
+    us.alleles.push_back(unified_allele(pos, "ACGT"));
+    us.alleles.push_back(unified_allele(pos, "A"));
+    us.alleles[1].normalized = allele(range(rid, beg, beg+4), "A");
+    us.alleles.push_back(unified_allele(pos, "ACCGT"));
+    us.alleles[2].normalized = allele(range(rid, beg+1, beg+1), "C");
+    for (int k = 0; k < 3; k++) {
+        us.alleles[k].quality = 10*k;
+        us.alleles[k].frequency = 0.25*k;
+    }
+    us.unification[allele(range(rid, beg-1, beg+4), "GACGT")] = 0;
+    us.unification[allele(range(rid, beg-1, beg+4), "GA")] = 1;
+    us.unification[allele(range(rid, beg, beg+1), "AC")] = 2;
+    us.unification[allele(range(rid, beg+2, beg+3), "G")] = 0;
+    us.fill_implicit_unification();
+    us.lost_allele_frequency = 0.125;
+    us.qual = 42;
+    return us;
+}
+
+static unified_site snv_site(int rid, int beg, const string& ref, const string& alt) {
+    range pos(rid, beg, beg+1);
+    unified_site us(pos);
+    us.alleles.push_back(unified_allele(pos, ref));
+    us.alleles.push_back(unified_allele(pos, alt));
+    us.fill_implicit_unification();
+    return us;
+}
+
+TEST_CASE("unified_site_table") {
+    vector<unified_site> sites;
+    sites.push_back(snv_site(0, 100, "A", "G"));
+    sites.push_back(deletion_site(0, 200));
+    sites.back().in_target = range(0, 150, 300);
+    sites.push_back(snv_site(0, 200, "A", "T"));
+    sites.back().monoallelic = true;
+    sites.push_back(deletion_site(1, 1000));
+    // an explicit entry contradicting the implicit one (from the unified allele)
+    sites.back().unification[allele(range(1, 1000, 1004), "A")] = 2;
+    sites.push_back(snv_site(1, 2000, "C", "A"));
+
+    unified_site_table table;
+    for (const auto& site : sites) {
+        table.push_back(site);
+    }
+    REQUIRE(table.size() == sites.size());
+    REQUIRE(table.memory_usage() > 0);
+
+    SECTION("round trip") {
+        for (size_t i = 0; i < sites.size(); i++) {
+            unified_site us = table[i].get();
+            REQUIRE(us == sites[i]);
+            REQUIRE(us.in_target == sites[i].in_target);
+        }
+    }
+
+    SECTION("view") {
+        auto v = table[1];
+        REQUIRE(v.pos() == range(0, 200, 204));
+        REQUIRE(v.in_target() == range(0, 150, 300));
+        REQUIRE(v.lost_allele_frequency() == 0.125f);
+        REQUIRE(v.qual() == 42);
+        REQUIRE_FALSE(v.monoallelic());
+        REQUIRE(table[2].monoallelic());
+        REQUIRE(v.allele_count() == 3);
+        REQUIRE(v.allele_dna(2) == "ACCGT");
+        REQUIRE(v.allele_normalized(2) == allele(range(0, 201, 201), "C"));
+        REQUIRE(v.allele_quality(2) == 20);
+        REQUIRE(v.allele_frequency(1) == 0.25f);
+    }
+
+    SECTION("unify") {
+        for (size_t i = 0; i < sites.size(); i++) {
+            auto v = table[i];
+            for (const auto& p : sites[i].unification) {
+                REQUIRE(v.unify(p.first) == p.second);
+            }
+            REQUIRE(v.unify(allele(sites[i].pos, "TTTTT")) == -1);
+            REQUIRE(v.unify(allele(range(9, 0, 1), "A")) == -1);
+        }
+        REQUIRE(table[3].unify(allele(range(1, 1000, 1004), "A")) == 2);
+    }
+
+    SECTION("of vector") {
+        vector<unified_site> sites2 = sites;
+        unified_site_table table2;
+        unified_site_table_of_vector(sites2, table2);
+        REQUIRE(sites2.empty());
+        REQUIRE(table2.size() == sites.size());
+        for (size_t i = 0; i < sites.size(); i++) {
+            REQUIRE(table2[i].get() == sites[i]);
+        }
+    }
+}
+
+TEST_CASE("unified_site_table compactness") {
+    // many SNV sites with random alleles
+    std::mt19937 rng(42);
+    const string nts = "ACGT";
+    vector<unified_site> sites;
+    for (int i = 0; i < 10000; i++) {
+        int r = rng() % 4;
+        sites.push_back(snv_site(i/5000, 10*i, nts.substr(r, 1), nts.substr((r+1+rng()%3)%4, 1)));
+    }
+
+    unified_site_table table;
+    for (const auto& site : sites) {
+        table.push_back(site);
+    }
+    for (size_t i = 0; i < sites.size(); i += 97) {
+        REQUIRE(table[i].get() == sites[i]);
+        REQUIRE(table[i].unify(allele(sites[i].pos, sites[i].alleles[1].dna)) == 1);
+    }
+    // no unification entries need to be stored for these sites, so the table
+    // takes less than just the top-level structs of the vector representation
+    // (not counting their maps or strings)
+    table.shrink_to_fit();
+    REQUIRE(table.memory_usage() < sites.size() * (sizeof(unified_site) + 2*sizeof(unified_allele)));
+}
@@ -1,9 +1,12 @@
 #include <iostream>
+#include <chrono>
 #include "unifier.h"
 #include "types.h"
+#include "scheduler.h"
 #include "catch.hpp"
 using namespace std;
 using namespace GLnexus;
+#include "unifier_utils.h"
 
 TEST_CASE("unifier max_alleles_per_site") {
     discovered_alleles dal;
@@ -78,3 +81,406 @@ TEST_CASE("unifier max_alleles_per_site") {
         REQUIRE(sites[0].alleles[1].dna == "G");
     }
 }
+
+// Synthesize a dense active region at offset on contig rid resembling a long STR: many
+// overlapping deletions and insertions of varied length plus SNVs, chained
+// together so that the whole region forms one active region. The reference
+// sequence is random, unless the contig's is given (so that regions placed
+// on it may overlap consistently).
+static void synthetic_active_region(int len, int n_alts, unsigned seed, discovered_alleles& dal,
+                                    int rid = 0, int offset = 1000, const string* contig = nullptr) {
+    const char* bases = "ACGT";
+    auto rand = [&seed]() { seed = seed*1103515245 + 12345; return (seed >> 16) & 0x7fff; };
+    string refdna;
+    if (contig) {
+        refdna = contig->substr(offset, len + 64);
+    } else {
+        for (int i = 0; i < len + 64; i++) {
+            refdna += bases[rand() % 4];
+        }
+    }
+    auto add = [&](int beg, int rlen, const string& alt, unsigned copies, int AQ) {
+        discovered_allele_info ref;
+        ref.is_ref = true;
+        ref.topAQ = top_AQ(99);
+        ref.zGQ = zygosity_by_GQ(1, 99, 1);
+        dal[allele(range(rid, offset+beg, offset+beg+rlen), refdna.substr(beg, rlen))] = ref;
+        discovered_allele_info dai;
+        dai.topAQ = top_AQ(AQ);
+        dai.zGQ = zygosity_by_GQ(1, 99, copies);
+        dal[allele(range(rid, offset+beg, offset+beg+rlen), alt)] = dai;
+    };
+    for (int i = 0; i < n_alts; i++) {
+        int beg = rand() % len;
+        unsigned copies = 1 + rand() % 50;
+        int AQ = rand() % 4 ? 99 : 5;
+        switch (rand() % 3) {
+        case 0: { // SNV
+            char b = bases[rand() % 4];
+            if (b == refdna[beg]) b = (b == 'A' ? 'C' : 'A');
+            add(beg, 1, string(1, b), copies, AQ);
+            break;
+        }
+        case 1: { // deletion
+            int k = 2 + rand() % 40;
+            add(beg, k, refdna.substr(beg, 1), copies, AQ);
+            break;
+        }
+        default: { // insertion
+            string ins = refdna.substr(beg, 1);
+            int k = 1 + rand() % 20;
+            for (int j = 0; j < k; j++) ins += bases[rand() % 4];
+            add(beg, 1, ins, copies, AQ);
+        }
+        }
+    }
+}
+
+// Reference overlap lookups: the scans of every site/allele which the
+// unifier originally made, installed for the lifetime of this object.
+struct reference_overlap_scans {
+    reference_overlap_scans() {
+        overlap_lookups_for_testing.site = [](map<range,minimized_alleles>& sites, const range& pos,
+                                              bool& multiple) {
+            auto related_site = sites.end();
+            multiple = false;
+            for (auto site = sites.begin(); site != sites.end(); site++) {
+                if (pos.overlaps(site->first)) {
+                    if (related_site == sites.end()) {
+                        related_site = site;
+                    } else {
+                        multiple = true;
+                        break;
+                    }
+                }
+            }
+            return related_site;
+        };
+        overlap_lookups_for_testing.refs = [](const discovered_alleles& refs, const range& pos,
+                                              discovered_alleles& ans) {
+            for (const auto& ref : refs) {
+                if (ref.first.pos.overlaps(pos)) {
+                    ans.insert(ref);
+                }
+            }
+        };
+        overlap_lookups_for_testing.pruned = [](const minimized_alleles& pruned, const range& pos,
+                                                minimized_alleles& ans) {
+            for (const auto& p : pruned) {
+                if (p.first.pos.overlaps(pos)) {
+                    ans.insert(p);
+                }
+            }
+        };
+    }
+    ~reference_overlap_scans() {
+        overlap_lookups_for_testing = overlap_lookups();
+    }
+};
+
+static void check_dense_active_region(int len, int n_alts, UnifierPreference pref, bool report = false) {
+    discovered_alleles dal;
+    synthetic_active_region(len, n_alts, 42+len, dal);
+
+    unifier_config cfg;
+    cfg.min_AQ1 = 10;
+    cfg.max_alleles_per_site = 32;
+    cfg.preference = pref;
+    discovered_alleles dal2(dal);
+    vector<unified_site> sites;
+    unifier_stats stats;
+    auto t0 = std::chrono::steady_clock::now();
+    Status s = unified_sites(cfg, 1000, dal, sites, stats);
+    auto t1 = std::chrono::steady_clock::now();
+    REQUIRE(s.ok());
+    REQUIRE(sites.size() > 0);
+    REQUIRE(stats.unified_alleles > 0);
+    REQUIRE(stats.lost_alleles > 0);
+
+    // sites are in order, non-overlapping, and account for all the unified
+    // alleles
+    size_t unified_alleles = 0;
+    for (size_t i = 0; i < sites.size(); i++) {
+        REQUIRE(sites[i].alleles.size() >= 2);
+        REQUIRE(sites[i].alleles.size() <= cfg.max_alleles_per_site);
+        if (i) {
+            REQUIRE(sites[i-1].pos.end <= sites[i].pos.beg);
+        }
+        unified_alleles += sites[i].alleles.size() - 1;
+    }
+    REQUIRE(unified_alleles == stats.unified_alleles);
+
+    if (report) {
+        cout << "dense active region: " << len << "bp, " << n_alts << " candidate ALT alleles, "
+             << sites.size() << " sites, " << stats.lost_alleles << " lost alleles, "
+             << std::chrono::duration<double>(t1-t0).count() << "s" << endl;
+    } else {
+        // the same unified sites as the reference scans (which are too slow
+        // for the stress benchmark)
+        vector<unified_site> ref_sites;
+        unifier_stats ref_stats;
+        {
+            reference_overlap_scans ref;
+            REQUIRE(unified_sites(cfg, 1000, dal2, ref_sites, ref_stats).ok());
+        }
+        REQUIRE(ref_sites.size() == sites.size());
+        for (size_t i = 0; i < sites.size(); i++) {
+            REQUIRE(ref_sites[i] == sites[i]);
+            REQUIRE(ref_sites[i].in_target == sites[i].in_target);
+        }
+        REQUIRE(ref_stats.unified_alleles == stats.unified_alleles);
+        REQUIRE(ref_stats.lost_alleles == stats.lost_alleles);
+        REQUIRE(ref_stats.filtered_alleles == stats.filtered_alleles);
+    }
+}
+
+TEST_CASE("unifier dense active region") {
+    check_dense_active_region(1000, 2000, UnifierPreference::Common);
+    check_dense_active_region(1000, 2000, UnifierPreference::Small);
+}
+
+// stress benchmark; run explicitly with: unit_tests "[stress]"
+TEST_CASE("unifier dense active region stress", "[.][stress]") {
+    for (int len : {5000, 10000, 20000}) {
+        check_dense_active_region(len, 2*len, UnifierPreference::Common, true);
+        check_dense_active_region(len, 2*len, UnifierPreference::Small, true);
+    }
+}
+
+TEST_CASE("unifier parallel") {
+    // many active regions of varying size & density across several contigs
+    discovered_alleles dal;
+    unsigned seed = 1;
+    for (int rid = 0; rid < 3; rid++) {
+        for (int offset = 1000; offset < 200000; offset += 5000) {
+            seed = seed*1103515245 + 12345;
+            int len = 10 + (seed >> 16) % 1000;
+            synthetic_active_region(len, 1 + len/((seed >> 8) % 8 + 1), seed, dal, rid, offset);
+        }
+    }
+
+    unifier_config cfg;
+    cfg.min_AQ1 = 10;
+    cfg.max_alleles_per_site = 32;
+
+    discovered_alleles dal2(dal);
+    vector<unified_site> sites;
+    unifier_stats stats;
+    REQUIRE(unified_sites(cfg, 1000, dal2, sites, stats).ok());
+    REQUIRE(dal2.empty());
+    REQUIRE(sites.size() > 1000);
+
+    Scheduler scheduler(4);
+    for (bool stream : {false, true}) {
+        dal2 = dal;
+        vector<unified_site> sites2;
+        unifier_stats stats2;
+        REQUIRE(unified_sites(cfg, 1000, dal2, sites2, stats2, scheduler, stream).ok());
+        REQUIRE(dal2.empty());
+        REQUIRE(sites2 == sites);
+        REQUIRE(stats2.unified_alleles == stats.unified_alleles);
+        REQUIRE(stats2.lost_alleles == stats.lost_alleles);
+        REQUIRE(stats2.filtered_alleles == stats.filtered_alleles);
+    }
+}
+
+// The unifier's partitioning into active regions and delineation of their
+// sites as they were before it streamed region by region: a reference for
+// pop_active_region and delineate_region. (The steps of delineation now
+// consume their inputs, so these pass them copies.)
+static map<range,discovered_alleles> reference_partition(const discovered_alleles& alleles) {
+    map<range,discovered_alleles> ans;
+
+    range rng(-1,-1,-1);
+    discovered_alleles als;
+
+    for (const auto& it : alleles) {
+        REQUIRE(rng <= it.first.pos);
+        if (rng.rid != it.first.pos.rid || rng.end < it.first.pos.beg) {
+            if (rng.rid != -1) {
+                REQUIRE(!als.empty());
+                ans[rng] = als;
+            }
+            rng = it.first.pos;
+            als.clear();
+        }
+
+        rng.end = max(rng.end, it.first.pos.end);
+        REQUIRE(it.first.pos.within(rng));
+        als.insert(it);
+    }
+
+    if (rng.rid != -1) {
+        REQUIRE(!als.empty());
+        ans[rng] = als;
+    }
+
+    return ans;
+}
+
+using site_inputs = tuple<discovered_alleles,minimized_alleles,minimized_alleles>;
+
+static Status reference_delineate_sites(const unifier_config& cfg, const discovered_alleles& alleles,
+                                        map<range,site_inputs>& ans,
+                                        vector<pair<minimized_allele,discovered_allele>>& all_pruned_alleles) {
+    Status s;
+    ans.clear();
+    all_pruned_alleles.clear();
+    for (const auto& active_region : reference_partition(alleles)) {
+        // minimize the alt alleles
+        discovered_alleles region(active_region.second);
+        map<range,discovered_allele> refs_by_range;
+        minimized_alleles alts, pruned;
+        S(minimize_alleles(cfg, region, refs_by_range, alts));
+
+        // exclude alleles not overlapping the discovery target range
+        for (auto it = alts.begin(); it != alts.end(); ) {
+            auto trg = it->second.in_target;
+            if (trg.rid < 0 || trg.overlaps(it->first.pos)) {
+                ++it;
+            } else {
+                alts.erase(it++);
+            }
+        }
+
+        // reconstruct the active region's reference allele
+        discovered_alleles refs;
+        for (const auto& p : refs_by_range) {
+            refs.insert(p.second);
+        }
+        allele active_region_ref(active_region.first,"A");
+        S(unify_ref(active_region.first, refs, active_region_ref));
+
+        // detect equivalent alt alleles at different positions, and collapse them
+        minimized_alleles aligned_alts;
+        S(unify_nonaligned_alts(active_region_ref, alts, aligned_alts));
+
+        // prune alt alleles as necessary to yield sites
+        const auto sites = prune_alleles(cfg, aligned_alts, pruned);
+
+        for (const auto& site : sites) {
+            discovered_alleles site_refs;
+            for (const auto& ref : refs) {
+                if (ref.first.pos.overlaps(site.first)) {
+                    site_refs.insert(ref);
+                }
+            }
+            minimized_alleles site_pruned;
+            for (const auto& p : pruned) {
+                if (p.first.pos.overlaps(site.first)) {
+                    site_pruned.insert(p);
+                }
+            }
+            REQUIRE(ans.find(site.first) == ans.end());
+            ans[site.first] = make_tuple(site_refs,site.second,site_pruned);
+        }
+
+        for (const auto& pa : pruned) {
+            const discovered_allele *longest_original_ref = nullptr;
+            for (const auto& al : pa.second.originals) {
+                const auto r = refs_by_range.find(al.pos);
+                REQUIRE(r != refs_by_range.end());
+                if (!longest_original_ref || longest_original_ref->first.dna.size() < r->second.first.dna.size()) {
+                    longest_original_ref = &(r->second);
+                }
+            }
+            all_pruned_alleles.push_back(make_pair(pa, *longest_original_ref));
+        }
+    }
+    return Status::OK();
+}
+
+static void require_same(const minimized_alleles& a, const minimized_alleles& b) {
+    REQUIRE(a.size() == b.size());
+    for (auto p = a.begin(), q = b.begin(); p != a.end(); p++, q++) {
+        REQUIRE(p->first == q->first);
+        REQUIRE(p->second.originals == q->second.originals);
+        REQUIRE(p->second.all_filtered == q->second.all_filtered);
+        REQUIRE(p->second.topAQ == q->second.topAQ);
+        REQUIRE(p->second.copy_number == q->second.copy_number);
+        REQUIRE(p->second.in_target == q->second.in_target);
+    }
+}
+
+TEST_CASE("unifier active regions and sites") {
+    // active regions placed close enough together that many overlap or abut
+    // one another, and so merge into larger ones
+    discovered_alleles dal;
+    unsigned seed = 7;
+    for (int rid = 0; rid < 2; rid++) {
+        string contig;
+        for (int i = 0; i < 61000; i++) {
+            seed = seed*1103515245 + 12345;
+            contig += "ACGT"[(seed >> 16) % 4];
+        }
+        for (int offset = 1000; offset < 60000; offset += 300) {
+            seed = seed*1103515245 + 12345;
+            int len = 1 + (seed >> 16) % 400;
+            synthetic_active_region(len, 1 + len/((seed >> 8) % 4 + 1), seed, dal, rid, offset, &contig);
+        }
+    }
+    // and a discovery target range, excluding some alleles of a region
+    for (auto& p : dal) {
+        if (p.first.pos.rid == 1 && p.first.pos.beg < 5000) {
+            p.second.in_target = range(1, 1000, 3000);
+        }
+    }
+
+    unifier_config cfg;
+    cfg.min_AQ1 = 10;
+    cfg.max_alleles_per_site = 8;
+
+    for (auto pref : {UnifierPreference::Common, UnifierPreference::Small}) {
+        cfg.preference = pref;
+
+        // partition
+        const auto ref_regions = reference_partition(dal);
+        REQUIRE(ref_regions.size() > 10);
+        discovered_alleles dal2(dal), region;
+        auto ref_region = ref_regions.begin();
+        while (!dal2.empty()) {
+            region.clear();
+            range rng = pop_active_region(dal2, region);
+            REQUIRE(ref_region != ref_regions.end());
+            REQUIRE(rng == ref_region->first);
+            REQUIRE(region == ref_region->second);
+            ref_region++;
+        }
+        REQUIRE(ref_region == ref_regions.end());
+
+        // delineate
+        map<range,site_inputs> ref_sites;
+        vector<pair<minimized_allele,discovered_allele>> ref_pruned;
+        REQUIRE(reference_delineate_sites(cfg, dal, ref_sites, ref_pruned).ok());
+        REQUIRE(ref_pruned.size() > 0);
+
+        dal2 = dal;
+        auto ref_site = ref_sites.begin();
+        size_t n_pruned = 0;
+        vector<pair<minimized_allele,discovered_allele>> pruned;
+        while (!dal2.empty()) {
+            region.clear();
+            range rng = pop_active_region(dal2, region);
+            REQUIRE(delineate_region(cfg, rng, region,
+                                     [&](const range& pos, const discovered_alleles& refs,
+                                         const minimized_alleles& alts, const minimized_alleles& site_pruned) {
+                                         REQUIRE(ref_site != ref_sites.end());
+                                         REQUIRE(pos == ref_site->first);
+                                         REQUIRE(refs == get<0>(ref_site->second));
+                                         require_same(alts, get<1>(ref_site->second));
+                                         require_same(site_pruned, get<2>(ref_site->second));
+                                         ref_site++;
+                                         return Status::OK();
+                                     }, pruned).ok());
+            REQUIRE(region.empty());
+            for (const auto& pa : pruned) {
+                REQUIRE(n_pruned < ref_pruned.size());
+                const auto& rpa = ref_pruned[n_pruned++];
+                require_same(minimized_alleles{pa.first}, minimized_alleles{rpa.first});
+                REQUIRE(pa.second == rpa.second);
+            }
+        }
+        REQUIRE(ref_site == ref_sites.end());
+        REQUIRE(n_pruned == ref_pruned.size());
+    }
+}
@@ -18,6 +18,7 @@ class VCFData : public Metadata, public BCFData {
     };
     map<string,vcf_data_t> datasets_;
     map<string,string> sample_datasets_;
+    uint64_t metadata_version_ = 0;
 
     VCFData() {}
 
@@ -164,6 +165,15 @@ public:
         return Status::OK();
     }
 
+    uint64_t metadata_version() const override {
+        return metadata_version_;
+    }
+
+    // as if a data set were removed or replaced (without changing any)
+    void bump_metadata_version() {
+        metadata_version_++;
+    }
+
     Status sample_dataset(const string& sample, string& ans) const override {
         auto p = sample_datasets_.find(sample);
         if (p == sample_datasets_.end()) {